@@ -40,10 +40,12 @@ def compile_shaders():
 			cmd_line += ' -fshader-stage=vert'
 		elif path.suffix == '.frag':
 			cmd_line += ' -fshader-stage=frag'
+		elif path.suffix == '.comp':
+			cmd_line += ' -fshader-stage=comp'
 		elif path.suffix == '.h':
 			continue
 		else:
-			raise Exception('Shader must end with .vert or with .frag')
+			raise Exception('Shader must end with .vert, .frag or .comp')
 
 		output_file_name = f"{path}.spirv"
 		output_path = os.path.join(root_dir, 'Runnable/shaders', output_file_name)
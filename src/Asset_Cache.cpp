@@ -0,0 +1,307 @@
+#include "Asset_Cache.h"
+
+#include "Tracy_Header.h"
+
+#include "b_lib/File.h"
+#include "b_lib/Log.h"
+
+#if IS_POSIX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+
+bool Mapped_File::open(Unicode_String path, Allocator allocator)
+{
+	ZoneScoped;
+
+	data = NULL;
+	size = 0;
+
+#if OS_WINDOWS
+	wchar_t* wide_path = path.to_wide_string(allocator);
+
+	// Shared for writing, so header of a mapped cooked file can be updated, see write_cooked_source_modification_time().
+	HANDLE file = CreateFileW(wide_path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return false;
+
+	// Mapping keeps the file open by itself.
+	defer { CloseHandle(file); };
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) return false;
+
+	mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mapping) return false;
+
+	data = (u8*) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!data)
+	{
+		CloseHandle(mapping);
+		return false;
+	}
+
+	size = file_size.QuadPart;
+
+#elif IS_POSIX
+	int fd = ::open(path.to_utf8(allocator), O_RDONLY);
+	if (fd == -1) return false;
+
+	defer { ::close(fd); };
+
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) return false;
+
+	void* mapped = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (mapped == MAP_FAILED) return false;
+
+	data = (u8*) mapped;
+	size = file_stat.st_size;
+#endif
+
+	return true;
+}
+
+void Mapped_File::close()
+{
+	if (!data) return;
+
+#if OS_WINDOWS
+	UnmapViewOfFile(data);
+	CloseHandle(mapping);
+#elif IS_POSIX
+	munmap(data, size);
+#endif
+
+	data = NULL;
+	size = 0;
+}
+
+
+bool get_source_file_info(Unicode_String path, Allocator allocator, Source_File_Info* out_info)
+{
+#if OS_WINDOWS
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	if (!GetFileAttributesExW(path.to_wide_string(allocator), GetFileExInfoStandard, &attributes)) return false;
+
+	out_info->size              = (u64(attributes.nFileSizeHigh) << 32) | attributes.nFileSizeLow;
+	out_info->modification_time = (u64(attributes.ftLastWriteTime.dwHighDateTime) << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+
+#elif IS_POSIX
+	struct stat file_stat;
+	if (stat(path.to_utf8(allocator), &file_stat) != 0) return false;
+
+	out_info->size              = file_stat.st_size;
+	out_info->modification_time = file_stat.st_mtime;
+#endif
+
+	return true;
+}
+
+// Only this header field is written, the rest of the file might be mapped and in use.
+static bool write_cooked_source_modification_time(Unicode_String cooked_path, u64 modification_time, Allocator allocator)
+{
+	u64 offset = offsetof(Cooked_Asset_Header, source_modification_time);
+
+#if OS_WINDOWS
+	HANDLE file = CreateFileW(cooked_path.to_wide_string(allocator), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return false;
+
+	defer { CloseHandle(file); };
+
+	OVERLAPPED overlapped = {};
+	overlapped.Offset = DWORD(offset);
+
+	DWORD written = 0;
+	if (!WriteFile(file, &modification_time, sizeof(modification_time), &written, &overlapped)) return false;
+
+	return written == sizeof(modification_time);
+
+#elif IS_POSIX
+	int fd = ::open(cooked_path.to_utf8(allocator), O_WRONLY);
+	if (fd == -1) return false;
+
+	defer { ::close(fd); };
+
+	return pwrite(fd, &modification_time, sizeof(modification_time), offset) == sizeof(modification_time);
+#endif
+}
+
+// Eight bytes per step, collisions only have to be unlikely between versions of the same file.
+u64 hash_file_contents(u8* data, u64 size)
+{
+	ZoneScoped;
+
+	const u64 multiplier = 0x9e3779b97f4a7c15;
+
+	u64 hash = size ^ 0xcbf29ce484222325;
+
+	u64 i = 0;
+	for (; i + 8 <= size; i += 8)
+	{
+		u64 word;
+		memcpy(&word, data + i, 8);
+
+		hash = (hash ^ word) * multiplier;
+		hash ^= hash >> 29;
+	}
+
+	for (; i < size; i++)
+	{
+		hash = (hash ^ data[i]) * multiplier;
+	}
+
+	hash ^= hash >> 32;
+	hash *= multiplier;
+	hash ^= hash >> 29;
+
+	return hash;
+}
+
+
+
+void Asset_Cache::init()
+{
+	make_array(&mapped_files, 64, c_allocator);
+
+	create_directory_recursively(path_concat(frame_allocator, cooked_assets_directory, Unicode_String(U"textures")), c_allocator);
+	create_directory_recursively(path_concat(frame_allocator, cooked_assets_directory, Unicode_String(U"meshes")),   c_allocator);
+}
+
+Unicode_String Asset_Cache::get_cooked_path(Unicode_String source_path, Cooked_Asset_Type type, Allocator allocator)
+{
+	Unicode_String directory = type == Cooked_Asset_Type::Texture ? Unicode_String(U"textures") : Unicode_String(U"meshes");
+
+	// Same as asset's name in Asset_Storage.
+	Unicode_String file_name = format_unicode_string(allocator, U"%.cooked", get_file_name_without_extension(source_path));
+
+	return path_concat(allocator, path_concat(allocator, cooked_assets_directory, directory), file_name);
+}
+
+u8* Asset_Cache::find(Unicode_String source_path, Cooked_Asset_Type type, u32 import_flags, Allocator allocator)
+{
+	ZoneScoped;
+
+	Source_File_Info source_info;
+	if (!get_source_file_info(source_path, allocator, &source_info)) return NULL;
+
+
+	Unicode_String cooked_path = get_cooked_path(source_path, type, allocator);
+
+	Mapped_File file;
+	if (!file.open(cooked_path, allocator))
+	{
+		Scoped_Lock lock(mutex);
+		statistics.misses += 1;
+		return NULL;
+	}
+
+	bool is_touched = false;
+
+	auto is_valid = [&]() -> bool
+	{
+		if (file.size < sizeof(Cooked_Asset_Header)) return false;
+
+		Cooked_Asset_Header* header = (Cooked_Asset_Header*) file.data;
+
+		if (header->magic        != cooked_asset_magic   ||
+			header->version      != cooked_asset_version ||
+			header->type         != type                 ||
+			header->import_flags != import_flags         ||
+			header->payload_size != file.size - sizeof(Cooked_Asset_Header))
+		{
+			return false;
+		}
+
+		if (header->source_size != source_info.size) return false;
+
+		if (header->source_modification_time == source_info.modification_time) return true;
+
+
+		// Touched, but might be unchanged.
+		is_touched = true;
+
+		Buffer source;
+		if (!read_entire_file_to_buffer(c_allocator, source_path, &source)) return false;
+		defer { source.free(); };
+
+		return header->source_hash == hash_file_contents(source.data, source.occupied);
+	};
+
+	if (!is_valid())
+	{
+		Log(U"Cooked % is stale", source_path);
+
+		file.close();
+
+		Scoped_Lock lock(mutex);
+		statistics.misses += 1;
+		return NULL;
+	}
+
+	// Otherwise source would be hashed on every run from now on.
+	if (is_touched && !write_cooked_source_modification_time(cooked_path, source_info.modification_time, allocator))
+	{
+		Log(U"Failed to update modification time in cooked %", source_path);
+	}
+
+	Scoped_Lock lock(mutex);
+
+	mapped_files.add(file);
+	statistics.hits += 1;
+
+	return file.data + sizeof(Cooked_Asset_Header);
+}
+
+bool Asset_Cache::store(Unicode_String source_path, u8* source_data, u64 source_size, Cooked_Asset_Type type, u32 import_flags, Cooked_Blob* blobs, int blobs_count, Allocator allocator)
+{
+	ZoneScoped;
+
+	Source_File_Info source_info;
+	if (!get_source_file_info(source_path, allocator, &source_info)) return false;
+
+
+	Cooked_Asset_Header header = {
+		.magic        = cooked_asset_magic,
+		.version      = cooked_asset_version,
+		.type         = type,
+		.import_flags = import_flags,
+
+		.source_size              = source_size,
+		.source_modification_time = source_info.modification_time,
+		.source_hash              = hash_file_contents(source_data, source_size),
+
+		.payload_size = 0,
+	};
+
+	for (int i = 0; i < blobs_count; i++)
+	{
+		header.payload_size += blobs[i].size;
+	}
+
+
+	Unicode_String cooked_path = get_cooked_path(source_path, type, allocator);
+
+	File file = open_file(allocator, cooked_path, FILE_WRITE | FILE_CREATE_NEW);
+
+	if (!file.succeeded_to_open())
+	{
+		Log(U"Failed to open file to write cooked asset: %", cooked_path);
+		return false;
+	}
+
+	defer { file.close(); };
+
+
+	file.write((u8*) &header, sizeof(header));
+
+	for (int i = 0; i < blobs_count; i++)
+	{
+		file.write((u8*) blobs[i].data, blobs[i].size);
+	}
+
+	return true;
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include "b_lib/Basic.h"
+#include "b_lib/String.h"
+#include "b_lib/Dynamic_Array.h"
+#include "b_lib/Threading.h"
+#include "b_lib/Math.h"
+
+#if OS_WINDOWS
+#include <Windows.h>
+#endif
+
+
+// Cooked assets.
+//  Every source file in assets/ gets its own cooked file in assets/cooked/, so a changed source invalidates only its own entry.
+//  Cooked files are memory mapped for the whole run, loaded textures and meshes point right into them.
+//  Asset_Cache can be used from worker threads, allocator arguments are for temporary allocations.
+
+
+constexpr u32 cooked_asset_magic   = 'K' | ('G' << 8) | ('C' << 16) | ('A' << 24);
+constexpr u32 cooked_asset_version = 3; // Bump when layout of cooked files or import of any asset type changes.
+
+
+enum class Cooked_Asset_Type: u32
+{
+	Texture = 1,
+	Mesh    = 2,
+};
+
+struct Cooked_Asset_Header
+{
+	u32 magic;
+	u32 version;
+	Cooked_Asset_Type type;
+	u32 import_flags; // Import settings asset was cooked with, type specific.
+
+	// Equal size and modification time are trusted, otherwise source is hashed.
+	u64 source_size;
+	u64 source_modification_time;
+	u64 source_hash;
+
+	u64 payload_size; // Payload follows the header.
+};
+static_assert(sizeof(Cooked_Asset_Header) == 48);
+
+
+// Payload of Cooked_Asset_Type::Texture, followed by the mip chain as import_texture() lays it out.
+struct Cooked_Texture
+{
+	s32 width;
+	s32 height;
+	u32 format; // Texture_Format
+	s32 mip_levels_count;
+	u64 size;
+};
+
+constexpr u32 COOKED_TEXTURE_COMPRESSED = 1;
+
+
+// Payload of Cooked_Asset_Type::Mesh, followed by vertices, u32 indices, then submeshes.
+//  Triangle list with shared vertices, already went through optimize_mesh().
+struct Cooked_Mesh
+{
+	u64 vertices_count;
+	u64 indices_count;
+	u64 submeshes_count;
+
+	Vector3 bounds_min;
+	Vector3 bounds_max;
+};
+
+
+
+struct Mapped_File
+{
+	u8* data;
+	u64 size;
+
+#if OS_WINDOWS
+	HANDLE mapping;
+#endif
+
+	bool open(Unicode_String path, Allocator allocator);
+	void close();
+};
+
+
+struct Source_File_Info
+{
+	u64 size;
+	u64 modification_time;
+};
+
+bool get_source_file_info(Unicode_String path, Allocator allocator, Source_File_Info* out_info);
+
+u64 hash_file_contents(u8* data, u64 size);
+
+
+struct Cooked_Blob
+{
+	void* data;
+	u64   size;
+};
+
+struct Asset_Cache
+{
+	Unicode_String cooked_assets_directory = U"assets/cooked";
+
+	Mutex mutex; // Guards mapped_files and statistics.
+
+	Dynamic_Array<Mapped_File> mapped_files; // Unmapped only at exit, loaded assets point into them.
+
+	struct
+	{
+		int hits;
+		int misses;
+	} statistics;
+
+
+	void init();
+
+	Unicode_String get_cooked_path(Unicode_String source_path, Cooked_Asset_Type type, Allocator allocator);
+
+	// Returns payload, or NULL if there is no cooked file or it's stale.
+	u8*  find(Unicode_String source_path, Cooked_Asset_Type type, u32 import_flags, Allocator allocator);
+
+	// Payload is written as concatenation of blobs. source_data is what source file contained, it's hashed.
+	bool store(Unicode_String source_path, u8* source_data, u64 source_size, Cooked_Asset_Type type, u32 import_flags, Cooked_Blob* blobs, int blobs_count, Allocator allocator);
+};
+
+inline Asset_Cache asset_cache;
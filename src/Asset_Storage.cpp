@@ -2,32 +2,52 @@
 
 
 #include "Renderer.h"
+#include "Settings.h"
+#include "Texture_Import.h"
+#include "Mesh_Import.h"
+#include "Asset_Cache.h"
+#include "Worker_Pool.h"
+
+struct Asset_Load_Job
+{
+	Unicode_String path;
+	bool           is_mesh;
+
+	bool succeeded;
+};
 
 void Asset_Storage::init()
 {
 	make_hash_map(&textures, 128, c_allocator);
 	make_hash_map(&meshes,   128, c_allocator);
 
+	asset_cache.init();
+
+	Time_Measurer tm = create_time_measurer();
 
+	defer { Log(U"Assets are loaded in % ms, cooked: %, cooked now: %", tm.ms_elapsed_double(), asset_cache.statistics.hits, asset_cache.statistics.misses); };
 
-	// Load textures
+
+	// Directories are scanned here, it's cheap. Decoding and parsing is what is spread over worker_pool.
+	//  GPU uploads happen later anyway: textures are streamed on first draw, meshes are uploaded on first use.
+	auto jobs = make_array<Asset_Load_Job>(64, frame_allocator);
+
+	// Textures
 	{
 		auto iter = iterate_files(U"assets/textures", frame_allocator);
 		if (iter.succeeded_to_open())
 		{
 			while (iter.next().is_not_empty())
 			{
-				Texture* tex = load_texture(path_concat(frame_allocator, iter.directory, iter.current));
-				
-				if (tex)
-					Log(U"Loaded texture: %", tex->name);
-				else
-					Log(U"Failed to load texture: %", iter.current);
+				jobs.add({
+					.path    = path_concat(frame_allocator, iter.directory, iter.current),
+					.is_mesh = false,
+				});
 			}
 		}
 	}
 
-	// Load meshes
+	// Meshes
 	{
 		auto iter = iterate_files(U"assets/meshes", frame_allocator);
 		if (iter.succeeded_to_open())
@@ -36,313 +56,224 @@ void Asset_Storage::init()
 			{
 				if (iter.current.ends_with(U".obj"))
 				{
-					Mesh* mesh = load_obj_mesh(path_concat(frame_allocator, iter.directory, iter.current));
-				
-					if (mesh)
-						Log(U"Loaded mesh: %", mesh->name);
-					else
-						Log(U"Failed to load mesh: %", iter.current);
+					jobs.add({
+						.path    = path_concat(frame_allocator, iter.directory, iter.current),
+						.is_mesh = true,
+					});
 				}
 			}
 		}
 	}
-}
 
-Texture* Asset_Storage::load_texture(Unicode_String path)
-{
-	int width;
-	int height;
-	int channels_count;
-	
-	u8 *data = stbi_load(path.to_utf8(frame_allocator), &width, &height, &channels_count, 0);
-	
-	if (!data)
-		return NULL;
 
-	defer { stbi_image_free(data); };
+	init_srgb_tables();
+	init_vertex_score_tables();
 
-	if (channels_count != 4 &&
-		channels_count != 3 && 
-		channels_count != 1)
+	worker_pool.run([](void* data, int job_index, Allocator allocator)
 	{
-		return NULL;
-	}
+		Asset_Load_Job* job = ((Asset_Load_Job*) data) + job_index;
 
+		ZoneScopedN("load_asset");
 
-	Texture texture;
-
-	texture.width  = width;
-	texture.height = height;
+		int   path_utf8_length;
+		char* path_utf8 = job->path.to_utf8(allocator, &path_utf8_length);
+		ZoneText(path_utf8, path_utf8_length);
 
-	texture.size = width * height * channels_count;
+		if (job->is_mesh)
+			job->succeeded = asset_storage.load_obj_mesh(job->path, allocator);
+		else
+			job->succeeded = asset_storage.load_texture(job->path, allocator);
 
-	texture.image_buffer = c_allocator.alloc(texture.size, code_location());
-	memcpy(texture.image_buffer, data, texture.size);
+	}, jobs.data, jobs.count);
 
 
-	switch (channels_count)
+	for (Asset_Load_Job& job: jobs)
 	{
-		case 4:
-			texture.format = Texture_Format::RGBA;
-			break;
-		case 3:
-			texture.format = Texture_Format::RGB;
-			break;
-		case 1:
-			texture.format = Texture_Format::Monochrome;
-			break;
-	}
-
+		Unicode_String name = get_file_name_without_extension(job.path);
 
-	texture.name = get_file_name_without_extension(path).copy_with(c_allocator);
-
-	return textures.put(texture.name, texture);
+		if (job.is_mesh)
+		{
+			if (job.succeeded)
+				Log(U"Loaded mesh: %", name);
+			else
+				Log(U"Failed to load mesh: %", job.path);
+		}
+		else
+		{
+			if (job.succeeded)
+				Log(U"Loaded texture: %", name);
+			else
+				Log(U"Failed to load texture: %", job.path);
+		}
+	}
 }
 
-Mesh* Asset_Storage::load_obj_mesh(Unicode_String path)
+bool Asset_Storage::load_texture(Unicode_String path, Allocator allocator)
 {
-	Buffer buffer;
-
-	if (!read_entire_file_to_buffer(c_allocator, path, &buffer))
-	{
-		return NULL;
-	}
+	ZoneScoped;
 
-	defer{ buffer.free(); };
+	bool compress = settings.compress_textures && renderer.is_bc_compression_supported;
 
+	u32 import_flags = compress ? COOKED_TEXTURE_COMPRESSED : 0;
 
-	String str = String((char*) buffer.data, buffer.occupied);
 
-	auto positions = make_array<Vector3>(128, c_allocator);
-	auto normals   = make_array<Vector3>(128, c_allocator);
-	auto uvs       = make_array<Vector2>(128, c_allocator);
-	defer { positions.free(); };
-	defer { normals.free(); };
-	defer { uvs.free(); };
+	if (u8* payload = asset_cache.find(path, Cooked_Asset_Type::Texture, import_flags, allocator))
+	{
+		Cooked_Texture* cooked = (Cooked_Texture*) payload;
 
+		Texture texture;
 
-	// @MemoryLeak: if we fail to parse, this arrays will not be freed.
-	auto vertices = make_array<Vertex>(128, c_allocator);
-	auto indices  = make_array<u32>   (128, c_allocator);
+		texture.width            = cooked->width;
+		texture.height           = cooked->height;
+		texture.format           = (Texture_Format) cooked->format;
+		texture.mip_levels_count = cooked->mip_levels_count;
+		texture.size             = cooked->size;
+		texture.image_buffer     = cooked + 1; // Read only, points into mapped cooked file.
 
+		texture.name = get_file_name_without_extension(path).copy_with(c_allocator);
 
+		Scoped_Lock lock(publish_mutex);
+		textures.put(texture.name, texture);
+		return true;
+	}
 
-	int line = 0;
 
+	Buffer buffer;
 
-	auto take_until_whitespace_then_advance_and_skip_whitespace = [](String* str) -> String
+	if (!read_entire_file_to_buffer(c_allocator, path, &buffer))
 	{
-		auto str_copy = *str;
-
-		auto result = take_until_whitespace_or_newline(str_copy);
-		str_copy.advance(result.length);
-		str_copy = skip_whitespace(str_copy);
+		return false;
+	}
 
-		*str = str_copy;
+	defer { buffer.free(); };
 
-		return result;
-	};
 
+	int width;
+	int height;
+	int channels_count;
+	
+	u8 *data = stbi_load_from_memory(buffer.data, buffer.occupied, &width, &height, &channels_count, 0);
+	
+	if (!data)
+		return false;
 
+	defer { stbi_image_free(data); };
 
-	while (true)
+	if (channels_count != 4 &&
+		channels_count != 3 && 
+		channels_count != 1)
 	{
-		if (str.length == 0) break;
-		
-		if (str[0] == '#')
-		{
-			str.advance(take_until_inclusive(str, '\n').length);
-			continue;
-		}
-
-		auto line_start = take_until_whitespace_then_advance_and_skip_whitespace(&str);
-
-
-		if (line_start == "v")
-		{
-			auto x_str = take_until_whitespace_then_advance_and_skip_whitespace(&str);
-			auto y_str = take_until_whitespace_then_advance_and_skip_whitespace(&str);
-			auto z_str = take_until_whitespace_then_advance_and_skip_whitespace(&str);
-
-			Vector3 position;
-
-			bool success = true;
-
-			success &= parse_number(x_str, &position.x);
-			success &= parse_number(y_str, &position.y);
-			success &= parse_number(z_str, &position.z);
-
-			if (!success)
-			{
-				Log(U"Failed to parse position at line: %", line);
-				return false;
-			}
-
-
-			positions.add(position);
-		}
-		else if (line_start == "vn")
-		{
-			auto x_str = take_until_whitespace_then_advance_and_skip_whitespace(&str);
-			auto y_str = take_until_whitespace_then_advance_and_skip_whitespace(&str);
-			auto z_str = take_until_whitespace_then_advance_and_skip_whitespace(&str);
-
-			Vector3 normal;
-
-			bool success = true;
-
-			success &= parse_number(x_str, &normal.x);
-			success &= parse_number(y_str, &normal.y);
-			success &= parse_number(z_str, &normal.z);
-
-			if (!success)
-			{
-				Log(U"Failed to parse normal at line: %", line);
-				return false;
-			}
-
+		return false;
+	}
 
-			normals.add(normal);
-		}
-		else if (line_start == "vt")
-		{
-			auto u_str = take_until_whitespace_then_advance_and_skip_whitespace(&str);
-			auto v_str = take_until_whitespace_then_advance_and_skip_whitespace(&str);
 
-			Vector2 uv;
+	Texture texture;
 
-			bool success = true;
+	import_texture(&texture, data, width, height, channels_count, compress);
 
-			success &= parse_number(u_str, &uv.x);
-			success &= parse_number(v_str, &uv.y);
+	{
+		Cooked_Texture cooked = {
+			.width            = texture.width,
+			.height           = texture.height,
+			.format           = (u32) texture.format,
+			.mip_levels_count = texture.mip_levels_count,
+			.size             = texture.size,
+		};
+
+		Cooked_Blob blobs[] = {
+			{ .data = &cooked,              .size = sizeof(cooked) },
+			{ .data = texture.image_buffer, .size = texture.size   },
+		};
+
+		asset_cache.store(path, buffer.data, buffer.occupied, Cooked_Asset_Type::Texture, import_flags, blobs, 2, allocator);
+	}
 
-			if (!success)
-			{
-				Log(U"Failed to parse normal at line: %", line);
-				return false;
-			}
+	texture.name = get_file_name_without_extension(path).copy_with(c_allocator);
 
-			uvs.add(uv);
-		}
-		else if (line_start == "f")
-		{
-			auto take_until_whitespace_or_slash_and_advance = [](String* str, bool* out_met_slash) -> String
-			{
-				auto str_copy = *str;
+	Scoped_Lock lock(publish_mutex);
+	textures.put(texture.name, texture);
+	return true;
+}
 
-				str_copy = skip_whitespace(str_copy);
+bool Asset_Storage::load_obj_mesh(Unicode_String path, Allocator allocator)
+{
+	ZoneScoped;
 
-				for (int i = 0; i < str_copy.length; i++)
-				{
-					char c = str_copy[i];
-
-					if (c == ' ' || c == '/' || c == '\n')
-					{
-						*out_met_slash = c == '/';
-						str->advance(i + 1);
-						return str_copy.sliced(0, i);
-					}
-				}
+	if (u8* payload = asset_cache.find(path, Cooked_Asset_Type::Mesh, 0, allocator))
+	{
+		Cooked_Mesh* cooked = (Cooked_Mesh*) payload;
 
-				*out_met_slash = false;
-				str->advance(str->length);
-				return str_copy;
-			};
+		Mesh mesh = {};
 
+		// Point into mapped cooked file, never grown.
+		mesh.vertices.data  = (Vertex*) (cooked + 1);
+		mesh.vertices.count = cooked->vertices_count;
 
+		mesh.indices.data  = (u32*) (mesh.vertices.data + cooked->vertices_count);
+		mesh.indices.count = cooked->indices_count;
 
+		mesh.submeshes.data  = (Submesh*) (mesh.indices.data + cooked->indices_count);
+		mesh.submeshes.count = cooked->submeshes_count;
 
-			auto parse_vertex = [&](Vertex* out_vertex) -> bool
-			{
-				bool met_slash;
+		mesh.bounds_min = cooked->bounds_min;
+		mesh.bounds_max = cooked->bounds_max;
 
-				Vertex vertex = {};
+		mesh.vertex_format = settings.quantize_meshes ? Mesh_Vertex_Format::Quantized : Mesh_Vertex_Format::Float;
 
-				auto position_index_str = take_until_whitespace_or_slash_and_advance(&str, &met_slash);
-				int  position_index;
-				if (!parse_number(position_index_str, &position_index))
-				{
-					Log(U"Failed to parse position index at line: %", line);
-					return false;
-				}
+		mesh.name = get_file_name_without_extension(path).copy_with(c_allocator);
 
-				vertex.position = *positions[position_index - 1];
+		Scoped_Lock lock(publish_mutex);
+		meshes.put(mesh.name, mesh);
+		return true;
+	}
 
-				if (met_slash)
-				{
-					auto uv_index_str = take_until_whitespace_or_slash_and_advance(&str, &met_slash);
-
-					if (uv_index_str.length) // UV may be skipped.
-					{
-						int  uv_index;
-						if (!parse_number(uv_index_str, &uv_index))
-						{
-							Log(U"Failed to parse uv index at line: %", line);
-							return false;
-						}
-
-						vertex.uv = *uvs[uv_index - 1];
-					}
-
-					if (met_slash)
-					{
-						auto normal_index_str = take_until_whitespace_or_slash_and_advance(&str, &met_slash);
-						int  normal_index;
-						if (!parse_number(normal_index_str, &normal_index))
-						{
-							Log(U"Failed to parse normal index at line: %", line);
-							return false;
-						}
-
-						vertex.normal = *normals[normal_index - 1];
-					}
-				}
 
-				*out_vertex = vertex;
-				return true;
-			};
+	Buffer buffer;
 
+	if (!read_entire_file_to_buffer(c_allocator, path, &buffer))
+	{
+		return false;
+	}
 
-			Vertex parsed_vertices[3];
-			if (!parse_vertex(&parsed_vertices[0]))
-			{
-				Log(U"Failed to parse vertex[0] at line: %", line);
-				return false;
-			}
+	defer{ buffer.free(); };
 
-			if (!parse_vertex(&parsed_vertices[1]))
-			{
-				Log(U"Failed to parse vertex[1] at line: %", line);
-				return false;
-			}
 
-			if (!parse_vertex(&parsed_vertices[2]))
-			{
-				Log(U"Failed to parse vertex[2] at line: %", line);
-				return false;
-			}
+	Mesh mesh = {};
 
+	if (!parse_obj_mesh(String((char*) buffer.data, buffer.occupied), &mesh.vertices, &mesh.indices, &mesh.submeshes))
+	{
+		return false;
+	}
 
-			vertices.add_range(parsed_vertices, 3);
+	optimize_mesh(&mesh.vertices, &mesh.indices, &mesh.submeshes);
 
-			indices.add(vertices.count - 3);
-			indices.add(vertices.count - 2);
-			indices.add(vertices.count - 1);
-		}
+	compute_mesh_bounds(mesh.vertices.data, mesh.vertices.count, &mesh.bounds_min, &mesh.bounds_max);
 
-		if (str[0] == '\n')
-			str.advance(1);
+	mesh.vertex_format = settings.quantize_meshes ? Mesh_Vertex_Format::Quantized : Mesh_Vertex_Format::Float;
 
-		line += 1;
+	{
+		Cooked_Mesh cooked = {
+			.vertices_count  = (u64) mesh.vertices.count,
+			.indices_count   = (u64) mesh.indices.count,
+			.submeshes_count = (u64) mesh.submeshes.count,
+
+			.bounds_min = mesh.bounds_min,
+			.bounds_max = mesh.bounds_max,
+		};
+
+		Cooked_Blob blobs[] = {
+			{ .data = &cooked,             .size = sizeof(cooked) },
+			{ .data = mesh.vertices.data,  .size = sizeof(Vertex)  * mesh.vertices.count  },
+			{ .data = mesh.indices.data,   .size = sizeof(u32)     * mesh.indices.count   },
+			{ .data = mesh.submeshes.data, .size = sizeof(Submesh) * mesh.submeshes.count },
+		};
+
+		asset_cache.store(path, buffer.data, buffer.occupied, Cooked_Asset_Type::Mesh, 0, blobs, 4, allocator);
 	}
 
-
-	Mesh mesh = {};
-
-	mesh.vertices = vertices;
-	mesh.indices  = indices;
-
 	mesh.name = get_file_name_without_extension(path).copy_with(c_allocator);
 
-	return meshes.put(mesh.name, mesh);
+	Scoped_Lock lock(publish_mutex);
+	meshes.put(mesh.name, mesh);
+	return true;
 }
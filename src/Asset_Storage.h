@@ -1,6 +1,7 @@
 #pragma once
 
 #include "b_lib/Hash_Map.h"
+#include "b_lib/Threading.h"
 
 #include "Renderer.h"
 
@@ -11,11 +12,14 @@ struct Asset_Storage
 	Hash_Map<Unicode_String, Texture> textures;
 	Hash_Map<Unicode_String, Mesh>    meshes;
 
+	Mutex publish_mutex; // Loaders run on worker threads, they put into maps under it.
+
 
 	void init();
 
-	Texture* load_texture(Unicode_String path);
-	Mesh*    load_obj_mesh(Unicode_String path);
+	// Thread safe, allocator is for temporary allocations.
+	bool load_texture (Unicode_String path, Allocator allocator);
+	bool load_obj_mesh(Unicode_String path, Allocator allocator);
 
 
 	inline Texture* find_texture(Unicode_String name)
@@ -1,5 +1,6 @@
 #include "Editor.h"
 
+#include "Main.h"
 #include "Input.h"
 
 void Editor::init()
@@ -17,10 +18,34 @@ void Editor::do_frame()
 	if (!editor.is_open) return;
 
 
+	// Clicks on UI don't reach the level. Hover is from the previous frame, same as UI's own click handling.
+	if (loaded_level && input.is_key_down(Key::LMB) && ui.hover == invalid_ui_id)
+	{
+		pick_entity();
+	}
+
+
 	scoped_set_and_revert(ui.parameters.text_font_face_size, 8);
 
 	if (ui.button(Rect::make_from_center_and_size(renderer.width / 2, renderer.height / 2, 200, 40), U"Editor button", rgba(50, 50, 60, 255), ui_id(0)))
 	{
 
 	}
-}
\ No newline at end of file
+}
+
+// Against entity bounds in loaded level's Level_Bvh.
+void Editor::pick_entity()
+{
+	Vector3 origin, direction;
+	renderer.get_camera_ray(&loaded_level->camera, input.mouse_x, input.mouse_y, &origin, &direction);
+
+	Entity_Id entity;
+	float     distance;
+	if (!loaded_level->bvh.ray_cast(&loaded_level->entities_storage, origin, direction, 10000, &entity, &distance))
+	{
+		selected_entity = 0;
+		return;
+	}
+
+	selected_entity = entity;
+}
@@ -6,8 +6,12 @@ struct Editor
 {
 	bool is_open = false;
 
+	Entity_Id selected_entity = 0; // Picked with left mouse button, zero if none.
+
 	void init();
 	void do_frame();
+
+	void pick_entity();
 };
 
 inline Editor editor;
\ No newline at end of file
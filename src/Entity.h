@@ -6,26 +6,125 @@
 #include "b_lib/Math.h"
 
 
-using Entity_Id = u32;
+// Slot index in Entities_Storage::slots in low 32 bits, slot's generation in high 32.
+//  Generation changes when entity is destroyed, so ids of destroyed entities never resolve to slot's next entity.
+//  Generations start at 1, so zero is never a valid id.
+using Entity_Id = u64;
 
-struct Entity
+inline Entity_Id make_entity_id(u32 slot_index, u32 generation)
+{
+	return (u64(generation) << 32) | slot_index;
+}
+
+inline u32 get_entity_id_slot_index(Entity_Id id)
+{
+	return u32(id);
+}
+
+inline u32 get_entity_id_generation(Entity_Id id)
 {
-	Vector3    position;
-	Quaternion rotation;
-	Vector3    scale;
+	return u32(id >> 32);
+}
+
+struct Mesh;
+struct Material;
+struct Entity_Chunk;
+
+// Object to world, row major 3x4. Same layout as renderer's Mesh_Instance.
+struct World_Matrix
+{
+	Vector4 rows[3];
+};
 
+// Position, rotation and scale aren't fields, they are stored structure-of-arrays in entity's chunk, see Entity_Chunk.
+struct Entity
+{
 	Entity_Id  id;
+
+	// World matrix is parent's world matrix times own transform. Zero means none, so is an id of destroyed entity.
+	//  Change it with Entities_Storage::set_parent().
+	Entity_Id  parent;
+
+	// Drawn by Renderer::draw_level() if mesh is set, assets don't move after Asset_Storage::init().
+	//  Not reflected, they are resolved from asset names. Change them with Entities_Storage::set_mesh().
+	Mesh*     mesh;
+	Material* material; // NULL means renderer's default material.
+
+	// Entity moves when another one is destroyed, see Entities_Storage::flush_destroyed_entities().
+	Entity_Chunk* chunk;
+	u32           index_in_chunk;
+
+	inline Vector3*    position();
+	inline Quaternion* rotation();
+	inline Vector3*    scale();
+
+	// Must be called after changing position, rotation or scale, see update_world_matrices().
+	inline void mark_transform_dirty();
 };
 
 REFLECT(Entity)
-	MEMBER(position);
-	MEMBER(rotation);
-	MEMBER(scale);
-
 	MEMBER(id);
+	MEMBER(parent);
 REFLECT_END();
 
 
+// Entities of one type are packed into 16 KB chunks. Base transform is split into arrays,
+//  so passes over transforms of all entities walk memory linearly. Entity structs themselves,
+//  with fields of derived types, follow the arrays, entity_size bytes each.
+//  World matrices are outputs of update_world_matrices(), recomputed only for entities flagged dirty.
+//  Everything lives in the chunk's own allocation, header comes first.
+struct Entity_Chunk
+{
+	static constexpr u64 size = 16 * 1024;
+
+	u32 pool_index;    // In Entities_Storage::pools.
+	u32 index_in_pool; // In Entity_Pool::chunks. Every chunk but the last one is full.
+	u32 count;
+	u32 capacity;
+	u32 entity_size;
+
+	Vector3*    positions;
+	Quaternion* rotations;
+	Vector3*    scales;
+	u8*         entities;
+
+	World_Matrix* world_matrices;
+	u8*           dirty_flags; // 1 if transform changed since last update_world_matrices().
+	bool          has_dirty_transforms;
+
+	// Entities whose world matrices last update_world_matrices() recomputed are within [changed_first, changed_end),
+	//  valid while chunk is in Entities_Storage::changed_chunks.
+	u32 changed_first;
+	u32 changed_end;
+
+	inline Entity* get_entity(u32 index)
+	{
+		return (Entity*) (entities + u64(index) * entity_size);
+	}
+};
+
+inline Vector3* Entity::position()
+{
+	return &chunk->positions[index_in_chunk];
+}
+
+inline Quaternion* Entity::rotation()
+{
+	return &chunk->rotations[index_in_chunk];
+}
+
+inline Vector3* Entity::scale()
+{
+	return &chunk->scales[index_in_chunk];
+}
+
+inline void Entity::mark_transform_dirty()
+{
+	chunk->dirty_flags[index_in_chunk] = 1;
+	chunk->has_dirty_transforms = true;
+}
+
+
 
 
 
@@ -0,0 +1,211 @@
+#include "Geometry_Manager.h"
+
+#include "Main.h"
+#include "Renderer.h"
+#include "Tracy_Header.h"
+
+#include "b_lib/Log.h"
+
+
+
+void Geometry_Manager::init()
+{
+	ZoneScoped;
+
+	init_pool(&vertex_pool, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, vertex_buffer_size);
+	init_pool(&index_pool,  VK_BUFFER_USAGE_INDEX_BUFFER_BIT,  index_buffer_size);
+
+	make_array(&pending_copies, 64, c_allocator);
+}
+
+void Geometry_Manager::init_pool(Geometry_Pool* pool, VkBufferUsageFlags usage, u64 default_buffer_size)
+{
+	pool->usage               = usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	pool->default_buffer_size = default_buffer_size;
+	pool->used_size           = 0;
+
+	make_array(&pool->buffers, 4, c_allocator);
+	pool->heap.init();
+}
+
+void Geometry_Manager::add_buffer(Geometry_Pool* pool, u64 required_size)
+{
+	ZoneScoped;
+
+	u64 size = max(pool->default_buffer_size, align(required_size, tlsf_granularity));
+
+	Geometry_Buffer geometry_buffer = {
+		.size = size,
+	};
+
+	VkBufferCreateInfo create_info = {
+		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+		.size  = size,
+		.usage = pool->usage,
+		.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+	};
+
+	if (vkCreateBuffer(renderer.device, &create_info, renderer.host_allocator, &geometry_buffer.buffer) != VK_SUCCESS)
+		abort_the_mission(U"Failed to vkCreateBuffer");
+
+	// Dedicated, so allocator's defragmentation never has to move a whole geometry buffer.
+	geometry_buffer.memory = vulkan_memory_allocator.allocate_and_bind(geometry_buffer.buffer, (Vulkan_Memory_Allocation_Flags) (VULKAN_MEMORY_ONLY_DEVICE_MEMORY | VULKAN_MEMORY_DEDICATED), code_location());
+
+	pool->heap.add_pool(pool->buffers.count, size);
+	pool->buffers.add(geometry_buffer);
+
+	Log(U"Added % geometry buffer of %", pool == &vertex_pool ? Unicode_String(U"vertex") : Unicode_String(U"index"), size_to_string(size, frame_allocator));
+}
+
+
+Geometry_Allocation Geometry_Manager::allocate(Geometry_Pool* pool, u64 size, u64 alignment)
+{
+	ZoneScoped;
+
+	s32 block_index = pool->heap.allocate(size, alignment);
+
+	if (block_index == -1)
+	{
+		add_buffer(pool, size + alignment);
+
+		block_index = pool->heap.allocate(size, alignment);
+		assert(block_index != -1);
+	}
+
+	Tlsf_Block* block = pool->heap.block(block_index);
+
+	pool->used_size += block->size;
+
+	return {
+		.pool = pool,
+
+		.buffer_index = block->pool_index,
+		.block_index  = block_index,
+
+		.offset = block->offset,
+		.size   = size,
+	};
+}
+
+void Geometry_Manager::free(Geometry_Allocation allocation)
+{
+	if (!allocation.pool) return;
+
+	Geometry_Pool* pool = allocation.pool;
+
+	pool->used_size -= pool->heap.block(allocation.block_index)->size;
+	pool->heap.free(allocation.block_index);
+}
+
+void Geometry_Manager::free_after_frame(Geometry_Allocation allocation)
+{
+	if (!allocation.pool) return;
+
+	renderer.current_frame_slot()->retired_geometry.add(allocation);
+}
+
+
+void* Geometry_Manager::queue_upload(Geometry_Allocation allocation)
+{
+	Renderer::Frame_Slot* slot = renderer.current_frame_slot();
+
+	// Offset must be a multiple of 4 for copies on transfer capable queues.
+	u64 staging_offset;
+	if (!slot->staging_buffer.allocate(allocation.size, 4, &staging_offset))
+	{
+		renderer.grow_frame_linear_buffer(slot, &slot->staging_buffer, allocation.size + 4);
+
+		bool allocated = slot->staging_buffer.allocate(allocation.size, 4, &staging_offset);
+		assert(allocated);
+	}
+
+	pending_copies.add({
+		.staging_buffer = slot->staging_buffer.buffer,
+		.buffer         = get_buffer(allocation),
+		.region = {
+			.srcOffset = staging_offset,
+			.dstOffset = allocation.offset,
+			.size      = allocation.size,
+		},
+	});
+
+	uploaded_bytes_this_frame += allocation.size;
+
+	return slot->staging_buffer.mapped_data + staging_offset;
+}
+
+// One copy per staging and geometry buffer pair, then one barrier for all of them.
+void Geometry_Manager::record_uploads(VkCommandBuffer command_buffer)
+{
+	ZoneScoped;
+
+	TracyPlot("Geometry upload bytes", (s64) uploaded_bytes_this_frame);
+	TracyPlot("Geometry vertex bytes", (s64) vertex_pool.used_size);
+	TracyPlot("Geometry index bytes",  (s64) index_pool.used_size);
+
+	uploaded_bytes_this_frame = 0;
+
+	if (pending_copies.count == 0) return;
+
+	defer { pending_copies.clear(); };
+
+
+	Dynamic_Array<VkBufferCopy> regions = make_array<VkBufferCopy>(pending_copies.count, frame_allocator);
+
+	for (int i = 0; i < pending_copies.count; i++)
+	{
+		Geometry_Copy* copy = pending_copies[i];
+
+		// Pair has already been handled.
+		bool is_handled = false;
+		for (int j = 0; j < i; j++)
+		{
+			if (pending_copies[j]->staging_buffer == copy->staging_buffer && pending_copies[j]->buffer == copy->buffer)
+			{
+				is_handled = true;
+				break;
+			}
+		}
+		if (is_handled) continue;
+
+
+		regions.clear();
+
+		for (int j = i; j < pending_copies.count; j++)
+		{
+			if (pending_copies[j]->staging_buffer == copy->staging_buffer && pending_copies[j]->buffer == copy->buffer)
+			{
+				regions.add(pending_copies[j]->region);
+			}
+		}
+
+		vkCmdCopyBuffer(command_buffer, copy->staging_buffer, copy->buffer, regions.count, regions.data);
+	}
+
+
+	// Ranges are fresh, so nothing earlier could have been reading them, only later reads have to wait.
+	VkMemoryBarrier barrier = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT,
+	};
+
+	vkCmdPipelineBarrier(command_buffer,
+		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+		0,
+		1, &barrier,
+		0, NULL,
+		0, NULL);
+}
+
+void Geometry_Manager::submit_uploads_now()
+{
+	ZoneScoped;
+
+	if (pending_copies.count == 0) return;
+
+	VkCommandBuffer command_buffer = renderer.begin_single_command_buffer();
+	record_uploads(command_buffer);
+	renderer.end_single_command_buffer(command_buffer);
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "b_lib/Basic.h"
+#include "b_lib/Dynamic_Array.h"
+
+#include "vulkan/vulkan.h"
+
+#include "Vulkan_Memory_Allocator.h"
+
+
+// Mesh geometry lives in a few big device local buffers, vertices in one pool of them and indices in another.
+//  Buffers of a pool are suballocated with Tlsf_Heap, buffer's index is its pool index in the heap.
+//  Meshes that share buffers are drawn with one bind and vertexOffset/firstIndex.
+//
+// Uploads are written to the frame's staging buffer right away,
+//  copies are recorded as one batch before main render pass, so mesh can be drawn in the same frame.
+
+
+struct Geometry_Pool;
+
+struct Geometry_Allocation
+{
+	Geometry_Pool* pool = NULL; // NULL if not allocated.
+
+	s32 buffer_index;
+	s32 block_index;
+
+	u64 offset;
+	u64 size;
+};
+
+struct Geometry_Buffer
+{
+	VkBuffer                 buffer;
+	Vulkan_Memory_Allocation memory;
+	u64                      size;
+};
+
+struct Geometry_Pool
+{
+	VkBufferUsageFlags usage;
+	u64                default_buffer_size; // Bigger allocations get a buffer of their own size.
+
+	Dynamic_Array<Geometry_Buffer> buffers;
+	Tlsf_Heap heap;
+
+	u64 used_size;
+};
+
+
+struct Geometry_Manager
+{
+	static constexpr u64 vertex_buffer_size = megabytes(64);
+	static constexpr u64 index_buffer_size  = megabytes(32);
+
+	Geometry_Pool vertex_pool;
+	Geometry_Pool index_pool;
+
+
+	struct Geometry_Copy
+	{
+		VkBuffer     staging_buffer; // Staging buffer might be regrown in the middle of the frame.
+		VkBuffer     buffer;
+		VkBufferCopy region;
+	};
+
+	Dynamic_Array<Geometry_Copy> pending_copies;
+
+	u64 uploaded_bytes_this_frame = 0;
+
+
+	void init();
+
+	// Alignment is vertex or index size, so offset divides into vertexOffset/firstIndex.
+	Geometry_Allocation allocate(Geometry_Pool* pool, u64 size, u64 alignment);
+
+	// GPU must be done with the range, otherwise use free_after_frame().
+	void free(Geometry_Allocation allocation);
+	void free_after_frame(Geometry_Allocation allocation);
+
+	inline VkBuffer get_buffer(Geometry_Allocation allocation)
+	{
+		return allocation.pool->buffers[allocation.buffer_index]->buffer;
+	}
+
+	// Returns staging memory of allocation's size, it's copied into allocation before main render pass of this frame.
+	void* queue_upload(Geometry_Allocation allocation);
+
+	// Must happen outside of render pass.
+	void record_uploads(VkCommandBuffer command_buffer);
+
+	// For uploads queued outside of a frame, like at init. Staging memory is reset by the next frame_begin()
+	//  before record_uploads() runs, so they are copied with a blocking submit instead.
+	void submit_uploads_now();
+
+
+	// For manager's internal usage.
+	void init_pool(Geometry_Pool* pool, VkBufferUsageFlags usage, u64 default_buffer_size);
+	void add_buffer(Geometry_Pool* pool, u64 required_size);
+};
+
+inline Geometry_Manager geometry_manager;
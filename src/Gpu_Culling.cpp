@@ -0,0 +1,579 @@
+#include "Gpu_Culling.h"
+
+#include "Main.h"
+#include "Renderer.h"
+#include "Tracy_Header.h"
+
+#include "b_lib/Log.h"
+
+
+
+void Gpu_Culling::init()
+{
+	ZoneScoped;
+
+	make_array(&groups,  64, c_allocator);
+	make_array(&batches, 8,  c_allocator);
+
+	make_array(&entity_groups,       1024, c_allocator);
+	make_array(&entity_instances,    1024, c_allocator);
+	make_array(&pool_first_entities, 8,    c_allocator);
+
+	make_array(&pending_upload.regions, 64, c_allocator);
+
+	if (!is_supported)
+	{
+		Log(U"GPU culling is not supported, levels are culled on CPU");
+		return;
+	}
+
+	VkDescriptorSetLayoutBinding bindings[descriptor_bindings_count];
+	make_descriptor_bindings(bindings);
+
+	cull_pipeline    = renderer.create_compute_pipeline(renderer.mesh_shaders.gpu_cull,          bindings, descriptor_bindings_count, sizeof(Cull_Uniform_Block));
+	compact_pipeline = renderer.create_compute_pipeline(renderer.mesh_shaders.gpu_compact_draws, bindings, descriptor_bindings_count, sizeof(Cull_Uniform_Block));
+
+	if (!is_draw_indirect_count_supported)
+	{
+		Log(U"VK_KHR_draw_indirect_count is not supported, culled batches draw all of their command slots");
+	}
+}
+
+void Gpu_Culling::ensure_buffer_size(Device_Buffer* buffer, u64 size, VkBufferUsageFlags usage)
+{
+	if (buffer->size >= size) return;
+
+	ZoneScoped;
+
+	if (buffer->buffer != VK_NULL_HANDLE)
+	{
+		// Previous frames might still use it.
+		renderer.current_frame_slot()->retired_buffers.add({
+			.buffer = buffer->buffer,
+			.memory = buffer->memory,
+		});
+	}
+
+	u64 new_size = max(buffer->size * 2, align(size, 256));
+
+	VkBufferCreateInfo create_info = {
+		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+		.size  = new_size,
+		.usage = usage | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+	};
+
+	if (vkCreateBuffer(renderer.device, &create_info, renderer.host_allocator, &buffer->buffer) != VK_SUCCESS)
+		abort_the_mission(U"Failed to vkCreateBuffer");
+
+	buffer->memory = vulkan_memory_allocator.allocate_and_bind(buffer->buffer, (Vulkan_Memory_Allocation_Flags) (VULKAN_MEMORY_ONLY_DEVICE_MEMORY | VULKAN_MEMORY_DEDICATED), code_location());
+	buffer->size   = new_size;
+}
+
+
+void Gpu_Culling::upload_level(Level* new_level)
+{
+	ZoneScoped;
+
+	Entities_Storage* storage = &new_level->entities_storage;
+
+	level                    = new_level;
+	level_version            = storage->version;
+	level_transforms_version = storage->transforms_version;
+
+	groups.clear();
+
+	Dynamic_Array<u32> entity_draws;
+	instances_count = renderer.group_level_entities(storage, NULL, &groups, 0, &entity_draws);
+
+
+	// Storage order, culling doesn't care about it and it keeps neighbouring entities together.
+	entity_groups.clear();
+	entity_groups.add_range(entity_draws.data, entity_draws.count);
+
+	entity_instances.clear();
+
+	u32 instance_index = 0;
+	for (u32 group_index: entity_groups)
+	{
+		entity_instances.add(group_index == u32_max ? u32_max : instance_index);
+
+		if (group_index != u32_max) instance_index += 1;
+	}
+
+	pool_first_entities.clear();
+
+	u32 entity_index = 0;
+	for (Entity_Pool& pool: storage->pools)
+	{
+		pool_first_entities.add(entity_index);
+
+		for (Entity_Chunk* chunk: pool.chunks)
+		{
+			entity_index += chunk->count;
+		}
+	}
+
+	if (instances_count == 0) return;
+
+
+	u32 first_visible = 0;
+	for (Renderer::Level_Draw& group: groups)
+	{
+		group.first_instance = first_visible;
+		first_visible += group.instances_count;
+	}
+
+	// Contents of a grown buffer aren't preserved, everything is uploaded below anyway.
+	ensure_buffer_size(&instance_buffer, u64(instances_count) * sizeof(Gpu_Instance), 0);
+	ensure_buffer_size(&visible_buffer,  u64(instances_count) * sizeof(u32),          0);
+
+
+	Dynamic_Array<Entity_Chunk*> chunks = make_array<Entity_Chunk*>(64, frame_allocator);
+	storage->for_each_chunk([&](Entity_Chunk* chunk)
+	{
+		chunks.add(chunk);
+	});
+
+	upload_instances(chunks.data, chunks.count, false);
+}
+
+void Gpu_Culling::upload_moved_instances()
+{
+	Entities_Storage* storage = &level->entities_storage;
+
+	if (storage->transforms_version == level_transforms_version) return;
+
+	ZoneScoped;
+
+	// Changed ranges only cover the last update, if an earlier one was missed everything is stale.
+	bool has_missed_updates = storage->transforms_version != level_transforms_version + 1;
+
+	level_transforms_version = storage->transforms_version;
+
+	if (instances_count == 0) return;
+
+	if (has_missed_updates)
+	{
+		Dynamic_Array<Entity_Chunk*> chunks = make_array<Entity_Chunk*>(64, frame_allocator);
+		storage->for_each_chunk([&](Entity_Chunk* chunk)
+		{
+			chunks.add(chunk);
+		});
+
+		upload_instances(chunks.data, chunks.count, false);
+	}
+	else
+	{
+		upload_instances(storage->changed_chunks.data, storage->changed_chunks.count, true);
+	}
+}
+
+void Gpu_Culling::upload_instances(Entity_Chunk** chunks, int chunks_count, bool only_changed_ranges)
+{
+	ZoneScoped;
+
+	auto get_range = [&](Entity_Chunk* chunk, u32* out_first, u32* out_end, u32* out_first_entity)
+	{
+		*out_first = only_changed_ranges ? chunk->changed_first : 0;
+		*out_end   = only_changed_ranges ? chunk->changed_end   : chunk->count;
+
+		*out_first_entity = *pool_first_entities[chunk->pool_index] + chunk->index_in_pool * chunk->capacity;
+	};
+
+
+	u32 staged_total = 0;
+
+	for (int chunk_index = 0; chunk_index < chunks_count; chunk_index++)
+	{
+		u32 first, end, first_entity;
+		get_range(chunks[chunk_index], &first, &end, &first_entity);
+
+		for (u32 i = first; i < end; i++)
+		{
+			if (*entity_instances[first_entity + i] != u32_max) staged_total += 1;
+		}
+	}
+
+	if (staged_total == 0) return;
+
+
+	Renderer::Frame_Slot* slot = renderer.current_frame_slot();
+
+	u64 upload_size = u64(staged_total) * sizeof(Gpu_Instance);
+
+	u64 staging_offset;
+	if (!slot->staging_buffer.allocate(upload_size, 16, &staging_offset))
+	{
+		renderer.grow_frame_linear_buffer(slot, &slot->staging_buffer, upload_size + 16);
+
+		bool allocated = slot->staging_buffer.allocate(upload_size, 16, &staging_offset);
+		assert(allocated);
+	}
+
+	// Uploads happen once per frame, so all regions come from this allocation.
+	assert(pending_upload.staging_buffer == VK_NULL_HANDLE);
+
+	pending_upload.staging_buffer = slot->staging_buffer.buffer;
+	pending_upload.regions.clear();
+
+	Gpu_Instance* staged = (Gpu_Instance*) (slot->staging_buffer.mapped_data + staging_offset);
+	u32 staged_count = 0;
+
+	for (int chunk_index = 0; chunk_index < chunks_count; chunk_index++)
+	{
+		Entity_Chunk* chunk = chunks[chunk_index];
+
+		u32 first, end, first_entity;
+		get_range(chunk, &first, &end, &first_entity);
+
+		// Instances of a chunk's range are consecutive, entities without mesh just don't have any.
+		u32 first_instance = u32_max;
+		u32 first_staged   = staged_count;
+
+		for (u32 i = first; i < end; i++)
+		{
+			u32 instance_index = *entity_instances[first_entity + i];
+			if (instance_index == u32_max) continue;
+
+			if (first_instance == u32_max) first_instance = instance_index;
+
+			Gpu_Instance* instance = &staged[staged_count];
+
+			memcpy(&instance->transform, &chunk->world_matrices[i], sizeof(Mesh_Instance));
+			instance->group_index = *entity_groups[first_entity + i];
+
+			staged_count += 1;
+		}
+
+		if (first_instance == u32_max) continue;
+
+		VkBufferCopy region = {
+			.srcOffset = staging_offset + u64(first_staged) * sizeof(Gpu_Instance),
+			.dstOffset = u64(first_instance) * sizeof(Gpu_Instance),
+			.size      = u64(staged_count - first_staged) * sizeof(Gpu_Instance),
+		};
+
+		if (pending_upload.regions.count)
+		{
+			VkBufferCopy* last = pending_upload.regions[pending_upload.regions.count - 1];
+
+			if (last->srcOffset + last->size == region.srcOffset && last->dstOffset + last->size == region.dstOffset)
+			{
+				last->size += region.size;
+				continue;
+			}
+		}
+
+		pending_upload.regions.add(region);
+	}
+
+	assert(staged_count == staged_total);
+}
+
+void Gpu_Culling::draw_level(Level* new_level)
+{
+	ZoneScoped;
+
+	if (new_level != level || new_level->entities_storage.version != level_version)
+	{
+		upload_level(new_level);
+	}
+	else
+	{
+		upload_moved_instances();
+	}
+
+	if (instances_count == 0) return;
+
+
+	// Meshes might move between geometry buffers, so batches and group table are rebuilt every frame.
+	batches.clear();
+
+	Dynamic_Array<u32> group_batches = make_array<u32>(groups.count, frame_allocator);
+
+	for (Renderer::Level_Draw& group: groups)
+	{
+		Mesh* mesh = group.mesh;
+
+		renderer.make_sure_mesh_is_on_gpu(mesh);
+
+		int batch_index = -1;
+		for (int i = 0; i < batches.count; i++)
+		{
+			Batch* batch = batches[i];
+
+			if (batch->format        == mesh->vertex_format &&
+				batch->vertex_buffer == mesh->vertex_buffer &&
+				batch->index_buffer  == mesh->index_buffer  &&
+				batch->index_type    == mesh->index_type)
+			{
+				batch_index = i;
+				break;
+			}
+		}
+
+		if (batch_index == -1)
+		{
+			batches.add({
+				.format        = mesh->vertex_format,
+				.vertex_buffer = mesh->vertex_buffer,
+				.index_buffer  = mesh->index_buffer,
+				.index_type    = mesh->index_type,
+			});
+
+			batch_index = batches.count - 1;
+		}
+
+		batches[batch_index]->groups_count += 1;
+		group_batches.add(batch_index);
+	}
+
+	u32 first_command = 0;
+	for (Batch& batch: batches)
+	{
+		batch.first_command = first_command;
+		first_command += batch.groups_count;
+	}
+
+
+	ensure_buffer_size(&group_count_buffer, u64(groups.count)  * sizeof(u32), 0);
+	ensure_buffer_size(&draw_count_buffer,  u64(batches.count) * sizeof(u32), VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT);
+	ensure_buffer_size(&command_buffer,     u64(groups.count)  * sizeof(VkDrawIndexedIndirectCommand), VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT);
+
+
+	// Group table is small, so it's written to this frame's instance buffer.
+	Renderer::Frame_Slot* slot = renderer.current_frame_slot();
+
+	u64 groups_size = u64(groups.count) * sizeof(Gpu_Draw_Group);
+	u64 alignment   = max((u64) renderer.physical_device_properties.limits.minStorageBufferOffsetAlignment, (u64) 16);
+
+	u64 groups_offset;
+	if (!slot->instance_buffer.allocate(groups_size, alignment, &groups_offset))
+	{
+		renderer.grow_frame_linear_buffer(slot, &slot->instance_buffer, groups_size + alignment);
+
+		bool allocated = slot->instance_buffer.allocate(groups_size, alignment, &groups_offset);
+		assert(allocated);
+	}
+
+	Gpu_Draw_Group* gpu_groups = (Gpu_Draw_Group*) (slot->instance_buffer.mapped_data + groups_offset);
+
+	for (int i = 0; i < groups.count; i++)
+	{
+		Renderer::Level_Draw* group = groups[i];
+		Mesh* mesh = group->mesh;
+
+		u32 batch_index = *group_batches[i];
+
+		Vector3 sphere_center;
+		float   sphere_radius;
+		get_mesh_bounding_sphere(mesh, &sphere_center, &sphere_radius);
+
+		gpu_groups[i] = {
+			.bounds_min      = Vector4::make(mesh->bounds_min.x, mesh->bounds_min.y, mesh->bounds_min.z, 0),
+			.bounds_max      = Vector4::make(mesh->bounds_max.x, mesh->bounds_max.y, mesh->bounds_max.z, 0),
+			.bounding_sphere = Vector4::make(sphere_center.x, sphere_center.y, sphere_center.z, sphere_radius),
+			.color           = group->material->color.as_vector4(),
+
+			.indices_count = (u32) mesh->indices.count,
+			.first_index   = mesh->first_index,
+			.vertex_offset = mesh->vertex_offset,
+
+			.first_visible       = group->first_instance,
+			.batch_index         = batch_index,
+			.batch_first_command = batches[batch_index]->first_command,
+		};
+	}
+
+
+	descriptor_set = renderer.imm_get_descriptor_set(cull_pipeline.descriptor_set_layout);
+	{
+		VkDescriptorBufferInfo buffer_infos[descriptor_bindings_count] = {
+			{ .buffer = instance_buffer.buffer,         .offset = 0,             .range = u64(instances_count) * sizeof(Gpu_Instance) },
+			{ .buffer = slot->instance_buffer.buffer,   .offset = groups_offset, .range = groups_size },
+			{ .buffer = visible_buffer.buffer,          .offset = 0,             .range = u64(instances_count) * sizeof(u32) },
+			{ .buffer = group_count_buffer.buffer,      .offset = 0,             .range = u64(groups.count) * sizeof(u32) },
+			{ .buffer = command_buffer.buffer,          .offset = 0,             .range = u64(groups.count) * sizeof(VkDrawIndexedIndirectCommand) },
+			{ .buffer = draw_count_buffer.buffer,       .offset = 0,             .range = u64(batches.count) * sizeof(u32) },
+		};
+
+		VkWriteDescriptorSet write_info = {
+			.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+			.dstSet = descriptor_set,
+			.dstBinding = 0,
+			.dstArrayElement = 0,
+			.descriptorCount = descriptor_bindings_count,
+			.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			.pBufferInfo = buffer_infos,
+		};
+
+		vkUpdateDescriptorSets(renderer.device, 1, &write_info, 0, NULL);
+	}
+
+	memcpy(cull_uniform.frustum_planes, renderer.level_frustum_planes, sizeof(cull_uniform.frustum_planes));
+	cull_uniform.instances_count = instances_count;
+	cull_uniform.groups_count    = groups.count;
+
+	is_drawing = true;
+
+	// Visible count stays on GPU, so these are instances before culling.
+	renderer.level_statistics.instances += instances_count;
+}
+
+
+void Gpu_Culling::record_culling(VkCommandBuffer cmd)
+{
+	ZoneScoped;
+
+	if (!is_drawing) return;
+
+	renderer.begin_debug_marker("Level culling", rgba(70, 150, 0, 255));
+	defer { renderer.end_debug_marker(); };
+
+
+	// Previous frame's draws might still read what is about to be overwritten.
+	vkCmdPipelineBarrier(cmd,
+		VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+		VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		0,
+		0, NULL,
+		0, NULL,
+		0, NULL);
+
+	if (pending_upload.staging_buffer != VK_NULL_HANDLE)
+	{
+		vkCmdCopyBuffer(cmd, pending_upload.staging_buffer, instance_buffer.buffer, pending_upload.regions.count, pending_upload.regions.data);
+		pending_upload.staging_buffer = VK_NULL_HANDLE;
+	}
+
+	vkCmdFillBuffer(cmd, group_count_buffer.buffer, 0, u64(groups.count)  * sizeof(u32), 0);
+	vkCmdFillBuffer(cmd, draw_count_buffer.buffer,  0, u64(batches.count) * sizeof(u32), 0);
+
+	// Commands past draw count aren't read, unless there's no draw count.
+	if (!cmd_draw_indexed_indirect_count)
+	{
+		vkCmdFillBuffer(cmd, command_buffer.buffer, 0, u64(groups.count) * sizeof(VkDrawIndexedIndirectCommand), 0);
+	}
+
+	{
+		VkMemoryBarrier barrier = {
+			.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+			.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+			.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+		};
+
+		vkCmdPipelineBarrier(cmd,
+			VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			0,
+			1, &barrier,
+			0, NULL,
+			0, NULL);
+	}
+
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, cull_pipeline.pipeline);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, cull_pipeline.pipeline_layout, 0, 1, &descriptor_set, 0, NULL);
+	vkCmdPushConstants(cmd, cull_pipeline.pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(cull_uniform), &cull_uniform);
+
+	vkCmdDispatch(cmd, (instances_count + 63) / 64, 1, 1);
+
+	{
+		VkMemoryBarrier barrier = {
+			.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+			.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+			.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+		};
+
+		vkCmdPipelineBarrier(cmd,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			0,
+			1, &barrier,
+			0, NULL,
+			0, NULL);
+	}
+
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, compact_pipeline.pipeline);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, compact_pipeline.pipeline_layout, 0, 1, &descriptor_set, 0, NULL);
+	vkCmdPushConstants(cmd, compact_pipeline.pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(cull_uniform), &cull_uniform);
+
+	vkCmdDispatch(cmd, (groups.count + 63) / 64, 1, 1);
+
+	{
+		VkMemoryBarrier barrier = {
+			.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+			.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+			.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT,
+		};
+
+		vkCmdPipelineBarrier(cmd,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+			0,
+			1, &barrier,
+			0, NULL,
+			0, NULL);
+	}
+}
+
+void Gpu_Culling::record_draws(VkCommandBuffer cmd)
+{
+	ZoneScoped;
+
+	if (!is_drawing) return;
+
+	defer { is_drawing = false; };
+
+	renderer.begin_debug_marker("Culled level draws", rgba(150, 70, 0, 255));
+	defer { renderer.end_debug_marker(); };
+
+
+	Culled_Mesh_Uniform_Block uniform;
+	memcpy(uniform.view_projection, renderer.level_view_projection, sizeof(uniform.view_projection));
+
+	u32 command_stride = sizeof(VkDrawIndexedIndirectCommand);
+
+	// One pass per vertex format, so each pipeline is bound once.
+	for (int format = 0; format < array_count(mesh_pipelines); format++)
+	{
+		Renderer::Imm_Pipeline* pipeline = &mesh_pipelines[format];
+
+		bool is_pipeline_bound = false;
+
+		for (int batch_index = 0; batch_index < batches.count; batch_index++)
+		{
+			Batch* batch = batches[batch_index];
+
+			if ((int) batch->format != format) continue;
+
+			if (!is_pipeline_bound)
+			{
+				vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->pipeline);
+				vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->pipeline_layout, 0, 1, &descriptor_set, 0, NULL);
+				vkCmdPushConstants(cmd, pipeline->pipeline_layout, VK_SHADER_STAGE_ALL_GRAPHICS, 0, sizeof(uniform), &uniform);
+
+				is_pipeline_bound = true;
+			}
+
+			VkDeviceSize offset = 0;
+			vkCmdBindVertexBuffers(cmd, 0, 1, &batch->vertex_buffer, &offset);
+			vkCmdBindIndexBuffer(cmd, batch->index_buffer, 0, batch->index_type);
+
+			u64 commands_offset = u64(batch->first_command) * command_stride;
+
+			if (cmd_draw_indexed_indirect_count)
+			{
+				cmd_draw_indexed_indirect_count(cmd, command_buffer.buffer, commands_offset, draw_count_buffer.buffer, u64(batch_index) * sizeof(u32), batch->groups_count, command_stride);
+			}
+			else
+			{
+				vkCmdDrawIndexedIndirect(cmd, command_buffer.buffer, commands_offset, batch->groups_count, command_stride);
+			}
+
+			renderer.level_statistics.draw_calls += 1;
+		}
+	}
+}
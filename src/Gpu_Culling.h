@@ -0,0 +1,177 @@
+#pragma once
+
+#include "b_lib/Basic.h"
+#include "b_lib/Dynamic_Array.h"
+#include "b_lib/Math.h"
+
+#include "vulkan/vulkan.h"
+
+#include "Renderer.h"
+
+
+// Level entities are culled against the camera frustum on GPU and drawn with indirect draws.
+//
+// Instances of the whole level live in a device local buffer, uploaded again only when level or its version changes,
+//  so static levels cost nothing on CPU per frame besides a small table of (mesh, material) groups.
+//  Moves only upload instances of changed ranges of Entities_Storage::changed_chunks.
+//
+// Before main render pass:
+//  gpu_cull.comp          - one thread per instance, visible ones are appended to their group's range of visible buffer.
+//  gpu_compact_draws.comp - one thread per group, groups with visible instances get a draw command.
+// Groups that share vertex format and geometry buffers form a batch, every batch is one vkCmdDrawIndexedIndirectCount.
+//
+// Without VK_KHR_draw_indirect_count batch draws all of its command slots, unused ones are zeroed and draw nothing.
+
+
+// Keep in sync with gpu_culling.glsl.h
+struct Gpu_Instance
+{
+	Mesh_Instance transform;
+	u32           group_index;
+	u32           padding[3];
+};
+static_assert(sizeof(Gpu_Instance) == 64);
+
+struct Gpu_Draw_Group
+{
+	Vector4 bounds_min;
+	Vector4 bounds_max;
+	Vector4 bounding_sphere; // Object space center and radius.
+	Vector4 color;
+
+	u32 indices_count;
+	u32 first_index;
+	s32 vertex_offset;
+
+	u32 first_visible; // Groups have fixed ranges of visible buffer, sized by their instance counts.
+	u32 batch_index;
+	u32 batch_first_command;
+
+	u32 padding[2];
+};
+static_assert(sizeof(Gpu_Draw_Group) == 96);
+
+struct Cull_Uniform_Block
+{
+	Vector4 frustum_planes[5];
+
+	u32 instances_count;
+	u32 groups_count;
+};
+static_assert(sizeof(Cull_Uniform_Block) <= VULKAN_MAX_PUSH_CONSTANT_SIZE);
+
+// Push constants of mesh_culled.vert, the rest comes from the group.
+struct Culled_Mesh_Uniform_Block
+{
+	float view_projection[16]; // Row major.
+};
+static_assert(sizeof(Culled_Mesh_Uniform_Block) <= VULKAN_MAX_PUSH_CONSTANT_SIZE);
+
+
+struct Gpu_Culling
+{
+	bool is_supported = false; // multiDrawIndirect and drawIndirectFirstInstance.
+
+	bool is_draw_indirect_count_supported = false;
+	PFN_vkCmdDrawIndexedIndirectCountKHR cmd_draw_indexed_indirect_count = NULL;
+
+
+	// All of them have the same set layout, see gpu_culling.glsl.h for bindings.
+	Renderer::Imm_Pipeline cull_pipeline;
+	Renderer::Imm_Pipeline compact_pipeline;
+	Renderer::Imm_Pipeline mesh_pipelines[2]; // Indexed by Mesh_Vertex_Format, created by Renderer::create_mesh_pipelines().
+
+	static constexpr int descriptor_bindings_count = 6;
+
+	inline void make_descriptor_bindings(VkDescriptorSetLayoutBinding* out_bindings)
+	{
+		for (int i = 0; i < descriptor_bindings_count; i++)
+		{
+			out_bindings[i] = {
+				.binding = (u32) i,
+				.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+				.descriptorCount = 1,
+				.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_COMPUTE_BIT,
+				.pImmutableSamplers = NULL,
+			};
+		}
+	}
+
+
+	struct Device_Buffer
+	{
+		VkBuffer                 buffer = VK_NULL_HANDLE;
+		Vulkan_Memory_Allocation memory;
+		u64                      size = 0;
+	};
+
+	Device_Buffer instance_buffer;
+	Device_Buffer visible_buffer;
+	Device_Buffer group_count_buffer;
+	Device_Buffer command_buffer;
+	Device_Buffer draw_count_buffer;
+
+
+	// Uploaded level. Level_Draw::first_instance is group's first_visible.
+	Level* level         = NULL;
+	u64    level_version = 0;
+	u64    level_transforms_version = 0;
+	u32    instances_count = 0;
+
+	Dynamic_Array<Renderer::Level_Draw> groups;
+
+	// Uploaded level's entities in Entities_Storage::for_each_chunk() order, u32_max for ones without mesh.
+	//  Entity of chunk's index i is at pool_first_entities[chunk->pool_index] + chunk->index_in_pool * chunk->capacity + i.
+	Dynamic_Array<u32> entity_groups;
+	Dynamic_Array<u32> entity_instances; // In instance_buffer.
+	Dynamic_Array<u32> pool_first_entities;
+
+
+	struct Batch
+	{
+		Mesh_Vertex_Format format;
+		VkBuffer           vertex_buffer;
+		VkBuffer           index_buffer;
+		VkIndexType        index_type;
+
+		u32 first_command;
+		u32 groups_count;
+	};
+
+	// Set up by draw_level(), consumed by record_culling() and record_draws() of the same frame.
+	bool is_drawing = false;
+
+	Dynamic_Array<Batch> batches;
+
+	VkDescriptorSet    descriptor_set;
+	Cull_Uniform_Block cull_uniform;
+
+	struct
+	{
+		VkBuffer staging_buffer = VK_NULL_HANDLE; // NULL if nothing is pending.
+		Dynamic_Array<VkBufferCopy> regions;
+	} pending_upload;
+
+
+	void init();
+
+	// Called by Renderer::draw_level(), which has already set up level_view_projection and level_frustum_planes.
+	void draw_level(Level* level);
+
+	// Must happen outside of render pass.
+	void record_culling(VkCommandBuffer command_buffer);
+	void record_draws(VkCommandBuffer command_buffer);
+
+
+	// For internal usage.
+	void upload_level(Level* level);
+	void upload_moved_instances();
+
+	// Stages instances of whole chunks or only of their changed ranges, consecutive ones share a copy region.
+	void upload_instances(Entity_Chunk** chunks, int chunks_count, bool only_changed_ranges);
+
+	// Old buffer is destroyed when frame is done with it, contents are not preserved.
+	void ensure_buffer_size(Device_Buffer* buffer, u64 size, VkBufferUsageFlags usage);
+};
+
+inline Gpu_Culling gpu_culling;
@@ -3,29 +3,227 @@
 #include "b_lib/Math.h"
 
 #include "Entities_Info.h"
+#include "Level_Bvh.h"
+
+// Chunks of one entity type, see Entity_Chunk. Entities are kept packed, only the last chunk has free space.
+struct Entity_Pool
+{
+	Reflection::Struct_Type* entity_type;
+
+	Dynamic_Array<Entity_Chunk*> chunks;
+
+	// Last chunk that became empty, kept so spawning and despawning around a chunk boundary doesn't allocate.
+	Entity_Chunk* spare_chunk = NULL;
+};
+
+// Maps Entity_Id's slot index to the entity, slots of destroyed entities are reused through a free list.
+struct Entity_Slot
+{
+	Entity* entity; // NULL if slot is free.
+
+	u32 generation;
+	u32 next_free_slot; // u32_max ends the list.
+
+	bool is_destroyed; // Waiting for flush_destroyed_entities(), entity is still in its chunk.
+};
 
 struct Entities_Storage
 {
-	Hash_Map<Entity_Id, Entity*> entities;
+	Dynamic_Array<Entity_Slot> slots;
+	u32 first_free_slot = u32_max;
+
+	Dynamic_Array<Entity_Pool> pools; // One per entity type, in order of first creation.
+
+	u32 entities_count = 0;
+
+	// Slot indices, see destroy_entity().
+	Dynamic_Array<u32> destroyed_slots;
+
+	// Ids of entities that have a parent, parents go before their children. See update_world_matrices().
+	Dynamic_Array<Entity_Id> hierarchy_order;
+	bool is_hierarchy_order_stale = false;
 
-	Entity_Id next_entity_id = 0;
+	// Since the last Level_Bvh::update(), which clears them. Moved ones are appended by update_world_matrices(),
+	//  destroyed ones by flush_destroyed_entities(), ids of destroyed entities don't resolve anymore.
+	Dynamic_Array<Entity_Id> moved_entities;
+	Dynamic_Array<Entity_Id> destroyed_entities;
+
+	// Bumped when entities are created or destroyed or their mesh changes, renderer keeps a GPU copy of entities
+	//  and uploads it again when this changes. Meshes are changed with set_mesh(), which bumps it.
+	u64 version = 0;
+
+	// Bumped by every update_world_matrices(), changed_chunks are chunks it recomputed anything in.
+	//  Renderer uploads only their changed ranges if it has seen the previous transforms_version.
+	u64 transforms_version = 0;
+	Dynamic_Array<Entity_Chunk*> changed_chunks;
+
+	inline void mark_changed()
+	{
+		version += 1;
+	}
 
 	inline static Entities_Storage make()
 	{
 		Entities_Storage storage = {};
-		make_hash_map(&storage.entities, 512, c_allocator);
+		make_array(&storage.slots, 512, c_allocator);
+		make_array(&storage.pools, 8, c_allocator);
+		make_array(&storage.destroyed_slots, 64, c_allocator);
+		make_array(&storage.hierarchy_order, 64, c_allocator);
+		make_array(&storage.moved_entities, 256, c_allocator);
+		make_array(&storage.destroyed_entities, 64, c_allocator);
+		make_array(&storage.changed_chunks, 64, c_allocator);
 	
 		return storage;
 	}
 
+	// Frees chunks too, so entities go away without being destroyed one by one.
+	inline void free()
+	{
+		for (Entity_Pool& pool: pools)
+		{
+			for (Entity_Chunk* chunk: pool.chunks)
+			{
+				c_allocator.free(chunk, code_location());
+			}
+
+			if (pool.spare_chunk)
+			{
+				c_allocator.free(pool.spare_chunk, code_location());
+			}
+
+			pool.chunks.free();
+		}
+
+		slots.free();
+		pools.free();
+		destroyed_slots.free();
+		hierarchy_order.free();
+		moved_entities.free();
+		destroyed_entities.free();
+		changed_chunks.free();
+	}
+
+
+	inline Entity_Pool* get_pool(Reflection::Struct_Type* entity_type)
+	{
+		for (Entity_Pool& pool: pools)
+		{
+			if (pool.entity_type == entity_type) return &pool;
+		}
+
+		Entity_Pool pool = {
+			.entity_type = entity_type,
+		};
+		make_array(&pool.chunks, 16, c_allocator);
+
+		pools.add(pool);
+
+		return pools[pools.count - 1];
+	}
+
+	inline Entity_Chunk* add_chunk(Entity_Pool* pool)
+	{
+		if (pool->spare_chunk)
+		{
+			Entity_Chunk* chunk = pool->spare_chunk;
+			pool->spare_chunk = NULL;
+
+			chunk->index_in_pool = pool->chunks.count;
+
+			pool->chunks.add(chunk);
+			return chunk;
+		}
+
+		u8* memory = (u8*) c_allocator.alloc(Entity_Chunk::size, code_location());
+
+		u64 header_size = align(sizeof(Entity_Chunk), 16);
+		u64 entity_size = align(pool->entity_type->size, 16); // Keeps every entity struct as aligned as the first one.
+
+		u64 bytes_per_entity = sizeof(Vector3) + sizeof(Quaternion) + sizeof(Vector3) + entity_size + sizeof(World_Matrix) + sizeof(u8);
+
+		// Minus what aligning arrays might waste.
+		u32 capacity = u32((Entity_Chunk::size - header_size - 5 * 16) / bytes_per_entity);
+		assert(capacity > 0);
+
+		Entity_Chunk* chunk = (Entity_Chunk*) memory;
+		*chunk = {
+			.pool_index    = u32(pool - pools.data),
+			.index_in_pool = (u32) pool->chunks.count,
+			.count         = 0,
+			.capacity      = capacity,
+			.entity_size   = (u32) entity_size,
+		};
+
+		u64 offset = header_size;
+
+		chunk->positions = (Vector3*)    (memory + offset); offset = align(offset + capacity * sizeof(Vector3),    16);
+		chunk->rotations = (Quaternion*) (memory + offset); offset = align(offset + capacity * sizeof(Quaternion), 16);
+		chunk->scales    = (Vector3*)    (memory + offset); offset = align(offset + capacity * sizeof(Vector3),    16);
+		chunk->entities  =                memory + offset;  offset += capacity * entity_size;
+
+		chunk->world_matrices = (World_Matrix*) (memory + offset); offset += capacity * sizeof(World_Matrix);
+		chunk->dirty_flags    =                  memory + offset;  offset += capacity * sizeof(u8);
+
+		assert(offset <= Entity_Chunk::size);
+
+		pool->chunks.add(chunk);
+
+		return chunk;
+	}
 
 	inline Entity* create_entity(Reflection::Struct_Type* entity_type)
 	{
-		defer { next_entity_id += 1; };
-		Entity* e = (Entity*) c_allocator.alloc(entity_type->size, code_location());
-		memset(e, 0, entity_type->size); // You should apply ZII principle in the code.
+		u32 slot_index;
+
+		if (first_free_slot != u32_max)
+		{
+			slot_index      = first_free_slot;
+			first_free_slot = slots[slot_index]->next_free_slot;
+		}
+		else
+		{
+			slots.add({
+				.entity     = NULL,
+				.generation = 1,
+			});
+
+			slot_index = slots.count - 1;
+		}
+
+
+		Entity_Pool* pool = get_pool(entity_type);
+
+		Entity_Chunk* chunk = pool->chunks.count ? *pool->chunks[pool->chunks.count - 1] : NULL;
+		if (!chunk || chunk->count == chunk->capacity)
+		{
+			chunk = add_chunk(pool);
+		}
+
+		u32 index = chunk->count;
+		chunk->count += 1;
+
+		Entity* e = chunk->get_entity(index);
+		memset(e, 0, chunk->entity_size); // You should apply ZII principle in the code.
+
+		chunk->positions[index] = {};
+		chunk->rotations[index] = {};
+		chunk->scales[index]    = {};
+
+		chunk->world_matrices[index] = {};
+
+		Entity_Slot* slot = slots[slot_index];
+		slot->entity       = e;
+		slot->is_destroyed = false;
+
+		e->id             = make_entity_id(slot_index, slot->generation);
+		e->chunk          = chunk;
+		e->index_in_chunk = index;
+
+		e->mark_transform_dirty();
 		
-		entities.put(next_entity_id, e);
+		entities_count += 1;
+
+		mark_changed();
 
 		return e;
 	}
@@ -40,14 +238,162 @@ struct Entities_Storage
 		return create_entity(entity_type);
 	}
 
-	// @TODO: implement destroy_entity
+	// NULL if entity is destroyed, including ones waiting for flush_destroyed_entities().
+	//  Pointer is valid until the next flush_destroyed_entities(), keep ids rather than pointers.
+	inline Entity* get_entity(Entity_Id id)
+	{
+		u32 slot_index = get_entity_id_slot_index(id);
+		if (slot_index >= (u32) slots.count) return NULL;
+
+		Entity_Slot* slot = slots[slot_index];
+		if (slot->generation != get_entity_id_generation(id) || slot->is_destroyed) return NULL;
+
+		return slot->entity;
+	}
+
+	// Deferred, entity stays where it is until flush_destroyed_entities(), so it's safe to call while iterating.
+	//  Id stops resolving right away. Stale ids are ignored.
+	inline void destroy_entity(Entity_Id id)
+	{
+		if (!get_entity(id)) return;
+
+		u32 slot_index = get_entity_id_slot_index(id);
+
+		slots[slot_index]->is_destroyed = true;
+		destroyed_slots.add(slot_index);
+	}
+
+	// Fills every hole with the last entity of the same pool, so chunks stay packed.
+	//  Must not be called while iterating.
+	inline void flush_destroyed_entities()
+	{
+		if (destroyed_slots.count == 0) return;
+
+		for (u32 slot_index: destroyed_slots)
+		{
+			Entity_Slot* slot = slots[slot_index];
+
+			Entity*       entity = slot->entity;
+			Entity_Chunk* chunk  = entity->chunk;
+			u32           index  = entity->index_in_chunk;
+
+			destroyed_entities.add(entity->id);
+
+			Entity_Pool*  pool       = pools[chunk->pool_index];
+			Entity_Chunk* last_chunk = *pool->chunks[pool->chunks.count - 1];
+			u32           last_index = last_chunk->count - 1;
+
+			if (last_chunk != chunk || last_index != index)
+			{
+				Entity* moved = last_chunk->get_entity(last_index);
+
+				chunk->positions[index] = last_chunk->positions[last_index];
+				chunk->rotations[index] = last_chunk->rotations[last_index];
+				chunk->scales[index]    = last_chunk->scales[last_index];
+
+				chunk->world_matrices[index] = last_chunk->world_matrices[last_index];
+				chunk->dirty_flags[index]    = last_chunk->dirty_flags[last_index];
+
+				if (chunk->dirty_flags[index]) chunk->has_dirty_transforms = true;
+
+				memcpy(entity, moved, chunk->entity_size);
+
+				entity->chunk          = chunk;
+				entity->index_in_chunk = index;
+
+				slots[get_entity_id_slot_index(entity->id)]->entity = entity;
+			}
+
+			last_chunk->count -= 1;
+
+			if (last_chunk->count == 0)
+			{
+				pool->chunks.count -= 1;
+
+				if (pool->spare_chunk)
+				{
+					c_allocator.free(pool->spare_chunk, code_location());
+				}
+				pool->spare_chunk = last_chunk;
+			}
+
+
+			slot->entity       = NULL;
+			slot->is_destroyed = false;
+			slot->generation   = max(slot->generation + 1, (u32) 1); // Zero is reserved for null id.
+
+			slot->next_free_slot = first_free_slot;
+			first_free_slot      = slot_index;
+
+			entities_count -= 1;
+		}
+
+		destroyed_slots.clear();
+
+		// Children of destroyed entities became roots. Without any children there is nothing to rebuild,
+		//  and rebuilding walks every entity.
+		if (hierarchy_order.count)
+		{
+			is_hierarchy_order_stale = true;
+		}
+
+		mark_changed();
+	}
+
+	// mesh might be NULL, material NULL means renderer's default material.
+	//  Both renderer's GPU copy of entities and level's Level_Bvh see the change.
+	inline void set_mesh(Entity* entity, Mesh* mesh, Material* material)
+	{
+		entity->mesh     = mesh;
+		entity->material = material;
+		entity->mark_transform_dirty();
+
+		mark_changed();
+	}
+
+	// parent might be zero. Cycles are not allowed.
+	inline void set_parent(Entity* entity, Entity_Id parent)
+	{
+		entity->parent = parent;
+		entity->mark_transform_dirty();
+
+		is_hierarchy_order_stale = true;
+	}
+
+	// Dense iteration, calls callback(Entity_Chunk*) for every chunk of every pool, in the same order every time.
+	//  Within a chunk entity i has positions[i], rotations[i], scales[i] and get_entity(i).
+	template <typename F>
+	inline void for_each_chunk(F callback)
+	{
+		for (Entity_Pool& pool: pools)
+		{
+			for (Entity_Chunk* chunk: pool.chunks)
+			{
+				callback(chunk);
+			}
+		}
+	}
 };
 
 
+// Right handed, Y is up, looks along -Z when yaw and pitch are 0.
+struct Camera
+{
+	Vector3 position;
+
+	float yaw;   // Radians, around Y.
+	float pitch; // Radians, around X.
+
+	float vertical_fov = 1.2; // Radians.
+	float near_plane   = 0.05; // Depth is reversed and there is no far plane.
+};
+
 struct Level
 {
 	Entities_Storage entities_storage;
 
+	Level_Bvh bvh;
 
+	Camera camera;
 };
 
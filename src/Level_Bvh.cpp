@@ -0,0 +1,948 @@
+#include "Level_Bvh.h"
+
+#include "Main.h"
+#include "Level.h"
+#include "Renderer.h"
+#include "Transforms.h"
+#include "Worker_Pool.h"
+#include "Tracy_Header.h"
+
+#include "b_lib/Log.h"
+
+
+static inline float surface_area(Vector3 bounds_min, Vector3 bounds_max)
+{
+	float x = bounds_max.x - bounds_min.x;
+	float y = bounds_max.y - bounds_min.y;
+	float z = bounds_max.z - bounds_min.z;
+
+	return 2 * (x * y + y * z + z * x);
+}
+
+static inline void merge_bounds(Vector3* bounds_min, Vector3* bounds_max, Vector3 other_min, Vector3 other_max)
+{
+	*bounds_min = Vector3::make(min(bounds_min->x, other_min.x), min(bounds_min->y, other_min.y), min(bounds_min->z, other_min.z));
+	*bounds_max = Vector3::make(max(bounds_max->x, other_max.x), max(bounds_max->y, other_max.y), max(bounds_max->z, other_max.z));
+}
+
+static inline bool contains_bounds(Vector3 bounds_min, Vector3 bounds_max, Vector3 inner_min, Vector3 inner_max)
+{
+	return inner_min.x >= bounds_min.x && inner_min.y >= bounds_min.y && inner_min.z >= bounds_min.z &&
+	       inner_max.x <= bounds_max.x && inner_max.y <= bounds_max.y && inner_max.z <= bounds_max.z;
+}
+
+static inline bool overlap_bounds(Vector3 a_min, Vector3 a_max, Vector3 b_min, Vector3 b_max)
+{
+	return a_min.x <= b_max.x && a_max.x >= b_min.x &&
+	       a_min.y <= b_max.y && a_max.y >= b_min.y &&
+	       a_min.z <= b_max.z && a_max.z >= b_min.z;
+}
+
+static inline void make_fat_bounds(Vector3 bounds_min, Vector3 bounds_max, Vector3* out_min, Vector3* out_max)
+{
+	Vector3 margin = Vector3::make(
+		(bounds_max.x - bounds_min.x) * Level_Bvh::fat_margin,
+		(bounds_max.y - bounds_min.y) * Level_Bvh::fat_margin,
+		(bounds_max.z - bounds_min.z) * Level_Bvh::fat_margin);
+
+	*out_min = Vector3::make(bounds_min.x - margin.x, bounds_min.y - margin.y, bounds_min.z - margin.z);
+	*out_max = Vector3::make(bounds_max.x + margin.x, bounds_max.y + margin.y, bounds_max.z + margin.z);
+}
+
+
+// Center goes through the matrix, extent through its absolute value.
+bool get_entity_bounds(Entity* entity, Vector3* out_min, Vector3* out_max)
+{
+	Mesh* mesh = entity->mesh;
+	if (!mesh) return false;
+
+	World_Matrix* m = &entity->chunk->world_matrices[entity->index_in_chunk];
+
+	Vector3 center = Vector3::make((mesh->bounds_min.x + mesh->bounds_max.x) * 0.5f, (mesh->bounds_min.y + mesh->bounds_max.y) * 0.5f, (mesh->bounds_min.z + mesh->bounds_max.z) * 0.5f);
+	Vector3 extent = Vector3::make((mesh->bounds_max.x - mesh->bounds_min.x) * 0.5f, (mesh->bounds_max.y - mesh->bounds_min.y) * 0.5f, (mesh->bounds_max.z - mesh->bounds_min.z) * 0.5f);
+
+	float world_center[3];
+	float world_extent[3];
+
+	for (int i = 0; i < 3; i++)
+	{
+		Vector4 row = m->rows[i];
+
+		world_center[i] = row.x * center.x + row.y * center.y + row.z * center.z + row.w;
+		world_extent[i] = fabsf(row.x) * extent.x + fabsf(row.y) * extent.y + fabsf(row.z) * extent.z;
+	}
+
+	*out_min = Vector3::make(world_center[0] - world_extent[0], world_center[1] - world_extent[1], world_center[2] - world_extent[2]);
+	*out_max = Vector3::make(world_center[0] + world_extent[0], world_center[1] + world_extent[1], world_center[2] + world_extent[2]);
+
+	return true;
+}
+
+
+
+void Level_Bvh::init()
+{
+	make_array(&nodes,       1024, c_allocator);
+	make_array(&free_nodes,  64,   c_allocator);
+	make_array(&slot_leaves, 1024, c_allocator);
+
+	make_array(&traversal_stack, 64, c_allocator);
+}
+
+void Level_Bvh::free()
+{
+	nodes.free();
+	free_nodes.free();
+	slot_leaves.free();
+
+	traversal_stack.free();
+}
+
+s32 Level_Bvh::allocate_node()
+{
+	if (free_nodes.count)
+	{
+		s32 node_index = *free_nodes[free_nodes.count - 1];
+		free_nodes.count -= 1;
+		return node_index;
+	}
+
+	nodes.add({});
+	return nodes.count - 1;
+}
+
+void Level_Bvh::free_node(s32 node_index)
+{
+	free_nodes.add(node_index);
+}
+
+
+s32 Level_Bvh::get_leaf(Entity_Id entity)
+{
+	u32 slot_index = get_entity_id_slot_index(entity);
+	if (slot_index >= (u32) slot_leaves.count) return -1;
+
+	s32 leaf = *slot_leaves[slot_index];
+
+	// Slot might have been reused by another entity.
+	if (leaf == -1 || nodes[leaf]->entity != entity) return -1;
+
+	return leaf;
+}
+
+void Level_Bvh::set_leaf(Entity_Id entity, s32 leaf)
+{
+	u32 slot_index = get_entity_id_slot_index(entity);
+
+	while ((u32) slot_leaves.count <= slot_index)
+	{
+		slot_leaves.add(-1);
+	}
+
+	*slot_leaves[slot_index] = leaf;
+}
+
+
+// Stops at the first node whose bounds stay the same, nodes above it can't change either.
+void Level_Bvh::refit_ancestors(s32 node_index)
+{
+	while (node_index != -1)
+	{
+		Bvh_Node* node = nodes[node_index];
+		Bvh_Node* a    = nodes[node->children[0]];
+		Bvh_Node* b    = nodes[node->children[1]];
+
+		Vector3 bounds_min = a->bounds_min;
+		Vector3 bounds_max = a->bounds_max;
+		merge_bounds(&bounds_min, &bounds_max, b->bounds_min, b->bounds_max);
+
+		if (memcmp(&bounds_min, &node->bounds_min, sizeof(Vector3)) == 0 && memcmp(&bounds_max, &node->bounds_max, sizeof(Vector3)) == 0) break;
+
+		node->bounds_min = bounds_min;
+		node->bounds_max = bounds_max;
+
+		node_index = node->parent;
+	}
+}
+
+// Walks down towards the cheapest sibling, cost of a node is the area of its bounds merged with the leaf,
+//  plus how much every ancestor has to grow on the way.
+void Level_Bvh::insert_leaf(Entity_Id entity, Vector3 bounds_min, Vector3 bounds_max)
+{
+	s32 leaf = allocate_node();
+	*nodes[leaf] = {
+		.bounds_min = bounds_min,
+		.bounds_max = bounds_max,
+		.parent     = -1,
+		.children   = { -1, -1 },
+		.entity     = entity,
+	};
+
+	set_leaf(entity, leaf);
+	leaves_count += 1;
+
+	if (root == -1)
+	{
+		root = leaf;
+		return;
+	}
+
+
+	s32 sibling = root;
+
+	while (!nodes[sibling]->is_leaf())
+	{
+		Bvh_Node* node = nodes[sibling];
+
+		Vector3 merged_min = node->bounds_min;
+		Vector3 merged_max = node->bounds_max;
+		merge_bounds(&merged_min, &merged_max, bounds_min, bounds_max);
+
+		float area        = surface_area(node->bounds_min, node->bounds_max);
+		float merged_area = surface_area(merged_min, merged_max);
+
+		float cost             = 2 * merged_area;       // New parent of this node and the leaf.
+		float inheritance_cost = 2 * (merged_area - area); // Pushing the leaf further down.
+
+		float child_costs[2];
+		for (int i = 0; i < 2; i++)
+		{
+			Bvh_Node* child = nodes[node->children[i]];
+
+			Vector3 child_min = child->bounds_min;
+			Vector3 child_max = child->bounds_max;
+			merge_bounds(&child_min, &child_max, bounds_min, bounds_max);
+
+			float child_cost = surface_area(child_min, child_max);
+			if (!child->is_leaf())
+			{
+				child_cost -= surface_area(child->bounds_min, child->bounds_max);
+			}
+
+			child_costs[i] = child_cost + inheritance_cost;
+		}
+
+		if (cost < child_costs[0] && cost < child_costs[1]) break;
+
+		sibling = node->children[child_costs[0] < child_costs[1] ? 0 : 1];
+	}
+
+
+	s32 old_parent = nodes[sibling]->parent;
+	s32 new_parent = allocate_node();
+
+	Vector3 parent_min = nodes[sibling]->bounds_min;
+	Vector3 parent_max = nodes[sibling]->bounds_max;
+	merge_bounds(&parent_min, &parent_max, bounds_min, bounds_max);
+
+	*nodes[new_parent] = {
+		.bounds_min = parent_min,
+		.bounds_max = parent_max,
+		.parent     = old_parent,
+		.children   = { sibling, leaf },
+		.entity     = 0,
+	};
+
+	if (old_parent != -1)
+	{
+		Bvh_Node* parent = nodes[old_parent];
+		parent->children[parent->children[0] == sibling ? 0 : 1] = new_parent;
+	}
+	else
+	{
+		root = new_parent;
+	}
+
+	nodes[sibling]->parent = new_parent;
+	nodes[leaf]->parent    = new_parent;
+
+	refit_ancestors(old_parent);
+}
+
+void Level_Bvh::remove_leaf(s32 leaf)
+{
+	set_leaf(nodes[leaf]->entity, -1);
+	leaves_count -= 1;
+
+	defer { free_node(leaf); };
+
+	if (leaf == root)
+	{
+		root = -1;
+		return;
+	}
+
+	s32 parent      = nodes[leaf]->parent;
+	s32 grandparent = nodes[parent]->parent;
+	s32 sibling     = nodes[parent]->children[nodes[parent]->children[0] == leaf ? 1 : 0];
+
+	free_node(parent);
+
+	nodes[sibling]->parent = grandparent;
+
+	if (grandparent == -1)
+	{
+		root = sibling;
+		return;
+	}
+
+	Bvh_Node* node = nodes[grandparent];
+	node->children[node->children[0] == parent ? 0 : 1] = sibling;
+
+	refit_ancestors(grandparent);
+}
+
+
+void Level_Bvh::update(Entities_Storage* storage)
+{
+	ZoneScoped;
+
+	defer {
+		storage->moved_entities.clear();
+		storage->destroyed_entities.clear();
+	};
+
+	// Rebuilding is cheaper than touching most of the tree one leaf at a time,
+	//  and incremental changes make the tree worse over time.
+	u32 changes_count = storage->moved_entities.count + storage->destroyed_entities.count;
+
+	if (!is_built || changes_count > leaves_count / 4 + 1024 || changes_since_rebuild > leaves_count + 1024)
+	{
+		rebuild(storage);
+		return;
+	}
+
+
+	for (Entity_Id id: storage->destroyed_entities)
+	{
+		s32 leaf = get_leaf(id);
+		if (leaf == -1) continue;
+
+		remove_leaf(leaf);
+		changes_since_rebuild += 1;
+	}
+
+	for (Entity_Id id: storage->moved_entities)
+	{
+		Entity* entity = storage->get_entity(id);
+		if (!entity) continue;
+
+		s32 leaf = get_leaf(id);
+
+		Vector3 bounds_min, bounds_max;
+		if (!get_entity_bounds(entity, &bounds_min, &bounds_max))
+		{
+			if (leaf != -1)
+			{
+				remove_leaf(leaf);
+				changes_since_rebuild += 1;
+			}
+			continue;
+		}
+
+		if (leaf != -1 && contains_bounds(nodes[leaf]->bounds_min, nodes[leaf]->bounds_max, bounds_min, bounds_max)) continue;
+
+
+		Vector3 fat_min, fat_max;
+		make_fat_bounds(bounds_min, bounds_max, &fat_min, &fat_max);
+
+		if (leaf == -1)
+		{
+			insert_leaf(id, fat_min, fat_max);
+		}
+		else
+		{
+			nodes[leaf]->bounds_min = fat_min;
+			nodes[leaf]->bounds_max = fat_max;
+
+			refit_ancestors(nodes[leaf]->parent);
+		}
+
+		changes_since_rebuild += 1;
+	}
+}
+
+
+struct Bvh_Build_Item
+{
+	Vector3 bounds_min;
+	Vector3 bounds_max;
+	Vector3 centroid;
+
+	Entity_Id entity;
+};
+
+// Subtree of items [first, first + count) takes 2 * count - 1 nodes from node_index.
+//  Left child is right after its parent, right child follows the whole left subtree.
+struct Bvh_Build_Task
+{
+	u32 first;
+	u32 count;
+	s32 node_index;
+	s32 parent;
+};
+
+struct Bvh_Build_Context
+{
+	Level_Bvh*      bvh;
+	Bvh_Build_Item* items;
+
+	Dynamic_Array<Bvh_Build_Task> tasks;
+};
+
+
+static inline float get_axis(Vector3 v, int axis)
+{
+	return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+// Moves item with the median centroid to the middle, smaller ones go before it. Returns left half's count.
+static u32 split_build_items(Bvh_Build_Item* items, u32 count)
+{
+	Vector3 centroid_min = items[0].centroid;
+	Vector3 centroid_max = items[0].centroid;
+
+	for (u32 i = 1; i < count; i++)
+	{
+		merge_bounds(&centroid_min, &centroid_max, items[i].centroid, items[i].centroid);
+	}
+
+	Vector3 size = Vector3::make(centroid_max.x - centroid_min.x, centroid_max.y - centroid_min.y, centroid_max.z - centroid_min.z);
+
+	int axis = 0;
+	if (size.y > get_axis(size, axis)) axis = 1;
+	if (size.z > get_axis(size, axis)) axis = 2;
+
+
+	u32 middle = count / 2;
+
+	// Quickselect.
+	u32 left  = 0;
+	u32 right = count - 1;
+
+	while (left < right)
+	{
+		float pivot = get_axis(items[(left + right) / 2].centroid, axis);
+
+		u32 i = left;
+		u32 j = right;
+
+		while (i <= j)
+		{
+			while (get_axis(items[i].centroid, axis) < pivot) i += 1;
+			while (get_axis(items[j].centroid, axis) > pivot) j -= 1;
+
+			if (i <= j)
+			{
+				Bvh_Build_Item temp = items[i];
+				items[i] = items[j];
+				items[j] = temp;
+
+				i += 1;
+				if (j == 0) break;
+				j -= 1;
+			}
+		}
+
+		if (middle <= j) right = j;
+		else if (middle >= i) left = i;
+		else break;
+	}
+
+	return middle;
+}
+
+static void build_subtree(Level_Bvh* bvh, Bvh_Build_Item* items, u32 count, s32 node_index, s32 parent)
+{
+	Bvh_Node* node = bvh->nodes[node_index];
+	node->parent = parent;
+
+	if (count == 1)
+	{
+		node->bounds_min  = items[0].bounds_min;
+		node->bounds_max  = items[0].bounds_max;
+		node->children[0] = -1;
+		node->children[1] = -1;
+		node->entity      = items[0].entity;
+
+		*bvh->slot_leaves[get_entity_id_slot_index(items[0].entity)] = node_index;
+		return;
+	}
+
+	u32 left_count = split_build_items(items, count);
+
+	s32 left  = node_index + 1;
+	s32 right = node_index + 2 * left_count;
+
+	build_subtree(bvh, items,              left_count,         left,  node_index);
+	build_subtree(bvh, items + left_count, count - left_count, right, node_index);
+
+	node = bvh->nodes[node_index];
+	node->children[0] = left;
+	node->children[1] = right;
+	node->entity      = 0;
+
+	node->bounds_min = bvh->nodes[left]->bounds_min;
+	node->bounds_max = bvh->nodes[left]->bounds_max;
+	merge_bounds(&node->bounds_min, &node->bounds_max, bvh->nodes[right]->bounds_min, bvh->nodes[right]->bounds_max);
+}
+
+// Top of the tree is split on the calling thread until subtrees are small enough to be jobs.
+//  Bounds of these top nodes are known only after jobs are done, they are filled in reverse, children first.
+void Level_Bvh::rebuild(Entities_Storage* storage)
+{
+	ZoneScoped;
+
+	nodes.clear();
+	free_nodes.clear();
+
+	root                  = -1;
+	leaves_count          = 0;
+	changes_since_rebuild = 0;
+	is_built              = true;
+
+	slot_leaves.clear();
+	slot_leaves.ensure_capacity(storage->slots.count);
+	for (int i = 0; i < storage->slots.count; i++)
+	{
+		slot_leaves.add(-1);
+	}
+
+
+	Bvh_Build_Item* items = (Bvh_Build_Item*) c_allocator.alloc(sizeof(Bvh_Build_Item) * max(storage->entities_count, (u32) 1), code_location());
+	defer { c_allocator.free(items, code_location()); };
+
+	u32 items_count = 0;
+
+	storage->for_each_chunk([&](Entity_Chunk* chunk)
+	{
+		for (u32 i = 0; i < chunk->count; i++)
+		{
+			Entity* entity = chunk->get_entity(i);
+
+			Vector3 bounds_min, bounds_max;
+			if (!get_entity_bounds(entity, &bounds_min, &bounds_max)) continue;
+
+			Bvh_Build_Item* item = &items[items_count];
+			items_count += 1;
+
+			make_fat_bounds(bounds_min, bounds_max, &item->bounds_min, &item->bounds_max);
+
+			item->centroid = Vector3::make((bounds_min.x + bounds_max.x) * 0.5f, (bounds_min.y + bounds_max.y) * 0.5f, (bounds_min.z + bounds_max.z) * 0.5f);
+			item->entity   = entity->id;
+		}
+	});
+
+	if (items_count == 0) return;
+
+
+	nodes.ensure_capacity(2 * items_count - 1);
+	nodes.count = 2 * items_count - 1;
+
+	root         = 0;
+	leaves_count = items_count;
+
+
+	Bvh_Build_Context context = {
+		.bvh   = this,
+		.items = items,
+	};
+	context.tasks = make_array<Bvh_Build_Task>(worker_pool.workers_count * 8, frame_allocator);
+
+	Dynamic_Array<s32> top_nodes = make_array<s32>(worker_pool.workers_count * 8, frame_allocator); // Preorder.
+
+	u32 task_size = max(items_count / u32(worker_pool.workers_count * 4), (u32) 1024);
+
+	Dynamic_Array<Bvh_Build_Task> stack = make_array<Bvh_Build_Task>(64, frame_allocator);
+	stack.add({
+		.first      = 0,
+		.count      = items_count,
+		.node_index = 0,
+		.parent     = -1,
+	});
+
+	while (stack.count)
+	{
+		Bvh_Build_Task task = *stack[stack.count - 1];
+		stack.count -= 1;
+
+		if (task.count <= task_size)
+		{
+			context.tasks.add(task);
+			continue;
+		}
+
+		u32 left_count = split_build_items(items + task.first, task.count);
+
+		s32 left  = task.node_index + 1;
+		s32 right = task.node_index + 2 * left_count;
+
+		*nodes[task.node_index] = {
+			.parent   = task.parent,
+			.children = { left, right },
+			.entity   = 0,
+		};
+		top_nodes.add(task.node_index);
+
+		// Right is pushed first, so left is taken first and top_nodes stay in preorder.
+		stack.add({ .first = task.first + left_count, .count = task.count - left_count, .node_index = right, .parent = task.node_index });
+		stack.add({ .first = task.first,              .count = left_count,              .node_index = left,  .parent = task.node_index });
+	}
+
+
+	worker_pool.run([](void* data, int job_index, Allocator allocator)
+	{
+		ZoneScopedN("Build BVH subtree");
+
+		Bvh_Build_Context* context = (Bvh_Build_Context*) data;
+		Bvh_Build_Task*    task    = context->tasks[job_index];
+
+		build_subtree(context->bvh, context->items + task->first, task->count, task->node_index, task->parent);
+
+	}, &context, context.tasks.count);
+
+
+	for (int i = top_nodes.count - 1; i >= 0; i--)
+	{
+		Bvh_Node* node = nodes[*top_nodes[i]];
+
+		node->bounds_min = nodes[node->children[0]]->bounds_min;
+		node->bounds_max = nodes[node->children[0]]->bounds_max;
+		merge_bounds(&node->bounds_min, &node->bounds_max, nodes[node->children[1]]->bounds_min, nodes[node->children[1]]->bounds_max);
+	}
+}
+
+
+// Slab test, distance to where the ray enters the box, 0 if it starts inside.
+static inline bool ray_hits_bounds(Vector3 origin, Vector3 inverse_direction, Vector3 bounds_min, Vector3 bounds_max, float max_distance, float* out_distance)
+{
+	float enter = 0;
+	float exit  = max_distance;
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float o   = get_axis(origin, axis);
+		float inv = get_axis(inverse_direction, axis);
+
+		float t0 = (get_axis(bounds_min, axis) - o) * inv;
+		float t1 = (get_axis(bounds_max, axis) - o) * inv;
+
+		if (t0 > t1)
+		{
+			float temp = t0;
+			t0 = t1;
+			t1 = temp;
+		}
+
+		// NaN from 0 * infinity fails these comparisons, so it's ignored.
+		if (t0 > enter) enter = t0;
+		if (t1 < exit)  exit  = t1;
+
+		if (enter > exit) return false;
+	}
+
+	*out_distance = enter;
+	return true;
+}
+
+bool Level_Bvh::ray_cast(Entities_Storage* storage, Vector3 origin, Vector3 direction, float max_distance, Entity_Id* out_entity, float* out_distance)
+{
+	ZoneScoped;
+
+	if (root == -1) return false;
+
+	Vector3 inverse_direction = Vector3::make(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+
+	float     closest        = max_distance;
+	Entity_Id closest_entity = 0;
+
+	Dynamic_Array<Bvh_Stack_Entry>& stack = traversal_stack;
+	stack.clear();
+	stack.add({ .node_index = root });
+
+	while (stack.count)
+	{
+		Bvh_Node* node = nodes[stack[stack.count - 1]->node_index];
+		stack.count -= 1;
+
+		float distance;
+		if (!ray_hits_bounds(origin, inverse_direction, node->bounds_min, node->bounds_max, closest, &distance)) continue;
+
+		if (node->is_leaf())
+		{
+			// Fat bounds only tell the ray might hit, distance is to entity's own bounds.
+			Entity* entity = storage->get_entity(node->entity);
+			if (!entity) continue;
+
+			Vector3 bounds_min, bounds_max;
+			if (!get_entity_bounds(entity, &bounds_min, &bounds_max)) continue;
+
+			if (!ray_hits_bounds(origin, inverse_direction, bounds_min, bounds_max, closest, &distance)) continue;
+
+			closest        = distance;
+			closest_entity = node->entity;
+			continue;
+		}
+
+		stack.add({ .node_index = node->children[0] });
+		stack.add({ .node_index = node->children[1] });
+	}
+
+	if (!closest_entity) return false;
+
+	*out_entity   = closest_entity;
+	*out_distance = closest;
+
+	return true;
+}
+
+void Level_Bvh::query_aabb(Vector3 bounds_min, Vector3 bounds_max, Dynamic_Array<Entity_Id>* out_entities)
+{
+	ZoneScoped;
+
+	if (root == -1) return;
+
+	Dynamic_Array<Bvh_Stack_Entry>& stack = traversal_stack;
+	stack.clear();
+	stack.add({ .node_index = root });
+
+	while (stack.count)
+	{
+		Bvh_Node* node = nodes[stack[stack.count - 1]->node_index];
+		stack.count -= 1;
+
+		if (!overlap_bounds(node->bounds_min, node->bounds_max, bounds_min, bounds_max)) continue;
+
+		if (node->is_leaf())
+		{
+			out_entities->add(node->entity);
+			continue;
+		}
+
+		stack.add({ .node_index = node->children[0] });
+		stack.add({ .node_index = node->children[1] });
+	}
+}
+
+// Every stack entry carries mask of planes its bounds still cross, once a node is inside all of them
+//  its whole subtree is taken without tests.
+void Level_Bvh::query_frustum(Vector4* planes, int planes_count, Dynamic_Array<Entity_Id>* out_entities)
+{
+	ZoneScoped;
+
+	assert(planes_count <= 32);
+
+	if (root == -1) return;
+
+	Dynamic_Array<Bvh_Stack_Entry>& stack = traversal_stack;
+	stack.clear();
+	stack.add({ .node_index = root, .planes_mask = planes_count == 32 ? u32_max : (1u << planes_count) - 1 });
+
+	while (stack.count)
+	{
+		Bvh_Stack_Entry entry = *stack[stack.count - 1];
+		stack.count -= 1;
+
+		Bvh_Node* node = nodes[entry.node_index];
+
+		u32  planes_mask = entry.planes_mask;
+		bool is_outside  = false;
+
+		for (int i = 0; i < planes_count; i++)
+		{
+			if (!(planes_mask & (1u << i))) continue;
+
+			Vector4 plane = planes[i];
+
+			// Corners furthest along and against plane's normal.
+			float furthest = plane.w;
+			float nearest  = plane.w;
+
+			furthest += plane.x * (plane.x > 0 ? node->bounds_max.x : node->bounds_min.x);
+			furthest += plane.y * (plane.y > 0 ? node->bounds_max.y : node->bounds_min.y);
+			furthest += plane.z * (plane.z > 0 ? node->bounds_max.z : node->bounds_min.z);
+
+			if (furthest < 0)
+			{
+				is_outside = true;
+				break;
+			}
+
+			nearest += plane.x * (plane.x > 0 ? node->bounds_min.x : node->bounds_max.x);
+			nearest += plane.y * (plane.y > 0 ? node->bounds_min.y : node->bounds_max.y);
+			nearest += plane.z * (plane.z > 0 ? node->bounds_min.z : node->bounds_max.z);
+
+			if (nearest >= 0)
+			{
+				planes_mask &= ~(1u << i);
+			}
+		}
+
+		if (is_outside) continue;
+
+		if (node->is_leaf())
+		{
+			out_entities->add(node->entity);
+			continue;
+		}
+
+		stack.add({ .node_index = node->children[0], .planes_mask = planes_mask });
+		stack.add({ .node_index = node->children[1], .planes_mask = planes_mask });
+	}
+}
+
+
+
+void run_bvh_benchmark()
+{
+	ZoneScoped;
+
+	const u32 static_count = 1000000;
+	const u32 moving_count = 10000;
+	const int frames       = 60;
+
+	// Million entities take hundreds of megabytes, so the level doesn't outlive the benchmark.
+	Level* level = create_new_level();
+	defer { free_level(level); };
+
+	u32 random = 0x9e3779b9;
+	auto next_float = [&]() -> float
+	{
+		random ^= random << 13;
+		random ^= random >> 17;
+		random ^= random << 5;
+		return float(random % 20001) / 10000.0f - 1.0f;
+	};
+
+	for (u32 i = 0; i < static_count + moving_count; i++)
+	{
+		Entity* entity = level->entities_storage.create_entity((Reflection::Struct_Type*) Reflection::type_of<Entity>());
+
+		*entity->position() = Vector3::make(next_float() * 1000, next_float() * 50, next_float() * 1000);
+		*entity->scale()    = Vector3::make(1, 1, 1);
+
+		entity->rotation()->w = 1;
+
+		level->entities_storage.set_mesh(entity, &renderer.primitives.quad, NULL);
+	}
+
+	Entities_Storage* storage = &level->entities_storage;
+
+	update_world_matrices(storage);
+	storage->moved_entities.clear();
+
+
+	Time_Measurer tm = create_time_measurer();
+	level->bvh.rebuild(storage);
+	double rebuild_ms = tm.ms_elapsed_double();
+
+
+	// Last entities move, far enough every frame to leave their fat bounds.
+	double update_ms = 0;
+
+	for (int frame = 0; frame < frames; frame++)
+	{
+		storage->for_each_chunk([&](Entity_Chunk* chunk)
+		{
+			for (u32 i = 0; i < chunk->count; i++)
+			{
+				Entity* entity = chunk->get_entity(i);
+
+				// Created after static ones, so they got the last slots.
+				if (get_entity_id_slot_index(entity->id) < static_count) continue;
+
+				chunk->positions[i].x += (frame % 2) ? -2.0f : 2.0f;
+				entity->mark_transform_dirty();
+			}
+		});
+
+		update_world_matrices(storage);
+
+		tm = create_time_measurer();
+		level->bvh.update(storage);
+		update_ms += tm.ms_elapsed_double();
+	}
+
+
+	const int rays_count = 10000;
+
+	tm = create_time_measurer();
+
+	int hits_count = 0;
+	for (int i = 0; i < rays_count; i++)
+	{
+		float angle = float(i) * 0.0007f;
+
+		Vector3 direction = Vector3::make(cosf(angle) * 0.7f, -0.14f, sinf(angle) * 0.7f);
+		float   length    = sqrtf(direction.x * direction.x + direction.y * direction.y + direction.z * direction.z);
+		direction = Vector3::make(direction.x / length, direction.y / length, direction.z / length);
+
+		Entity_Id entity;
+		float     distance;
+		if (level->bvh.ray_cast(&level->entities_storage, Vector3::make(0, 60, 0), direction, 5000, &entity, &distance))
+		{
+			hits_count += 1;
+		}
+	}
+
+	double rays_ms = tm.ms_elapsed_double();
+
+
+	const int boxes_count = 10000;
+
+	Dynamic_Array<Entity_Id> results = make_array<Entity_Id>(1024, c_allocator);
+	defer { results.free(); };
+
+	tm = create_time_measurer();
+
+	for (int i = 0; i < boxes_count; i++)
+	{
+		float x = float(i % 100) * 20 - 1000;
+		float z = float(i / 100) * 20 - 1000;
+
+		results.clear();
+		level->bvh.query_aabb(Vector3::make(x, -50, z), Vector3::make(x + 10, 50, z + 10), &results);
+	}
+
+	double boxes_ms = tm.ms_elapsed_double();
+
+
+	// Camera at eye looking along -Z and a bit down, 90 degrees of field of view both ways.
+	Vector3 eye   = Vector3::make(0, 60, 0);
+	float   pitch = -0.3f;
+
+	float c = cosf(pitch), s = sinf(pitch);
+
+	Vector3 forward = Vector3::make(0, s, -c);
+	Vector3 up      = Vector3::make(0, c, s);
+
+	auto plane_through_camera = [&](Vector3 normal) -> Vector4
+	{
+		return Vector4::make(normal.x, normal.y, normal.z, -(normal.x * eye.x + normal.y * eye.y + normal.z * eye.z));
+	};
+
+	const float k = 0.70710678f;
+
+	Vector4 planes[5] = {
+		plane_through_camera(Vector3::make( k, forward.y * k, forward.z * k)),
+		plane_through_camera(Vector3::make(-k, forward.y * k, forward.z * k)),
+		plane_through_camera(Vector3::make(0, (forward.y - up.y) * k, (forward.z - up.z) * k)),
+		plane_through_camera(Vector3::make(0, (forward.y + up.y) * k, (forward.z + up.z) * k)),
+		plane_through_camera(forward),
+	};
+	planes[4].w -= 0.05f;
+
+	results.clear();
+
+	tm = create_time_measurer();
+	level->bvh.query_frustum(planes, array_count(planes), &results);
+	double frustum_ms = tm.ms_elapsed_double();
+
+
+	Log(U"BVH benchmark: % static and % moving entities, % nodes", static_count, moving_count, level->bvh.nodes.count);
+	Log(U"BVH benchmark, full rebuild on % workers: % ms", worker_pool.workers_count, rebuild_ms);
+	Log(U"BVH benchmark, update with % moving entities: % ms per frame", moving_count, update_ms / double(frames));
+	Log(U"BVH benchmark, % ray casts: % ms, % hits", rays_count, rays_ms, hits_count);
+	Log(U"BVH benchmark, % box queries: % ms", boxes_count, boxes_ms);
+	Log(U"BVH benchmark, frustum query: % ms, % visible", frustum_ms, results.count);
+}
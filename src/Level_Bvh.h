@@ -0,0 +1,102 @@
+#pragma once
+
+#include "b_lib/Basic.h"
+#include "b_lib/Dynamic_Array.h"
+#include "b_lib/Math.h"
+
+#include "Entity.h"
+
+struct Entities_Storage;
+
+
+// Bounding volume hierarchy over world space bounds of level's entities that have a mesh.
+//
+// Leaves keep bounds fattened by a fraction of entity's size, so an entity moving a little doesn't touch the tree.
+//  When it leaves its fat bounds, only its leaf and ancestors are refit. Insertion picks the sibling
+//  that grows the surface area least, removal replaces the parent with the sibling.
+//
+// Quality drops as things move around, so after enough changes, and on first update, the whole tree
+//  is rebuilt on worker_pool with median splits. Nodes of a rebuilt tree are in depth first order.
+
+struct Bvh_Node
+{
+	Vector3 bounds_min;
+	Vector3 bounds_max;
+
+	s32 parent;      // -1 for root.
+	s32 children[2]; // -1 for leaves.
+
+	Entity_Id entity; // Leaves only.
+
+	inline bool is_leaf()
+	{
+		return children[0] == -1;
+	}
+};
+
+struct Bvh_Stack_Entry
+{
+	s32 node_index;
+	u32 planes_mask; // Frustum query only, planes the node's bounds still cross.
+};
+
+struct Level_Bvh
+{
+	// Leaf bounds grow by this fraction of entity's extent on every side.
+	static constexpr float fat_margin = 0.2f;
+
+	Dynamic_Array<Bvh_Node> nodes;
+	Dynamic_Array<s32>      free_nodes;
+
+	s32 root = -1;
+
+	// Leaf of every entity by its Entity_Id slot index, -1 if entity is not in the tree.
+	Dynamic_Array<s32> slot_leaves;
+
+	u32  leaves_count = 0;
+	u32  changes_since_rebuild = 0; // Inserts, removals and refits.
+	bool is_built = false;
+
+	// Reused by queries, so they aren't safe to call from several threads at once.
+	Dynamic_Array<Bvh_Stack_Entry> traversal_stack;
+
+
+	void init();
+	void free();
+
+	// After update_world_matrices(), consumes Entities_Storage::moved_entities and destroyed_entities.
+	void update(Entities_Storage* storage);
+
+	void rebuild(Entities_Storage* storage);
+
+
+	// Closest entity whose bounds the ray hits, against bounds rather than triangles. Fat bounds only prune the tree,
+	//  leaves are tested against exact get_entity_bounds() of storage's entities, so storage must be the one tree was updated with.
+	//  direction must be normalized. Returns false if nothing is hit within max_distance.
+	bool ray_cast(Entities_Storage* storage, Vector3 origin, Vector3 direction, float max_distance, Entity_Id* out_entity, float* out_distance);
+
+	// Entities whose fat bounds overlap, so results might be a little more than exact.
+	void query_aabb(Vector3 bounds_min, Vector3 bounds_max, Dynamic_Array<Entity_Id>* out_entities);
+
+	// Inside is positive side of planes, same as Renderer::level_frustum_planes.
+	void query_frustum(Vector4* planes, int planes_count, Dynamic_Array<Entity_Id>* out_entities);
+
+
+	// For internal usage.
+	s32  allocate_node();
+	void free_node(s32 node_index);
+
+	void insert_leaf(Entity_Id entity, Vector3 bounds_min, Vector3 bounds_max);
+	void remove_leaf(s32 leaf);
+	void refit_ancestors(s32 node_index);
+
+	s32 get_leaf(Entity_Id entity);
+	void set_leaf(Entity_Id entity, s32 leaf);
+};
+
+
+// Entity's mesh bounds in world space, false if entity has no mesh.
+bool get_entity_bounds(Entity* entity, Vector3* out_min, Vector3* out_max);
+
+// Logs rebuild, refit and query timings on a level of a million static and ten thousand moving entities.
+void run_bvh_benchmark();
@@ -13,6 +13,10 @@
 #include "Key_Bindings.h"
 #include "Editor.h"
 #include "Asset_Storage.h"
+#include "Mesh_Import.h"
+#include "Worker_Pool.h"
+#include "Gpu_Culling.h"
+#include "Transforms.h"
 
 
 #if OS_WINDOWS
@@ -111,8 +115,39 @@ void do_frame()
 	{
 		vulkan_memory_allocator.dump_allocations();
 	}
+
+	if (input.is_key_down(Key::F11))
+	{
+		vulkan_memory_allocator.toggle_benchmark();
+	}
+
+	if (input.is_key_down(Key::F6))
+	{
+		run_obj_parse_benchmark();
+	}
+
+	if (input.is_key_down(Key::F8))
+	{
+		run_transform_benchmark();
+	}
+
+	if (input.is_key_down(Key::F7))
+	{
+		run_bvh_benchmark();
+	}
+
+	if (input.is_key_down(Key::F9))
+	{
+		toggle_level_benchmark();
+	}
 #endif
 
+	if (input.is_key_down(Key::F10))
+	{
+		vulkan_memory_allocator.write_statistics_json(path_concat(frame_allocator, executable_directory, Unicode_String(U"video_memory_statistics.json")));
+	}
+
+
 
 
 	if (window_height == 0 || window_width == 0)
@@ -153,10 +188,23 @@ void do_frame()
 	defer { ui.post_frame(); };
 
 
+	update_level_benchmark();
+
 	renderer.frame_begin();
 	defer { renderer.frame_end(); };
 
 
+	if (loaded_level)
+	{
+		// Entities destroyed during the previous frame, nothing iterates them at this point.
+		loaded_level->entities_storage.flush_destroyed_entities();
+
+		update_world_matrices(&loaded_level->entities_storage);
+
+		loaded_level->bvh.update(&loaded_level->entities_storage);
+
+		renderer.draw_level(loaded_level);
+	}
 
 
 
@@ -268,6 +316,8 @@ int main()
 		}
 	}
 
+	detect_avx2_support();
+
 #if OS_WINDOWS
 	// Set dump writer
 	{
@@ -748,6 +798,8 @@ int main()
 
 	ui.init();
 
+	worker_pool.init();
+
 	asset_storage.init();
 
 	editor.init();
@@ -874,9 +926,187 @@ inline void handle_os_resize_event(int new_width, int new_height)
 
 Level* create_new_level()
 {
-	Level level;
+	Level level = {};
 
 	level.entities_storage = Entities_Storage::make();
+	level.bvh.init();
 
 	return copy(&level, c_allocator);
-}
\ No newline at end of file
+}
+
+// Level must not be loaded_level or referenced by renderer anymore.
+void free_level(Level* level)
+{
+	level->entities_storage.free();
+	level->bvh.free();
+
+	c_allocator.free(level, code_location());
+}
+
+Level* create_benchmark_level(int entities_count)
+{
+	ZoneScoped;
+
+	Level* level = create_new_level();
+
+	Mesh* meshes[] = {
+		&renderer.primitives.quad,
+		asset_storage.find_mesh(U"teapot"), // Might be missing.
+	};
+
+	int meshes_count = meshes[1] ? 2 : 1;
+
+
+	rgba colors[] = {
+		rgba(220, 80,  60,  255),
+		rgba(80,  200, 90,  255),
+		rgba(70,  120, 230, 255),
+		rgba(230, 210, 90,  255),
+	};
+
+	for (int i = 0; i < array_count(colors); i++)
+	{
+		level_benchmark.materials[i].color = colors[i];
+	}
+
+
+	// Square grid, kinds are shuffled so grouping has some work to do.
+	int   side    = int(ceilf(sqrtf(float(entities_count))));
+	float spacing = 3.0;
+
+	u32 random = 0x9e3779b9;
+	auto next_random = [&]() -> u32
+	{
+		random ^= random << 13;
+		random ^= random >> 17;
+		random ^= random << 5;
+		return random;
+	};
+
+	for (int i = 0; i < entities_count; i++)
+	{
+		Entity* entity = level->entities_storage.create_entity((Reflection::Struct_Type*) Reflection::type_of<Entity>());
+
+		float x = (float(i % side) - float(side) * 0.5f) * spacing;
+		float z = (float(i / side) - float(side) * 0.5f) * spacing;
+
+		float angle = float(next_random() % 360) * 3.14159265f / 180.0f;
+
+		*entity->position() = Vector3::make(x, 0, z);
+		*entity->scale()    = Vector3::make(1, 1, 1);
+
+		// Around Y.
+		Quaternion* rotation = entity->rotation();
+		rotation->x = 0;
+		rotation->y = sinf(angle * 0.5f);
+		rotation->z = 0;
+		rotation->w = cosf(angle * 0.5f);
+
+		Mesh*     mesh     = meshes[next_random() % meshes_count];
+		Material* material = &level_benchmark.materials[next_random() % array_count(level_benchmark.materials)];
+
+		level->entities_storage.set_mesh(entity, mesh, material);
+	}
+
+	level->camera.position = Vector3::make(0, 60, float(side) * spacing * 0.5f + 20);
+	level->camera.pitch    = -0.6;
+
+	return level;
+}
+
+static void start_level_benchmark_run()
+{
+	int size_index = level_benchmark.run_index / 2;
+
+	if (!level_benchmark.levels[size_index])
+	{
+		level_benchmark.levels[size_index] = create_benchmark_level(Level_Benchmark::entities_counts[size_index]);
+	}
+
+	loaded_level = level_benchmark.levels[size_index];
+	settings.gpu_culling = level_benchmark.run_index % 2 == 1;
+
+	level_benchmark.frames_count = -Level_Benchmark::warmup_frames;
+	level_benchmark.cpu_ms       = 0;
+	level_benchmark.draw_calls   = 0;
+	level_benchmark.instances    = 0;
+}
+
+static void stop_level_benchmark()
+{
+	loaded_level         = level_benchmark.previous_level;
+	settings.gpu_culling = level_benchmark.previous_gpu_culling;
+
+	level_benchmark.previous_level = NULL;
+
+	// Hundreds of megabytes for the largest one, created again on the next run.
+	for (Level*& level: level_benchmark.levels)
+	{
+		if (!level) continue;
+
+		free_level(level);
+		level = NULL;
+	}
+
+	// Otherwise a level allocated at the same address would look already uploaded.
+	gpu_culling.level = NULL;
+}
+
+void toggle_level_benchmark()
+{
+	if (level_benchmark.previous_level)
+	{
+		stop_level_benchmark();
+
+		Log(U"Level benchmark stopped");
+		return;
+	}
+
+	level_benchmark.previous_level       = loaded_level;
+	level_benchmark.previous_gpu_culling = settings.gpu_culling;
+
+	level_benchmark.run_index = 0;
+	start_level_benchmark_run();
+
+	Log(U"Level benchmark started");
+}
+
+void update_level_benchmark()
+{
+	if (!level_benchmark.previous_level) return;
+
+	level_benchmark.frames_count += 1;
+	if (level_benchmark.frames_count <= 0) return;
+
+	level_benchmark.cpu_ms       += renderer.level_statistics.cpu_ms;
+	level_benchmark.draw_calls   += renderer.level_statistics.draw_calls;
+	level_benchmark.instances    += renderer.level_statistics.instances;
+
+	if (level_benchmark.frames_count < Level_Benchmark::run_frames) return;
+
+	double frames = double(level_benchmark.frames_count);
+
+	// GPU culling can't be told apart by statistics, draw calls and instances are counted before culling.
+	Log(U"Level benchmark, % entities, % culling: % ms CPU submission, % draw calls, % instances per frame",
+		Level_Benchmark::entities_counts[level_benchmark.run_index / 2],
+		settings.gpu_culling && gpu_culling.is_supported ? Unicode_String(U"GPU") : Unicode_String(U"CPU"),
+		level_benchmark.cpu_ms / frames, double(level_benchmark.draw_calls) / frames, double(level_benchmark.instances) / frames);
+
+	level_benchmark.run_index += 1;
+
+	// Without support GPU run would be the same as CPU one.
+	if (level_benchmark.run_index % 2 == 1 && !gpu_culling.is_supported)
+	{
+		level_benchmark.run_index += 1;
+	}
+
+	if (level_benchmark.run_index >= Level_Benchmark::sizes_count * 2)
+	{
+		stop_level_benchmark();
+
+		Log(U"Level benchmark finished");
+		return;
+	}
+
+	start_level_benchmark_run();
+}
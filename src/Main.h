@@ -123,5 +123,39 @@ inline void release_mouse()
 inline Level* loaded_level = NULL;
 
 Level* create_new_level();
+void   free_level(Level* level);
+
+
+// F9 swaps loaded level with a level of many entities and back,
+//  renderer's level statistics are logged while it is shown.
+struct Level_Benchmark
+{
+	// Every count runs with CPU culling, then with GPU culling if it's supported.
+	static constexpr int sizes_count = 3;
+	static constexpr int entities_counts[sizes_count] = { 10000, 100000, 1000000 };
+
+	static constexpr int warmup_frames = 10; // Not measured, first of them uploads the level.
+	static constexpr int run_frames    = 120;
+
+	Level* levels[sizes_count] = {}; // Created on first run of a size, freed when benchmark stops.
+
+	Level* previous_level = NULL; // Not NULL while benchmark is running.
+	bool   previous_gpu_culling;
+
+	Material materials[4];
+
+	int run_index; // Index in entities_counts * 2, plus 1 for GPU culling.
+
+	int    frames_count; // Negative during warmup.
+	double cpu_ms;
+	s64    draw_calls;
+	s64    instances;
+};
+
+inline Level_Benchmark level_benchmark;
+
+Level* create_benchmark_level(int entities_count);
+void   toggle_level_benchmark();
+void   update_level_benchmark(); // Before renderer.frame_begin(), renderer's statistics are still previous frame's.
 
 
@@ -0,0 +1,1308 @@
+#include "Mesh_Import.h"
+
+#include "Tracy_Header.h"
+
+#include "b_lib/Log.h"
+#include "b_lib/Time_Measurer.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+
+
+// Scanning works on raw pointers, big OBJ files are mostly numbers and whitespace.
+
+static inline bool is_obj_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline bool is_obj_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static inline void skip_obj_spaces(char** p, char* end)
+{
+	while (*p < end && is_obj_space(**p)) *p += 1;
+}
+
+static inline void skip_obj_line(char** p, char* end)
+{
+	char* newline = (char*) memchr(*p, '\n', end - *p);
+	*p = newline ? newline + 1 : end;
+}
+
+
+static const double powers_of_ten[] = {
+	1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// Skips leading spaces. Digits are accumulated into integer mantissa, then scaled once,
+//  that's exact enough for float and is much faster than going through parse_number().
+static bool scan_obj_float(char** p, char* end, float* out)
+{
+	skip_obj_spaces(p, end);
+
+	char* c = *p;
+
+	bool negative = false;
+	if (c < end && (*c == '-' || *c == '+'))
+	{
+		negative = *c == '-';
+		c += 1;
+	}
+
+	// Digits beyond what fits into u64 only move the exponent.
+	const u64 mantissa_limit = 1000000000000000000ull;
+
+	u64 mantissa     = 0;
+	int exponent     = 0;
+	int digits_count = 0;
+
+	while (c < end && is_obj_digit(*c))
+	{
+		if (mantissa < mantissa_limit)
+			mantissa = mantissa * 10 + (*c - '0');
+		else
+			exponent += 1;
+
+		digits_count += 1;
+		c += 1;
+	}
+
+	if (c < end && *c == '.')
+	{
+		c += 1;
+
+		while (c < end && is_obj_digit(*c))
+		{
+			if (mantissa < mantissa_limit)
+			{
+				mantissa = mantissa * 10 + (*c - '0');
+				exponent -= 1;
+			}
+
+			digits_count += 1;
+			c += 1;
+		}
+	}
+
+	if (digits_count == 0) return false;
+
+	if (c < end && (*c == 'e' || *c == 'E'))
+	{
+		c += 1;
+
+		bool negative_exponent = false;
+		if (c < end && (*c == '-' || *c == '+'))
+		{
+			negative_exponent = *c == '-';
+			c += 1;
+		}
+
+		if (c >= end || !is_obj_digit(*c)) return false;
+
+		int exponent_value = 0;
+		while (c < end && is_obj_digit(*c))
+		{
+			if (exponent_value < 10000)
+				exponent_value = exponent_value * 10 + (*c - '0');
+
+			c += 1;
+		}
+
+		exponent += negative_exponent ? -exponent_value : exponent_value;
+	}
+
+
+	double value = double(mantissa);
+
+	if (mantissa != 0)
+	{
+		while (exponent > 22)  { value *= 1e22; exponent -= 22; }
+		while (exponent < -22) { value /= 1e22; exponent += 22; }
+
+		value = exponent >= 0 ? value * powers_of_ten[exponent] : value / powers_of_ten[-exponent];
+	}
+
+	*out = float(negative ? -value : value);
+	*p = c;
+
+	return true;
+}
+
+static bool scan_obj_index(char** p, char* end, s64* out)
+{
+	char* c = *p;
+
+	bool negative = false;
+	if (c < end && *c == '-')
+	{
+		negative = true;
+		c += 1;
+	}
+
+	if (c >= end || !is_obj_digit(*c)) return false;
+
+	s64 value = 0;
+	while (c < end && is_obj_digit(*c))
+	{
+		// Absurdly big indices stop growing here, they are rejected as out of range anyway.
+		if (value < (s64(1) << 40))
+			value = value * 10 + (*c - '0');
+
+		c += 1;
+	}
+
+	*out = negative ? -value : value;
+	*p = c;
+
+	return true;
+}
+
+// OBJ indices start from 1, negative ones count back from the last element defined so far.
+static bool resolve_obj_index(s64 index, s64 count, u32* out)
+{
+	if (index > 0 && index <= count)
+	{
+		*out = u32(index - 1);
+		return true;
+	}
+
+	if (index < 0 && -index <= count)
+	{
+		*out = u32(count + index);
+		return true;
+	}
+
+	return false;
+}
+
+
+
+struct Obj_Corner
+{
+	u32 position;
+	u32 uv;     // u32_max if omitted.
+	u32 normal; // u32_max if omitted.
+};
+
+static u64 hash_obj_corner(Obj_Corner corner)
+{
+	const u64 multiplier = 0x9e3779b97f4a7c15;
+
+	u64 hash = ((u64(corner.position) << 32) | corner.uv) * multiplier;
+	hash ^= hash >> 29;
+	hash  = (hash ^ corner.normal) * multiplier;
+	hash ^= hash >> 32;
+
+	return hash;
+}
+
+// Open addressing, maps corner triplet to the vertex that was made for it.
+struct Obj_Vertex_Table
+{
+	struct Slot
+	{
+		Obj_Corner corner;
+		u32        vertex_index; // u32_max if slot is empty.
+	};
+
+	Slot* slots;
+	u64   capacity; // Power of two.
+	u64   count;
+
+
+	void init(u64 initial_capacity)
+	{
+		capacity = initial_capacity;
+		count    = 0;
+
+		slots = (Slot*) c_allocator.alloc(capacity * sizeof(Slot), code_location());
+
+		for (u64 i = 0; i < capacity; i++)
+		{
+			slots[i].vertex_index = u32_max;
+		}
+	}
+
+	void free()
+	{
+		c_allocator.free(slots, code_location());
+	}
+
+	Slot* find(Obj_Corner corner)
+	{
+		u64 slot_index = hash_obj_corner(corner) & (capacity - 1);
+
+		while (true)
+		{
+			Slot* slot = &slots[slot_index];
+
+			if (slot->vertex_index == u32_max) return slot;
+
+			if (slot->corner.position == corner.position &&
+				slot->corner.uv       == corner.uv       &&
+				slot->corner.normal   == corner.normal)
+			{
+				return slot;
+			}
+
+			slot_index = (slot_index + 1) & (capacity - 1);
+		}
+	}
+
+	void grow()
+	{
+		ZoneScoped;
+
+		Slot* old_slots    = slots;
+		u64   old_capacity = capacity;
+
+		init(old_capacity * 2);
+
+		for (u64 i = 0; i < old_capacity; i++)
+		{
+			if (old_slots[i].vertex_index == u32_max) continue;
+
+			*find(old_slots[i].corner) = old_slots[i];
+			count += 1;
+		}
+
+		c_allocator.free(old_slots, code_location());
+	}
+};
+
+
+
+bool parse_obj_mesh(String str, Dynamic_Array<Vertex>* out_vertices, Dynamic_Array<u32>* out_indices, Dynamic_Array<Submesh>* out_submeshes)
+{
+	ZoneScoped;
+
+	auto positions = make_array<Vector3>(1024, c_allocator);
+	auto normals   = make_array<Vector3>(1024, c_allocator);
+	auto uvs       = make_array<Vector2>(1024, c_allocator);
+	defer { positions.free(); };
+	defer { normals.free(); };
+	defer { uvs.free(); };
+
+	auto face_vertices = make_array<u32>(16, c_allocator);
+	defer { face_vertices.free(); };
+
+	Obj_Vertex_Table table;
+	table.init(4096);
+	defer { table.free(); };
+
+
+	auto vertices  = make_array<Vertex> (1024, c_allocator);
+	auto indices   = make_array<u32>    (1024, c_allocator);
+	auto submeshes = make_array<Submesh>(4,    c_allocator);
+
+	bool succeeded = false;
+	defer
+	{
+		if (!succeeded)
+		{
+			vertices.free();
+			indices.free();
+			submeshes.free();
+		}
+	};
+
+
+	u32 submesh_first_index = 0;
+
+	auto finish_submesh = [&]()
+	{
+		if (u32(indices.count) > submesh_first_index)
+		{
+			submeshes.add({
+				.first_index   = submesh_first_index,
+				.indices_count = u32(indices.count) - submesh_first_index,
+			});
+		}
+
+		submesh_first_index = indices.count;
+	};
+
+
+	char* p   = str.data;
+	char* end = str.data + str.length;
+
+	for (int line = 1; p < end; line += 1, skip_obj_line(&p, end))
+	{
+		skip_obj_spaces(&p, end);
+
+		char* keyword = p;
+		while (p < end && !is_obj_space(*p) && *p != '\n') p += 1;
+
+		s64 keyword_length = p - keyword;
+
+
+		if (keyword_length == 1 && keyword[0] == 'v')
+		{
+			Vector3 position;
+
+			if (!scan_obj_float(&p, end, &position.x) ||
+				!scan_obj_float(&p, end, &position.y) ||
+				!scan_obj_float(&p, end, &position.z))
+			{
+				Log(U"Failed to parse position at line: %", line);
+				return false;
+			}
+
+			positions.add(position);
+		}
+		else if (keyword_length == 2 && keyword[0] == 'v' && keyword[1] == 'n')
+		{
+			Vector3 normal;
+
+			if (!scan_obj_float(&p, end, &normal.x) ||
+				!scan_obj_float(&p, end, &normal.y) ||
+				!scan_obj_float(&p, end, &normal.z))
+			{
+				Log(U"Failed to parse normal at line: %", line);
+				return false;
+			}
+
+			normals.add(normal);
+		}
+		else if (keyword_length == 2 && keyword[0] == 'v' && keyword[1] == 't')
+		{
+			Vector2 uv;
+
+			// Optional third coordinate is skipped with the rest of the line.
+			if (!scan_obj_float(&p, end, &uv.x) ||
+				!scan_obj_float(&p, end, &uv.y))
+			{
+				Log(U"Failed to parse uv at line: %", line);
+				return false;
+			}
+
+			uvs.add(uv);
+		}
+		else if (keyword_length == 1 && keyword[0] == 'f')
+		{
+			face_vertices.clear();
+
+			while (true)
+			{
+				skip_obj_spaces(&p, end);
+				if (p >= end || *p == '\n' || *p == '#') break;
+
+
+				// Corner is v, v/vt, v//vn or v/vt/vn.
+				s64 position_index;
+				s64 uv_index;
+				s64 normal_index;
+
+				bool has_uv     = false;
+				bool has_normal = false;
+
+				if (!scan_obj_index(&p, end, &position_index))
+				{
+					Log(U"Failed to parse position index at line: %", line);
+					return false;
+				}
+
+				if (p < end && *p == '/')
+				{
+					p += 1;
+
+					if (p < end && *p != '/')
+					{
+						if (!scan_obj_index(&p, end, &uv_index))
+						{
+							Log(U"Failed to parse uv index at line: %", line);
+							return false;
+						}
+
+						has_uv = true;
+					}
+
+					if (p < end && *p == '/')
+					{
+						p += 1;
+
+						if (!scan_obj_index(&p, end, &normal_index))
+						{
+							Log(U"Failed to parse normal index at line: %", line);
+							return false;
+						}
+
+						has_normal = true;
+					}
+				}
+
+				if (p < end && !is_obj_space(*p) && *p != '\n')
+				{
+					Log(U"Unexpected character in face at line: %", line);
+					return false;
+				}
+
+
+				Obj_Corner corner = {
+					.uv     = u32_max,
+					.normal = u32_max,
+				};
+
+				if (!resolve_obj_index(position_index, positions.count, &corner.position) ||
+					(has_uv     && !resolve_obj_index(uv_index,     uvs.count,     &corner.uv)) ||
+					(has_normal && !resolve_obj_index(normal_index, normals.count, &corner.normal)))
+				{
+					Log(U"Face index is out of range at line: %", line);
+					return false;
+				}
+
+
+				if ((table.count + 1) * 2 > table.capacity)
+				{
+					table.grow();
+				}
+
+				auto slot = table.find(corner);
+
+				if (slot->vertex_index == u32_max)
+				{
+					slot->corner       = corner;
+					slot->vertex_index = vertices.count;
+					table.count += 1;
+
+					vertices.add({
+						.position = *positions[corner.position],
+						.normal   = corner.normal != u32_max ? *normals[corner.normal] : Vector3{},
+						.uv       = corner.uv     != u32_max ? *uvs[corner.uv]         : Vector2{},
+					});
+				}
+
+				face_vertices.add(slot->vertex_index);
+			}
+
+			if (face_vertices.count < 3)
+			{
+				Log(U"Face has less than 3 corners at line: %", line);
+				return false;
+			}
+
+			// Fan around the first corner, fine for convex polygons which is what exporters write.
+			for (int i = 1; i + 1 < face_vertices.count; i++)
+			{
+				indices.add(*face_vertices[0]);
+				indices.add(*face_vertices[i]);
+				indices.add(*face_vertices[i + 1]);
+			}
+		}
+		else if (keyword_length == 1 && (keyword[0] == 'o' || keyword[0] == 'g'))
+		{
+			finish_submesh();
+		}
+
+		// Comments, materials, smoothing groups and everything else are skipped.
+	}
+
+	finish_submesh();
+
+
+	*out_vertices  = vertices;
+	*out_indices   = indices;
+	*out_submeshes = submeshes;
+
+	succeeded = true;
+	return true;
+}
+
+
+
+template <typename T>
+static T* alloc_mesh_scratch(u64 count)
+{
+	return (T*) c_allocator.alloc(sizeof(T) * max(count, u64(1)), code_location());
+}
+
+
+
+// Tom Forsyth's linear-speed vertex cache optimisation.
+//  Greedy: next triangle is the best scored one among triangles of vertices in the simulated LRU cache.
+//  Vertices score higher when they are in cache and when they have few triangles left, so islands get finished.
+
+constexpr int vertex_cache_size = 32;
+
+static float vertex_cache_position_scores[vertex_cache_size];
+static float vertex_valence_scores[64];
+
+void init_vertex_score_tables()
+{
+	for (int i = 0; i < vertex_cache_size; i++)
+	{
+		// Last triangle's vertices get a fixed score, so it doesn't matter in which order they are used.
+		vertex_cache_position_scores[i] = i < 3 ? 0.75f : powf(1.0f - float(i - 3) / float(vertex_cache_size - 3), 1.5f);
+	}
+
+	for (int i = 1; i < array_count(vertex_valence_scores); i++)
+	{
+		vertex_valence_scores[i] = 2.0f / sqrtf(float(i));
+	}
+}
+
+static float get_vertex_score(int cache_position, u32 remaining_triangles)
+{
+	if (remaining_triangles == 0) return -1.0f;
+
+	float score = cache_position >= 0 ? vertex_cache_position_scores[cache_position] : 0.0f;
+
+	score += remaining_triangles < array_count(vertex_valence_scores) ? vertex_valence_scores[remaining_triangles] : 2.0f / sqrtf(float(remaining_triangles));
+
+	return score;
+}
+
+void optimize_vertex_cache(u32* indices, u32 indices_count, u32 vertices_count)
+{
+	ZoneScoped;
+
+	u32 triangles_count = indices_count / 3;
+	if (triangles_count < 2) return;
+
+	// Triangles of vertex v are vertex_triangles[triangles_offsets[v] .. triangles_offsets[v] + remaining_triangles[v]].
+	//  Emitted triangles are swapped out of the end.
+	u32*   triangles_offsets   = alloc_mesh_scratch<u32>(vertices_count);
+	u32*   remaining_triangles = alloc_mesh_scratch<u32>(vertices_count);
+	u32*   vertex_triangles    = alloc_mesh_scratch<u32>(indices_count);
+	s32*   cache_positions     = alloc_mesh_scratch<s32>(vertices_count);
+	float* vertex_scores       = alloc_mesh_scratch<float>(vertices_count);
+	float* triangle_scores     = alloc_mesh_scratch<float>(triangles_count);
+	bool*  is_triangle_emitted = alloc_mesh_scratch<bool>(triangles_count);
+	u32*   result              = alloc_mesh_scratch<u32>(indices_count);
+	defer {
+		c_allocator.free(triangles_offsets,   code_location());
+		c_allocator.free(remaining_triangles, code_location());
+		c_allocator.free(vertex_triangles,    code_location());
+		c_allocator.free(cache_positions,     code_location());
+		c_allocator.free(vertex_scores,       code_location());
+		c_allocator.free(triangle_scores,     code_location());
+		c_allocator.free(is_triangle_emitted, code_location());
+		c_allocator.free(result,              code_location());
+	};
+
+	memset(remaining_triangles, 0, sizeof(u32) * vertices_count);
+
+	for (u32 i = 0; i < indices_count; i++)
+	{
+		remaining_triangles[indices[i]] += 1;
+	}
+
+	u32 offset = 0;
+	for (u32 v = 0; v < vertices_count; v++)
+	{
+		triangles_offsets[v] = offset;
+		offset += remaining_triangles[v];
+
+		remaining_triangles[v] = 0; // Reused as fill cursor below.
+	}
+
+	for (u32 t = 0; t < triangles_count; t++)
+	{
+		for (int k = 0; k < 3; k++)
+		{
+			u32 v = indices[t * 3 + k];
+			vertex_triangles[triangles_offsets[v] + remaining_triangles[v]] = t;
+			remaining_triangles[v] += 1;
+		}
+	}
+
+	for (u32 v = 0; v < vertices_count; v++)
+	{
+		cache_positions[v] = -1;
+		vertex_scores[v]   = get_vertex_score(-1, remaining_triangles[v]);
+	}
+
+	u32 best_triangle = 0;
+
+	for (u32 t = 0; t < triangles_count; t++)
+	{
+		triangle_scores[t] = vertex_scores[indices[t * 3]] + vertex_scores[indices[t * 3 + 1]] + vertex_scores[indices[t * 3 + 2]];
+		is_triangle_emitted[t] = false;
+
+		if (triangle_scores[t] > triangle_scores[best_triangle])
+			best_triangle = t;
+	}
+
+
+	u32 cache[vertex_cache_size + 3];
+	int cache_count = 0;
+
+	u32 unemitted_cursor = 0;
+
+	for (u32 emitted_count = 0; emitted_count < triangles_count; emitted_count++)
+	{
+		if (best_triangle == u32_max)
+		{
+			// Nothing in cache has triangles left, continue from any triangle that is left.
+			while (is_triangle_emitted[unemitted_cursor]) unemitted_cursor += 1;
+			best_triangle = unemitted_cursor;
+		}
+
+		u32* triangle = indices + best_triangle * 3;
+
+		memcpy(result + emitted_count * 3, triangle, sizeof(u32) * 3);
+		is_triangle_emitted[best_triangle] = true;
+
+		for (int k = 0; k < 3; k++)
+		{
+			u32  v         = triangle[k];
+			u32* triangles = vertex_triangles + triangles_offsets[v];
+
+			for (u32 i = 0; i < remaining_triangles[v]; i++)
+			{
+				if (triangles[i] == best_triangle)
+				{
+					triangles[i] = triangles[remaining_triangles[v] - 1];
+					break;
+				}
+			}
+
+			remaining_triangles[v] -= 1;
+		}
+
+
+		// Emitted triangle's vertices go to the front, the rest shifts back. Some fall out of the cache.
+		u32 new_cache[vertex_cache_size + 3];
+		int new_cache_count = 0;
+
+		for (int k = 0; k < 3; k++)
+		{
+			new_cache[new_cache_count++] = triangle[k];
+		}
+
+		for (int i = 0; i < cache_count; i++)
+		{
+			u32 v = cache[i];
+
+			if (v != triangle[0] && v != triangle[1] && v != triangle[2])
+				new_cache[new_cache_count++] = v;
+		}
+
+
+		best_triangle = u32_max;
+		float best_score = -1.0f;
+
+		for (int i = 0; i < new_cache_count; i++)
+		{
+			u32 v = new_cache[i];
+
+			int cache_position = i < vertex_cache_size ? i : -1;
+			cache_positions[v] = cache_position;
+
+			float score = get_vertex_score(cache_position, remaining_triangles[v]);
+			float score_delta = score - vertex_scores[v];
+			vertex_scores[v] = score;
+
+			u32* triangles = vertex_triangles + triangles_offsets[v];
+
+			for (u32 j = 0; j < remaining_triangles[v]; j++)
+			{
+				u32 t = triangles[j];
+
+				triangle_scores[t] += score_delta;
+
+				if (cache_position >= 0 && triangle_scores[t] > best_score)
+				{
+					best_score    = triangle_scores[t];
+					best_triangle = t;
+				}
+			}
+		}
+
+		cache_count = min(new_cache_count, vertex_cache_size);
+		memcpy(cache, new_cache, sizeof(u32) * cache_count);
+	}
+
+	memcpy(indices, result, sizeof(u32) * indices_count);
+}
+
+
+
+struct Overdraw_Cluster
+{
+	u32   first_triangle;
+	u32   triangles_count;
+	float sort_key;
+};
+
+static int compare_overdraw_clusters(const void* a, const void* b)
+{
+	Overdraw_Cluster* cluster_a = (Overdraw_Cluster*) a;
+	Overdraw_Cluster* cluster_b = (Overdraw_Cluster*) b;
+
+	if (cluster_a->sort_key != cluster_b->sort_key) return cluster_a->sort_key > cluster_b->sort_key ? -1 : 1;
+
+	// Keep it deterministic, cooked files shouldn't differ between runs.
+	return cluster_a->first_triangle < cluster_b->first_triangle ? -1 : 1;
+}
+
+// Clusters end where a small FIFO cache goes cold, so moving whole clusters around keeps most of
+//  the vertex cache ordering. Clusters facing away from mesh center are drawn first, they are likely to occlude the rest.
+void optimize_overdraw(u32* indices, u32 indices_count, Vertex* vertices)
+{
+	ZoneScoped;
+
+	u32 triangles_count = indices_count / 3;
+	if (triangles_count < 2) return;
+
+
+	auto clusters = make_array<Overdraw_Cluster>(64, c_allocator);
+	defer { clusters.free(); };
+
+	{
+		const int fifo_size = 16;
+
+		u32 fifo[fifo_size];
+		int fifo_count = 0;
+		int fifo_next  = 0;
+
+		auto is_in_fifo = [&](u32 v) -> bool
+		{
+			for (int i = 0; i < fifo_count; i++)
+			{
+				if (fifo[i] == v) return true;
+			}
+			return false;
+		};
+
+		for (u32 t = 0; t < triangles_count; t++)
+		{
+			int misses_count = 0;
+
+			for (int k = 0; k < 3; k++)
+			{
+				u32 v = indices[t * 3 + k];
+				if (is_in_fifo(v)) continue;
+
+				misses_count += 1;
+
+				fifo[fifo_next] = v;
+				fifo_next  = (fifo_next + 1) % fifo_size;
+				fifo_count = min(fifo_count + 1, fifo_size);
+			}
+
+			if (t == 0 || misses_count == 3)
+			{
+				clusters.add({ .first_triangle = t, .triangles_count = 0 });
+			}
+
+			clusters[clusters.count - 1]->triangles_count += 1;
+		}
+	}
+
+	if (clusters.count < 2) return;
+
+
+	auto get_position = [&](u32 t, int k) -> Vector3
+	{
+		return vertices[indices[t * 3 + k]].position;
+	};
+
+	// Vector of length equal to double area.
+	auto get_area_normal = [&](u32 t) -> Vector3
+	{
+		Vector3 a = get_position(t, 0);
+		Vector3 b = get_position(t, 1);
+		Vector3 c = get_position(t, 2);
+
+		float ab_x = b.x - a.x, ab_y = b.y - a.y, ab_z = b.z - a.z;
+		float ac_x = c.x - a.x, ac_y = c.y - a.y, ac_z = c.z - a.z;
+
+		return Vector3::make(ab_y * ac_z - ab_z * ac_y, ab_z * ac_x - ab_x * ac_z, ab_x * ac_y - ab_y * ac_x);
+	};
+
+	auto accumulate_centroid = [&](u32 t, double* sum, double* area_sum)
+	{
+		Vector3 n = get_area_normal(t);
+		double area = sqrt(double(n.x) * n.x + double(n.y) * n.y + double(n.z) * n.z);
+
+		for (int k = 0; k < 3; k++)
+		{
+			Vector3 p = get_position(t, k);
+			sum[0] += p.x * area / 3.0;
+			sum[1] += p.y * area / 3.0;
+			sum[2] += p.z * area / 3.0;
+		}
+
+		*area_sum += area;
+	};
+
+
+	double mesh_center[3] = {};
+	double mesh_area = 0;
+
+	for (u32 t = 0; t < triangles_count; t++)
+	{
+		accumulate_centroid(t, mesh_center, &mesh_area);
+	}
+
+	if (mesh_area <= 0) return;
+
+	for (int i = 0; i < 3; i++) mesh_center[i] /= mesh_area;
+
+
+	for (Overdraw_Cluster& cluster: clusters)
+	{
+		double center[3] = {};
+		double area = 0;
+		double normal[3] = {};
+
+		for (u32 t = cluster.first_triangle; t < cluster.first_triangle + cluster.triangles_count; t++)
+		{
+			accumulate_centroid(t, center, &area);
+
+			Vector3 n = get_area_normal(t);
+			normal[0] += n.x;
+			normal[1] += n.y;
+			normal[2] += n.z;
+		}
+
+		double normal_length = sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+
+		if (area <= 0 || normal_length <= 0)
+		{
+			cluster.sort_key = 0;
+			continue;
+		}
+
+		double key = 0;
+		for (int i = 0; i < 3; i++)
+		{
+			key += (center[i] / area - mesh_center[i]) * normal[i] / normal_length;
+		}
+
+		cluster.sort_key = float(key);
+	}
+
+	qsort(clusters.data, clusters.count, sizeof(Overdraw_Cluster), compare_overdraw_clusters);
+
+
+	u32* result = alloc_mesh_scratch<u32>(indices_count);
+	defer { c_allocator.free(result, code_location()); };
+
+	u32 written = 0;
+	for (Overdraw_Cluster& cluster: clusters)
+	{
+		memcpy(result + written, indices + cluster.first_triangle * 3, sizeof(u32) * 3 * cluster.triangles_count);
+		written += cluster.triangles_count * 3;
+	}
+
+	memcpy(indices, result, sizeof(u32) * written);
+}
+
+
+void optimize_vertex_fetch(Dynamic_Array<Vertex>* vertices, u32* indices, u32 indices_count)
+{
+	ZoneScoped;
+
+	u32* remap     = alloc_mesh_scratch<u32>(vertices->count);
+	Vertex* result = alloc_mesh_scratch<Vertex>(vertices->count);
+	defer {
+		c_allocator.free(remap,  code_location());
+		c_allocator.free(result, code_location());
+	};
+
+	for (int i = 0; i < vertices->count; i++)
+	{
+		remap[i] = u32_max;
+	}
+
+	u32 used_count = 0;
+
+	for (u32 i = 0; i < indices_count; i++)
+	{
+		u32 v = indices[i];
+
+		if (remap[v] == u32_max)
+		{
+			remap[v] = used_count;
+			result[used_count] = *(*vertices)[v];
+			used_count += 1;
+		}
+
+		indices[i] = remap[v];
+	}
+
+	memcpy(vertices->data, result, sizeof(Vertex) * used_count);
+	vertices->count = used_count;
+}
+
+
+void optimize_mesh(Dynamic_Array<Vertex>* vertices, Dynamic_Array<u32>* indices, Dynamic_Array<Submesh>* submeshes)
+{
+	ZoneScoped;
+
+	// Vertex cache optimisation works on submesh's own vertices, renumbered from zero,
+	//  so its tables are sized by the submesh rather than by the whole mesh.
+	//  local_vertices maps mesh's vertex to submesh's one, entries a range touched are reset after it.
+	u32* local_vertices = alloc_mesh_scratch<u32>(vertices->count);
+	u32* mesh_vertices  = alloc_mesh_scratch<u32>(vertices->count);
+	defer {
+		c_allocator.free(local_vertices, code_location());
+		c_allocator.free(mesh_vertices,  code_location());
+	};
+
+	for (int i = 0; i < vertices->count; i++)
+	{
+		local_vertices[i] = u32_max;
+	}
+
+	auto optimize_range = [&](u32 first_index, u32 indices_count)
+	{
+		u32* range = indices->data + first_index;
+
+		u32 local_count = 0;
+
+		for (u32 i = 0; i < indices_count; i++)
+		{
+			u32 v = range[i];
+
+			if (local_vertices[v] == u32_max)
+			{
+				local_vertices[v] = local_count;
+				mesh_vertices[local_count] = v;
+				local_count += 1;
+			}
+
+			range[i] = local_vertices[v];
+		}
+
+		optimize_vertex_cache(range, indices_count, local_count);
+
+		for (u32 i = 0; i < indices_count; i++)
+		{
+			range[i] = mesh_vertices[range[i]];
+		}
+
+		for (u32 i = 0; i < local_count; i++)
+		{
+			local_vertices[mesh_vertices[i]] = u32_max;
+		}
+
+		optimize_overdraw(range, indices_count, vertices->data);
+	};
+
+	if (submeshes->count)
+	{
+		for (Submesh& submesh: *submeshes)
+		{
+			optimize_range(submesh.first_index, submesh.indices_count);
+		}
+	}
+	else
+	{
+		optimize_range(0, indices->count);
+	}
+
+	optimize_vertex_fetch(vertices, indices->data, indices->count);
+}
+
+
+
+void compute_mesh_bounds(Vertex* vertices, int vertices_count, Vector3* out_min, Vector3* out_max)
+{
+	if (vertices_count == 0)
+	{
+		*out_min = Vector3::make(0, 0, 0);
+		*out_max = Vector3::make(0, 0, 0);
+		return;
+	}
+
+	Vector3 bounds_min = vertices[0].position;
+	Vector3 bounds_max = vertices[0].position;
+
+	for (int i = 1; i < vertices_count; i++)
+	{
+		Vector3 p = vertices[i].position;
+
+		bounds_min = Vector3::make(min(bounds_min.x, p.x), min(bounds_min.y, p.y), min(bounds_min.z, p.z));
+		bounds_max = Vector3::make(max(bounds_max.x, p.x), max(bounds_max.y, p.y), max(bounds_max.z, p.z));
+	}
+
+	*out_min = bounds_min;
+	*out_max = bounds_max;
+}
+
+
+static u16 quantize_unorm16(float value, float range_min, float range_size)
+{
+	if (range_size <= 0) return 0;
+
+	return u16(clamp(0.0f, 1.0f, (value - range_min) / range_size) * 65535.0f + 0.5f);
+}
+
+static s16 quantize_snorm16(float value)
+{
+	return s16(roundf(clamp(-1.0f, 1.0f, value) * 32767.0f));
+}
+
+// Rounds to nearest even, like GPU conversions do.
+static u16 float_to_half(float value)
+{
+	u32 bits;
+	memcpy(&bits, &value, sizeof(bits));
+
+	u32 sign            = (bits >> 16) & 0x8000;
+	u32 float_exponent  = (bits >> 23) & 0xff;
+	u32 mantissa        = bits & 0x7fffff;
+
+	s32 exponent = s32(float_exponent) - 127 + 15;
+
+	if (float_exponent == 0xff) return sign | 0x7c00 | (mantissa ? 0x200 : 0); // Infinity or NaN.
+	if (exponent >= 31)         return sign | 0x7c00;
+
+	u32 half;
+	u32 rest;
+	u32 halfway;
+
+	if (exponent <= 0)
+	{
+		if (exponent < -10) return sign;
+
+		// Denormal, implicit bit becomes explicit.
+		mantissa |= 0x800000;
+
+		u32 shift = 14 - exponent;
+
+		half    = mantissa >> shift;
+		rest    = mantissa & ((1 << shift) - 1);
+		halfway = 1 << (shift - 1);
+	}
+	else
+	{
+		half    = (u32(exponent) << 10) | (mantissa >> 13);
+		rest    = mantissa & 0x1fff;
+		halfway = 0x1000;
+	}
+
+	// Carry from mantissa into exponent is still the right result.
+	if (rest > halfway || (rest == halfway && (half & 1)))
+		half += 1;
+
+	return u16(sign | half);
+}
+
+// Normal is projected onto octahedron, then lower half is folded over the upper one.
+static void encode_octahedral_normal(Vector3 normal, s16* out)
+{
+	float length = fabsf(normal.x) + fabsf(normal.y) + fabsf(normal.z);
+
+	if (length <= 0)
+	{
+		out[0] = 0;
+		out[1] = 0;
+		return;
+	}
+
+	float u = normal.x / length;
+	float v = normal.y / length;
+
+	if (normal.z < 0)
+	{
+		float folded_u = (1.0f - fabsf(v)) * (u >= 0 ? 1.0f : -1.0f);
+		float folded_v = (1.0f - fabsf(u)) * (v >= 0 ? 1.0f : -1.0f);
+
+		u = folded_u;
+		v = folded_v;
+	}
+
+	out[0] = quantize_snorm16(u);
+	out[1] = quantize_snorm16(v);
+}
+
+void quantize_vertices(Vertex* vertices, int vertices_count, Vector3 bounds_min, Vector3 bounds_max, Quantized_Vertex* out_vertices)
+{
+	ZoneScoped;
+
+	Vector3 bounds_size = Vector3::make(bounds_max.x - bounds_min.x, bounds_max.y - bounds_min.y, bounds_max.z - bounds_min.z);
+
+	for (int i = 0; i < vertices_count; i++)
+	{
+		Vertex*           vertex = &vertices[i];
+		Quantized_Vertex* out    = &out_vertices[i];
+
+		out->position[0] = quantize_unorm16(vertex->position.x, bounds_min.x, bounds_size.x);
+		out->position[1] = quantize_unorm16(vertex->position.y, bounds_min.y, bounds_size.y);
+		out->position[2] = quantize_unorm16(vertex->position.z, bounds_min.z, bounds_size.z);
+		out->position[3] = 0;
+
+		encode_octahedral_normal(vertex->normal, out->normal);
+
+		out->uv[0] = float_to_half(vertex->uv.x);
+		out->uv[1] = float_to_half(vertex->uv.y);
+	}
+}
+
+
+
+// Benchmark input is written without printf, so generating it doesn't take longer than parsing.
+
+static inline void write_obj_u32(char** p, u32 value)
+{
+	char digits[10];
+	int  count = 0;
+
+	do
+	{
+		digits[count] = '0' + value % 10;
+		value /= 10;
+		count += 1;
+	} while (value);
+
+	while (count)
+	{
+		count -= 1;
+		**p = digits[count];
+		*p += 1;
+	}
+}
+
+// Three decimal places.
+static inline void write_obj_float(char** p, float value)
+{
+	if (value < 0)
+	{
+		**p = '-';
+		*p += 1;
+		value = -value;
+	}
+
+	u32 thousandths = u32(value * 1000.0f + 0.5f);
+
+	write_obj_u32(p, thousandths / 1000);
+
+	**p = '.';
+	*p += 1;
+
+	u32 fraction = thousandths % 1000;
+	(*p)[0] = '0' + fraction / 100;
+	(*p)[1] = '0' + fraction / 10 % 10;
+	(*p)[2] = '0' + fraction % 10;
+	*p += 3;
+}
+
+static inline void write_obj_text(char** p, const char* text)
+{
+	while (*text)
+	{
+		**p = *text;
+		*p += 1;
+		text += 1;
+	}
+}
+
+void run_obj_parse_benchmark()
+{
+	ZoneScoped;
+
+	// Wavy grid of quads with positions, uvs and normals, split into a submesh every 100 rows.
+	const u32 side       = 1000;
+	const int iterations = 3;
+
+	u32 vertices_count = (side + 1) * (side + 1);
+	u32 quads_count    = side * side;
+
+	u64   capacity = u64(vertices_count) * 96 + u64(quads_count) * 112 + u64(side) * 16;
+	char* text     = (char*) c_allocator.alloc(capacity, code_location());
+	defer { c_allocator.free(text, code_location()); };
+
+	char* p = text;
+
+	for (u32 z = 0; z <= side; z++)
+	{
+		for (u32 x = 0; x <= side; x++)
+		{
+			float height = sinf(float(x) * 0.05f) * cosf(float(z) * 0.05f) * 4.0f;
+
+			write_obj_text(&p, "v ");
+			write_obj_float(&p, float(x) - float(side) * 0.5f);
+			write_obj_text(&p, " ");
+			write_obj_float(&p, height);
+			write_obj_text(&p, " ");
+			write_obj_float(&p, float(z) - float(side) * 0.5f);
+			write_obj_text(&p, "\nvt ");
+			write_obj_float(&p, float(x) / float(side));
+			write_obj_text(&p, " ");
+			write_obj_float(&p, float(z) / float(side));
+			write_obj_text(&p, "\nvn 0.000 1.000 0.000\n");
+		}
+	}
+
+	for (u32 z = 0; z < side; z++)
+	{
+		if (z % 100 == 0)
+		{
+			write_obj_text(&p, "o rows_");
+			write_obj_u32(&p, z);
+			write_obj_text(&p, "\n");
+		}
+
+		for (u32 x = 0; x < side; x++)
+		{
+			// OBJ indices start at 1.
+			u32 corners[4] = {
+				z * (side + 1) + x + 1,
+				z * (side + 1) + x + 2,
+				(z + 1) * (side + 1) + x + 2,
+				(z + 1) * (side + 1) + x + 1,
+			};
+
+			write_obj_text(&p, "f");
+
+			for (u32 corner: corners)
+			{
+				write_obj_text(&p, " ");
+				write_obj_u32(&p, corner);
+				write_obj_text(&p, "/");
+				write_obj_u32(&p, corner);
+				write_obj_text(&p, "/");
+				write_obj_u32(&p, corner);
+			}
+
+			write_obj_text(&p, "\n");
+		}
+	}
+
+	u64 size = p - text;
+	assert(size <= capacity);
+
+
+	double best_ms = 0;
+	u32    triangles_count = 0;
+	u32    parsed_vertices_count = 0;
+
+	for (int i = 0; i < iterations; i++)
+	{
+		Dynamic_Array<Vertex>  vertices;
+		Dynamic_Array<u32>     indices;
+		Dynamic_Array<Submesh> submeshes;
+
+		Time_Measurer tm = create_time_measurer();
+
+		if (!parse_obj_mesh(String(text, size), &vertices, &indices, &submeshes))
+		{
+			Log(U"OBJ parse benchmark: failed to parse generated file");
+			return;
+		}
+
+		double ms = tm.ms_elapsed_double();
+		if (i == 0 || ms < best_ms) best_ms = ms;
+
+		triangles_count       = indices.count / 3;
+		parsed_vertices_count = vertices.count;
+
+		vertices.free();
+		indices.free();
+		submeshes.free();
+	}
+
+	Log(U"OBJ parse benchmark: % MB, % triangles, % vertices, best of %: % ms",
+		double(size) / double(megabytes(1)), triangles_count, parsed_vertices_count, iterations, best_ms);
+	Log(U"OBJ parse benchmark: % million triangles per second, % MB per second",
+		double(triangles_count) / (best_ms / 1000.0) / 1000000.0, double(size) / double(megabytes(1)) / (best_ms / 1000.0));
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "b_lib/Basic.h"
+#include "b_lib/String.h"
+#include "b_lib/Dynamic_Array.h"
+
+#include "Renderer.h"
+
+
+// CPU side mesh preparation, happens once at load time, result is cooked.
+
+
+// Wavefront OBJ with any number of corners per face and negative (relative) indices.
+//  Corners with the same position/uv/normal triplet share a vertex, n-gons are triangulated as fans.
+//  Every 'o' and 'g' starts a new submesh, materials and smoothing groups are ignored.
+//  Output arrays are allocated with c_allocator, on failure nothing is left allocated.
+bool parse_obj_mesh(String str, Dynamic_Array<Vertex>* out_vertices, Dynamic_Array<u32>* out_indices, Dynamic_Array<Submesh>* out_submeshes);
+
+// Logs parse speed on a generated OBJ file of two million triangles.
+void run_obj_parse_benchmark();
+
+
+// Import time optimization, runs before mesh is cooked. Triangles stay within their submeshes.
+//  Triangles are reordered for post-transform vertex cache, then clusters of them are ordered so outward facing
+//  ones go first and hide what's behind. Last, vertices are reordered in order of first use and unused are dropped.
+void optimize_mesh(Dynamic_Array<Vertex>* vertices, Dynamic_Array<u32>* indices, Dynamic_Array<Submesh>* submeshes);
+
+// Fills score tables optimize_vertex_cache() reads. Must happen once on the main thread before meshes are imported,
+//  same as init_srgb_tables().
+void init_vertex_score_tables();
+
+void optimize_vertex_cache(u32* indices, u32 indices_count, u32 vertices_count);
+void optimize_overdraw    (u32* indices, u32 indices_count, Vertex* vertices);
+void optimize_vertex_fetch(Dynamic_Array<Vertex>* vertices, u32* indices, u32 indices_count);
+
+
+void compute_mesh_bounds(Vertex* vertices, int vertices_count, Vector3* out_min, Vector3* out_max);
+
+// Positions are relative to bounds, Mesh_Vertex_Format::Quantized explains the layout.
+void quantize_vertices(Vertex* vertices, int vertices_count, Vector3 bounds_min, Vector3 bounds_max, Quantized_Vertex* out_vertices);
@@ -10,6 +10,9 @@
 
 
 #include "Asset_Storage.h"
+#include "Texture_Import.h"
+#include "Mesh_Import.h"
+#include "Gpu_Culling.h"
 
 
 u64 total_allocation_size = 0;
@@ -47,7 +50,14 @@ void Renderer::init(int initial_width, int initial_height)
 {
 	ZoneScoped;
 
-	make_array(&imm_mask_stack, 32, c_allocator);
+	make_array(&imm_mask_stack,     32, c_allocator);
+	make_array(&imm_inversed_masks, 8,  c_allocator);
+
+	make_array(&imm_pending_atlas_uploads, 64, c_allocator);
+
+	make_array(&texture_uploads,            16, c_allocator);
+	make_array(&texture_upload_batches,     4,  c_allocator);
+	make_array(&free_texture_upload_fences, 4,  c_allocator);
 
 	width  = initial_width;
 	height = initial_height;
@@ -62,15 +72,16 @@ void Renderer::init(int initial_width, int initial_height)
 
 
 	make_array(&swapchain_nodes,         4,  c_allocator);
-	make_array(&imm_descriptor_pools,    32, c_allocator);
+
+	make_array(&resident_textures,       32, c_allocator);
+	make_array(&resident_meshes,         32, c_allocator);
 	make_array(&imm_commands,            32, c_allocator);
+	make_array(&level_draws,             64, c_allocator);
 
-	make_array_map(&glyph_gpu_map,       32, c_allocator);
+	glyph_cache.init(1024);
 
 	make_bucket_array(&glyph_atlasses,   32, c_allocator);
 
-	make_array(&imm_used_uniform_buffer_memory_allocations, 32, c_allocator);
-
 
 	// Setup allocator callbacks
 	{
@@ -113,10 +124,9 @@ void Renderer::init(int initial_width, int initial_height)
 
 	// Check for MSAA support
 	{
-	 	VkPhysicalDeviceProperties physicalDeviceProperties;
-	    vkGetPhysicalDeviceProperties(physical_device, &physicalDeviceProperties);
+	    vkGetPhysicalDeviceProperties(physical_device, &physical_device_properties);
 
-	    VkSampleCountFlags counts = physicalDeviceProperties.limits.framebufferColorSampleCounts & physicalDeviceProperties.limits.framebufferDepthSampleCounts;
+	    VkSampleCountFlags counts = physical_device_properties.limits.framebufferColorSampleCounts & physical_device_properties.limits.framebufferDepthSampleCounts;
 
 	    // if (counts & VK_SAMPLE_COUNT_2_BIT) { msaa_samples_count = VK_SAMPLE_COUNT_2_BIT; }
 	    // if (counts & VK_SAMPLE_COUNT_4_BIT) { msaa_samples_count = VK_SAMPLE_COUNT_4_BIT; }
@@ -175,24 +185,10 @@ void Renderer::init(int initial_width, int initial_height)
 	}
 #endif
 
-	{
-		VkFenceCreateInfo create_info;
-		create_info.flags = 0;
-		create_info.pNext = 0;
-		create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-
-		if (vkCreateFence(device, &create_info, host_allocator, &rendering_done_fence) != VK_SUCCESS)
-			abort_the_mission(U"Failed to vkCreateFence");
-
+	create_frame_slots();
+	create_texture_table();
 
-
-		create_info.flags = 0;
-		create_info.pNext = 0;
-		create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-
-		if (vkCreateFence(device, &create_info, host_allocator, &image_availability_fence) != VK_SUCCESS)
-			abort_the_mission(U"Failed to vkCreateFence");
-	}
+	geometry_manager.init();
 
 	create_primitives();
 	create_white_texture();
@@ -202,86 +198,299 @@ void Renderer::init(int initial_width, int initial_height)
 
 	imm_load_shaders();
 	imm_create_pipelines();
+	create_mesh_pipelines();
+
+	gpu_culling.init();
 }
 
-void Renderer::imm_create_pipelines()
+void Renderer::create_frame_slots()
 {
-	// General pipeline
+	ZoneScoped;
+
+	for (Frame_Slot& slot: frame_slots)
 	{
-		VkPipelineDepthStencilStateCreateInfo depth_stencil = {
-			.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
+		make_array(&slot.descriptor_pools,         4,  c_allocator);
+		make_array(&slot.retired_buffers,          8,  c_allocator);
+		make_array(&slot.released_texture_indices, 8,  c_allocator);
+		make_array(&slot.retired_images,           4,  c_allocator);
+		make_array(&slot.retired_geometry,         8,  c_allocator);
+
+		slot.upload_buffer.create(imm_initial_upload_buffer_size, 0, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, code_location());
+		slot.staging_buffer.create(imm_initial_staging_buffer_size, 0, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, code_location());
+		slot.instance_buffer.create(initial_instance_buffer_size, 0, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, code_location());
 
+		VkCommandBufferAllocateInfo command_buffer_info = {
+			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
 			.pNext = NULL,
-			.flags = 0,
-			.depthTestEnable = VK_FALSE,
-			.depthWriteEnable = VK_FALSE,
-			.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL,
-			.depthBoundsTestEnable = VK_FALSE,
 			
-			.stencilTestEnable = VK_TRUE,
-			.front = {
-				.failOp = VK_STENCIL_OP_KEEP,
-				.passOp = VK_STENCIL_OP_KEEP,
-				.depthFailOp = VK_STENCIL_OP_KEEP,
-				.compareOp = VK_COMPARE_OP_LESS,
-				.compareMask = u32_max,
-				.writeMask = 0,
-				.reference = 0,
-			},
-			.minDepthBounds = 0.0,
-			.maxDepthBounds = 1.0
+			.commandPool = command_pool,
+			
+			.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+			.commandBufferCount = 1,
 		};
 
-		depth_stencil.back = depth_stencil.front;
+		if (vkAllocateCommandBuffers(device, &command_buffer_info, &slot.command_buffer) != VK_SUCCESS)
+			abort_the_mission(U"Failed to vkAllocateCommandBuffers");
 
 
-		VkDescriptorSetLayoutBinding bindings[] = {
-			{
-				.binding = 0,
-				.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-				.descriptorCount = 1,
-				.stageFlags = VK_SHADER_STAGE_ALL,
-				.pImmutableSamplers = NULL,
-			},
-			{
-				.binding = 1,
-				.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-				.descriptorCount = 1,
-				.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
-				.pImmutableSamplers = NULL,
-			},
+		// Created signaled, so the first wait on a fresh slot doesn't block.
+		VkFenceCreateInfo fence_info = {
+			.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+			.pNext = NULL,
+			.flags = VK_FENCE_CREATE_SIGNALED_BIT,
 		};
 
-		VkPipelineColorBlendAttachmentState colorBlendAttachment = {
-	    	.blendEnable = VK_TRUE,
-			.srcColorBlendFactor = VK_BLEND_FACTOR_ONE,
-			.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
-			.colorBlendOp = VK_BLEND_OP_ADD,
-			.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE,
-			.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO,
-			.alphaBlendOp = VK_BLEND_OP_MAX,
-			.colorWriteMask = VK_COLOR_COMPONENT_R_BIT |
-    					  VK_COLOR_COMPONENT_G_BIT |
-    					  VK_COLOR_COMPONENT_B_BIT |
-    					  VK_COLOR_COMPONENT_A_BIT ,
+		if (vkCreateFence(device, &fence_info, host_allocator, &slot.rendering_done_fence) != VK_SUCCESS)
+			abort_the_mission(U"Failed to vkCreateFence");
+
+
+		VkSemaphoreCreateInfo semaphore_info = {
+			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+			.pNext = NULL,
+			.flags = 0,
 		};
 
+		if (vkCreateSemaphore(device, &semaphore_info, host_allocator, &slot.image_available_semaphore) != VK_SUCCESS)
+			abort_the_mission(U"Failed to vkCreateSemaphore");
 
-		imm_general_pipeline = imm_create_pipeline({
-			.vertex_shader   = imm_shaders.glyph_rect_vertex,
-			.fragment_shader = imm_shaders.glyph_rect_fragment,
+		if (vkCreateSemaphore(device, &semaphore_info, host_allocator, &slot.rendering_done_semaphore) != VK_SUCCESS)
+			abort_the_mission(U"Failed to vkCreateSemaphore");
+	}
 
-			.blending_state = &colorBlendAttachment,
-			.depth_stencil_state = &depth_stencil,
+	frames_in_flight = max(1, min(settings.frames_in_flight, max_frames_in_flight));
+	frame_slot_index = 0;
 
-			.descriptor_set_layout_bindings = bindings,
-			.descriptor_set_layout_bindings_count = array_count(bindings),
+	main_command_buffer = frame_slots[0].command_buffer;
+}
 
-			.no_vertex_buffer = true,
-		});
+// Slot's rendering_done_fence must be signaled at this point.
+void Renderer::release_frame_slot_resources(Frame_Slot* slot)
+{
+	ZoneScoped;
+
+	for (Retired_Buffer& item: slot->retired_buffers)
+	{
+		vkDestroyBuffer(device, item.buffer, host_allocator);
+		vulkan_memory_allocator.free(item.memory);
+	}
+
+	slot->retired_buffers.clear();
+
+	for (Retired_Image& item: slot->retired_images)
+	{
+		vkDestroySampler(device, item.image_sampler, host_allocator);
+		vkDestroyImageView(device, item.image_view, host_allocator);
+		vkDestroyImage(device, item.image, host_allocator);
+		vulkan_memory_allocator.free(item.memory);
+	}
+
+	slot->retired_images.clear();
+
+	for (Geometry_Allocation allocation: slot->retired_geometry)
+	{
+		geometry_manager.free(allocation);
+	}
+
+	slot->retired_geometry.clear();
+
+	slot->upload_buffer.reset();
+	slot->staging_buffer.reset();
+	slot->instance_buffer.reset();
+	slot->general_descriptor_set = VK_NULL_HANDLE;
+
+	for (u32 texture_index: slot->released_texture_indices)
+	{
+		imm_free_texture_indices.add(texture_index);
+	}
+	slot->released_texture_indices.clear();
+
+
+	slot->current_descriptor_pool = 0;
+	for (VkDescriptorPool& pool: slot->descriptor_pools)
+	{
+		vkResetDescriptorPool(device, pool, 0);
+	}
+}
+
+void Renderer::set_frames_in_flight(int count)
+{
+	ZoneScoped;
+
+	count = max(1, min(count, max_frames_in_flight));
+
+	if (count == frames_in_flight) return;
+
+	// Changing ring size is rare, so just drain the GPU instead of tracking which slots are still pending.
+	vkDeviceWaitIdle(device);
+
+	for (Frame_Slot& slot: frame_slots)
+	{
+		release_frame_slot_resources(&slot);
+	}
+
+	Log(U"Frames in flight: % -> %", frames_in_flight, count);
+
+	frames_in_flight = count;
+	frame_slot_index = 0;
+}
+
+// Old buffer might still be referenced by commands recorded this frame, so it's destroyed along with other per frame buffers.
+void Renderer::grow_frame_linear_buffer(Frame_Slot* slot, Vulkan_Linear_Buffer* buffer, u64 required_size)
+{
+	ZoneScoped;
+
+	u64 new_capacity = buffer->capacity * 2;
+	while (new_capacity < required_size)
+		new_capacity *= 2;
+
+	Log(U"Growing frame buffer: % -> %", buffer->capacity, new_capacity);
+
+	vkUnmapMemory(device, buffer->memory.device_memory);
+
+	slot->retired_buffers.add({
+		.buffer = buffer->buffer,
+		.memory = buffer->memory,
+	});
+
+	u64 tail_padding = buffer->tail_padding;
+	VkBufferUsageFlags usage = buffer->usage;
+
+	*buffer = {};
+	buffer->create(new_capacity, tail_padding, usage, code_location());
+}
+
+void Renderer::imm_grow_upload_buffer(Frame_Slot* slot, u64 required_size)
+{
+	grow_frame_linear_buffer(slot, &slot->upload_buffer, required_size);
+
+	// Cached set points to the old buffer.
+	slot->general_descriptor_set = VK_NULL_HANDLE;
+}
+
+void Renderer::create_texture_table()
+{
+	ZoneScoped;
+
+	make_array(&imm_free_texture_indices, 32, c_allocator);
+
+
+	VkDescriptorSetLayoutBinding binding = {
+		.binding = 0,
+		.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+		.descriptorCount = imm_max_textures,
+		.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+		.pImmutableSamplers = NULL,
+	};
+
+	// Unused entries are never written, and new textures are registered while frames using the table are recorded or still executing.
+	VkDescriptorBindingFlagsEXT binding_flags =
+		VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT |
+		VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT |
+		VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT_EXT;
+
+	VkDescriptorSetLayoutBindingFlagsCreateInfoEXT binding_flags_info = {
+		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT,
+		.pNext = NULL,
+		.bindingCount = 1,
+		.pBindingFlags = &binding_flags,
+	};
+
+	VkDescriptorSetLayoutCreateInfo layout_info = {
+		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+		.pNext = &binding_flags_info,
+		.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT_EXT,
+		.bindingCount = 1,
+		.pBindings = &binding,
+	};
+
+	if (vkCreateDescriptorSetLayout(device, &layout_info, host_allocator, &imm_texture_table_layout) != VK_SUCCESS)
+		abort_the_mission(U"Failed to vkCreateDescriptorSetLayout");
+
+
+	VkDescriptorPoolSize pool_size = {
+		.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+		.descriptorCount = imm_max_textures,
+	};
+
+	VkDescriptorPoolCreateInfo pool_info = {
+		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+		.pNext = NULL,
+		.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT_EXT,
+		.maxSets = 1,
+		.poolSizeCount = 1,
+		.pPoolSizes = &pool_size,
+	};
+
+	if (vkCreateDescriptorPool(device, &pool_info, host_allocator, &imm_texture_table_pool) != VK_SUCCESS)
+		abort_the_mission(U"Failed to vkCreateDescriptorPool");
+
+
+	VkDescriptorSetAllocateInfo allocate_info = {
+		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+		.pNext = NULL,
+		.descriptorPool = imm_texture_table_pool,
+		.descriptorSetCount = 1,
+		.pSetLayouts = &imm_texture_table_layout,
+	};
+
+	if (vkAllocateDescriptorSets(device, &allocate_info, &imm_texture_table) != VK_SUCCESS)
+		abort_the_mission(U"Failed to vkAllocateDescriptorSets");
+}
+
+u32 Renderer::imm_register_texture(VkImageView image_view, VkSampler sampler)
+{
+	ZoneScoped;
+
+	u32 texture_index;
+
+	if (imm_free_texture_indices.count)
+	{
+		texture_index = *imm_free_texture_indices[imm_free_texture_indices.count - 1];
+		imm_free_texture_indices.count -= 1;
+	}
+	else
+	{
+		if (imm_texture_table_count == imm_max_textures)
+			abort_the_mission(U"Texture table is full, increase imm_max_textures");
+
+		texture_index = imm_texture_table_count;
+		imm_texture_table_count += 1;
 	}
 
-	// Texture pipeline
+
+	VkDescriptorImageInfo image_info = {
+		.sampler     = sampler,
+		.imageView   = image_view,
+		.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+	};
+
+	VkWriteDescriptorSet write_info = {
+		.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+		.pNext = NULL,
+		.dstSet = imm_texture_table,
+		.dstBinding = 0,
+		.dstArrayElement = texture_index,
+		.descriptorCount = 1,
+		.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+		.pImageInfo = &image_info,
+	};
+
+	vkUpdateDescriptorSets(device, 1, &write_info, 0, NULL);
+
+	return texture_index;
+}
+
+// Index becomes reusable once every frame that could've sampled it is done.
+void Renderer::imm_release_texture_index(u32 texture_index)
+{
+	assert(texture_index != white_texture.texture_index);
+
+	current_frame_slot()->released_texture_indices.add(texture_index);
+}
+
+void Renderer::imm_create_pipelines()
+{
+	// General pipeline
 	{
 		VkPipelineDepthStencilStateCreateInfo depth_stencil = {
 			.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
@@ -313,9 +522,9 @@ void Renderer::imm_create_pipelines()
 		VkDescriptorSetLayoutBinding bindings[] = {
 			{
 				.binding = 0,
-				.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+				.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
 				.descriptorCount = 1,
-				.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+				.stageFlags = VK_SHADER_STAGE_ALL,
 				.pImmutableSamplers = NULL,
 			},
 		};
@@ -335,9 +544,9 @@ void Renderer::imm_create_pipelines()
 		};
 
 
-		imm_texture_pipeline = imm_create_pipeline({
-			.vertex_shader   = imm_shaders.texture_vertex,
-			.fragment_shader = imm_shaders.texture_fragment,
+		imm_general_pipeline = imm_create_pipeline({
+			.vertex_shader   = imm_shaders.glyph_rect_vertex,
+			.fragment_shader = imm_shaders.glyph_rect_fragment,
 
 			.blending_state = &colorBlendAttachment,
 			.depth_stencil_state = &depth_stencil,
@@ -345,14 +554,15 @@ void Renderer::imm_create_pipelines()
 			.descriptor_set_layout_bindings = bindings,
 			.descriptor_set_layout_bindings_count = array_count(bindings),
 
-			.push_constant_size = sizeof(Texture_Uniform_Block),
+			.additional_set_layouts = &imm_texture_table_layout,
+			.additional_set_layouts_count = 1,
+
+			.push_constant_size = sizeof(General_Uniform_Block),
 
 			.no_vertex_buffer = true,
-		});	
+		});
 	}
 
-
-
 	// Mask pipeline
 	{
 		VkPipelineDepthStencilStateCreateInfo depth_stencil = {
@@ -435,70 +645,100 @@ void Renderer::imm_create_pipelines()
 			.no_vertex_buffer = true,
 		});
 	}
+}
 
-	// Line pipeline 
-	{
-		VkPipelineDepthStencilStateCreateInfo depth_stencil = {
-			.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
+void Renderer::create_mesh_pipelines()
+{
+	ZoneScoped;
 
-			.pNext = NULL,
-			.flags = 0,
-			.depthTestEnable = VK_FALSE,
-			.depthWriteEnable = VK_FALSE,
-			.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL,
-			.depthBoundsTestEnable = VK_FALSE,
-			
-			.stencilTestEnable = VK_TRUE,
-			.front = {
-				.failOp = VK_STENCIL_OP_KEEP,
-				.passOp = VK_STENCIL_OP_KEEP,
-				.depthFailOp = VK_STENCIL_OP_KEEP,
-				.compareOp = VK_COMPARE_OP_LESS,
-				.compareMask = u32_max,
-				.writeMask = 0,
-				.reference = 0,
-			},
-			.minDepthBounds = 0.0,
-			.maxDepthBounds = 1.0
-		};
+	// Depth is reversed, cleared to 0.
+	VkPipelineDepthStencilStateCreateInfo depth_stencil = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
 
-		depth_stencil.back = depth_stencil.front;
+		.depthTestEnable  = VK_TRUE,
+		.depthWriteEnable = VK_TRUE,
+		.depthCompareOp   = VK_COMPARE_OP_GREATER_OR_EQUAL,
+		.depthBoundsTestEnable = VK_FALSE,
 
+		.stencilTestEnable = VK_FALSE,
 
-		VkPipelineInputAssemblyStateCreateInfo input_assembly_state = {
-			.sType    = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
-			.topology = VK_PRIMITIVE_TOPOLOGY_LINE_LIST,
-			.primitiveRestartEnable = VK_FALSE,
-		};
+		.minDepthBounds = 0.0,
+		.maxDepthBounds = 1.0
+	};
 
-		VkPipelineColorBlendAttachmentState colorBlendAttachment = {
-	    	.blendEnable = VK_TRUE,
-			.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA,
-			.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
-			.colorBlendOp = VK_BLEND_OP_ADD,
-			.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE,
-			.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO,
-			.alphaBlendOp = VK_BLEND_OP_ADD,
-	    	.colorWriteMask = VK_COLOR_COMPONENT_R_BIT |
-				  VK_COLOR_COMPONENT_G_BIT |
-				  VK_COLOR_COMPONENT_B_BIT |
-				  VK_COLOR_COMPONENT_A_BIT ,
-		};
+	VkPipelineColorBlendAttachmentState blending = {
+		.blendEnable = VK_FALSE,
+		.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT,
+	};
 
-		imm_line_pipeline = imm_create_pipeline({
-			.vertex_shader   = imm_shaders.line_vertex,
-			.fragment_shader = imm_shaders.line_fragment,
+	// Projection flips Y, so counter clockwise stays counter clockwise on screen.
+	VkPipelineRasterizationStateCreateInfo rasterization = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
+		.depthClampEnable = VK_FALSE,
+		.rasterizerDiscardEnable = VK_FALSE,
+		.polygonMode = VK_POLYGON_MODE_FILL,
+		.cullMode  = VK_CULL_MODE_BACK_BIT,
+		.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE,
+		.depthBiasEnable = VK_FALSE,
+		.lineWidth = 1.0f,
+	};
 
-			.blending_state = &colorBlendAttachment,
-			.depth_stencil_state = &depth_stencil,
-			.input_assembly_state = &input_assembly_state,
+	VkDescriptorSetLayoutBinding bindings[] = {
+		{
+			.binding = 0,
+			.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			.descriptorCount = 1,
+			.stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+			.pImmutableSamplers = NULL,
+		},
+	};
 
-			.descriptor_set_layout_bindings_count = 0,
+	VkDescriptorSetLayoutBinding culled_bindings[Gpu_Culling::descriptor_bindings_count];
+	gpu_culling.make_descriptor_bindings(culled_bindings);
 
-			.push_constant_size = sizeof(Line_Uniform_Block),
+	Mesh_Vertex_Format formats[] = { Mesh_Vertex_Format::Float, Mesh_Vertex_Format::Quantized };
 
-			.no_vertex_buffer = true,
-		});
+	for (Mesh_Vertex_Format format: formats)
+	{
+		Mesh_Vertex_Input vertex_input;
+		make_mesh_vertex_input(format, &vertex_input);
+
+		mesh_pipelines[(int) format] = imm_create_pipeline({
+			.vertex_shader   = mesh_shaders.mesh_vertex,
+			.fragment_shader = mesh_shaders.mesh_fragment,
+
+			.blending_state      = &blending,
+			.depth_stencil_state = &depth_stencil,
+			.rasterization_state = &rasterization,
+
+			.descriptor_set_layout_bindings = bindings,
+			.descriptor_set_layout_bindings_count = array_count(bindings),
+
+			.push_constant_size = sizeof(Mesh_Uniform_Block),
+
+			.vertex_input_state    = &vertex_input.state,
+			.vertex_specialization = &vertex_input.specialization,
+		});
+
+		if (gpu_culling.is_supported)
+		{
+			gpu_culling.mesh_pipelines[(int) format] = imm_create_pipeline({
+				.vertex_shader   = mesh_shaders.mesh_culled_vertex,
+				.fragment_shader = mesh_shaders.mesh_fragment,
+
+				.blending_state      = &blending,
+				.depth_stencil_state = &depth_stencil,
+				.rasterization_state = &rasterization,
+
+				.descriptor_set_layout_bindings = culled_bindings,
+				.descriptor_set_layout_bindings_count = Gpu_Culling::descriptor_bindings_count,
+
+				.push_constant_size = sizeof(Culled_Mesh_Uniform_Block),
+
+				.vertex_input_state    = &vertex_input.state,
+				.vertex_specialization = &vertex_input.specialization,
+			});
+		}
 	}
 }
 
@@ -529,10 +769,19 @@ Renderer::Imm_Pipeline Renderer::imm_create_pipeline(Renderer::Imm_Pipeline_Opti
 		.size = (u32) options.push_constant_size,
 	};
 
+	VkDescriptorSetLayout set_layouts[4];
+	assert(options.additional_set_layouts_count < array_count(set_layouts));
+
+	set_layouts[0] = result.descriptor_set_layout;
+	for (int i = 0; i < options.additional_set_layouts_count; i++)
+	{
+		set_layouts[i + 1] = options.additional_set_layouts[i];
+	}
+
 	VkPipelineLayoutCreateInfo pipelineLayoutInfo = {
     	.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
-    	.setLayoutCount = 1,
-    	.pSetLayouts = &result.descriptor_set_layout,
+    	.setLayoutCount = (u32) (1 + options.additional_set_layouts_count),
+    	.pSetLayouts = set_layouts,
     	.pushConstantRangeCount = (u32) (options.push_constant_size ? 1 : 0),
     	.pPushConstantRanges = options.push_constant_size ? &push_constant_range : NULL,
 	};
@@ -548,6 +797,7 @@ Renderer::Imm_Pipeline Renderer::imm_create_pipeline(Renderer::Imm_Pipeline_Opti
 		.stage  = VK_SHADER_STAGE_VERTEX_BIT,
 		.module = options.vertex_shader,
 		.pName  = "main",
+		.pSpecializationInfo = options.vertex_specialization,
 	};
 
 	VkPipelineShaderStageCreateInfo fragShaderStageInfo = {
@@ -614,6 +864,11 @@ Renderer::Imm_Pipeline Renderer::imm_create_pipeline(Renderer::Imm_Pipeline_Opti
     	.lineWidth = 1.0f,
     };
 
+	if (options.rasterization_state)
+	{
+		rasterizer = *options.rasterization_state;
+	}
+
     VkPipelineMultisampleStateCreateInfo multisampling = {
     	.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
     	.rasterizationSamples = msaa_samples_count,
@@ -722,6 +977,11 @@ Renderer::Imm_Pipeline Renderer::imm_create_pipeline(Renderer::Imm_Pipeline_Opti
 		.pVertexAttributeDescriptions = vertex_attribute_descriptions,
 	};
 
+	if (options.vertex_input_state)
+	{
+		vertexInputInfo = *options.vertex_input_state;
+	}
+
 	if (options.no_vertex_buffer)
 	{
 		vertexInputInfo.vertexBindingDescriptionCount = 0;
@@ -770,6 +1030,59 @@ Renderer::Imm_Pipeline Renderer::imm_create_pipeline(Renderer::Imm_Pipeline_Opti
 }
 
 
+Renderer::Imm_Pipeline Renderer::create_compute_pipeline(VkShaderModule shader, VkDescriptorSetLayoutBinding* bindings, int bindings_count, int push_constant_size)
+{
+	ZoneScoped;
+
+	Imm_Pipeline result;
+
+	VkDescriptorSetLayoutCreateInfo create_info = {
+		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+		.bindingCount = (u32) bindings_count,
+		.pBindings    = bindings,
+	};
+
+	if (vkCreateDescriptorSetLayout(device, &create_info, host_allocator, &result.descriptor_set_layout) != VK_SUCCESS)
+		abort_the_mission(U"Failed to vkCreateDescriptorSetLayout");
+
+
+	VkPushConstantRange push_constant_range = {
+		.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+		.offset = 0,
+		.size = (u32) push_constant_size,
+	};
+
+	VkPipelineLayoutCreateInfo layout_info = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+		.setLayoutCount = 1,
+		.pSetLayouts = &result.descriptor_set_layout,
+		.pushConstantRangeCount = (u32) (push_constant_size ? 1 : 0),
+		.pPushConstantRanges = push_constant_size ? &push_constant_range : NULL,
+	};
+
+	if (vkCreatePipelineLayout(device, &layout_info, host_allocator, &result.pipeline_layout) != VK_SUCCESS)
+		abort_the_mission(U"Failed to vkCreatePipelineLayout");
+
+
+	VkComputePipelineCreateInfo pipeline_info = {
+		.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+		.stage = {
+			.sType  = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+			.stage  = VK_SHADER_STAGE_COMPUTE_BIT,
+			.module = shader,
+			.pName  = "main",
+		},
+		.layout = result.pipeline_layout,
+		.basePipelineHandle = VK_NULL_HANDLE,
+	};
+
+	if (vkCreateComputePipelines(device, VK_NULL_HANDLE, 1, &pipeline_info, host_allocator, &result.pipeline) != VK_SUCCESS)
+		abort_the_mission(U"Failed to vkCreateComputePipelines");
+
+	return result;
+}
+
+
 
 void Renderer::create_primitives()
 {
@@ -809,9 +1122,14 @@ void Renderer::create_primitives()
 		primitives.quad.vertices = Dynamic_Array<Vertex>::from_static_array(quad_vertices);
 		primitives.quad.indices  = Dynamic_Array<u32>::from_static_array(quad_indices);
 
+		compute_mesh_bounds(primitives.quad.vertices.data, primitives.quad.vertices.count, &primitives.quad.bounds_min, &primitives.quad.bounds_max);
+
 		primitives.quad.allocate_on_gpu();
 	}
 
+	// Renderer is initialized outside of a frame.
+	geometry_manager.submit_uploads_now();
+
 };
 
 void Mesh::allocate_on_gpu()
@@ -820,48 +1138,107 @@ void Mesh::allocate_on_gpu()
 
 	// Vertex buffer
 	{
-		u64 vertices_size = sizeof(vertices.data[0]) * vertices.count;
+		u64 vertex_size   = vertex_format == Mesh_Vertex_Format::Quantized ? sizeof(Quantized_Vertex) : sizeof(Vertex);
+		u64 vertices_size = vertex_size * vertices.count;
 
-		VkBufferCreateInfo bufferInfo = {
-			.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-			.size = vertices_size,
-			.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-			.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
-		};
+		vertex_allocation = geometry_manager.allocate(&geometry_manager.vertex_pool, vertices_size, vertex_size);
 
-		if (vkCreateBuffer(renderer.device, &bufferInfo, renderer.host_allocator, &vertex_buffer) != VK_SUCCESS)
-			abort_the_mission(U"Failed to vkCreateBuffer");
+		vertex_buffer = geometry_manager.get_buffer(vertex_allocation);
+		vertex_offset = s32(vertex_allocation.offset / vertex_size);
 
-		vertex_buffer_memory = vulkan_memory_allocator.allocate_and_bind(vertex_buffer, VULKAN_MEMORY_SHOULD_BE_MAPPABLE, code_location());
+		void* data = geometry_manager.queue_upload(vertex_allocation);
 
-		void* data;
-		vkMapMemory(renderer.device, vertex_buffer_memory.device_memory, vertex_buffer_memory.offset, bufferInfo.size, 0, &data);
-		memcpy(data, vertices.data, vertices_size);
-		vkUnmapMemory(renderer.device, vertex_buffer_memory.device_memory);
+		if (vertex_format == Mesh_Vertex_Format::Quantized)
+			quantize_vertices(vertices.data, vertices.count, bounds_min, bounds_max, (Quantized_Vertex*) data);
+		else
+			memcpy(data, vertices.data, vertices_size);
 	}
 
 	// Index buffer
 	{
-		u64 indices_size = sizeof(indices.data[0]) * indices.count;
+		index_type = vertices.count <= 65536 ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
 
-		VkBufferCreateInfo bufferInfo = {
-			.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-			.size = indices_size,
-			.usage = VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-			.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
-		};
+		u64 index_size   = index_type == VK_INDEX_TYPE_UINT16 ? sizeof(u16) : sizeof(u32);
+		u64 indices_size = index_size * indices.count;
 
-		if (vkCreateBuffer(renderer.device, &bufferInfo, renderer.host_allocator, &index_buffer) != VK_SUCCESS)
-			abort_the_mission(U"Failed to vkCreateBuffer");
+		index_allocation = geometry_manager.allocate(&geometry_manager.index_pool, indices_size, index_size);
 
-		index_buffer_memory = vulkan_memory_allocator.allocate_and_bind(index_buffer, VULKAN_MEMORY_SHOULD_BE_MAPPABLE, code_location());
+		index_buffer = geometry_manager.get_buffer(index_allocation);
+		first_index  = u32(index_allocation.offset / index_size);
 
-		void* data;
-		vkMapMemory(renderer.device, index_buffer_memory.device_memory, index_buffer_memory.offset, bufferInfo.size, 0, &data);
-		memcpy(data, indices.data, indices_size);
-		vkUnmapMemory(renderer.device, index_buffer_memory.device_memory);
+		void* data = geometry_manager.queue_upload(index_allocation);
+
+		if (index_type == VK_INDEX_TYPE_UINT16)
+		{
+			for (int i = 0; i < indices.count; i++)
+			{
+				((u16*) data)[i] = u16(*indices[i]);
+			}
+		}
+		else
+		{
+			memcpy(data, indices.data, indices_size);
+		}
 	}
 
+	is_on_gpu = true;
+}
+
+void Renderer::make_mesh_vertex_input(Mesh_Vertex_Format format, Mesh_Vertex_Input* out_input)
+{
+	bool is_quantized = format == Mesh_Vertex_Format::Quantized;
+
+	out_input->binding = {
+		.binding   = 0,
+		.stride    = is_quantized ? (u32) sizeof(Quantized_Vertex) : (u32) sizeof(Vertex),
+		.inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
+	};
+
+	out_input->attributes[0] = {
+		.location = 0,
+		.binding  = 0,
+		.format   = is_quantized ? VK_FORMAT_R16G16B16A16_UNORM : VK_FORMAT_R32G32B32_SFLOAT,
+		.offset   = is_quantized ? (u32) offsetof(Quantized_Vertex, position) : (u32) offsetof(Vertex, position),
+	};
+
+	out_input->attributes[1] = {
+		.location = 1,
+		.binding  = 0,
+		.format   = is_quantized ? VK_FORMAT_R16G16_SNORM : VK_FORMAT_R32G32B32_SFLOAT,
+		.offset   = is_quantized ? (u32) offsetof(Quantized_Vertex, normal) : (u32) offsetof(Vertex, normal),
+	};
+
+	out_input->attributes[2] = {
+		.location = 2,
+		.binding  = 0,
+		.format   = is_quantized ? VK_FORMAT_R16G16_SFLOAT : VK_FORMAT_R32G32_SFLOAT,
+		.offset   = is_quantized ? (u32) offsetof(Quantized_Vertex, uv) : (u32) offsetof(Vertex, uv),
+	};
+
+	out_input->state = {
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+
+		.vertexBindingDescriptionCount   = 1,
+		.pVertexBindingDescriptions      = &out_input->binding,
+		.vertexAttributeDescriptionCount = array_count(out_input->attributes),
+		.pVertexAttributeDescriptions    = out_input->attributes,
+	};
+
+
+	out_input->is_quantized = is_quantized ? VK_TRUE : VK_FALSE;
+
+	out_input->specialization_entry = {
+		.constantID = 0,
+		.offset     = 0,
+		.size       = sizeof(VkBool32),
+	};
+
+	out_input->specialization = {
+		.mapEntryCount = 1,
+		.pMapEntries   = &out_input->specialization_entry,
+		.dataSize      = sizeof(VkBool32),
+		.pData         = &out_input->is_quantized,
+	};
 }
 
 void Renderer::imm_load_shaders()
@@ -900,11 +1277,14 @@ void Renderer::imm_load_shaders()
 	imm_load_shader(U"imm_mask.vert.spirv", &imm_shaders.mask_vertex);
 	imm_load_shader(U"imm_mask.frag.spirv", &imm_shaders.mask_fragment);
 
-	imm_load_shader(U"imm_line.vert.spirv", &imm_shaders.line_vertex);
-	imm_load_shader(U"imm_line.frag.spirv", &imm_shaders.line_fragment);
+	imm_load_shader(U"mesh.vert.spirv", &mesh_shaders.mesh_vertex);
+	imm_load_shader(U"mesh.frag.spirv", &mesh_shaders.mesh_fragment);
+
+	imm_load_shader(U"mesh_culled.vert.spirv",        &mesh_shaders.mesh_culled_vertex);
+	imm_load_shader(U"gpu_cull.comp.spirv",           &mesh_shaders.gpu_cull);
+	imm_load_shader(U"gpu_compact_draws.comp.spirv",  &mesh_shaders.gpu_compact_draws);
+
 
-	imm_load_shader(U"imm_texture.vert.spirv", &imm_shaders.texture_vertex);
-	imm_load_shader(U"imm_texture.frag.spirv", &imm_shaders.texture_fragment);
 
 	Log(U"");
 }
@@ -916,6 +1296,9 @@ void Renderer::create_white_texture()
 	const static u8 white_texture_data[1] = { 255 };
 	
 	create_one_channel_texture((u8*) white_texture_data, 1, 1, &white_texture.image, &white_texture.image_view, &white_texture.image_sampler, &white_texture.image_memory);
+
+	white_texture.texture_index = imm_register_texture(white_texture.image_view, white_texture.image_sampler);
+	assert(white_texture.texture_index == 0);
 }
 
 void Renderer::create_one_channel_texture(u8* image_buffer, u32 width, u32 height, VkImage* out_image, VkImageView* out_image_view, VkSampler* out_sampler, Vulkan_Memory_Allocation* out_image_memory)
@@ -1026,31 +1409,36 @@ void Renderer::create_one_channel_texture(u8* image_buffer, u32 width, u32 heigh
     *out_image_memory  = image_memory;
 }
 
-void Renderer::make_sure_texture_is_on_gpu(Texture* texture)
+VkFormat Renderer::get_texture_vk_format(Texture_Format texture_format)
 {
-	ZoneScoped;
-
-	if (texture->is_on_gpu) return;
-
-	VkFormat format;
-
-	switch (texture->format)
+	switch (texture_format)
 	{
 		case Texture_Format::Monochrome:
-			format = OS_DARWIN ? VK_FORMAT_R8_UNORM : VK_FORMAT_R8_SRGB;
-			break;
-
-		case Texture_Format::RGB:			
-			format = OS_DARWIN ? VK_FORMAT_R8G8B8_UNORM : VK_FORMAT_R8G8B8_SRGB;
-			break;
+			return OS_DARWIN ? VK_FORMAT_R8_UNORM : VK_FORMAT_R8_SRGB;
 	
 		case Texture_Format::RGBA:			
-			format = OS_DARWIN ? VK_FORMAT_R8G8B8A8_UNORM : VK_FORMAT_R8G8B8A8_SRGB;
-			break;
+			return OS_DARWIN ? VK_FORMAT_R8G8B8A8_UNORM : VK_FORMAT_R8G8B8A8_SRGB;
+
+		case Texture_Format::BC1:
+			return OS_DARWIN ? VK_FORMAT_BC1_RGB_UNORM_BLOCK : VK_FORMAT_BC1_RGB_SRGB_BLOCK;
+
+		// There is no sRGB variant, import_texture() stores linear values instead.
+		case Texture_Format::BC4:
+			return VK_FORMAT_BC4_UNORM_BLOCK;
+
+		case Texture_Format::BC7:
+			return OS_DARWIN ? VK_FORMAT_BC7_UNORM_BLOCK : VK_FORMAT_BC7_SRGB_BLOCK;
 
 		default:
 			assert(false);
+			return VK_FORMAT_UNDEFINED;
 	}
+}
+
+// Image is left in UNDEFINED layout, pixels are in the staging buffer.
+void Renderer::create_texture_image(Texture* texture, VkFormat format, VkBuffer* out_staging_buffer, Vulkan_Memory_Allocation* out_staging_buffer_memory)
+{
+	ZoneScoped;
 
 	VkBuffer staging_buffer;
 	VkBufferCreateInfo create_info = {
@@ -1084,7 +1472,7 @@ void Renderer::make_sure_texture_is_on_gpu(Texture* texture)
     		.height = (u32) texture->height,
     		.depth  = 1,
     	},
-    	.mipLevels = 1,
+    	.mipLevels = (u32) texture->mip_levels_count,
     	.arrayLayers = 1,
     	.samples = VK_SAMPLE_COUNT_1_BIT,
     	.tiling = VK_IMAGE_TILING_OPTIMAL,
@@ -1096,24 +1484,27 @@ void Renderer::make_sure_texture_is_on_gpu(Texture* texture)
     vkCreateImage(device, &imageInfo, host_allocator, &image);
     image_memory = vulkan_memory_allocator.allocate_and_bind(image, (Vulkan_Memory_Allocation_Flags) 0, code_location());
 
-    transition_image_layout(image, format, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-	copy_buffer_to_image(staging_buffer, image, texture->width, texture->height);
-    transition_image_layout(image, format, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    texture->image        = image;
+    texture->image_memory = image_memory;
 
-	
-	vkDestroyBuffer(device, staging_buffer, host_allocator);
-    vulkan_memory_allocator.free(staging_buffer_memory);
+    *out_staging_buffer        = staging_buffer;
+    *out_staging_buffer_memory = staging_buffer_memory;
+}
 
+// Image must already be in SHADER_READ_ONLY layout, or be transitioned to it before anything samples it.
+void Renderer::make_texture_resident(Texture* texture, VkFormat format)
+{
+	ZoneScoped;
 
     VkImageViewCreateInfo image_view_info = {
     	.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
-    	.image = image,
+    	.image = texture->image,
     	.viewType = VK_IMAGE_VIEW_TYPE_2D,
     	.format = format,
     	.subresourceRange = {
     		.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
     		.baseMipLevel = 0,
-    		.levelCount = 1,
+    		.levelCount = (u32) texture->mip_levels_count,
     		.baseArrayLayer = 0,
     		.layerCount = 1,
     	}
@@ -1128,7 +1519,7 @@ void Renderer::make_sure_texture_is_on_gpu(Texture* texture)
     	.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
     	.magFilter = VK_FILTER_LINEAR,
     	.minFilter = VK_FILTER_LINEAR,
-    	.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+    	.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR,
     	.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
     	.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
     	.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
@@ -1136,6 +1527,8 @@ void Renderer::make_sure_texture_is_on_gpu(Texture* texture)
     	.maxAnisotropy = 16.0f,
     	.compareEnable = VK_FALSE,
     	.compareOp = VK_COMPARE_OP_ALWAYS,
+    	.minLod = 0.0f,
+    	.maxLod = (float) texture->mip_levels_count,
     	.borderColor = VK_BORDER_COLOR_INT_OPAQUE_WHITE,
     	.unnormalizedCoordinates = VK_FALSE,
 	};
@@ -1145,634 +1538,1353 @@ void Renderer::make_sure_texture_is_on_gpu(Texture* texture)
 
     texture->is_on_gpu = true;
 
-    texture->image         = image;
     texture->image_view    = image_view;
     texture->image_sampler = image_sampler;
-    texture->image_memory  = image_memory;
-}
 
+    texture->texture_index = imm_register_texture(image_view, image_sampler);
 
+    resident_textures.add(texture->name);
+}
 
-void Renderer::create_vk_instance()
+// Staging buffer holds mip levels one after another, same as Texture::image_buffer.
+//  Whole subresource copies are allowed regardless of queue's minImageTransferGranularity.
+void Renderer::record_texture_copy(VkCommandBuffer command_buffer, VkBuffer staging_buffer, VkImage image, Texture_Format format, int width, int height, int mip_levels_count)
 {
-	ZoneScoped;
+	VkBufferImageCopy regions[32];
+	assert(mip_levels_count <= 32);
 
-	VkApplicationInfo application_info;
-	VkInstanceCreateInfo instance_info;
+	u64 offset = 0;
 
-	application_info.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
-	application_info.pNext = NULL;
-	application_info.pApplicationName = mission_name.to_utf8(init_arena, NULL);
-	application_info.pEngineName = (char*) u8"хуй";
-	application_info.engineVersion = 228;
-	application_info.apiVersion = VK_API_VERSION_1_1;
+	for (int mip_level = 0; mip_level < mip_levels_count; mip_level++)
+	{
+		int level_width  = get_mip_level_dimension(width,  mip_level);
+		int level_height = get_mip_level_dimension(height, mip_level);
 
-	instance_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
-	instance_info.pNext = NULL;
-	instance_info.flags = 0;
-	instance_info.pApplicationInfo = &application_info;
+		regions[mip_level] = {
+			.bufferOffset = offset,
+			.bufferRowLength = 0,
+			.bufferImageHeight = 0,
 
+			.imageSubresource = {
+				.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+				.mipLevel = (u32) mip_level,
+				.baseArrayLayer = 0,
+				.layerCount = 1,
+			},
+			.imageOffset = { 0, 0, 0 },
+			.imageExtent = { (u32) level_width, (u32) level_height, 1 },
+		};
 
+		offset += get_mip_level_size(format, level_width, level_height);
+	}
 
-	Dynamic_Array<char*> extensions = make_array<char*>(32, init_arena);
+	vkCmdCopyBufferToImage(command_buffer, staging_buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mip_levels_count, regions);
+}
 
-#if OS_WINDOWS
-	extensions.add(VK_KHR_WIN32_SURFACE_EXTENSION_NAME);
-#elif OS_LINUX
-    extensions.add(VK_KHR_XLIB_SURFACE_EXTENSION_NAME);
-#elif OS_DARWIN
-	extensions.add(VK_EXT_METAL_SURFACE_EXTENSION_NAME);
-#endif
-	extensions.add(VK_KHR_SURFACE_EXTENSION_NAME);
+void Renderer::make_sure_texture_is_on_gpu(Texture* texture)
+{
+	ZoneScoped;
 
-	extensions.add("VK_KHR_get_physical_device_properties2");
+	texture->last_used_frame = frame_index;
 
-#if DEBUG
-	extensions.add("VK_EXT_debug_utils");
-#endif
+	if (texture->is_on_gpu) return;
 
+	// Would end up with two images, one of them leaked.
+	assert(!texture->is_upload_pending);
 
-	#ifdef NDEBUG
-	static_assert(!enable_validation_layers);
-	#endif
 
-	if (enable_validation_layers)
+	VkFormat format = get_texture_vk_format(texture->format);
+
+	VkBuffer                 staging_buffer;
+	Vulkan_Memory_Allocation staging_buffer_memory;
+	create_texture_image(texture, format, &staging_buffer, &staging_buffer_memory);
+
+    transition_image_layout(texture->image, format, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, texture->mip_levels_count);
+
 	{
+		VkCommandBuffer command_buffer = begin_single_command_buffer();
+		record_texture_copy(command_buffer, staging_buffer, texture->image, texture->format, texture->width, texture->height, texture->mip_levels_count);
+		end_single_command_buffer(command_buffer);
+	}
 
-		u32 available_validation_layers_count;
-		vkEnumerateInstanceLayerProperties(&available_validation_layers_count, NULL);
+    transition_image_layout(texture->image, format, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, texture->mip_levels_count);
 
-		Dynamic_Array<VkLayerProperties> available_validation_layers = make_array<VkLayerProperties>(available_validation_layers_count, init_arena);
-		
-		vkEnumerateInstanceLayerProperties(&available_validation_layers_count, available_validation_layers.data);
-		available_validation_layers.count = available_validation_layers_count;
+	vkDestroyBuffer(device, staging_buffer, host_allocator);
+    vulkan_memory_allocator.free(staging_buffer_memory);
 
+    make_texture_resident(texture, format);
+}
 
-		Dynamic_Array<const char*> c_validation_layer_strings = make_array<const char*>(32, init_arena);
+bool Renderer::stream_texture_to_gpu(Texture* texture)
+{
+	ZoneScoped;
 
-		for (const char* str : validation_layers)
-		{
-			bool found = false;
-			for (VkLayerProperties available_layer: available_validation_layers)
-			{
-				if (strcmp(available_layer.layerName, str) == 0)
-				{
-					found = true;
-					break;
-				}
-			}
+	texture->last_used_frame = frame_index;
 
-			if (!found)
-			{
-				log(ctx.logger, U"Validation layer '%' wasn't found. Skipping it.", str);
-				continue;
-			}
+	if (texture->is_on_gpu)         return true;
+	if (texture->is_upload_pending) return false;
 
+	// The rest waits for next frames, so a screen full of new textures doesn't allocate staging memory for all of them at once.
+	if (texture_upload_bytes_this_frame > 0 && texture_upload_bytes_this_frame + texture->size > max_texture_upload_bytes_per_frame) return false;
 
-			c_validation_layer_strings.add(str);
-		}
+	texture_upload_bytes_this_frame += texture->size;
 
-		instance_info.ppEnabledLayerNames = c_validation_layer_strings.data;
-		instance_info.enabledLayerCount = c_validation_layer_strings.count;
 
+	Texture_Upload upload = {
+		.texture_name     = texture->name,
+		.format           = get_texture_vk_format(texture->format),
+		.texture_format   = texture->format,
+		.width            = texture->width,
+		.height           = texture->height,
+		.mip_levels_count = texture->mip_levels_count,
+		.fence            = VK_NULL_HANDLE,
+	};
 
-		extensions.add(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
-	}
-	else
-	{
-		instance_info.enabledLayerCount = 0;
-	}
+	create_texture_image(texture, upload.format, &upload.staging_buffer, &upload.staging_buffer_memory);
 
+	upload.image        = texture->image;
+	upload.image_memory = texture->image_memory;
 
+	texture_uploads.add(upload);
 
-	instance_info.ppEnabledExtensionNames = extensions.data;
-	instance_info.enabledExtensionCount = extensions.count;
+	texture->is_upload_pending = true;
 
+	return false;
+}
 
+// Records copies of everything requested this frame into one command buffer for transfer queue.
+void Renderer::submit_texture_uploads()
+{
+	ZoneScoped;
 
-	VkResult result;
+	texture_upload_bytes_this_frame = 0;
 
-	result = vkCreateInstance(&instance_info, host_allocator, &instance);
-	if (result != VK_SUCCESS)
-		abort_the_mission(U"Failed to vkCreateInstance");
 
+	Dynamic_Array<Texture_Upload*> uploads = make_array<Texture_Upload*>(16, frame_allocator);
 
-	if (enable_validation_layers)
+	for (Texture_Upload& upload: texture_uploads)
 	{
-		PFN_vkCreateDebugUtilsMessengerEXT vkCreateDebugUtilsMessengerEXT = (PFN_vkCreateDebugUtilsMessengerEXT) vkGetInstanceProcAddr(instance, "vkCreateDebugUtilsMessengerEXT");
-		if (!vkCreateDebugUtilsMessengerEXT)
-			abort_the_mission(U"Failed to get pointer to vkCreateDebugUtilsMessengerEXT");
+		if (upload.fence == VK_NULL_HANDLE)
+		{
+			uploads.add(&upload);
+		}
+	}
 
-		VkDebugUtilsMessengerCreateInfoEXT createInfo = {};
-		createInfo.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT;
-		createInfo.messageSeverity = VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
-		createInfo.messageType = VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
-		createInfo.pUserData = NULL;
+	if (uploads.count == 0) return;
 
-		createInfo.pfnUserCallback = [](
-			VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
-			VkDebugUtilsMessageTypeFlagsEXT messageTypes,
-			const VkDebugUtilsMessengerCallbackDataEXT* pCallbackData,
-			void* pUserData) -> VkBool32
-		{
-			if (messageSeverity & VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT)
-			{
-				// assert(false);
-			}
-			log(ctx.logger, U"Vulkan reported\n   %\n", pCallbackData->pMessage);
 
-			return VK_FALSE;
-		};
+	VkCommandBufferAllocateInfo allocate_info = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+		.commandPool = transfer_command_pool,
+		.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+		.commandBufferCount = 1,
+	};
 
-		vkCreateDebugUtilsMessengerEXT(instance, &createInfo, host_allocator, &debug_messenger);
-	}
-}
+	VkCommandBuffer command_buffer;
+	if (vkAllocateCommandBuffers(device, &allocate_info, &command_buffer) != VK_SUCCESS)
+		abort_the_mission(U"Failed to vkAllocateCommandBuffers");
 
-void Renderer::find_suitable_gpu_and_create_device_and_queue()
-{
-	ZoneScoped;
+	VkCommandBufferBeginInfo begin_info = {
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+		.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+	};
 
-	VkResult result;
+	vkBeginCommandBuffer(command_buffer, &begin_info);
 
-	u32 devices_count;
-	vkEnumeratePhysicalDevices(instance, &devices_count, NULL);
-	if (devices_count == 0)
-		abort_the_mission(U"vkEnumeratePhysicalDevices returned 0, At least one device required to run.");
 
+	bool is_ownership_transferred = transfer_queue_family_index != queue_family_index;
 
-	Dynamic_Array<VkPhysicalDevice> vk_devices = make_array<VkPhysicalDevice>(devices_count, init_arena);
-	vk_devices.count = devices_count;
+	Dynamic_Array<VkImageMemoryBarrier> barriers = make_array<VkImageMemoryBarrier>(uploads.count, frame_allocator);
 
-	result = vkEnumeratePhysicalDevices(instance, &devices_count, vk_devices.data);
-	if (result != VK_SUCCESS)
-		abort_the_mission(U"Failed to vkEnumeratePhysicalDevices");
+	auto add_barrier = [&](Texture_Upload* upload, VkImageLayout old_layout, VkImageLayout new_layout, VkAccessFlags src_access, VkAccessFlags dst_access, u32 src_family, u32 dst_family)
+	{
+		barriers.add({
+			.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+			.pNext = NULL,
+
+			.srcAccessMask = src_access,
+			.dstAccessMask = dst_access,
 
+			.oldLayout = old_layout,
+			.newLayout = new_layout,
 
+			.srcQueueFamilyIndex = src_family,
+			.dstQueueFamilyIndex = dst_family,
 
+			.image = upload->image,
+			.subresourceRange = {
+				.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+				.baseMipLevel = 0,
+				.levelCount = (u32) upload->mip_levels_count,
+				.baseArrayLayer = 0,
+				.layerCount = 1,
+			},
+		});
+	};
 
 
-	for (VkPhysicalDevice& p_device : vk_devices)
+	for (Texture_Upload* upload: uploads)
 	{
-		VkPhysicalDeviceProperties device_properties;
-		VkPhysicalDeviceFeatures   device_features;
+		add_barrier(upload, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 0, VK_ACCESS_TRANSFER_WRITE_BIT, VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED);
+	}
 
-		vkGetPhysicalDeviceProperties(p_device, &device_properties);
-		vkGetPhysicalDeviceFeatures(p_device, &device_features);
+	vkCmdPipelineBarrier(command_buffer,
+		VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		0,
+		0, NULL,
+		0, NULL,
+		barriers.count, barriers.data);
 
-		String device_name = String::from_c_string((char*) device_properties.deviceName, init_arena);
 
-		log(ctx.logger, U"\nDevice '%'.\n  Driver version = %,\n  device type = %,\n  API version = %.%.%",
-			device_name,
-			device_properties.driverVersion,
-			device_properties.deviceType,
-			VK_VERSION_MAJOR(device_properties.apiVersion), VK_VERSION_MINOR(device_properties.apiVersion), VK_VERSION_PATCH(device_properties.apiVersion));
-		
-		defer{ log(ctx.logger, U"\n"); };
+	for (Texture_Upload* upload: uploads)
+	{
+		record_texture_copy(command_buffer, upload->staging_buffer, upload->image, upload->texture_format, upload->width, upload->height, upload->mip_levels_count);
+	}
 
-		// Use GPU with index 0.
-		// if (device_properties.deviceType != VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) continue;
 
+	// Release half of queue family ownership transfer, graphics queue acquires images in finish_texture_uploads().
+	//  Both halves describe the same layout transition, it's executed once.
+	if (is_ownership_transferred)
+	{
+		barriers.clear();
 
+		for (Texture_Upload* upload: uploads)
+		{
+			add_barrier(upload, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_ACCESS_TRANSFER_WRITE_BIT, 0, transfer_queue_family_index, queue_family_index);
+		}
 
-		u32 queue_family_count;
-		vkGetPhysicalDeviceQueueFamilyProperties(p_device, &queue_family_count, NULL);
-		
-		Dynamic_Array<VkQueueFamilyProperties> families = make_array<VkQueueFamilyProperties>(queue_family_count, init_arena);
-		
-		families.count = queue_family_count;
-		vkGetPhysicalDeviceQueueFamilyProperties(p_device, &queue_family_count, families.data);
+		vkCmdPipelineBarrier(command_buffer,
+			VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+			0,
+			0, NULL,
+			0, NULL,
+			barriers.count, barriers.data);
+	}
 
+	vkEndCommandBuffer(command_buffer);
 
 
+	VkFence fence;
 
-		for (VkQueueFamilyProperties& family_properties : families)
-		{
-			// @TODO: probably should've supported different queues for different task, but
-			//   for now just don't bother.
-			if ((family_properties.queueFlags & VK_QUEUE_GRAPHICS_BIT) &&
-				(family_properties.queueFlags & VK_QUEUE_COMPUTE_BIT) &&
-				(family_properties.queueFlags & VK_QUEUE_GRAPHICS_BIT))
-			{
-				queue_family_index = families.fast_pointer_index(&family_properties);
+	if (free_texture_upload_fences.count)
+	{
+		fence = *free_texture_upload_fences[free_texture_upload_fences.count - 1];
+		free_texture_upload_fences.count -= 1;
+	}
+	else
+	{
+		VkFenceCreateInfo fence_info = {
+			.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+			.pNext = NULL,
+			.flags = 0,
+		};
 
+		if (vkCreateFence(device, &fence_info, host_allocator, &fence) != VK_SUCCESS)
+			abort_the_mission(U"Failed to vkCreateFence");
+	}
 
-				VkDeviceQueueCreateInfo queue_create_info = {};
-				queue_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-				queue_create_info.queueFamilyIndex = queue_family_index;
-				queue_create_info.queueCount = 1;
 
-				float queue_priorities[] = { 1.0f };
-				queue_create_info.pQueuePriorities = queue_priorities;
+	VkSubmitInfo submit_info = {
+		.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+		.commandBufferCount = 1,
+		.pCommandBuffers = &command_buffer,
+	};
 
-				VkPhysicalDeviceFeatures deviceFeatures = {};
+	{
+		ZoneScopedN("vkQueueSubmit");
+		vkQueueSubmit(transfer_queue, 1, &submit_info, fence);
+	}
 
-			#if DEBUG
-				deviceFeatures.robustBufferAccess = VK_TRUE;
-			#endif
+	for (Texture_Upload* upload: uploads)
+	{
+		upload->fence = fence;
+	}
 
+	texture_upload_batches.add({
+		.command_buffer = command_buffer,
+		.fence          = fence,
+	});
+}
 
+// Polls transfer queue, textures of completed batches become usable by this frame's draws.
+void Renderer::finish_texture_uploads()
+{
+	ZoneScoped;
 
-				VkDeviceCreateInfo device_create_info = {};
-				device_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-				device_create_info.pQueueCreateInfos = &queue_create_info;
-				device_create_info.queueCreateInfoCount = 1;
-				device_create_info.pEnabledFeatures = &deviceFeatures;
+	bool is_ownership_transferred = transfer_queue_family_index != queue_family_index;
 
+	Dynamic_Array<VkImageMemoryBarrier> barriers = make_array<VkImageMemoryBarrier>(16, frame_allocator);
 
-				Dynamic_Array<char*> device_extensions = make_array<char*>(32, init_arena);
-				device_extensions.add(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
-				device_extensions.add("VK_EXT_memory_budget");
-				device_extensions.add("VK_KHR_dedicated_allocation");
-				device_extensions.add("VK_KHR_get_memory_requirements2");
 
-			#if DEBUG
+	for (int batch_index = 0; batch_index < texture_upload_batches.count; batch_index++)
+	{
+		Texture_Upload_Batch batch = *texture_upload_batches[batch_index];
 
-				u32 properties_count;
-				vkEnumerateDeviceExtensionProperties(p_device, NULL, &properties_count, NULL);
+		if (vkGetFenceStatus(device, batch.fence) != VK_SUCCESS) continue;
 
-				Dynamic_Array<VkExtensionProperties> fucking_bullshit = make_array<VkExtensionProperties>(properties_count, init_arena);
-				vkEnumerateDeviceExtensionProperties(p_device, NULL, &properties_count, fucking_bullshit.data);
 
-				fucking_bullshit.count = properties_count;
+		for (int i = 0; i < texture_uploads.count; i++)
+		{
+			Texture_Upload upload = *texture_uploads[i];
 
-				for (auto& ext : fucking_bullshit)
-				{
-					if (!strcmp(ext.extensionName, VK_EXT_DEBUG_MARKER_EXTENSION_NAME))
-					{
-						is_debug_marker_extension_available = true;
-					}
-				}
+			if (upload.fence != batch.fence) continue;
 
-				if (is_debug_marker_extension_available)
-				{
-					device_extensions.add(VK_EXT_DEBUG_MARKER_EXTENSION_NAME);
-				}
-			#endif
+			texture_uploads.remove_at_index(i);
+			i -= 1;
 
 
+			vkDestroyBuffer(device, upload.staging_buffer, host_allocator);
+			vulkan_memory_allocator.free(upload.staging_buffer_memory);
 
 
-				device_create_info.ppEnabledExtensionNames = device_extensions.data;
-				device_create_info.enabledExtensionCount   = device_extensions.count;
+			Texture* texture = asset_storage.find_texture(upload.texture_name);
+			if (!texture)
+			{
+				// Nothing has ever sampled it.
+				vkDestroyImage(device, upload.image, host_allocator);
+				vulkan_memory_allocator.free(upload.image_memory);
+				continue;
+			}
 
-				physical_device = p_device;
+			// Acquire half of ownership transfer, or just a layout transition if transfer queue is from graphics family.
+			barriers.add({
+				.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+				.pNext = NULL,
 
-				{
-					ZoneScopedN("vkCreateDevice");
-					result = vkCreateDevice(p_device, &device_create_info, host_allocator, &device);
-					if (result != VK_SUCCESS)
-						abort_the_mission(U"Failed to create vkCreateDevice on: % with queue family index: %", device_name, queue_family_index);
-				}
+				.srcAccessMask = (VkAccessFlags) (is_ownership_transferred ? 0 : VK_ACCESS_TRANSFER_WRITE_BIT),
+				.dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
 
+				.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+				.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
 
-				{
-					ZoneScopedN("vkGetDeviceQueue");
-					vkGetDeviceQueue(device, queue_family_index, 0, &device_queue);
-				}
+				.srcQueueFamilyIndex = is_ownership_transferred ? transfer_queue_family_index : VK_QUEUE_FAMILY_IGNORED,
+				.dstQueueFamilyIndex = is_ownership_transferred ? queue_family_index          : VK_QUEUE_FAMILY_IGNORED,
 
-				VkCommandPoolCreateInfo poolInfo = {};
-				poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-				poolInfo.queueFamilyIndex = queue_family_index;
-				poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+				.image = upload.image,
+				.subresourceRange = {
+					.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+					.baseMipLevel = 0,
+					.levelCount = (u32) upload.mip_levels_count,
+					.baseArrayLayer = 0,
+					.layerCount = 1,
+				},
+			});
 
-				{
-					ZoneScopedN("vkCreateCommandPool");
-					if (vkCreateCommandPool(device, &poolInfo, host_allocator, &command_pool) != VK_SUCCESS)
-						abort_the_mission(U"Failed to vkCreateCommandPool");
-				}
+			texture->is_upload_pending = false;
+			make_texture_resident(texture, upload.format);
+		}
 
-			#if DEBUG
-				if (is_debug_marker_extension_available)
-				{
-					pfnDebugMarkerSetObjectTag = (PFN_vkDebugMarkerSetObjectTagEXT)vkGetDeviceProcAddr(device, "vkDebugMarkerSetObjectTagEXT");
-					pfnDebugMarkerSetObjectName = (PFN_vkDebugMarkerSetObjectNameEXT)vkGetDeviceProcAddr(device, "vkDebugMarkerSetObjectNameEXT");
-					pfnCmdDebugMarkerBegin = (PFN_vkCmdDebugMarkerBeginEXT)vkGetDeviceProcAddr(device, "vkCmdDebugMarkerBeginEXT");
-					pfnCmdDebugMarkerEnd = (PFN_vkCmdDebugMarkerEndEXT)vkGetDeviceProcAddr(device, "vkCmdDebugMarkerEndEXT");
-					pfnCmdDebugMarkerInsert = (PFN_vkCmdDebugMarkerInsertEXT)vkGetDeviceProcAddr(device, "vkCmdDebugMarkerInsertEXT");
-				}
-			#endif
 
-				return;
-			}
-		}
+		vkFreeCommandBuffers(device, transfer_command_pool, 1, &batch.command_buffer);
+
+		vkResetFences(device, 1, &batch.fence);
+		free_texture_upload_fences.add(batch.fence);
+
+		texture_upload_batches.remove_at_index(batch_index);
+		batch_index -= 1;
 	}
 
-	abort_the_mission(U"Failed to locate suitable GPU");
-}
 
+	if (barriers.count)
+	{
+		vkCmdPipelineBarrier(main_command_buffer,
+			is_ownership_transferred ? VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT : VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+			0,
+			0, NULL,
+			0, NULL,
+			barriers.count, barriers.data);
+	}
+
+	TracyPlot("Texture uploads in flight", (s64) texture_uploads.count);
+}
 
-VkDescriptorSet Renderer::imm_get_descriptor_set(VkDescriptorSetLayout descriptor_set_layout)
+void Renderer::make_sure_mesh_is_on_gpu(Mesh* mesh)
 {
-	auto create_new_pool = [&]()
-	{
-		VkDescriptorPoolSize pool_sizes[] = {
-			{
-				.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-				.descriptorCount = 1
-			},
-			{
-				.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-				.descriptorCount = 1
-			},
-		};
+	mesh->last_used_frame = frame_index;
 
-		VkDescriptorPoolCreateInfo pool_info{};
-		pool_info.flags = 0;
-		pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-		pool_info.poolSizeCount = array_count(pool_sizes);
-		pool_info.pPoolSizes = pool_sizes;
-		pool_info.maxSets = 256;
+	if (mesh->is_on_gpu) return;
 
+	mesh->allocate_on_gpu();
 
-		if (vkCreateDescriptorPool(device, &pool_info, host_allocator, imm_descriptor_pools.add()) != VK_SUCCESS)
-			abort_the_mission(U"Failed to vkCreateDescriptorPool");
-	};
+	resident_meshes.add(mesh->name);
+}
+
+
+bool Renderer::is_resource_cold(u64 last_used_frame)
+{
+	return last_used_frame + max_frames_in_flight <= frame_index;
+}
+
+void Renderer::evict_texture(Texture* texture)
+{
+	ZoneScoped;
 
+	if (!texture->is_on_gpu) return;
 
-	if (imm_descriptor_pools.count == 0)
+
+	if (is_resource_cold(texture->last_used_frame))
 	{
-		create_new_pool();
+		vkDestroySampler(device, texture->image_sampler, host_allocator);
+		vkDestroyImageView(device, texture->image_view, host_allocator);
+		vkDestroyImage(device, texture->image, host_allocator);
+		vulkan_memory_allocator.free(texture->image_memory);
+	}
+	else
+	{
+		current_frame_slot()->retired_images.add({
+			.image         = texture->image,
+			.image_view    = texture->image_view,
+			.image_sampler = texture->image_sampler,
+			.memory        = texture->image_memory,
+		});
 	}
 
+	imm_release_texture_index(texture->texture_index);
 
-	VkDescriptorSetAllocateInfo allocate_info = {
-		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
-		.pNext = NULL,
-		.descriptorPool = *imm_descriptor_pools[imm_current_descriptor_pool],
-		.descriptorSetCount = 1,
-		.pSetLayouts = &descriptor_set_layout,
-	};
+	texture->is_on_gpu = false;
 
-	VkDescriptorSet descriptor_set;
 
-	VkResult result = vkAllocateDescriptorSets(device, &allocate_info, &descriptor_set);
-	if (result != VK_SUCCESS)
+	for (int i = 0; i < resident_textures.count; i++)
 	{
-		imm_current_descriptor_pool += 1;
-		if (imm_current_descriptor_pool == imm_descriptor_pools.count)
+		if (*resident_textures[i] == texture->name)
 		{
-			create_new_pool();
+			resident_textures.remove_at_index(i);
+			break;
 		}
+	}
+}
 
-		allocate_info.descriptorPool = *imm_descriptor_pools[imm_current_descriptor_pool];
+void Renderer::evict_mesh(Mesh* mesh)
+{
+	ZoneScoped;
 
-		result = vkAllocateDescriptorSets(device, &allocate_info, &descriptor_set);
-		if (result != VK_SUCCESS)
-			abort_the_mission(U"Failed to vkAllocateDescriptorSets");
+	if (!mesh->is_on_gpu) return;
+
+
+	if (is_resource_cold(mesh->last_used_frame))
+	{
+		geometry_manager.free(mesh->vertex_allocation);
+		geometry_manager.free(mesh->index_allocation);
+	}
+	else
+	{
+		geometry_manager.free_after_frame(mesh->vertex_allocation);
+		geometry_manager.free_after_frame(mesh->index_allocation);
 	}
 
-	return descriptor_set;
-}
+	mesh->vertex_allocation = {};
+	mesh->index_allocation  = {};
 
+	mesh->is_on_gpu = false;
 
 
+	for (int i = 0; i < resident_meshes.count; i++)
+	{
+		if (*resident_meshes[i] == mesh->name)
+		{
+			resident_meshes.remove_at_index(i);
+			break;
+		}
+	}
+}
 
-void Renderer::create_main_framebuffer()
+u64 Renderer::evict_cold_resources(u64 bytes_to_free)
 {
 	ZoneScoped;
 
-	main_color_image_format         = VK_FORMAT_R8G8B8A8_UNORM;
-	main_depth_stencil_image_format = VK_FORMAT_D24_UNORM_S8_UINT;
+	u64 freed = 0;
 
+	// Least recently used first.
+	while (freed < bytes_to_free)
 	{
-		VkImageCreateInfo i;
-		i.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+		Texture* oldest_texture = NULL;
+		Mesh*    oldest_mesh    = NULL;
 
-		i.pNext = NULL;
-		i.flags = 0;
-		i.imageType = VK_IMAGE_TYPE_2D;
-		i.format = main_color_image_format;
+		u64 oldest_frame = u64_max;
 
-		i.extent.width  = renderer.width;
-		i.extent.height = renderer.height;
-		i.extent.depth = 1;
+		for (Unicode_String name: resident_textures)
+		{
+			Texture* texture = asset_storage.find_texture(name);
 
-		i.mipLevels = 1;
-		i.arrayLayers = 1;
-		i.samples = msaa_samples_count;
+			if (texture && is_resource_cold(texture->last_used_frame) && texture->last_used_frame < oldest_frame)
+			{
+				oldest_texture = texture;
+				oldest_frame   = texture->last_used_frame;
+			}
+		}
 
-		i.tiling = VK_IMAGE_TILING_OPTIMAL;
-		i.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
-		i.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+		for (Unicode_String name: resident_meshes)
+		{
+			Mesh* mesh = asset_storage.find_mesh(name);
 
-		i.queueFamilyIndexCount = 1;
-		i.pQueueFamilyIndices = &queue_family_index;
-
-		i.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED; 
-
-		vkCreateImage(device, &i, host_allocator, &main_color_image);
-
-		main_color_image_memory = vulkan_memory_allocator.allocate_and_bind(main_color_image, VULKAN_MEMORY_ONLY_DEVICE_MEMORY, code_location());
+			if (mesh && is_resource_cold(mesh->last_used_frame) && mesh->last_used_frame < oldest_frame)
+			{
+				oldest_texture = NULL;
+				oldest_mesh    = mesh;
+				oldest_frame   = mesh->last_used_frame;
+			}
+		}
 
 
+		if (oldest_texture)
+		{
+			freed += oldest_texture->image_memory.size;
+			evict_texture(oldest_texture);
+		}
+		else if (oldest_mesh)
+		{
+			freed += oldest_mesh->vertex_allocation.size + oldest_mesh->index_allocation.size;
+			evict_mesh(oldest_mesh);
+		}
+		else
+		{
+			break;
+		}
+	}
 
-		i.format = main_depth_stencil_image_format;
-		i.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+	if (freed)
+	{
+		Log(U"Evicted % of cold textures and meshes", size_to_string(freed, frame_allocator));
+	}
 
-		vkCreateImage(device, &i, host_allocator, &main_depth_stencil_image);
+	return freed;
+}
 
-		main_depth_stencil_image_memory = vulkan_memory_allocator.allocate_and_bind(main_depth_stencil_image, VULKAN_MEMORY_ONLY_DEVICE_MEMORY, code_location());
-	}
+// Called between frames, after current frame slot is released.
+void Renderer::update_residency()
+{
+	ZoneScoped;
 
+	if (frame_index % residency_update_interval == 0)
 	{
-		VkImageViewCreateInfo i;
-		i.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-
-		i.pNext = NULL;
-		i.flags = 0;
+		vulkan_memory_allocator.update_memory_usage_information();
 
-		i.image = main_color_image;
-		i.viewType = VK_IMAGE_VIEW_TYPE_2D;
-		i.format = main_color_image_format;
+		u64 budget = vulkan_memory_allocator.device_local_memory_budget() / 100 * u64(max(1, min(settings.video_memory_budget_percent, 100)));
+		u64 used   = vulkan_memory_allocator.device_local_memory_used();
 
-		i.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
-		i.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
-		i.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
-		i.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
+		if (budget && used > budget)
+		{
+			evict_cold_resources(used - budget);
+		}
+	}
 
-		i.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		
-		i.subresourceRange.baseMipLevel = 0;
-		i.subresourceRange.levelCount = 1;
 
-		i.subresourceRange.baseArrayLayer = 0;
-		i.subresourceRange.layerCount = 1;
+	vulkan_memory_allocator.update_defragmentation();
 
-		vkCreateImageView(device, &i, host_allocator, &main_color_image_view);
+	if (vulkan_memory_allocator.draining_pool_index == -1) return;
 
 
+	// Move a few allocations out of the draining pool, uploading again from CPU copies lands them elsewhere.
+	//  Resources used this frame get retired images/buffers, so frames in flight keep valid ones.
+	//  Uploading might evict cold resources and reorder resident_textures, so the ones to move are picked first.
+	Dynamic_Array<Texture*> textures_to_move = make_array<Texture*>(max_residency_moves_per_frame, frame_allocator);
 
+	for (Unicode_String name: resident_textures)
+	{
+		if (textures_to_move.count >= max_residency_moves_per_frame) break;
 
-		i.image = main_depth_stencil_image;
-		i.format = main_depth_stencil_image_format;
-		i.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT;
+		Texture* texture = asset_storage.find_texture(name);
 
-		vkCreateImageView(device, &i, host_allocator, &main_depth_stencil_image_view);
+		if (texture && vulkan_memory_allocator.is_in_draining_pool(texture->image_memory))
+		{
+			textures_to_move.add(texture);
+		}
 	}
 
+	for (Texture* texture: textures_to_move)
 	{
-		VkAttachmentDescription color_attachment =
-		{
-			.flags = 0,
-			.format = main_color_image_format,
-			.samples = msaa_samples_count,
-
-			.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
-			.storeOp = VK_ATTACHMENT_STORE_OP_STORE,
-			
-			.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
-			.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
-			
-			.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-			.finalLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, // We will copy this image to swapchain.
-		};
+		// An earlier upload might have evicted it already.
+		if (!texture->is_on_gpu || !vulkan_memory_allocator.is_in_draining_pool(texture->image_memory)) continue;
 
-		VkAttachmentDescription depth_stencil_attachment =
-		{
-			.flags = 0,
-			.format = main_depth_stencil_image_format,
-			.samples = msaa_samples_count,
+		bool was_cold = is_resource_cold(texture->last_used_frame);
 
-			.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
-			.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+		evict_texture(texture);
 
-			.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
-			.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+		// Cold ones come back by themselves when they are needed.
+		if (!was_cold)
+		{
+			make_sure_texture_is_on_gpu(texture);
+		}
+	}
 
-			.initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
-			.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
-		};
+	// Meshes live in geometry_manager's dedicated buffers, those are never in a draining pool.
+}
 
-		VkAttachmentDescription attachments[] = { color_attachment, depth_stencil_attachment };
 
-		VkAttachmentReference color_attachment_references[] = {
-			{
-				.attachment = 0,
-				.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-			}
-		};
 
-		VkAttachmentReference depth_stencil_attachment_reference = {
-			.attachment = 1,
-			.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
-		};
+void Renderer::create_vk_instance()
+{
+	ZoneScoped;
 
+	VkApplicationInfo application_info;
+	VkInstanceCreateInfo instance_info;
 
-		VkSubpassDescription subpasses[] = {
-			{
-				.flags = 0,
-				.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
+	application_info.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+	application_info.pNext = NULL;
+	application_info.pApplicationName = mission_name.to_utf8(init_arena, NULL);
+	application_info.pEngineName = (char*) u8"хуй";
+	application_info.engineVersion = 228;
+	application_info.apiVersion = VK_API_VERSION_1_1;
 
-				.inputAttachmentCount = 0,
+	instance_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+	instance_info.pNext = NULL;
+	instance_info.flags = 0;
+	instance_info.pApplicationInfo = &application_info;
 
-				.colorAttachmentCount = array_count(color_attachment_references),
-				.pColorAttachments = color_attachment_references,
 
-				.pResolveAttachments = NULL,
 
-				.pDepthStencilAttachment = &depth_stencil_attachment_reference,
+	Dynamic_Array<char*> extensions = make_array<char*>(32, init_arena);
 
-				.preserveAttachmentCount = 0,
-			}
-		};
+#if OS_WINDOWS
+	extensions.add(VK_KHR_WIN32_SURFACE_EXTENSION_NAME);
+#elif OS_LINUX
+    extensions.add(VK_KHR_XLIB_SURFACE_EXTENSION_NAME);
+#elif OS_DARWIN
+	extensions.add(VK_EXT_METAL_SURFACE_EXTENSION_NAME);
+#endif
+	extensions.add(VK_KHR_SURFACE_EXTENSION_NAME);
 
-		VkSubpassDependency self_dependency = {
-			.srcSubpass = 0,
-			.dstSubpass = 0,
+	extensions.add("VK_KHR_get_physical_device_properties2");
 
-			.srcStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT,
-			.dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT,
+#if DEBUG
+	extensions.add("VK_EXT_debug_utils");
+#endif
 
-			.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-			.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT, 
 
-			.dependencyFlags = 0,
-		};
+	#ifdef NDEBUG
+	static_assert(!enable_validation_layers);
+	#endif
 
-		VkRenderPassCreateInfo i = {
-			.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
-			.pNext = NULL,
-			.flags = 0,
+	if (enable_validation_layers)
+	{
 
-			.attachmentCount = 2,
-			.pAttachments = attachments,
-			
-			.subpassCount = array_count(subpasses),
-			.pSubpasses = subpasses,
+		u32 available_validation_layers_count;
+		vkEnumerateInstanceLayerProperties(&available_validation_layers_count, NULL);
 
-			.dependencyCount = 0,
-			.pDependencies = &self_dependency,
-		};
+		Dynamic_Array<VkLayerProperties> available_validation_layers = make_array<VkLayerProperties>(available_validation_layers_count, init_arena);
+		
+		vkEnumerateInstanceLayerProperties(&available_validation_layers_count, available_validation_layers.data);
+		available_validation_layers.count = available_validation_layers_count;
 
-		vkCreateRenderPass(device, &i, host_allocator, &main_render_pass);
-	}
 
-	{
+		Dynamic_Array<const char*> c_validation_layer_strings = make_array<const char*>(32, init_arena);
 
-		VkImageView attachments[] = { main_color_image_view, main_depth_stencil_image_view };
+		for (const char* str : validation_layers)
+		{
+			bool found = false;
+			for (VkLayerProperties available_layer: available_validation_layers)
+			{
+				if (strcmp(available_layer.layerName, str) == 0)
+				{
+					found = true;
+					break;
+				}
+			}
 
+			if (!found)
+			{
+				log(ctx.logger, U"Validation layer '%' wasn't found. Skipping it.", str);
+				continue;
+			}
 
-		VkFramebufferCreateInfo i = {
-			.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
-			.pNext = NULL,
-			.flags = 0,
 
-			.renderPass = main_render_pass,
+			c_validation_layer_strings.add(str);
+		}
 
-			.attachmentCount = array_count(attachments),
-			.pAttachments = attachments,
+		instance_info.ppEnabledLayerNames = c_validation_layer_strings.data;
+		instance_info.enabledLayerCount = c_validation_layer_strings.count;
 
-			.width  = (u32) renderer.width,
-			.height = (u32) renderer.height,
-			.layers = 1,
-		};
 
-		vkCreateFramebuffer(device, &i, host_allocator, &main_framebuffer);
+		extensions.add(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
 	}
-
+	else
 	{
-		VkCommandBufferAllocateInfo i = {
-			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-			.pNext = NULL,
-			
-			.commandPool = command_pool,
-			
-			.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-			.commandBufferCount = 1,
-		};
-
-		vkAllocateCommandBuffers(device, &i, &main_command_buffer);
+		instance_info.enabledLayerCount = 0;
 	}
-}
-
 
 
-void Renderer::create_swapchain()
-{
-	Arena_Allocator arena;
-	create_arena_allocator(&arena, c_allocator, 4096);
-	defer { arena.free(); };
 
+	instance_info.ppEnabledExtensionNames = extensions.data;
+	instance_info.enabledExtensionCount = extensions.count;
 
-	swapchain_is_dead = false;
 
-	ZoneScoped;
 
 	VkResult result;
 
-	VkBool32 does_support_present;
-	result = vkGetPhysicalDeviceSurfaceSupportKHR(physical_device, queue_family_index, surface, &does_support_present);
+	result = vkCreateInstance(&instance_info, host_allocator, &instance);
 	if (result != VK_SUCCESS)
-		abort_the_mission(U"Failed to vkGetPhysicalDeviceSurfaceSupportKHR");
-
-	if (!does_support_present)
-		abort_the_mission(U"Vulkan surface doesn't support present");
-
+		abort_the_mission(U"Failed to vkCreateInstance");
 
-	VkSurfaceCapabilitiesKHR surface_capabilities;
-	result = vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physical_device, surface, &surface_capabilities);
-	if (result != VK_SUCCESS)
-		abort_the_mission(U"Failed to vkGetPhysicalDeviceSurfaceCapabilitiesKHR");
+
+	if (enable_validation_layers)
+	{
+		PFN_vkCreateDebugUtilsMessengerEXT vkCreateDebugUtilsMessengerEXT = (PFN_vkCreateDebugUtilsMessengerEXT) vkGetInstanceProcAddr(instance, "vkCreateDebugUtilsMessengerEXT");
+		if (!vkCreateDebugUtilsMessengerEXT)
+			abort_the_mission(U"Failed to get pointer to vkCreateDebugUtilsMessengerEXT");
+
+		VkDebugUtilsMessengerCreateInfoEXT createInfo = {};
+		createInfo.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT;
+		createInfo.messageSeverity = VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT;
+		createInfo.messageType = VK_DEBUG_UTILS_MESSAGE_TYPE_GENERAL_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_TYPE_VALIDATION_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_TYPE_PERFORMANCE_BIT_EXT;
+		createInfo.pUserData = NULL;
+
+		createInfo.pfnUserCallback = [](
+			VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
+			VkDebugUtilsMessageTypeFlagsEXT messageTypes,
+			const VkDebugUtilsMessengerCallbackDataEXT* pCallbackData,
+			void* pUserData) -> VkBool32
+		{
+			if (messageSeverity & VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT)
+			{
+				// assert(false);
+			}
+			log(ctx.logger, U"Vulkan reported\n   %\n", pCallbackData->pMessage);
+
+			return VK_FALSE;
+		};
+
+		vkCreateDebugUtilsMessengerEXT(instance, &createInfo, host_allocator, &debug_messenger);
+	}
+}
+
+void Renderer::find_suitable_gpu_and_create_device_and_queue()
+{
+	ZoneScoped;
+
+	VkResult result;
+
+	u32 devices_count;
+	vkEnumeratePhysicalDevices(instance, &devices_count, NULL);
+	if (devices_count == 0)
+		abort_the_mission(U"vkEnumeratePhysicalDevices returned 0, At least one device required to run.");
+
+
+	Dynamic_Array<VkPhysicalDevice> vk_devices = make_array<VkPhysicalDevice>(devices_count, init_arena);
+	vk_devices.count = devices_count;
+
+	result = vkEnumeratePhysicalDevices(instance, &devices_count, vk_devices.data);
+	if (result != VK_SUCCESS)
+		abort_the_mission(U"Failed to vkEnumeratePhysicalDevices");
+
+
+
+
+
+	for (VkPhysicalDevice& p_device : vk_devices)
+	{
+		VkPhysicalDeviceProperties device_properties;
+		VkPhysicalDeviceFeatures   device_features;
+
+		vkGetPhysicalDeviceProperties(p_device, &device_properties);
+		vkGetPhysicalDeviceFeatures(p_device, &device_features);
+
+		String device_name = String::from_c_string((char*) device_properties.deviceName, init_arena);
+
+		log(ctx.logger, U"\nDevice '%'.\n  Driver version = %,\n  device type = %,\n  API version = %.%.%",
+			device_name,
+			device_properties.driverVersion,
+			device_properties.deviceType,
+			VK_VERSION_MAJOR(device_properties.apiVersion), VK_VERSION_MINOR(device_properties.apiVersion), VK_VERSION_PATCH(device_properties.apiVersion));
+		
+		defer{ log(ctx.logger, U"\n"); };
+
+
+		// Texture table relies on descriptor indexing, see create_texture_table().
+		VkPhysicalDeviceDescriptorIndexingFeaturesEXT supported_indexing_features = {
+			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT,
+		};
+		{
+			VkPhysicalDeviceFeatures2 features_2 = {
+				.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+				.pNext = &supported_indexing_features,
+			};
+			vkGetPhysicalDeviceFeatures2(p_device, &features_2);
+		}
+
+		if (!supported_indexing_features.shaderSampledImageArrayNonUniformIndexing ||
+			!supported_indexing_features.descriptorBindingSampledImageUpdateAfterBind ||
+			!supported_indexing_features.descriptorBindingUpdateUnusedWhilePending ||
+			!supported_indexing_features.descriptorBindingPartiallyBound ||
+			!supported_indexing_features.runtimeDescriptorArray)
+		{
+			log(ctx.logger, U"Device '%' doesn't support required descriptor indexing features", device_name);
+			continue;
+		}
+
+		// Use GPU with index 0.
+		// if (device_properties.deviceType != VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) continue;
+
+
+
+		u32 queue_family_count;
+		vkGetPhysicalDeviceQueueFamilyProperties(p_device, &queue_family_count, NULL);
+		
+		Dynamic_Array<VkQueueFamilyProperties> families = make_array<VkQueueFamilyProperties>(queue_family_count, init_arena);
+		
+		families.count = queue_family_count;
+		vkGetPhysicalDeviceQueueFamilyProperties(p_device, &queue_family_count, families.data);
+
+
+
+
+		for (VkQueueFamilyProperties& family_properties : families)
+		{
+			// Everything but texture streaming goes through one graphics queue.
+			if ((family_properties.queueFlags & VK_QUEUE_GRAPHICS_BIT) &&
+				(family_properties.queueFlags & VK_QUEUE_COMPUTE_BIT) &&
+				(family_properties.queueFlags & VK_QUEUE_GRAPHICS_BIT))
+			{
+				queue_family_index = families.fast_pointer_index(&family_properties);
+
+
+				// Texture streaming queue. Transfer-only family (usually a DMA engine) is preferred,
+				//  then async compute family, then second queue of graphics family, then graphics queue itself.
+				transfer_queue_family_index = queue_family_index;
+				u32 transfer_queue_index    = 0;
+
+				{
+					int best_score = 0;
+
+					for (VkQueueFamilyProperties& other_family : families)
+					{
+						u32 other_family_index = families.fast_pointer_index(&other_family);
+
+						if (other_family.queueFlags & VK_QUEUE_GRAPHICS_BIT) continue;
+
+						// Compute families support transfers even if they don't report it.
+						int score = 0;
+						if (other_family.queueFlags & VK_QUEUE_COMPUTE_BIT)       score = 1;
+						else if (other_family.queueFlags & VK_QUEUE_TRANSFER_BIT) score = 2;
+
+						if (score > best_score)
+						{
+							best_score = score;
+							transfer_queue_family_index = other_family_index;
+						}
+					}
+
+					if (transfer_queue_family_index == queue_family_index && family_properties.queueCount > 1)
+					{
+						transfer_queue_index = 1;
+					}
+				}
+
+
+				float queue_priorities[] = { 1.0f, 0.5f };
+
+				VkDeviceQueueCreateInfo queue_create_infos[2] = {};
+				u32 queue_create_infos_count = 1;
+
+				queue_create_infos[0].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+				queue_create_infos[0].queueFamilyIndex = queue_family_index;
+				queue_create_infos[0].queueCount = transfer_queue_family_index == queue_family_index ? transfer_queue_index + 1 : 1;
+				queue_create_infos[0].pQueuePriorities = queue_priorities;
+
+				if (transfer_queue_family_index != queue_family_index)
+				{
+					queue_create_infos[1].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+					queue_create_infos[1].queueFamilyIndex = transfer_queue_family_index;
+					queue_create_infos[1].queueCount = 1;
+					queue_create_infos[1].pQueuePriorities = &queue_priorities[1];
+
+					queue_create_infos_count = 2;
+				}
+
+				VkPhysicalDeviceFeatures deviceFeatures = {};
+
+				// Without it textures are imported uncompressed.
+				is_bc_compression_supported = device_features.textureCompressionBC;
+				deviceFeatures.textureCompressionBC = device_features.textureCompressionBC;
+
+				// Without them levels are culled on CPU.
+				gpu_culling.is_supported = device_features.multiDrawIndirect && device_features.drawIndirectFirstInstance;
+				deviceFeatures.multiDrawIndirect         = device_features.multiDrawIndirect;
+				deviceFeatures.drawIndirectFirstInstance = device_features.drawIndirectFirstInstance;
+
+			#if DEBUG
+				deviceFeatures.robustBufferAccess = VK_TRUE;
+			#endif
+
+
+
+				VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexing_features = {
+					.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT,
+					.pNext = NULL,
+					.shaderSampledImageArrayNonUniformIndexing    = VK_TRUE,
+					.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE,
+					.descriptorBindingUpdateUnusedWhilePending    = VK_TRUE,
+					.descriptorBindingPartiallyBound              = VK_TRUE,
+					.runtimeDescriptorArray                       = VK_TRUE,
+				};
+
+
+				VkDeviceCreateInfo device_create_info = {};
+				device_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+				device_create_info.pNext = &indexing_features;
+				device_create_info.pQueueCreateInfos = queue_create_infos;
+				device_create_info.queueCreateInfoCount = queue_create_infos_count;
+				device_create_info.pEnabledFeatures = &deviceFeatures;
+
+
+				Dynamic_Array<char*> device_extensions = make_array<char*>(32, init_arena);
+				device_extensions.add(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+				device_extensions.add("VK_EXT_memory_budget");
+				device_extensions.add("VK_KHR_dedicated_allocation");
+				device_extensions.add("VK_KHR_get_memory_requirements2");
+				device_extensions.add(VK_KHR_MAINTENANCE3_EXTENSION_NAME);
+				device_extensions.add(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+
+
+				u32 properties_count;
+				vkEnumerateDeviceExtensionProperties(p_device, NULL, &properties_count, NULL);
+
+				Dynamic_Array<VkExtensionProperties> fucking_bullshit = make_array<VkExtensionProperties>(properties_count, init_arena);
+				vkEnumerateDeviceExtensionProperties(p_device, NULL, &properties_count, fucking_bullshit.data);
+
+				fucking_bullshit.count = properties_count;
+
+				// Core only in 1.2, without it culled draws have fixed count and empty ones are zeroed.
+				for (auto& ext : fucking_bullshit)
+				{
+					if (!strcmp(ext.extensionName, VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME))
+					{
+						gpu_culling.is_draw_indirect_count_supported = true;
+					}
+				}
+
+				if (gpu_culling.is_draw_indirect_count_supported)
+				{
+					device_extensions.add(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+				}
+
+			#if DEBUG
+				for (auto& ext : fucking_bullshit)
+				{
+					if (!strcmp(ext.extensionName, VK_EXT_DEBUG_MARKER_EXTENSION_NAME))
+					{
+						is_debug_marker_extension_available = true;
+					}
+				}
+
+				if (is_debug_marker_extension_available)
+				{
+					device_extensions.add(VK_EXT_DEBUG_MARKER_EXTENSION_NAME);
+				}
+			#endif
+
+
+
+
+				device_create_info.ppEnabledExtensionNames = device_extensions.data;
+				device_create_info.enabledExtensionCount   = device_extensions.count;
+
+				physical_device = p_device;
+
+				{
+					ZoneScopedN("vkCreateDevice");
+					result = vkCreateDevice(p_device, &device_create_info, host_allocator, &device);
+					if (result != VK_SUCCESS)
+						abort_the_mission(U"Failed to create vkCreateDevice on: % with queue family index: %", device_name, queue_family_index);
+				}
+
+
+				{
+					ZoneScopedN("vkGetDeviceQueue");
+					vkGetDeviceQueue(device, queue_family_index, 0, &device_queue);
+					vkGetDeviceQueue(device, transfer_queue_family_index, transfer_queue_index, &transfer_queue);
+				}
+
+				if (gpu_culling.is_draw_indirect_count_supported)
+				{
+					gpu_culling.cmd_draw_indexed_indirect_count = (PFN_vkCmdDrawIndexedIndirectCountKHR) vkGetDeviceProcAddr(device, "vkCmdDrawIndexedIndirectCountKHR");
+				}
+
+				Log(U"Graphics queue family: %, transfer queue family: %, transfer queue index: %", queue_family_index, transfer_queue_family_index, transfer_queue_index);
+
+				VkCommandPoolCreateInfo poolInfo = {};
+				poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+				poolInfo.queueFamilyIndex = queue_family_index;
+				poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+
+				{
+					ZoneScopedN("vkCreateCommandPool");
+					if (vkCreateCommandPool(device, &poolInfo, host_allocator, &command_pool) != VK_SUCCESS)
+						abort_the_mission(U"Failed to vkCreateCommandPool");
+				}
+
+				// Transfer command buffers live until their batch completes, then they are freed.
+				VkCommandPoolCreateInfo transfer_pool_info = {
+					.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+					.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+					.queueFamilyIndex = transfer_queue_family_index,
+				};
+
+				if (vkCreateCommandPool(device, &transfer_pool_info, host_allocator, &transfer_command_pool) != VK_SUCCESS)
+					abort_the_mission(U"Failed to vkCreateCommandPool");
+
+			#if DEBUG
+				if (is_debug_marker_extension_available)
+				{
+					pfnDebugMarkerSetObjectTag = (PFN_vkDebugMarkerSetObjectTagEXT)vkGetDeviceProcAddr(device, "vkDebugMarkerSetObjectTagEXT");
+					pfnDebugMarkerSetObjectName = (PFN_vkDebugMarkerSetObjectNameEXT)vkGetDeviceProcAddr(device, "vkDebugMarkerSetObjectNameEXT");
+					pfnCmdDebugMarkerBegin = (PFN_vkCmdDebugMarkerBeginEXT)vkGetDeviceProcAddr(device, "vkCmdDebugMarkerBeginEXT");
+					pfnCmdDebugMarkerEnd = (PFN_vkCmdDebugMarkerEndEXT)vkGetDeviceProcAddr(device, "vkCmdDebugMarkerEndEXT");
+					pfnCmdDebugMarkerInsert = (PFN_vkCmdDebugMarkerInsertEXT)vkGetDeviceProcAddr(device, "vkCmdDebugMarkerInsertEXT");
+				}
+			#endif
+
+				return;
+			}
+		}
+	}
+
+	abort_the_mission(U"Failed to locate suitable GPU");
+}
+
+
+VkDescriptorSet Renderer::imm_get_descriptor_set(VkDescriptorSetLayout descriptor_set_layout)
+{
+	// Pools are reset when the slot is reused, so sets allocated here live until GPU is done with this frame.
+	Frame_Slot* slot = current_frame_slot();
+
+	auto create_new_pool = [&]()
+	{
+		VkDescriptorPoolSize pool_sizes[] = {
+			{
+				.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+				.descriptorCount = 256
+			},
+			{
+				.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+				.descriptorCount = 256
+			},
+			{
+				.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+				.descriptorCount = 256
+			},
+		};
+
+		VkDescriptorPoolCreateInfo pool_info{};
+		pool_info.flags = 0;
+		pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+		pool_info.poolSizeCount = array_count(pool_sizes);
+		pool_info.pPoolSizes = pool_sizes;
+		pool_info.maxSets = 256;
+
+
+		if (vkCreateDescriptorPool(device, &pool_info, host_allocator, slot->descriptor_pools.add()) != VK_SUCCESS)
+			abort_the_mission(U"Failed to vkCreateDescriptorPool");
+	};
+
+
+	if (slot->descriptor_pools.count == 0)
+	{
+		create_new_pool();
+	}
+
+
+	VkDescriptorSetAllocateInfo allocate_info = {
+		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+		.pNext = NULL,
+		.descriptorPool = *slot->descriptor_pools[slot->current_descriptor_pool],
+		.descriptorSetCount = 1,
+		.pSetLayouts = &descriptor_set_layout,
+	};
+
+	VkDescriptorSet descriptor_set;
+
+	VkResult result = vkAllocateDescriptorSets(device, &allocate_info, &descriptor_set);
+	if (result != VK_SUCCESS)
+	{
+		slot->current_descriptor_pool += 1;
+		if (slot->current_descriptor_pool == slot->descriptor_pools.count)
+		{
+			create_new_pool();
+		}
+
+		allocate_info.descriptorPool = *slot->descriptor_pools[slot->current_descriptor_pool];
+
+		result = vkAllocateDescriptorSets(device, &allocate_info, &descriptor_set);
+		if (result != VK_SUCCESS)
+			abort_the_mission(U"Failed to vkAllocateDescriptorSets");
+	}
+
+	return descriptor_set;
+}
+
+VkDescriptorSet Renderer::imm_get_general_descriptor_set()
+{
+	Frame_Slot* slot = current_frame_slot();
+
+	if (slot->general_descriptor_set != VK_NULL_HANDLE) return slot->general_descriptor_set;
+
+
+	ZoneScoped;
+
+	VkDescriptorSet descriptor_set = imm_get_descriptor_set(imm_general_pipeline.descriptor_set_layout);
+
+	VkDescriptorBufferInfo buffer_info = {
+		.buffer = slot->upload_buffer.buffer,
+		.offset = 0,
+		.range  = VK_WHOLE_SIZE,
+	};
+
+	VkWriteDescriptorSet write_info = {
+		.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+		.pNext = NULL,
+		.dstSet = descriptor_set,
+		.dstBinding = 0,
+		.dstArrayElement = 0,
+		.descriptorCount = 1,
+		.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+		.pBufferInfo = &buffer_info,
+	};
+
+	vkUpdateDescriptorSets(device, 1, &write_info, 0, NULL);
+
+	slot->general_descriptor_set = descriptor_set;
+
+	return descriptor_set;
+}
+
+
+
+
+void Renderer::create_main_framebuffer()
+{
+	ZoneScoped;
+
+	main_color_image_format         = VK_FORMAT_R8G8B8A8_UNORM;
+	main_depth_stencil_image_format = VK_FORMAT_D24_UNORM_S8_UINT;
+
+	{
+		VkImageCreateInfo i;
+		i.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+
+		i.pNext = NULL;
+		i.flags = 0;
+		i.imageType = VK_IMAGE_TYPE_2D;
+		i.format = main_color_image_format;
+
+		i.extent.width  = renderer.width;
+		i.extent.height = renderer.height;
+		i.extent.depth = 1;
+
+		i.mipLevels = 1;
+		i.arrayLayers = 1;
+		i.samples = msaa_samples_count;
+
+		i.tiling = VK_IMAGE_TILING_OPTIMAL;
+		i.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+		i.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+		i.queueFamilyIndexCount = 1;
+		i.pQueueFamilyIndices = &queue_family_index;
+
+		i.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED; 
+
+		vkCreateImage(device, &i, host_allocator, &main_color_image);
+
+		main_color_image_memory = vulkan_memory_allocator.allocate_and_bind(main_color_image, VULKAN_MEMORY_ONLY_DEVICE_MEMORY, code_location());
+
+
+
+		i.format = main_depth_stencil_image_format;
+		i.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+
+		vkCreateImage(device, &i, host_allocator, &main_depth_stencil_image);
+
+		main_depth_stencil_image_memory = vulkan_memory_allocator.allocate_and_bind(main_depth_stencil_image, VULKAN_MEMORY_ONLY_DEVICE_MEMORY, code_location());
+	}
+
+	{
+		VkImageViewCreateInfo i;
+		i.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+
+		i.pNext = NULL;
+		i.flags = 0;
+
+		i.image = main_color_image;
+		i.viewType = VK_IMAGE_VIEW_TYPE_2D;
+		i.format = main_color_image_format;
+
+		i.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
+		i.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
+		i.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
+		i.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
+
+		i.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		
+		i.subresourceRange.baseMipLevel = 0;
+		i.subresourceRange.levelCount = 1;
+
+		i.subresourceRange.baseArrayLayer = 0;
+		i.subresourceRange.layerCount = 1;
+
+		vkCreateImageView(device, &i, host_allocator, &main_color_image_view);
+
+
+
+
+		i.image = main_depth_stencil_image;
+		i.format = main_depth_stencil_image_format;
+		i.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT;
+
+		vkCreateImageView(device, &i, host_allocator, &main_depth_stencil_image_view);
+	}
+
+	{
+		VkAttachmentDescription color_attachment =
+		{
+			.flags = 0,
+			.format = main_color_image_format,
+			.samples = msaa_samples_count,
+
+			.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+			.storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+			
+			.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+			.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+			
+			.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+			.finalLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, // We will copy this image to swapchain.
+		};
+
+		VkAttachmentDescription depth_stencil_attachment =
+		{
+			.flags = 0,
+			.format = main_depth_stencil_image_format,
+			.samples = msaa_samples_count,
+
+			.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+			.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+
+			.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+			.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+
+			.initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+			.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+		};
+
+		VkAttachmentDescription attachments[] = { color_attachment, depth_stencil_attachment };
+
+		VkAttachmentReference color_attachment_references[] = {
+			{
+				.attachment = 0,
+				.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+			}
+		};
+
+		VkAttachmentReference depth_stencil_attachment_reference = {
+			.attachment = 1,
+			.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+		};
+
+
+		VkSubpassDescription subpasses[] = {
+			{
+				.flags = 0,
+				.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
+
+				.inputAttachmentCount = 0,
+
+				.colorAttachmentCount = array_count(color_attachment_references),
+				.pColorAttachments = color_attachment_references,
+
+				.pResolveAttachments = NULL,
+
+				.pDepthStencilAttachment = &depth_stencil_attachment_reference,
+
+				.preserveAttachmentCount = 0,
+			}
+		};
+
+		VkSubpassDependency self_dependency = {
+			.srcSubpass = 0,
+			.dstSubpass = 0,
+
+			.srcStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT,
+			.dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT,
+
+			.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+			.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT, 
+
+			.dependencyFlags = 0,
+		};
+
+		VkRenderPassCreateInfo i = {
+			.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
+			.pNext = NULL,
+			.flags = 0,
+
+			.attachmentCount = 2,
+			.pAttachments = attachments,
+			
+			.subpassCount = array_count(subpasses),
+			.pSubpasses = subpasses,
+
+			.dependencyCount = 0,
+			.pDependencies = &self_dependency,
+		};
+
+		vkCreateRenderPass(device, &i, host_allocator, &main_render_pass);
+	}
+
+	{
+
+		VkImageView attachments[] = { main_color_image_view, main_depth_stencil_image_view };
+
+
+		VkFramebufferCreateInfo i = {
+			.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+			.pNext = NULL,
+			.flags = 0,
+
+			.renderPass = main_render_pass,
+
+			.attachmentCount = array_count(attachments),
+			.pAttachments = attachments,
+
+			.width  = (u32) renderer.width,
+			.height = (u32) renderer.height,
+			.layers = 1,
+		};
+
+		vkCreateFramebuffer(device, &i, host_allocator, &main_framebuffer);
+	}
+}
+
+
+
+void Renderer::create_swapchain()
+{
+	Arena_Allocator arena;
+	create_arena_allocator(&arena, c_allocator, 4096);
+	defer { arena.free(); };
+
+
+	swapchain_is_dead = false;
+
+	ZoneScoped;
+
+	VkResult result;
+
+	VkBool32 does_support_present;
+	result = vkGetPhysicalDeviceSurfaceSupportKHR(physical_device, queue_family_index, surface, &does_support_present);
+	if (result != VK_SUCCESS)
+		abort_the_mission(U"Failed to vkGetPhysicalDeviceSurfaceSupportKHR");
+
+	if (!does_support_present)
+		abort_the_mission(U"Vulkan surface doesn't support present");
+
+
+	VkSurfaceCapabilitiesKHR surface_capabilities;
+	result = vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physical_device, surface, &surface_capabilities);
+	if (result != VK_SUCCESS)
+		abort_the_mission(U"Failed to vkGetPhysicalDeviceSurfaceCapabilitiesKHR");
 
 
 
@@ -1782,718 +2894,1916 @@ void Renderer::create_swapchain()
 	Dynamic_Array<VkSurfaceFormatKHR> surface_formats = make_array<VkSurfaceFormatKHR>(surface_formats_count, arena);
 	surface_formats.count = surface_formats_count;
 	
-	result = vkGetPhysicalDeviceSurfaceFormatsKHR(physical_device, surface, &surface_formats_count, surface_formats.data);
+	result = vkGetPhysicalDeviceSurfaceFormatsKHR(physical_device, surface, &surface_formats_count, surface_formats.data);
+
+
+	u32 present_modes_count = 0;
+	vkGetPhysicalDeviceSurfacePresentModesKHR(physical_device, surface, &present_modes_count, NULL);
+	
+	Dynamic_Array<VkPresentModeKHR> present_modes = make_array<VkPresentModeKHR>(present_modes_count, arena);
+	present_modes.count = present_modes_count;
+
+	vkGetPhysicalDeviceSurfacePresentModesKHR(physical_device, surface, &present_modes_count, present_modes.data);
+
+
+
+	VkSurfaceFormatKHR* suitable_surface_format = NULL;
+	for (VkSurfaceFormatKHR& surface_format : surface_formats)
+	{
+		if (surface_format.format == VK_FORMAT_B8G8R8A8_UNORM)
+		{
+			suitable_surface_format = &surface_format;
+			break;
+		}
+	}
+
+	if (!suitable_surface_format)
+		abort_the_mission(U"No suitable surface format was found");
+
+
+	VkPresentModeKHR* suitable_present_mode = NULL;
+	for (VkPresentModeKHR& present_mode : present_modes)
+	{
+		if (present_mode == VK_PRESENT_MODE_FIFO_KHR)
+		{
+			suitable_present_mode = &present_mode;
+			break;
+		}
+	}
+
+	if (!suitable_present_mode)
+		abort_the_mission(U"No suitable present mode was found");
+
+
+
+	swapchain_image_format = suitable_surface_format->format;
+
+
+
+	VkSwapchainKHR old_swapchain = swapchain;
+
+	VkSwapchainCreateInfoKHR createInfo = {
+		.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
+		.surface = surface,
+		.minImageCount = surface_capabilities.minImageCount,
+		.imageFormat = swapchain_image_format,
+		.imageColorSpace = suitable_surface_format->colorSpace,
+		.imageExtent = {
+			.width  = (u32) renderer.width,
+			.height = (u32) renderer.height,
+		},
+		.imageArrayLayers = 1,
+		.imageUsage = VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+		.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE,
+		.queueFamilyIndexCount = 0,
+		.pQueueFamilyIndices = NULL,
+		.preTransform = surface_capabilities.currentTransform,
+		.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
+		.presentMode = *suitable_present_mode,
+		.clipped = VK_TRUE,
+		.oldSwapchain = old_swapchain,
+	};
+
+	{
+		ZoneScopedN("vkCreateSwapchainKHR");
+
+		if (vkCreateSwapchainKHR(device, &createInfo, host_allocator, &swapchain) != VK_SUCCESS)
+			abort_the_mission(U"vkCreateSwapchainKHR failed");
+
+		assert(swapchain);
+		
+		if (old_swapchain)
+			vkDestroySwapchainKHR(device, old_swapchain, host_allocator);
+	}
+	
+
+	u32 swapchain_images_count;
+	vkGetSwapchainImagesKHR(device, swapchain, &swapchain_images_count, NULL);
+
+	Dynamic_Array<VkImage> swapchain_images = make_array<VkImage>(swapchain_images_count, arena
+		);
+	swapchain_images.count = swapchain_images_count;
+	
+	vkGetSwapchainImagesKHR(device, swapchain, &swapchain_images_count, swapchain_images.data);
+
+
+	swapchain_nodes.clear();
+	swapchain_nodes.ensure_capacity(swapchain_images_count);
+
+
+	u32 index = 0;
+	for (VkImage& swapchain_image : swapchain_images)
+	{
+		Swapchain_Node* swapchain_node = swapchain_nodes.add();
+		swapchain_node->image = swapchain_image;
+		swapchain_node->index = index;
+
+
+		#if 0
+		VkImageViewCreateInfo createInfo = {};
+		createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+		createInfo.image = swapchain_image;
+		createInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+		createInfo.format = swapchain_image_format;
+		createInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
+		createInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
+		createInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
+		createInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
+		createInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		createInfo.subresourceRange.baseMipLevel = 0;
+		createInfo.subresourceRange.levelCount = 1;
+		createInfo.subresourceRange.baseArrayLayer = 0;
+		createInfo.subresourceRange.layerCount = 1;
+
+
+		if (vkCreateImageView(device, &createInfo, host_allocator, &swapchain_node->image_view) != VK_SUCCESS)
+			abort_the_mission(U"Failed to create image view for swapchain image");
+
+		#endif
+
+		index += 1;
+	}
+}
+	
+
+
+void Renderer::frame_begin()
+{
+	ZoneScoped;
+
+	if (settings.frames_in_flight != frames_in_flight)
+	{
+		set_frames_in_flight(settings.frames_in_flight);
+	}
+
+
+	Frame_Slot* slot = current_frame_slot();
+
+	// Only blocks if GPU is more than frames_in_flight frames behind.
+	{
+		ZoneScopedN("Wait for frame slot");
+		vkWaitForFences(device, 1, &slot->rendering_done_fence, VK_TRUE, u64_max);
+	}
+
+	release_frame_slot_resources(slot);
+
+	update_residency();
+
+	// Previous frame's ones stay readable until here.
+	level_statistics = {};
+
+	main_command_buffer = slot->command_buffer;
+
+
+	{
+		ZoneScopedN("vkAcquireNextImageKHR");
+
+		u32 node_index;
+
+		VkResult acquire_result = vkAcquireNextImageKHR(device, swapchain, u64_max, slot->image_available_semaphore, VK_NULL_HANDLE, &node_index);
+		if (acquire_result == VK_SUCCESS || acquire_result == VK_SUBOPTIMAL_KHR)
+		{
+			current_swapchain_node = swapchain_nodes[node_index];
+		}
+		else
+		{
+			// Semaphore is not going to be signaled, frame is rendered but not presented.
+			current_swapchain_node = NULL;
+			swapchain_is_dead = true;
+		}
+	}
+
+
+
+
+	VkCommandBufferBeginInfo begin_info;
+	begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	begin_info.pInheritanceInfo = NULL;
+	begin_info.pNext = NULL;
+
+	vkBeginCommandBuffer(main_command_buffer, &begin_info);
+
+	{
+		VkImageMemoryBarrier color_attachment_barrier = {
+			.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+			.pNext = 0,
+			
+			.srcAccessMask = 0,
+			.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+			
+			.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+			.newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+			
+			.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			
+			.image = main_color_image,
+			.subresourceRange = {
+				.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+				.baseMipLevel = 0,
+				.levelCount = 1,
+				.baseArrayLayer = 0,
+				.layerCount = 1,
+			},
+		};
+
+		// Previous frame may still be blitting from main_color_image, wait for its transfers.
+		vkCmdPipelineBarrier(main_command_buffer,
+			VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+			0,
+			0, NULL,
+			0, NULL,
+			1, &color_attachment_barrier);
+	}
+
+	{
+		VkImageMemoryBarrier depth_stencil_attachment_barrier = {
+			.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+			.pNext = 0,
+			
+			.srcAccessMask = 0,
+			.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+			
+			.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+			.newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+			
+			.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			
+			.image = main_depth_stencil_image,
+			.subresourceRange = {
+				.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT,
+				.baseMipLevel = 0,
+				.levelCount = 1,
+				.baseArrayLayer = 0,
+				.layerCount = 1,
+			},
+		};
+
+		vkCmdPipelineBarrier(main_command_buffer,
+			VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+			VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT | VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+			0,
+			0, NULL,
+			0, NULL,
+			1, &depth_stencil_attachment_barrier);
+	}
+
+
+	// Stencil contents don't survive between frames.
+	renderer.imm_mask_stack.count = 0;
+	renderer.imm_recalculate_mask_buffer(true);
+}
+
+void Renderer::begin_main_render_pass()
+{
+	ZoneScoped;
+
+	{
+		VkRect2D render_area = {
+			.offset = {
+				.x = 0,
+				.y = 0,
+			},
+
+			.extent = {
+				.width  = (u32) renderer.width,
+				.height = (u32) renderer.height,
+			},
+		};
+
+
+		VkClearValue color_attachment_clear_value;
+		color_attachment_clear_value.color.float32[0] = 0.0f;
+		color_attachment_clear_value.color.float32[1] = 0.0f;
+		color_attachment_clear_value.color.float32[2] = 0.0f;
+
+		VkClearValue depth_attachment_clear_value;
+		depth_attachment_clear_value.depthStencil.depth   = 0;
+		depth_attachment_clear_value.depthStencil.stencil = 1;
+		
+		VkClearValue clear_values[] = { color_attachment_clear_value, depth_attachment_clear_value };
+
+
+		VkRenderPassBeginInfo render_pass_begin_info = {
+			.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+			.pNext = NULL,
+			
+			.renderPass = main_render_pass,
+			.framebuffer = main_framebuffer,
+			.renderArea = render_area,
+
+			.clearValueCount = array_count(clear_values),
+			.pClearValues = clear_values,
+		};
+
+
+		vkCmdBeginRenderPass(main_command_buffer, &render_pass_begin_info, VK_SUBPASS_CONTENTS_INLINE);
+	}
+
+	VkViewport viewport = {
+		.x = 0,
+		.y = 0,
+		.width  = (float) renderer.width,
+		.height = (float) renderer.height,
+		.minDepth = 0.0,
+		.maxDepth = 1.0
+	};
+	vkCmdSetViewport(main_command_buffer, 0, 1, &viewport);
+
+	VkRect2D scissor_rect = {
+		.offset = {
+			.x = 0,
+			.y = 0
+		},
+		.extent = {
+			.width  = (u32) renderer.width,
+			.height = (u32) renderer.height 
+		}
+	};
+
+	vkCmdSetScissor(main_command_buffer, 0, 1, &scissor_rect);
+}
+
+void Renderer::frame_end()
+{
+	ZoneScoped;
+
+
+	// Transfers and dispatches can't be recorded inside of render pass.
+	finish_texture_uploads();
+	imm_upload_missing_glyphs();
+	imm_record_atlas_uploads();
+	geometry_manager.record_uploads(main_command_buffer);
+	gpu_culling.record_culling(main_command_buffer);
+
+	begin_main_render_pass();
+
+	// Level goes first, immediate mode UI is drawn over it.
+	record_level_draws();
+
+	imm_execute_commands();
+
+	// Textures requested by this frame's draws.
+	submit_texture_uploads();
+
+
+
+	vkCmdEndRenderPass(main_command_buffer);
+
+
+	// Acquire has failed, nothing to present this frame.
+	if (current_swapchain_node)
+	{
+		{
+			VkImageMemoryBarrier present_image_barrier = {
+				.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+				.pNext = 0,
+			
+				.srcAccessMask = 0,
+				.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+			
+				.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+				.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+			
+				.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+				.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			
+				.image = current_swapchain_node->image,
+				.subresourceRange = {
+					.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+					.baseMipLevel = 0,
+					.levelCount = 1,
+					.baseArrayLayer = 0,
+					.layerCount = 1,
+				},
+			};
+
+			// Source stage matches image_available_semaphore's wait stage, so the layout transition happens after the image is acquired.
+			vkCmdPipelineBarrier(main_command_buffer,
+				VK_PIPELINE_STAGE_TRANSFER_BIT,
+				VK_PIPELINE_STAGE_TRANSFER_BIT,
+				0,
+				0, NULL,
+				0, NULL,
+				1, &present_image_barrier);
+		}
+
+
+		{
+			if (msaa_samples_count == VK_SAMPLE_COUNT_1_BIT)
+			{
+				VkImageBlit image_blit = {
+					.srcSubresource = {
+						.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+						.mipLevel = 0,
+						.baseArrayLayer = 0,
+						.layerCount = 1,
+					},
+					.srcOffsets = {
+						{
+							.x = 0, .y = 0, .z = 0,
+						},
+						{
+							.x = renderer.width, .y = renderer.height, .z = 1,
+						}
+					},
+					.dstSubresource = {
+						.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+						.mipLevel = 0,
+						.baseArrayLayer = 0,
+						.layerCount = 1,
+					},
+					.dstOffsets = {
+						{
+							.x = 0, .y = 0, .z = 0,
+						},
+						{
+							.x = renderer.width, .y = renderer.height, .z = 1,
+						}
+					},
+				};
+				vkCmdBlitImage(main_command_buffer, main_color_image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, current_swapchain_node->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &image_blit, VK_FILTER_NEAREST);
+			}
+			else
+			{
+				VkImageResolve region = {
+					.srcSubresource = {
+						.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+						.mipLevel = 0,
+						.baseArrayLayer = 0,
+						.layerCount = 1,
+					},
+					.srcOffset = {
+						.x = 0, .y = 0, .z = 0,
+					},
+					.dstSubresource = {
+						.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+						.mipLevel = 0,
+						.baseArrayLayer = 0,
+						.layerCount = 1,
+					},
+					.dstOffset = {
+						.x = 0, .y = 0, .z = 0,
+					},
+					.extent = {
+						.width  = (u32) renderer.width,
+						.height = (u32) renderer.height,
+						.depth = 1,
+					}
+				};
+				vkCmdResolveImage(main_command_buffer, main_color_image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, current_swapchain_node->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+			}
+
+	#if 0
+			VkImageCopy image_copy = {
+				.srcSubresource = {
+					.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+					.mipLevel = 0,
+					.baseArrayLayer = 0,
+					.layerCount = 1,
+				},
+				.srcOffset = { .x = 0, .y = 0, .z = 0, },
+
+				.dstSubresource = {
+					.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+					.mipLevel = 0,
+					.baseArrayLayer = 0,
+					.layerCount = 1,
+				},
+				.dstOffset = { .x = 0, .y = 0, .z = 0, },
+
+				.extent = { .width = renderer.width, .height = renderer.height, .depth = 1 }
+			};
+
+			vkCmdCopyImage(main_command_buffer, main_color_image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, current_swapchain_node->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &image_copy);
+	#endif
+		}
+	
+
+		{
+			VkImageMemoryBarrier present_image_barrier = {
+				.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+				.pNext = 0,
+			
+				// Presentation waits on rendering_done_semaphore, which makes the blit visible.
+				//  The barrier only has to order the layout transition after the blit.
+				.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+				.dstAccessMask = 0,
+			
+				.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+				.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+			
+				.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+				.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			
+				.image = current_swapchain_node->image,
+				.subresourceRange = {
+					.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+					.baseMipLevel = 0,
+					.levelCount = 1,
+					.baseArrayLayer = 0,
+					.layerCount = 1,
+				},
+			};
+
+			vkCmdPipelineBarrier(main_command_buffer,
+				VK_PIPELINE_STAGE_TRANSFER_BIT,
+				VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+				0,
+				0, NULL,
+				0, NULL,
+				1, &present_image_barrier);
+		}
+	}
+
+	vkEndCommandBuffer(main_command_buffer);
+
+
+	Frame_Slot* slot = current_frame_slot();
+
+	bool has_image_to_present = current_swapchain_node != NULL;
+
+	VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+
+	VkSubmitInfo submit_info = {
+		.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+		.pNext = NULL,
+
+		.waitSemaphoreCount = (u32) (has_image_to_present ? 1 : 0),
+		.pWaitSemaphores    = &slot->image_available_semaphore,
+		.pWaitDstStageMask  = &wait_stage,
+
+		.commandBufferCount = 1,
+		.pCommandBuffers    = &main_command_buffer,
+
+		.signalSemaphoreCount = (u32) (has_image_to_present ? 1 : 0),
+		.pSignalSemaphores    = &slot->rendering_done_semaphore,
+	};
+
+
+	{
+		ZoneScopedN("vkQueueSubmit");
+
+		vkResetFences(device, 1, &slot->rendering_done_fence);
+		vkQueueSubmit(device_queue, 1, &submit_info, slot->rendering_done_fence);
+	}
+
+	// Next frame is recorded into the next slot, we'll wait for this one only when we get back to it.
+	defer { frame_slot_index = (frame_slot_index + 1) % frames_in_flight; };
+
+
+	TracyPlot("Imm upload allocations", imm_upload_statistics.allocations);
+	TracyPlot("Imm upload bytes",       imm_upload_statistics.bytes);
+
+	TracyPlot("Level draw calls", level_statistics.draw_calls);
+	TracyPlot("Level instances",  level_statistics.instances);
+	TracyPlot("Level CPU ms",     level_statistics.cpu_ms);
+
+	vulkan_memory_allocator.publish_statistics();
+
+	imm_upload_statistics = {};
+
+
+	if (!has_image_to_present) return;
+
+
+	VkPresentInfoKHR presentInfo = {};
+	presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+	presentInfo.waitSemaphoreCount = 1;
+	presentInfo.pWaitSemaphores = &slot->rendering_done_semaphore;
+
+	VkSwapchainKHR swapChains[] = { swapchain };
+	presentInfo.swapchainCount = 1;
+	presentInfo.pSwapchains   = swapChains;
+	presentInfo.pImageIndices = &current_swapchain_node->index;
+	presentInfo.pResults = NULL;
+
+
+
+	{
+		ZoneScopedN("vkQueuePresentKHR");
+
+		VkResult present_result = vkQueuePresentKHR(device_queue, &presentInfo);
+		if (present_result == VK_ERROR_OUT_OF_DATE_KHR)
+		{
+			// Frame that supposed to be presented won't be presented.
+			swapchain_is_dead = true;
+		}
+	}
+}
+
+void get_mesh_bounding_sphere(Mesh* mesh, Vector3* out_center, float* out_radius)
+{
+	Vector3 size = Vector3::make(mesh->bounds_max.x - mesh->bounds_min.x, mesh->bounds_max.y - mesh->bounds_min.y, mesh->bounds_max.z - mesh->bounds_min.z);
+
+	*out_center = Vector3::make((mesh->bounds_min.x + mesh->bounds_max.x) * 0.5f, (mesh->bounds_min.y + mesh->bounds_max.y) * 0.5f, (mesh->bounds_min.z + mesh->bounds_max.z) * 0.5f);
+	*out_radius = sqrtf(size.x * size.x + size.y * size.y + size.z * size.z) * 0.5f;
+}
+
+// Row major. Reversed depth with infinite far plane: near plane maps to 1, infinity to 0.
+static void make_view_projection(Camera* camera, float aspect_ratio, float* out_matrix)
+{
+	float cy = cosf(camera->yaw),   sy = sinf(camera->yaw);
+	float cp = cosf(camera->pitch), sp = sinf(camera->pitch);
+
+	// Inverse of camera's rotation, yaw is applied first.
+	float view[3][4] = {
+		{ cy,      0,   -sy     },
+		{ sp * sy, cp,  sp * cy },
+		{ cp * sy, -sp, cp * cy },
+	};
+
+	for (int i = 0; i < 3; i++)
+	{
+		view[i][3] = -(view[i][0] * camera->position.x + view[i][1] * camera->position.y + view[i][2] * camera->position.z);
+	}
+
+	float f = 1.0f / tanf(camera->vertical_fov * 0.5f);
+
+	for (int i = 0; i < 4; i++)
+	{
+		out_matrix[0  + i] = view[0][i] * f / aspect_ratio;
+		out_matrix[4  + i] = view[1][i] * -f; // Vulkan's Y points down.
+		out_matrix[8  + i] = 0;
+		out_matrix[12 + i] = -view[2][i];
+	}
+
+	out_matrix[11] = camera->near_plane;
+}
+
+void Renderer::get_camera_ray(Camera* camera, float screen_x, float screen_y, Vector3* out_origin, Vector3* out_direction)
+{
+	float cy = cosf(camera->yaw),   sy = sinf(camera->yaw);
+	float cp = cosf(camera->pitch), sp = sinf(camera->pitch);
+
+	float aspect_ratio = float(width) / float(max(height, 1));
+	float tangent      = tanf(camera->vertical_fov * 0.5f);
+
+	// View space, camera looks along -Z.
+	float x = (screen_x / float(max(width,  1)) * 2 - 1) * tangent * aspect_ratio;
+	float y = (screen_y / float(max(height, 1)) * 2 - 1) * tangent;
+	float z = -1;
+
+	// Transposed rotation of make_view_projection(), so back to world space.
+	Vector3 direction = Vector3::make(
+		x * cy + y * sp * sy + z * cp * sy,
+		         y * cp      - z * sp,
+		x * -sy + y * sp * cy + z * cp * cy);
+
+	float length = sqrtf(direction.x * direction.x + direction.y * direction.y + direction.z * direction.z);
+
+	*out_origin    = camera->position;
+	*out_direction = Vector3::make(direction.x / length, direction.y / length, direction.z / length);
+}
+
+// Planes are sums of clip space rows. Far plane is at infinity, so there's none.
+static void make_frustum_planes(float* m, Vector4* out_planes)
+{
+	auto plane = [&](int row, float sign) -> Vector4
+	{
+		return Vector4::make(m[12] + sign * m[row * 4 + 0], m[13] + sign * m[row * 4 + 1], m[14] + sign * m[row * 4 + 2], m[15] + sign * m[row * 4 + 3]);
+	};
+
+	out_planes[0] = plane(0,  1); // Left
+	out_planes[1] = plane(0, -1); // Right
+	out_planes[2] = plane(1,  1); // Top, Y is flipped.
+	out_planes[3] = plane(1, -1); // Bottom
+	out_planes[4] = plane(2, -1); // Near, depth <= 1.
+
+	for (int i = 0; i < 5; i++)
+	{
+		Vector4 p = out_planes[i];
+
+		float length = sqrtf(p.x * p.x + p.y * p.y + p.z * p.z);
+		out_planes[i] = Vector4::make(p.x / length, p.y / length, p.z / length, p.w / length);
+	}
+}
+
+// Listed entities, or all of them in chunk order if entities is NULL. Order is the same every time.
+template <typename F>
+static void for_each_level_entity(Entities_Storage* storage, Dynamic_Array<Entity_Id>* entities, F callback)
+{
+	if (entities)
+	{
+		for (Entity_Id id: *entities)
+		{
+			Entity* entity = storage->get_entity(id);
+			if (!entity) continue; // Destroyed after the query.
+
+			callback(entity, &entity->chunk->world_matrices[entity->index_in_chunk]);
+		}
+		return;
+	}
+
+	storage->for_each_chunk([&](Entity_Chunk* chunk)
+	{
+		for (u32 i = 0; i < chunk->count; i++)
+		{
+			callback(chunk->get_entity(i), &chunk->world_matrices[i]);
+		}
+	});
+}
 
+u32 Renderer::group_level_entities(Entities_Storage* storage, Dynamic_Array<Entity_Id>* entities, Dynamic_Array<Level_Draw>* draws, int first_draw_index, Dynamic_Array<u32>* out_entity_draws)
+{
+	ZoneScoped;
 
-	u32 present_modes_count = 0;
-	vkGetPhysicalDeviceSurfacePresentModesKHR(physical_device, surface, &present_modes_count, NULL);
-	
-	Dynamic_Array<VkPresentModeKHR> present_modes = make_array<VkPresentModeKHR>(present_modes_count, arena);
-	present_modes.count = present_modes_count;
+	// (mesh, material) -> index in draws. Open addressing, rebuilt twice as big when half full.
+	Dynamic_Array<s32> table;
+	int table_capacity = 0;
 
-	vkGetPhysicalDeviceSurfacePresentModesKHR(physical_device, surface, &present_modes_count, present_modes.data);
+	auto hash_draw_key = [](Mesh* mesh, Material* material) -> u32
+	{
+		u64 x = u64(mesh) ^ (u64(material) * 0x9e3779b97f4a7c15);
+
+		x ^= x >> 32;
+		x *= 0xbf58476d1ce4e5b9;
+		x ^= x >> 29;
+
+		return u32(x);
+	};
+
+	auto insert_into_table = [&](u32 draw_index)
+	{
+		Level_Draw* draw = (*draws)[draw_index];
+
+		u32 slot = hash_draw_key(draw->mesh, draw->material) & (table_capacity - 1);
+		while (*table[slot] != -1)
+		{
+			slot = (slot + 1) & (table_capacity - 1);
+		}
+
+		*table[slot] = draw_index;
+	};
+
+	auto rebuild_table = [&](int new_capacity)
+	{
+		table_capacity = new_capacity;
+
+		table = make_array<s32>(table_capacity, frame_allocator);
+		table.count = table_capacity;
+		memset(table.data, 0xff, sizeof(s32) * table_capacity);
+
+		for (int i = first_draw_index; i < draws->count; i++)
+		{
+			insert_into_table(i);
+		}
+	};
+
+	auto find_or_add_draw = [&](Mesh* mesh, Material* material) -> u32
+	{
+		u32 slot = hash_draw_key(mesh, material) & (table_capacity - 1);
+
+		while (*table[slot] != -1)
+		{
+			Level_Draw* draw = (*draws)[*table[slot]];
+			if (draw->mesh == mesh && draw->material == material) return *table[slot];
+
+			slot = (slot + 1) & (table_capacity - 1);
+		}
+
+		draws->add({
+			.mesh     = mesh,
+			.material = material,
+		});
+
+		u32 draw_index = draws->count - 1;
+
+		if ((draws->count - first_draw_index) * 2 > table_capacity)
+			rebuild_table(table_capacity * 2);
+		else
+			*table[slot] = draw_index;
+
+		return draw_index;
+	};
+
+	rebuild_table(256);
+
+
+	u32 entities_count = entities ? (u32) entities->count : storage->entities_count;
+
+	*out_entity_draws = make_array<u32>(max(entities_count, (u32) 1), frame_allocator);
+
+	u32 instances_count = 0;
+
+	// Entities tend to be created in runs of the same kind.
+	Mesh*     last_mesh = NULL;
+	Material* last_material = NULL;
+	u32       last_draw_index = 0;
+
+	for_each_level_entity(storage, entities, [&](Entity* entity, World_Matrix* world_matrix)
+	{
+		if (!entity->mesh)
+		{
+			out_entity_draws->add(u32_max);
+			return;
+		}
+
+		Material* material = entity->material ? entity->material : &default_material;
+
+		if (entity->mesh != last_mesh || material != last_material)
+		{
+			last_mesh       = entity->mesh;
+			last_material   = material;
+			last_draw_index = find_or_add_draw(entity->mesh, material);
+		}
+
+		(*draws)[last_draw_index]->instances_count += 1;
+		out_entity_draws->add(last_draw_index);
+
+		instances_count += 1;
+	});
+
+	return instances_count;
+}
+
+void Renderer::draw_level(Level* level)
+{
+	ZoneScoped;
+
+	Time_Measurer tm = create_time_measurer();
+	defer { level_statistics.cpu_ms += tm.ms_elapsed_double(); };
+
+	Entities_Storage* storage = &level->entities_storage;
+
+	level_statistics.entities += storage->entities_count;
+
+	make_view_projection(&level->camera, float(width) / float(max(height, 1)), level_view_projection);
+	make_frustum_planes(level_view_projection, level_frustum_planes);
+
+
+	if (settings.gpu_culling && gpu_culling.is_supported)
+	{
+		gpu_culling.draw_level(level);
+		return;
+	}
+
+
+	Dynamic_Array<Entity_Id> visible_entities = make_array<Entity_Id>(1024, frame_allocator);
+	level->bvh.query_frustum(level_frustum_planes, array_count(level_frustum_planes), &visible_entities);
+
+
+	int first_draw_index = level_draws.count;
+
+	// Counting sort by draw, grouping counts instances of every draw.
+	Dynamic_Array<u32> entity_draws;
+	u32 instances_count = group_level_entities(storage, &visible_entities, &level_draws, first_draw_index, &entity_draws);
+
+	if (instances_count == 0) return;
+
+
+	Frame_Slot* slot = current_frame_slot();
+
+	u64 instances_size = u64(instances_count) * sizeof(Mesh_Instance);
+	u64 alignment      = max((u64) physical_device_properties.limits.minStorageBufferOffsetAlignment, (u64) 16);
+
+	u64 instances_offset;
+	if (!slot->instance_buffer.allocate(instances_size, alignment, &instances_offset))
+	{
+		grow_frame_linear_buffer(slot, &slot->instance_buffer, instances_size + alignment);
+
+		bool allocated = slot->instance_buffer.allocate(instances_size, alignment, &instances_offset);
+		assert(allocated);
+	}
+
+
+	// Pipelines of both formats have the same set layout.
+	VkDescriptorSet descriptor_set = imm_get_descriptor_set(mesh_pipelines[0].descriptor_set_layout);
+	{
+		VkDescriptorBufferInfo buffer_info = {
+			.buffer = slot->instance_buffer.buffer,
+			.offset = instances_offset,
+			.range  = instances_size,
+		};
+
+		VkWriteDescriptorSet write_info = {
+			.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+			.dstSet = descriptor_set,
+			.dstBinding = 0,
+			.dstArrayElement = 0,
+			.descriptorCount = 1,
+			.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			.pBufferInfo = &buffer_info,
+		};
+
+		vkUpdateDescriptorSets(device, 1, &write_info, 0, NULL);
+	}
+
+
+	// Draws get consecutive ranges, cursors point to the next free instance of each.
+	Dynamic_Array<u32> cursors = make_array<u32>(level_draws.count - first_draw_index, frame_allocator);
+
+	u32 first_instance = 0;
+
+	for (int i = first_draw_index; i < level_draws.count; i++)
+	{
+		Level_Draw* draw = level_draws[i];
+
+		draw->instances_descriptor_set = descriptor_set;
+		draw->first_instance           = first_instance;
+
+		cursors.add(first_instance);
+		first_instance += draw->instances_count;
+
+		make_sure_mesh_is_on_gpu(draw->mesh);
+	}
+
+
+	{
+		ZoneScopedN("Write instances");
+
+		Mesh_Instance* instances = (Mesh_Instance*) (slot->instance_buffer.mapped_data + instances_offset);
+
+		// Same order as in group_level_entities().
+		u32 entity_index = 0;
+
+		for_each_level_entity(storage, &visible_entities, [&](Entity* entity, World_Matrix* world_matrix)
+		{
+			u32 draw_index = *entity_draws[entity_index];
+			entity_index += 1;
+
+			if (draw_index == u32_max) return;
+
+			u32* cursor = cursors[draw_index - first_draw_index];
+
+			memcpy(&instances[*cursor], world_matrix, sizeof(Mesh_Instance));
+			*cursor += 1;
+		});
+	}
+
+	level_statistics.instances += instances_count;
+}
+
+void Renderer::record_level_draws()
+{
+	ZoneScoped;
+
+	defer { level_draws.clear(); };
+
+	Time_Measurer tm = create_time_measurer();
+	defer { level_statistics.cpu_ms += tm.ms_elapsed_double(); };
+
+	gpu_culling.record_draws(main_command_buffer);
+
+	if (level_draws.count == 0) return;
+
+	begin_debug_marker("Level draws", rgba(150, 70, 0, 255));
+	defer { end_debug_marker(); };
+
+
+	Mesh_Uniform_Block uniform;
+	memcpy(uniform.view_projection, level_view_projection, sizeof(uniform.view_projection));
+
+	u32 per_draw_offset = offsetof(Mesh_Uniform_Block, bounds_min);
+
+	// One pass per vertex format, so each pipeline is bound once.
+	for (int format = 0; format < array_count(mesh_pipelines); format++)
+	{
+		Imm_Pipeline* pipeline = &mesh_pipelines[format];
+
+		bool            is_pipeline_bound = false;
+		VkDescriptorSet bound_descriptor_set = VK_NULL_HANDLE;
+		VkBuffer        bound_vertex_buffer  = VK_NULL_HANDLE;
+		VkBuffer        bound_index_buffer   = VK_NULL_HANDLE;
+		VkIndexType     bound_index_type     = VK_INDEX_TYPE_UINT32;
+
+		for (Level_Draw& draw: level_draws)
+		{
+			Mesh* mesh = draw.mesh;
+
+			if ((int) mesh->vertex_format != format) continue;
+
+			if (!is_pipeline_bound)
+			{
+				vkCmdBindPipeline(main_command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->pipeline);
+				vkCmdPushConstants(main_command_buffer, pipeline->pipeline_layout, VK_SHADER_STAGE_ALL_GRAPHICS, 0, sizeof(uniform.view_projection), &uniform.view_projection);
+
+				is_pipeline_bound = true;
+			}
+
+			if (draw.instances_descriptor_set != bound_descriptor_set)
+			{
+				vkCmdBindDescriptorSets(main_command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->pipeline_layout, 0, 1, &draw.instances_descriptor_set, 0, NULL);
+				bound_descriptor_set = draw.instances_descriptor_set;
+			}
+
+			// Meshes share geometry buffers, so these rarely change.
+			if (mesh->vertex_buffer != bound_vertex_buffer)
+			{
+				VkDeviceSize offset = 0;
+				vkCmdBindVertexBuffers(main_command_buffer, 0, 1, &mesh->vertex_buffer, &offset);
+				bound_vertex_buffer = mesh->vertex_buffer;
+			}
+
+			if (mesh->index_buffer != bound_index_buffer || mesh->index_type != bound_index_type)
+			{
+				vkCmdBindIndexBuffer(main_command_buffer, mesh->index_buffer, 0, mesh->index_type);
+				bound_index_buffer = mesh->index_buffer;
+				bound_index_type   = mesh->index_type;
+			}
+
+
+			uniform.bounds_min = Vector4::make(mesh->bounds_min.x, mesh->bounds_min.y, mesh->bounds_min.z, 0);
+			uniform.bounds_max = Vector4::make(mesh->bounds_max.x, mesh->bounds_max.y, mesh->bounds_max.z, 0);
+			uniform.color      = draw.material->color.as_vector4();
+
+			vkCmdPushConstants(main_command_buffer, pipeline->pipeline_layout, VK_SHADER_STAGE_ALL_GRAPHICS, per_draw_offset, sizeof(Mesh_Uniform_Block) - per_draw_offset, ((u8*) &uniform) + per_draw_offset);
+
+			vkCmdDrawIndexed(main_command_buffer, mesh->indices.count, draw.instances_count, mesh->first_index, mesh->vertex_offset, draw.first_instance);
+
+			level_statistics.draw_calls += 1;
+		}
+	}
+}
+
+
+
+
+
+
+
+
+bool Renderer::should_resize()
+{
+	return swapchain_is_dead;
+}
+
+
+void Renderer::resize(int new_width, int new_height)
+{
+	ZoneScoped;
+
+
+	if (new_width  == width &&
+		new_height == height) return;
+
+
+	width = new_width;
+	height = new_height;
+
+	recreate_swapchain();
+}
+
+
+
+
+void Renderer::imm_recalculate_mask_buffer(bool force_stencil_rebuild)
+{
+	ZoneScoped;
+
+	Rect clip_rect = Rect::make(0, 0, width, height);
+
+	bool rebuild_stencil = force_stencil_rebuild;
+	int  inversed_masks_count = 0;
+
+	for (Rect_Mask& mask: imm_mask_stack)
+	{
+		if (mask.inversed)
+		{
+			if (inversed_masks_count >= imm_inversed_masks.count)
+			{
+				rebuild_stencil = true;
+			}
+			else
+			{
+				Rect* applied = imm_inversed_masks[inversed_masks_count];
+
+				if (applied->x_left  != mask.rect.x_left  || applied->y_bottom != mask.rect.y_bottom ||
+					applied->x_right != mask.rect.x_right || applied->y_top    != mask.rect.y_top)
+				{
+					rebuild_stencil = true;
+				}
+			}
+
+			inversed_masks_count += 1;
+		}
+		else
+		{
+			clip_rect.x_left   = max(clip_rect.x_left,   mask.rect.x_left);
+			clip_rect.y_bottom = max(clip_rect.y_bottom, mask.rect.y_bottom);
+			clip_rect.x_right  = min(clip_rect.x_right,  mask.rect.x_right);
+			clip_rect.y_top    = min(clip_rect.y_top,    mask.rect.y_top);
+		}
+	}
+
+	if (inversed_masks_count != imm_inversed_masks.count)
+	{
+		rebuild_stencil = true;
+	}
+
+
+	if (!rebuild_stencil &&
+		clip_rect.x_left  == imm_clip_rect.x_left  && clip_rect.y_bottom == imm_clip_rect.y_bottom &&
+		clip_rect.x_right == imm_clip_rect.x_right && clip_rect.y_top    == imm_clip_rect.y_top)
+	{
+		return;
+	}
+
+
+	if (rebuild_stencil)
+	{
+		imm_inversed_masks.clear();
+
+		for (Rect_Mask& mask: imm_mask_stack)
+		{
+			if (mask.inversed)
+			{
+				imm_inversed_masks.add(mask.rect);
+			}
+		}
+	}
+
+	imm_clip_rect = clip_rect;
+
+	imm_commands.add({
+		.type = Imm_Command_Type::Recalculate_Mask_Buffer,
+
+		.recalculate_mask_buffer = {
+			.clip_rect       = clip_rect,
+			.rebuild_stencil = rebuild_stencil,
+			.inversed_masks  = rebuild_stencil ? imm_inversed_masks.copy_with(frame_allocator) : Dynamic_Array<Rect>{},
+		}
+	});
+}
+
+
+
+void Renderer::imm_draw_text(Font::Face* face, Unicode_String str, int x, int y, rgba color)
+{
+	ZoneScoped;
+
+	auto iter = string_by_glyphs(str, face);
+	int iter_previous_x = iter.x;
+	while (iter.next())
+	{
+		defer{ iter_previous_x = iter.x; };
+
+		if (!iter.render_glyph) continue;
+
+		// :GlyphLocalCoords:
+		imm_draw_glyph(face, &iter.current_glyph, x + iter_previous_x + iter.current_glyph.left_offset, y - (iter.current_glyph.height - iter.current_glyph.top_offset), color);
+	}
+}
+
+
+void Renderer::imm_draw_text_culled(Font::Face* face, Unicode_String str, int x, int y, Rect cull_rect, rgba color)
+{
+	ZoneScoped;
 
+	auto iter = string_by_glyphs(str, face);
+	int iter_previous_x = iter.x;
+	while (iter.next())
+	{
+		defer{ iter_previous_x = iter.x; };
 
+		if (!iter.render_glyph) continue;
 
-	VkSurfaceFormatKHR* suitable_surface_format = NULL;
-	for (VkSurfaceFormatKHR& surface_format : surface_formats)
-	{
-		if (surface_format.format == VK_FORMAT_B8G8R8A8_UNORM)
+		int local_x =  x + iter_previous_x + iter.current_glyph.left_offset;
+		if (local_x > cull_rect.x_right) // Assuming left-to-right text.
 		{
-			suitable_surface_format = &surface_format;
 			break;
 		}
+
+		imm_draw_glyph(face, &iter.current_glyph, local_x, y - (iter.current_glyph.height - iter.current_glyph.top_offset), color);
+
 	}
+}
 
-	if (!suitable_surface_format)
-		abort_the_mission(U"No suitable surface format was found");
 
 
-	VkPresentModeKHR* suitable_present_mode = NULL;
-	for (VkPresentModeKHR& present_mode : present_modes)
-	{
-		if (present_mode == VK_PRESENT_MODE_FIFO_KHR)
-		{
-			suitable_present_mode = &present_mode;
-			break;
+void Renderer::imm_draw_texture(Rect rect, Texture* texture)
+{
+	ZoneScoped;
+
+	imm_commands.add({
+		.type = Imm_Command_Type::Draw_Texture,
+
+		.draw_texture = {
+			.rect  = rect,
+			.texture_name = texture->name,
 		}
-	}
+	});
+}
 
-	if (!suitable_present_mode)
-		abort_the_mission(U"No suitable present mode was found");
+void Renderer::imm_draw_rect(Rect rect, rgba color)
+{
+	ZoneScoped;
 
+	imm_commands.add({
+		.type = Imm_Command_Type::Draw_Rect,
 
+		.draw_rect = {
+			.rect  = rect,
+			.color = color
+		}
+	});
+}
 
-	swapchain_image_format = suitable_surface_format->format;
 
+void Renderer::imm_draw_rect_with_alpha_fade(Rect rect, rgba color, int alpha_left, int alpha_right)
+{
+	ZoneScoped;
 
+	imm_commands.add({
+		.type = Imm_Command_Type::Draw_Faded_Rect,
 
-	VkSwapchainKHR old_swapchain = swapchain;
+		.draw_faded_rect = {
+			.rect  = rect,
+			.color = color,
 
-	VkSwapchainCreateInfoKHR createInfo = {
-		.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
-		.surface = surface,
-		.minImageCount = surface_capabilities.minImageCount,
-		.imageFormat = swapchain_image_format,
-		.imageColorSpace = suitable_surface_format->colorSpace,
-		.imageExtent = {
-			.width  = (u32) renderer.width,
-			.height = (u32) renderer.height,
-		},
-		.imageArrayLayers = 1,
-		.imageUsage = VK_IMAGE_USAGE_TRANSFER_DST_BIT,
-		.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE,
-		.queueFamilyIndexCount = 0,
-		.pQueueFamilyIndices = NULL,
-		.preTransform = surface_capabilities.currentTransform,
-		.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
-		.presentMode = *suitable_present_mode,
-		.clipped = VK_TRUE,
-		.oldSwapchain = old_swapchain,
-	};
+			.alpha_left  = alpha_left,
+			.alpha_right = alpha_right,
+		}
+	});
+}
 
-	{
-		ZoneScopedN("vkCreateSwapchainKHR");
+void Renderer::imm_draw_line(int x0, int y0, int x1, int y1, rgba color, float thickness, bool anti_aliased)
+{
+	ZoneScoped;
 
-		if (vkCreateSwapchainKHR(device, &createInfo, host_allocator, &swapchain) != VK_SUCCESS)
-			abort_the_mission(U"vkCreateSwapchainKHR failed");
+	imm_commands.add({
+		.type = Imm_Command_Type::Draw_Line,
 
-		assert(swapchain);
-		
-		if (old_swapchain)
-			vkDestroySwapchainKHR(device, old_swapchain, host_allocator);
-	}
-	
+		.draw_line = {
+			
+			.x0 = x0,
+			.y0 = y0,
+			.x1 = x1,
+			.y1 = y1,
 
-	u32 swapchain_images_count;
-	vkGetSwapchainImagesKHR(device, swapchain, &swapchain_images_count, NULL);
+			.color = color,
 
-	Dynamic_Array<VkImage> swapchain_images = make_array<VkImage>(swapchain_images_count, arena
-		);
-	swapchain_images.count = swapchain_images_count;
-	
-	vkGetSwapchainImagesKHR(device, swapchain, &swapchain_images_count, swapchain_images.data);
+			.thickness    = thickness,
+			.anti_aliased = anti_aliased,
+		}
+	});
+}
 
 
-	swapchain_nodes.clear();
-	swapchain_nodes.ensure_capacity(swapchain_images_count);
 
+void Renderer::imm_draw_glyph(Font::Face* face, Glyph* glyph, int x, int y, rgba color)
+{
+	ZoneScoped;
 
-	u32 index = 0;
-	for (VkImage& swapchain_image : swapchain_images)
-	{
-		Swapchain_Node* swapchain_node = swapchain_nodes.add();
-		swapchain_node->image = swapchain_image;
-		swapchain_node->index = index;
+	if (glyph->width == 0 || glyph->height == 0) return;
 
 
-		#if 0
-		VkImageViewCreateInfo createInfo = {};
-		createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-		createInfo.image = swapchain_image;
-		createInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-		createInfo.format = swapchain_image_format;
-		createInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
-		createInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
-		createInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
-		createInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
-		createInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-		createInfo.subresourceRange.baseMipLevel = 0;
-		createInfo.subresourceRange.levelCount = 1;
-		createInfo.subresourceRange.baseArrayLayer = 0;
-		createInfo.subresourceRange.layerCount = 1;
+	imm_commands.add({
+		.type = Imm_Command_Type::Draw_Glyph,
 
+		.draw_glyph = {
+			
+			.glyph = *glyph,
+			.glyph_key = Glyph_Key::make(face, *glyph),
 
-		if (vkCreateImageView(device, &createInfo, host_allocator, &swapchain_node->image_view) != VK_SUCCESS)
-			abort_the_mission(U"Failed to create image view for swapchain image");
+			.x = x,
+			.y = y,
 
-		#endif
+			.color = color,
+		}
+	});
+}
 
-		index += 1;
+
+u64 Renderer::glyph_atlas_bytes()
+{
+	u64 result = 0;
+
+	for (int i = 0; i < glyph_atlasses.count; i++)
+	{
+		Texture_Atlas* atlas = glyph_atlasses[i];
+
+		if (atlas->is_alive)
+		{
+			result += u64(atlas->size) * u64(atlas->size);
+		}
 	}
+
+	return result;
 }
-	
 
+void Renderer::imm_evict_glyph(s32 glyph_index)
+{
+	Glyph_Gpu_Region* region = &glyph_cache.get(glyph_index)->region;
 
-void Renderer::frame_begin()
+	region->atlas->remove(region->offset.x, region->offset.y, region->size.x, region->size.y);
+
+	glyph_cache.remove(glyph_index);
+}
+
+// Least recently used glyph overall is the oldest tail among atlasses' LRU lists.
+bool Renderer::imm_evict_cold_glyphs(int area_to_free)
 {
 	ZoneScoped;
 
-	u32 node_index;
-
-	vkAcquireNextImageKHR(device, swapchain, u64_max, VK_NULL_HANDLE, image_availability_fence, &node_index);
-	current_swapchain_node = swapchain_nodes[node_index];
+	int evicted_count = 0;
+	s64 freed_area    = 0;
 
-	vkWaitForFences(device, 1, &image_availability_fence, VK_FALSE, u64_max);
-	vkResetFences(device, 1, &image_availability_fence);
+	while (freed_area < area_to_free)
+	{
+		s32 oldest       = -1;
+		u64 oldest_frame = u64_max;
 
+		for (int i = 0; i < glyph_atlasses.count; i++)
+		{
+			Texture_Atlas* atlas = glyph_atlasses[i];
 
+			if (!atlas->is_alive || atlas->is_retiring || atlas->lru_last == -1) continue;
 
+			Glyph_Gpu_Region* region = &glyph_cache.get(atlas->lru_last)->region;
 
+			if (is_resource_cold(region->last_used_frame) && region->last_used_frame < oldest_frame)
+			{
+				oldest       = atlas->lru_last;
+				oldest_frame = region->last_used_frame;
+			}
+		}
 
+		if (oldest == -1) break;
 
-	VkCommandBufferBeginInfo begin_info;
-	begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-	begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-	begin_info.pInheritanceInfo = NULL;
-	begin_info.pNext = NULL;
+		Glyph_Gpu_Region* region = &glyph_cache.get(oldest)->region;
+		freed_area += region->size.x * region->size.y;
 
-	vkBeginCommandBuffer(main_command_buffer, &begin_info);
+		imm_evict_glyph(oldest);
+		evicted_count += 1;
+	}
 
+	if (evicted_count > 0)
 	{
-		VkImageMemoryBarrier color_attachment_barrier = {
-			.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-			.pNext = 0,
-			
-			.srcAccessMask = 0,
-			.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
-			
-			.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-			.newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-			
-			.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-			.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-			
-			.image = main_color_image,
-			.subresourceRange = {
-				.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-				.baseMipLevel = 0,
-				.levelCount = 1,
-				.baseArrayLayer = 0,
-				.layerCount = 1,
-			},
-		};
-
-		vkCmdPipelineBarrier(main_command_buffer,
-			VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-			VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-			0,
-			0, NULL,
-			0, NULL,
-			1, &color_attachment_barrier);
+		Log(U"Evicted % cold glyphs", evicted_count);
 	}
 
+	return evicted_count > 0;
+}
+
+void Renderer::imm_allocate_glyph_region(int width, int height, Texture_Atlas** out_atlas, int* out_x_left, int* out_y_bottom)
+{
+	ZoneScoped;
+
+	auto put_in_existing_atlas = [&]() -> bool
 	{
-		VkImageMemoryBarrier depth_stencil_attachment_barrier = {
-			.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-			.pNext = 0,
-			
-			.srcAccessMask = 0,
-			.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
-			
-			.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-			.newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
-			
-			.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-			.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-			
-			.image = main_depth_stencil_image,
-			.subresourceRange = {
-				.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT,
-				.baseMipLevel = 0,
-				.levelCount = 1,
-				.baseArrayLayer = 0,
-				.layerCount = 1,
-			},
-		};
+		for (int i = 0; i < glyph_atlasses.count; i++)
+		{
+			Texture_Atlas* atlas = glyph_atlasses[i];
+
+			if (!atlas->is_alive || atlas->is_retiring) continue;
+
+			if (atlas->put_in(width, height, out_x_left, out_y_bottom))
+			{
+				*out_atlas = atlas;
+				return true;
+			}
+		}
+
+		return false;
+	};
+
+	if (put_in_existing_atlas()) return;
+
+
+	u64 budget = u64(max(settings.glyph_atlas_budget_mb, 1)) * megabytes(1);
+	u64 atlas_bytes = u64(glyph_atlas_size) * u64(glyph_atlas_size);
+
+	if (glyph_atlas_bytes() + atlas_bytes > budget)
+	{
+		// Free a reasonable chunk at once, so following missing glyphs fit right away.
+		int area_to_free = max(width * height, glyph_atlas_size * glyph_atlas_size / 8);
 
-		vkCmdPipelineBarrier(main_command_buffer,
-			VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-			VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT | VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-			0,
-			0, NULL,
-			0, NULL,
-			1, &depth_stencil_attachment_barrier);
+		while (imm_evict_cold_glyphs(area_to_free))
+		{
+			if (put_in_existing_atlas()) return;
+		}
+
+		Log(U"Glyph atlas budget is exceeded, every glyph is in use");
 	}
 
 
-	{
-		VkRect2D render_area = {
-			.offset = {
-				.x = 0,
-				.y = 0,
-			},
+	Texture_Atlas* atlas = NULL;
 
-			.extent = {
-				.width  = (u32) renderer.width,
-				.height = (u32) renderer.height,
-			},
-		};
+	for (int i = 0; i < glyph_atlasses.count; i++)
+	{
+		if (!glyph_atlasses[i]->is_alive)
+		{
+			atlas = glyph_atlasses[i];
+			*atlas = Texture_Atlas::make(glyph_atlas_size);
+			break;
+		}
+	}
 
+	if (!atlas)
+	{
+		atlas = glyph_atlasses.add(Texture_Atlas::make(glyph_atlas_size));
+	}
 
-		VkClearValue color_attachment_clear_value;
-		color_attachment_clear_value.color.float32[0] = 0.0f;
-		color_attachment_clear_value.color.float32[1] = 0.0f;
-		color_attachment_clear_value.color.float32[2] = 0.0f;
+	bool result = atlas->put_in(width, height, out_x_left, out_y_bottom);
+	assert(result);
 
-		VkClearValue depth_attachment_clear_value;
-		depth_attachment_clear_value.depthStencil.depth   = 0;
-		depth_attachment_clear_value.depthStencil.stencil = 1;
-		
-		VkClearValue clear_values[] = { color_attachment_clear_value, depth_attachment_clear_value };
+	*out_atlas = atlas;
+}
 
+void Renderer::imm_maintain_glyph_atlasses()
+{
+	ZoneScoped;
 
-		VkRenderPassBeginInfo render_pass_begin_info = {
-			.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
-			.pNext = NULL,
-			
-			.renderPass = main_render_pass,
-			.framebuffer = main_framebuffer,
-			.renderArea = render_area,
+	int alive_count = 0;
+	bool has_retiring = false;
 
-			.clearValueCount = array_count(clear_values),
-			.pClearValues = clear_values,
-		};
+	for (int i = 0; i < glyph_atlasses.count; i++)
+	{
+		Texture_Atlas* atlas = glyph_atlasses[i];
 
+		if (!atlas->is_alive) continue;
 
-		vkCmdBeginRenderPass(main_command_buffer, &render_pass_begin_info, VK_SUBPASS_CONTENTS_INLINE);
+		if (atlas->is_retiring)
+		{
+			has_retiring = true;
+		}
+		else
+		{
+			alive_count += 1;
+		}
 	}
 
-	VkViewport viewport = {
-		.x = 0,
-		.y = 0,
-		.width  = (float) renderer.width,
-		.height = (float) renderer.height,
-		.minDepth = 0.0,
-		.maxDepth = 1.0
-	};
-	vkCmdSetViewport(main_command_buffer, 0, 1, &viewport);
 
-	VkRect2D scissor_rect = {
-		.offset = {
-			.x = 0,
-			.y = 0
-		},
-		.extent = {
-			.width  = (u32) renderer.width,
-			.height = (u32) renderer.height 
+	u64 budget = u64(max(settings.glyph_atlas_budget_mb, 1)) * megabytes(1);
+
+	bool is_over_budget = glyph_atlas_bytes() > budget;
+
+	// One atlas at a time, glyphs moved out of it need room in the others.
+	if (!has_retiring && alive_count > 1 && (is_over_budget || frame_index % glyph_atlas_repack_interval == 0))
+	{
+		Texture_Atlas* emptiest = NULL;
+
+		for (int i = 0; i < glyph_atlasses.count; i++)
+		{
+			Texture_Atlas* atlas = glyph_atlasses[i];
+
+			if (!atlas->is_alive || atlas->is_retiring) continue;
+
+			if (!emptiest || atlas->occupancy() < emptiest->occupancy())
+			{
+				emptiest = atlas;
+			}
 		}
-	};
 
-	vkCmdSetScissor(main_command_buffer, 0, 1, &scissor_rect);
+		if (is_over_budget || emptiest->occupancy() < glyph_atlas_repack_occupancy)
+		{
+			Log(U"Retiring glyph atlas, occupancy: %", emptiest->occupancy());
 
+			emptiest->is_retiring = true;
+			has_retiring = true;
+		}
+	}
 
+	if (!has_retiring) return;
 
 
-	imm_current_descriptor_pool = 0;
-	for (VkDescriptorPool& pool: imm_descriptor_pools)
+	// Glyphs used recently are moved out of retiring atlasses as they are drawn, cold ones are just dropped.
+	//  Coldest are at the end of LRU list, so only glyphs that get evicted are visited.
+	for (int i = 0; i < glyph_atlasses.count; i++)
 	{
-		vkResetDescriptorPool(device, pool, 0);
+		Texture_Atlas* atlas = glyph_atlasses[i];
+
+		if (!atlas->is_alive || !atlas->is_retiring) continue;
+
+		while (atlas->lru_last != -1 && is_resource_cold(glyph_cache.get(atlas->lru_last)->region.last_used_frame))
+		{
+			imm_evict_glyph(atlas->lru_last);
+		}
 	}
 
-	renderer.imm_mask_stack.count = 0;
-	renderer.imm_recalculate_mask_buffer();
+	for (int i = 0; i < glyph_atlasses.count; i++)
+	{
+		Texture_Atlas* atlas = glyph_atlasses[i];
+
+		if (atlas->is_alive && atlas->is_retiring && atlas->regions_count == 0 && is_resource_cold(atlas->last_used_frame))
+		{
+			atlas->destroy();
+		}
+	}
 }
 
-void Renderer::frame_end()
+void Renderer::imm_upload_missing_glyphs()
 {
-	ZoneScoped;
-
+	ZoneScopedN("Upload missing glyphs");
 
-	imm_execute_commands();
+	imm_maintain_glyph_atlasses();
 
+	glyph_cache.clear_front_cache();
 
 
-	vkCmdEndRenderPass(main_command_buffer);
+	for (Imm_Command& command: imm_commands)
+	{			
+		if (command.type != Imm_Command_Type::Draw_Glyph) continue;
 
 
-	{
-		VkImageMemoryBarrier present_image_barrier = {
-			.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-			.pNext = 0,
-			
-			.srcAccessMask = 0,
-			.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-			
-			.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-			.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-			
-			.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-			.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-			
-			.image = current_swapchain_node->image,
-			.subresourceRange = {
-				.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-				.baseMipLevel = 0,
-				.levelCount = 1,
-				.baseArrayLayer = 0,
-				.layerCount = 1,
-			},
-		};
+		Glyph& glyph = command.draw_glyph.glyph;
 
-		vkCmdPipelineBarrier(main_command_buffer,
-			VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-			VK_PIPELINE_STAGE_TRANSFER_BIT,
-			0,
-			0, NULL,
-			0, NULL,
-			1, &present_image_barrier);
-	}
+		Glyph_Key glyph_key = command.draw_glyph.glyph_key;
 
+		s32 glyph_index = glyph_cache.find(glyph_key);
 
-	{
-		if (msaa_samples_count == VK_SAMPLE_COUNT_1_BIT)
+		if (glyph_index != -1 && glyph_cache.get(glyph_index)->region.atlas->is_retiring)
 		{
-			VkImageBlit image_blit = {
-				.srcSubresource = {
-					.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-					.mipLevel = 0,
-					.baseArrayLayer = 0,
-					.layerCount = 1,
-				},
-				.srcOffsets = {
-					{
-						.x = 0, .y = 0, .z = 0,
-					},
-					{
-						.x = renderer.width, .y = renderer.height, .z = 1,
-					}
-				},
-				.dstSubresource = {
-					.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-					.mipLevel = 0,
-					.baseArrayLayer = 0,
-					.layerCount = 1,
-				},
-				.dstOffsets = {
-					{
-						.x = 0, .y = 0, .z = 0,
-					},
-					{
-						.x = renderer.width, .y = renderer.height, .z = 1,
-					}
-				},
-			};
-			vkCmdBlitImage(main_command_buffer, main_color_image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, current_swapchain_node->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &image_blit, VK_FILTER_NEAREST);
+			// Region stays intact, retiring atlas doesn't accept new ones, so commands that already reference it are fine.
+			imm_evict_glyph(glyph_index);
+			glyph_index = -1;
 		}
-		else
+
+		if (glyph_index == -1)
 		{
-			VkImageResolve region = {
-				.srcSubresource = {
-					.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-					.mipLevel = 0,
-					.baseArrayLayer = 0,
-					.layerCount = 1,
-				},
-				.srcOffset = {
-					.x = 0, .y = 0, .z = 0,
-				},
-				.dstSubresource = {
-					.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-					.mipLevel = 0,
-					.baseArrayLayer = 0,
-					.layerCount = 1,
-				},
-				.dstOffset = {
-					.x = 0, .y = 0, .z = 0,
-				},
-				.extent = {
-					.width  = (u32) renderer.width,
-					.height = (u32) renderer.height,
-					.depth = 1,
-				}
-			};
-			vkCmdResolveImage(main_command_buffer, main_color_image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, current_swapchain_node->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+			// Glyph is not on GPU.
+
+			Texture_Atlas* atlas;
+
+			int uv_x_left;
+			int uv_y_bottom;
+
+			// Empty glyphs still occupy a pixel, so every region belongs to some shelf.
+			Vector2i region_size = Vector2i::make(max(glyph.width, 1), max(glyph.height, 1));
+
+			imm_allocate_glyph_region(region_size.x, region_size.y, &atlas, &uv_x_left, &uv_y_bottom);
+
+			imm_queue_atlas_upload(atlas, glyph.image_buffer, glyph.width, glyph.height, uv_x_left, uv_y_bottom);
+
+
+			glyph_index = glyph_cache.add(glyph_key, {
+				.atlas  = atlas,
+				.offset = Vector2i::make(uv_x_left, uv_y_bottom),
+				.size   = region_size,
+			});
 		}
 
-#if 0
-		VkImageCopy image_copy = {
-			.srcSubresource = {
-				.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-				.mipLevel = 0,
-				.baseArrayLayer = 0,
-				.layerCount = 1,
-			},
-			.srcOffset = { .x = 0, .y = 0, .z = 0, },
+		glyph_cache.mark_used(glyph_index, frame_index);
 
-			.dstSubresource = {
-				.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-				.mipLevel = 0,
-				.baseArrayLayer = 0,
-				.layerCount = 1,
-			},
-			.dstOffset = { .x = 0, .y = 0, .z = 0, },
+		Glyph_Gpu_Region* region = &glyph_cache.get(glyph_index)->region;
+		region->atlas->last_used_frame = frame_index;
 
-			.extent = { .width = renderer.width, .height = renderer.height, .depth = 1 }
-		};
+		command.draw_glyph.glyph_gpu_region = *region;
+	}
 
-		vkCmdCopyImage(main_command_buffer, main_color_image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, current_swapchain_node->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &image_copy);
-#endif
+
+	TracyPlot("Glyph atlas bytes", (s64) glyph_atlas_bytes());
+}
+
+void Glyph_Cache::init(int initial_capacity)
+{
+	assert((initial_capacity & (initial_capacity - 1)) == 0);
+
+	capacity = initial_capacity;
+	count = 0;
+
+	entries = (Entry*) c_allocator.alloc(sizeof(Entry) * capacity, code_location());
+	memset(entries, 0, sizeof(Entry) * capacity);
+
+	make_array(&glyphs, initial_capacity / 2, c_allocator);
+	first_free_glyph = -1;
+
+	clear_front_cache();
+}
+
+s32 Glyph_Cache::find(Glyph_Key key)
+{
+	s32* front = &front_cache[key.hash & (front_cache_size - 1)];
+
+	if (*front != -1 && glyphs[*front]->key == key)
+	{
+		return *front;
 	}
-	
 
+
+	u32 mask = capacity - 1;
+
+	for (u32 index = key.hash & mask;; index = (index + 1) & mask)
 	{
-		VkImageMemoryBarrier present_image_barrier = {
-			.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-			.pNext = 0,
-			
-			.srcAccessMask = 0,
-			.dstAccessMask = 0, // All memory is available after we wait for fences. Right? 
-			
-			.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-			.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
-			
-			.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-			.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-			
-			.image = current_swapchain_node->image,
-			.subresourceRange = {
-				.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-				.baseMipLevel = 0,
-				.levelCount = 1,
-				.baseArrayLayer = 0,
-				.layerCount = 1,
-			},
-		};
+		Entry* entry = &entries[index];
 
-		vkCmdPipelineBarrier(main_command_buffer,
-			VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-			VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
-			0,
-			0, NULL,
-			0, NULL,
-			1, &present_image_barrier);
+		if (entry->key.hash == 0) return -1;
+
+		if (entry->key == key)
+		{
+			*front = entry->glyph_index;
+			return entry->glyph_index;
+		}
 	}
+}
 
-	vkEndCommandBuffer(main_command_buffer);
+s32 Glyph_Cache::add(Glyph_Key key, Glyph_Gpu_Region region)
+{
+	assert(key.hash != 0);
 
+	// Keep load factor under 1/2, so probe sequences stay short.
+	if ((count + 1) * 2 > capacity)
+	{
+		grow();
+	}
 
-	VkSubmitInfo submit_info;
-	submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-	submit_info.commandBufferCount = 1;
-	submit_info.pCommandBuffers = &main_command_buffer;
-	submit_info.pNext = NULL;
-	submit_info.signalSemaphoreCount = 0;
-	submit_info.waitSemaphoreCount = 0;
 
+	s32 glyph_index;
 
+	if (first_free_glyph != -1)
 	{
-		ZoneScopedN("Send queue and wait for it");
-
-		vkQueueSubmit(device_queue, 1, &submit_info, rendering_done_fence);
-		
-		vkWaitForFences(device, 1, &rendering_done_fence, VK_FALSE, u64_max);
-		vkResetFences(device, 1, &rendering_done_fence);
+		glyph_index      = first_free_glyph;
+		first_free_glyph = glyphs[glyph_index]->next;
+	}
+	else
+	{
+		glyphs.add({});
+		glyph_index = glyphs.count - 1;
 	}
 
-	VkPresentInfoKHR presentInfo = {};
-	presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-	presentInfo.waitSemaphoreCount = 0;
-
-	VkSwapchainKHR swapChains[] = { swapchain };
-	presentInfo.swapchainCount = 1;
-	presentInfo.pSwapchains   = swapChains;
-	presentInfo.pImageIndices = &current_swapchain_node->index;
-	presentInfo.pResults = NULL;
+	*glyphs[glyph_index] = {
+		.key    = key,
+		.region = region,
+	};
 
+	link_to_atlas(glyph_index);
 
 
+	u32 mask = capacity - 1;
+
+	for (u32 index = key.hash & mask;; index = (index + 1) & mask)
 	{
-		ZoneScopedN("vkQueuePresentKHR");
+		Entry* entry = &entries[index];
 
-		VkResult present_result = vkQueuePresentKHR(device_queue, &presentInfo);
-		if (present_result == VK_ERROR_OUT_OF_DATE_KHR)
+		if (entry->key.hash == 0)
 		{
-			// Frame that supposed to be presented won't be presented.
-			swapchain_is_dead = true;
-		}
-	}
+			entry->key         = key;
+			entry->glyph_index = glyph_index;
 
+			count += 1;
 
-	{
-		for (auto& item: imm_used_uniform_buffer_memory_allocations)
-		{
-			vkDestroyBuffer(device, item.buffer, host_allocator);
-			vulkan_memory_allocator.free(item.memory);
+			return glyph_index;
 		}
 
-		imm_used_uniform_buffer_memory_allocations.clear();
+		assert(entry->key != key);
 	}
 }
 
-void Renderer::draw_level(Level* level)
+// Backward shift deletion: entries after the hole that would be reachable from their home slot through it are moved into it,
+//  so probe sequences never cross an empty slot and no tombstones are needed.
+void Glyph_Cache::remove(s32 glyph_index)
 {
-	
-}
+	Cached_Glyph* glyph = glyphs[glyph_index];
 
+	u32 mask = capacity - 1;
 
+	u32 hole = glyph->key.hash & mask;
+	while (entries[hole].key != glyph->key)
+	{
+		assert(entries[hole].key.hash != 0);
+		hole = (hole + 1) & mask;
+	}
 
+	for (u32 index = (hole + 1) & mask; entries[index].key.hash != 0; index = (index + 1) & mask)
+	{
+		u32 home = entries[index].key.hash & mask;
 
+		// Distance from home is at least distance from hole, so the entry can move back into the hole.
+		if (((index - home) & mask) >= ((index - hole) & mask))
+		{
+			entries[hole] = entries[index];
+			hole = index;
+		}
+	}
 
+	entries[hole] = {};
+	count -= 1;
 
 
+	unlink_from_atlas(glyph_index);
 
-bool Renderer::should_resize()
-{
-	return swapchain_is_dead;
+	// Front cache might still point here, key check rejects it.
+	glyph->key  = {};
+	glyph->next = first_free_glyph;
+	first_free_glyph = glyph_index;
 }
 
-
-void Renderer::resize(int new_width, int new_height)
+void Glyph_Cache::mark_used(s32 glyph_index, u64 frame)
 {
-	ZoneScoped;
-
-
-	if (new_width  == width &&
-		new_height == height) return;
+	Cached_Glyph* glyph = glyphs[glyph_index];
 
+	if (glyph->region.last_used_frame == frame) return;
 
-	width = new_width;
-	height = new_height;
+	glyph->region.last_used_frame = frame;
 
-	recreate_swapchain();
+	unlink_from_atlas(glyph_index);
+	link_to_atlas(glyph_index);
 }
 
+void Glyph_Cache::link_to_atlas(s32 glyph_index)
+{
+	Cached_Glyph*  glyph = glyphs[glyph_index];
+	Texture_Atlas* atlas = glyph->region.atlas;
 
+	glyph->previous = -1;
+	glyph->next     = atlas->lru_first;
 
+	if (atlas->lru_first != -1)
+	{
+		glyphs[atlas->lru_first]->previous = glyph_index;
+	}
+	else
+	{
+		atlas->lru_last = glyph_index;
+	}
 
-void Renderer::imm_recalculate_mask_buffer()
-{
-	ZoneScoped;
+	atlas->lru_first = glyph_index;
+}
 
-	imm_commands.add({
-		.type = Imm_Command_Type::Recalculate_Mask_Buffer,
+void Glyph_Cache::unlink_from_atlas(s32 glyph_index)
+{
+	Cached_Glyph*  glyph = glyphs[glyph_index];
+	Texture_Atlas* atlas = glyph->region.atlas;
 
-		.recalculate_mask_buffer = {
-			.mask_stack = imm_mask_stack.copy_with(frame_allocator),
-		}
-	});
-}
+	if (glyph->previous != -1) glyphs[glyph->previous]->next = glyph->next;
+	else                       atlas->lru_first = glyph->next;
 
+	if (glyph->next != -1) glyphs[glyph->next]->previous = glyph->previous;
+	else                   atlas->lru_last = glyph->previous;
 
+	glyph->previous = -1;
+	glyph->next     = -1;
+}
 
-void Renderer::imm_draw_text(Font::Face* face, Unicode_String str, int x, int y, rgba color)
+void Glyph_Cache::grow()
 {
 	ZoneScoped;
 
-	auto iter = string_by_glyphs(str, face);
-	int iter_previous_x = iter.x;
-	while (iter.next())
-	{
-		defer{ iter_previous_x = iter.x; };
-
-		if (!iter.render_glyph) continue;
+	Entry* old_entries  = entries;
+	int    old_capacity = capacity;
 
-		// :GlyphLocalCoords:
-		imm_draw_glyph(&iter.current_glyph, x + iter_previous_x + iter.current_glyph.left_offset, y - (iter.current_glyph.height - iter.current_glyph.top_offset), color);
-	}
-}
+	capacity *= 2;
 
+	entries = (Entry*) c_allocator.alloc(sizeof(Entry) * capacity, code_location());
+	memset(entries, 0, sizeof(Entry) * capacity);
 
-void Renderer::imm_draw_text_culled(Font::Face* face, Unicode_String str, int x, int y, Rect cull_rect, rgba color)
-{
-	ZoneScoped;
+	u32 mask = capacity - 1;
 
-	auto iter = string_by_glyphs(str, face);
-	int iter_previous_x = iter.x;
-	while (iter.next())
+	for (int i = 0; i < old_capacity; i++)
 	{
-		defer{ iter_previous_x = iter.x; };
+		Entry* old = &old_entries[i];
 
-		if (!iter.render_glyph) continue;
+		if (old->key.hash == 0) continue;
 
-		int local_x =  x + iter_previous_x + iter.current_glyph.left_offset;
-		if (local_x > cull_rect.x_right) // Assuming left-to-right text.
+		u32 index = old->key.hash & mask;
+		while (entries[index].key.hash != 0)
 		{
-			break;
+			index = (index + 1) & mask;
 		}
 
-		imm_draw_glyph(&iter.current_glyph, local_x, y - (iter.current_glyph.height - iter.current_glyph.top_offset), color);
-
+		entries[index] = *old;
 	}
+
+	c_allocator.free(old_entries, code_location());
 }
 
+void Glyph_Cache::clear_front_cache()
+{
+	for (s32& index: front_cache)
+	{
+		index = -1;
+	}
+}
 
 
-void Renderer::imm_draw_texture(Rect rect, Texture* texture)
+void Renderer::imm_queue_atlas_upload(Texture_Atlas* atlas, void* image_buffer, int width, int height, int x, int y)
 {
-	ZoneScoped;
+	if (width == 0 || height == 0) return;
 
-	imm_commands.add({
-		.type = Imm_Command_Type::Draw_Texture,
+	Frame_Slot* slot = current_frame_slot();
 
-		.draw_texture = {
-			.rect  = rect,
-			.texture_name = texture->name,
-		}
-	});
-}
+	u64 size = u64(width) * u64(height);
 
-void Renderer::imm_draw_rect(Rect rect, rgba color)
-{
-	ZoneScoped;
+	// Offset must be a multiple of 4 for copies on transfer capable queues.
+	u64 offset;
+	if (!slot->staging_buffer.allocate(size, 4, &offset))
+	{
+		grow_frame_linear_buffer(slot, &slot->staging_buffer, size + 4);
 
-	imm_commands.add({
-		.type = Imm_Command_Type::Draw_Rect,
+		bool allocated = slot->staging_buffer.allocate(size, 4, &offset);
+		assert(allocated);
+	}
 
-		.draw_rect = {
-			.rect  = rect,
-			.color = color
-		}
+	memcpy(slot->staging_buffer.mapped_data + offset, image_buffer, size);
+
+	imm_pending_atlas_uploads.add({
+		.atlas = atlas,
+		.staging_buffer = slot->staging_buffer.buffer,
+		.region = {
+			.bufferOffset      = offset,
+			.bufferRowLength   = 0,
+			.bufferImageHeight = 0,
+
+			.imageSubresource = {
+				.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+				.mipLevel       = 0,
+				.baseArrayLayer = 0,
+				.layerCount     = 1,
+			},
+
+			.imageOffset = { x, y, 0 },
+			.imageExtent = { (u32) width, (u32) height, 1 },
+		},
 	});
 }
 
-
-void Renderer::imm_draw_rect_with_alpha_fade(Rect rect, rgba color, int alpha_left, int alpha_right)
+// One copy and a pair of barriers per touched atlas (and staging buffer), no matter how many glyphs were added.
+void Renderer::imm_record_atlas_uploads()
 {
 	ZoneScoped;
 
-	imm_commands.add({
-		.type = Imm_Command_Type::Draw_Faded_Rect,
+	if (imm_pending_atlas_uploads.count == 0) return;
 
-		.draw_faded_rect = {
-			.rect  = rect,
-			.color = color,
+	defer { imm_pending_atlas_uploads.clear(); };
 
-			.alpha_left  = alpha_left,
-			.alpha_right = alpha_right,
-		}
-	});
-}
 
-void Renderer::imm_draw_line(int x0, int y0, int x1, int y1, rgba color)
-{
-	ZoneScoped;
+	Dynamic_Array<VkBufferImageCopy> regions = make_array<VkBufferImageCopy>(imm_pending_atlas_uploads.count, frame_allocator);
 
-	imm_commands.add({
-		.type = Imm_Command_Type::Draw_Line,
+	for (int i = 0; i < imm_pending_atlas_uploads.count; i++)
+	{
+		Texture_Atlas* atlas          = imm_pending_atlas_uploads[i]->atlas;
+		VkBuffer       staging_buffer = imm_pending_atlas_uploads[i]->staging_buffer;
 
-		.draw_line = {
-			
-			.x0 = x0,
-			.y0 = y0,
-			.x1 = x1,
-			.y1 = y1,
+		// Atlas has already been handled.
+		bool is_handled = false;
+		for (int j = 0; j < i; j++)
+		{
+			if (imm_pending_atlas_uploads[j]->atlas == atlas && imm_pending_atlas_uploads[j]->staging_buffer == staging_buffer)
+			{
+				is_handled = true;
+				break;
+			}
+		}
+		if (is_handled) continue;
 
-			.color = color,
+
+		regions.clear();
+
+		for (int j = i; j < imm_pending_atlas_uploads.count; j++)
+		{
+			if (imm_pending_atlas_uploads[j]->atlas == atlas && imm_pending_atlas_uploads[j]->staging_buffer == staging_buffer)
+			{
+				regions.add(imm_pending_atlas_uploads[j]->region);
+			}
 		}
-	});
-}
 
 
+		VkImageMemoryBarrier barrier = {
+			.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+			.pNext = NULL,
 
-void Renderer::imm_draw_glyph(Glyph* glyph, int x, int y, rgba color)
-{
-	ZoneScoped;
+			.srcAccessMask = atlas->has_contents ? VK_ACCESS_SHADER_READ_BIT : (VkAccessFlags) 0,
+			.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
 
-	if (glyph->width == 0 || glyph->height == 0) return;
+			// Fresh atlas has nothing worth preserving.
+			.oldLayout = atlas->has_contents ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_UNDEFINED,
+			.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
 
+			.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
 
-	imm_commands.add({
-		.type = Imm_Command_Type::Draw_Glyph,
+			.image = atlas->image,
+			.subresourceRange = {
+				.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+				.baseMipLevel = 0,
+				.levelCount = 1,
+				.baseArrayLayer = 0,
+				.layerCount = 1,
+			},
+		};
 
-		.draw_glyph = {
-			
-			.glyph = *glyph,
+		// Frames still in flight may be sampling other glyphs of this atlas.
+		vkCmdPipelineBarrier(main_command_buffer,
+			VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+			VK_PIPELINE_STAGE_TRANSFER_BIT,
+			0,
+			0, NULL,
+			0, NULL,
+			1, &barrier);
 
-			.x = x,
-			.y = y,
+		vkCmdCopyBufferToImage(main_command_buffer, staging_buffer, atlas->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, regions.count, regions.data);
 
-			.color = color,
-		}
-	});
-}
 
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		barrier.oldLayout     = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		barrier.newLayout     = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+		vkCmdPipelineBarrier(main_command_buffer,
+			VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+			0,
+			0, NULL,
+			0, NULL,
+			1, &barrier);
+
+		atlas->has_contents = true;
+	}
+}
 
 void Renderer::imm_execute_commands()
 {
@@ -2518,62 +4828,10 @@ void Renderer::imm_execute_commands()
 #endif
 
 
-	// Upload missing glyps to the GPU.
-	{
-		ZoneScopedN("Upload missing glyphs");
-
-		for (Imm_Command& command: imm_commands)
-		{			
-			if (command.type != Imm_Command_Type::Draw_Glyph) continue;
-
-
-			Glyph& glyph = command.draw_glyph.glyph;
-
-			Glyph_Key glyph_key = Glyph_Key::make(glyph);
-
-			Glyph_Gpu_Region* slot = glyph_gpu_map.get(glyph_key);
-
-			if (!slot)
-			{
-				// Glyph is not on GPU.
-
-				constexpr int atlas_size = 1024;
-
-				if (glyph_atlasses.count == 0)
-				{
-					glyph_atlasses.add(Texture_Atlas::make(atlas_size));
-				}
-
-
-				Texture_Atlas* atlas = glyph_atlasses[glyph_atlasses.count - 1];
-
-				int uv_x_left;
-				int uv_y_bottom;
-
-				if (!atlas->put_in(glyph.image_buffer, glyph.width, glyph.height, &uv_x_left, &uv_y_bottom))
-				{
-					atlas = glyph_atlasses.add(Texture_Atlas::make(atlas_size));
-
-					bool result = atlas->put_in(glyph.image_buffer, glyph.width, glyph.height, &uv_x_left, &uv_y_bottom);
-					assert(result);
-				}
-
-				slot  = glyph_gpu_map.put(glyph_key, {
-					.atlas = atlas,
-					.offset = Vector2i::make(uv_x_left, uv_y_bottom),
-				});
-			}
-
-			assert(slot);
-
-			command.draw_glyph.glyph_gpu_region = *slot;
-		}
-	}
-
-
-
 	int batch_starting_command_index = -1;
-	Texture_Atlas* current_atlas = NULL;
+
+	// Set by Recalculate_Mask_Buffer, frame_begin always emits one before any draw.
+	Rect current_clip_rect = Rect::make(0, 0, renderer.width, renderer.height);
 
 	auto flush_at = [&](int batch_ending_command_index)
 	{
@@ -2584,132 +4842,166 @@ void Renderer::imm_execute_commands()
 
 		defer{ batch_starting_command_index = -1; };
 
-		int instance_count = batch_ending_command_index - batch_starting_command_index + 1;
+		// Upper bound, batch may contain Recalculate_Mask_Buffer commands that don't produce instances.
+		int max_instance_count = batch_ending_command_index - batch_starting_command_index + 1;
 
-		if (instance_count == 0) return;
+		if (max_instance_count == 0) return;
 
 		begin_debug_marker("Execute batched draw", rgba(0, 150, 70, 255));
 		defer { end_debug_marker(); };
 
 
-		assert(instance_count > 0);
+		assert(max_instance_count > 0);
 
 
 		vkCmdBindPipeline(main_command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, imm_general_pipeline.pipeline);
 
-		size_t uniform_buffer_size = instance_count * sizeof(Batched_Draw_Command_Block);
+		Frame_Slot* slot = current_frame_slot();
 
-		VkBufferCreateInfo buffer_create_info = {
-			.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-			.pNext = NULL,	
-			.flags = 0,
-			.size = uniform_buffer_size,
-			.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-			.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
-			.queueFamilyIndexCount = 0,
+		u64 instances_size = max_instance_count * sizeof(Imm_Instance);
+
+		u64 instances_offset;
+		if (!slot->upload_buffer.allocate(instances_size, sizeof(Imm_Instance), &instances_offset))
+		{
+			imm_grow_upload_buffer(slot, instances_size);
+
+			bool allocated = slot->upload_buffer.allocate(instances_size, sizeof(Imm_Instance), &instances_offset);
+			assert(allocated);
+		}
+
+		imm_upload_statistics.allocations += 1;
+		imm_upload_statistics.bytes       += instances_size;
+
+
+		auto pack_rect = [](s16* out, int x_left, int y_bottom, int x_right, int y_top)
+		{
+			out[0] = (s16) max(-32768, min(x_left,   32767));
+			out[1] = (s16) max(-32768, min(y_bottom, 32767));
+			out[2] = (s16) max(-32768, min(x_right,  32767));
+			out[3] = (s16) max(-32768, min(y_top,    32767));
+		};
+
+		auto pack_color = [](rgba color) -> u32
+		{
+			return u32(color.r) | (u32(color.g) << 8) | (u32(color.b) << 16) | (u32(color.a) << 24);
+		};
+
+		auto pack_params = [](int draw_type, int alpha_left, int alpha_right, u32 texture_index) -> u32
+		{
+			assert(texture_index < imm_max_textures);
+
+			return u32(draw_type) | (u32(alpha_left) << 4) | (u32(alpha_right) << 12) | (texture_index << 20);
 		};
 
-		VkBuffer uniform_buffer;
-		vkCreateBuffer(device, &buffer_create_info, host_allocator, &uniform_buffer);
+		auto pack_uv = [](int coord, int atlas_size) -> u16
+		{
+			return (u16) ((u64(coord) * 65535 + u64(atlas_size / 2)) / u64(atlas_size));
+		};
 
-		auto memory = vulkan_memory_allocator.allocate_and_bind(uniform_buffer, VULKAN_MEMORY_SHOULD_BE_MAPPABLE, code_location());
 
+		int instance_count = 0;
 
-		// Upload uniform data.
+		// Write instances straight into persistently mapped memory.
 		{
-			void* data;
-			vkMapMemory(device, memory.device_memory, memory.offset, memory.size, 0, &data);
+			Imm_Instance* instances = (Imm_Instance*) (slot->upload_buffer.mapped_data + instances_offset);
 
-			for (int i = 0; i < instance_count; i++)
+			for (int i = batch_starting_command_index; i <= batch_ending_command_index; i++)
 			{
-				Batched_Draw_Command_Block* block = ((Batched_Draw_Command_Block*) data) + i;
+				Imm_Command* command = imm_commands[i];
+
+				// Clip rect changes are already baked into commands' clip_rect.
+				if (command->type == Imm_Command_Type::Recalculate_Mask_Buffer) continue;
 
-				Imm_Command* command = imm_commands[batch_starting_command_index + i];
+				Imm_Instance* instance = instances + instance_count;
+				instance_count += 1;
 
 			#if DEBUG
 				command->is_executed = true;
 			#endif
 
-				block->screen_size = {
-					renderer.width,
-					renderer.height,
-				};
+				pack_rect(instance->clip_rect, command->clip_rect.x_left, command->clip_rect.y_bottom, command->clip_rect.x_right, command->clip_rect.y_top);
 
 				switch (command->type)
 				{
 					case Imm_Command_Type::Draw_Rect:
 					{
-						block->draw_type = DRAW_TYPE_RECT;
-
-						block->rect = Vector4i::make(
-							command->draw_rect.rect.x_left,
-							command->draw_rect.rect.y_bottom,
-							command->draw_rect.rect.x_right,
-							command->draw_rect.rect.y_top
-						);
-						block->color = Vector4::make(
-							command->draw_rect.color.r,
-							command->draw_rect.color.g,
-							command->draw_rect.color.b,
-							command->draw_rect.color.a
-						);
+						Rect& rect = command->draw_rect.rect;
+
+						pack_rect(instance->rect, rect.x_left, rect.y_bottom, rect.x_right, rect.y_top);
+
+						instance->color  = pack_color(command->draw_rect.color);
+						instance->params = pack_params(DRAW_TYPE_RECT, 0, 0, white_texture.texture_index);
 					}
 					break;
 					case Imm_Command_Type::Draw_Faded_Rect:
 					{
-						block->draw_type = DRAW_TYPE_FADED_RECT;
-
+						Rect& rect = command->draw_faded_rect.rect;
 
-						block->rect = Vector4i::make(
-							command->draw_faded_rect.rect.x_left,
-							command->draw_faded_rect.rect.y_bottom,
-							command->draw_faded_rect.rect.x_right,
-							command->draw_faded_rect.rect.y_top
-						);
-						block->color = Vector4::make(
-							command->draw_faded_rect.color.r,
-							command->draw_faded_rect.color.g,
-							command->draw_faded_rect.color.b,
-							command->draw_faded_rect.color.a
-						);
+						pack_rect(instance->rect, rect.x_left, rect.y_bottom, rect.x_right, rect.y_top);
 
-
-						block->faded_rect_left_alpha  = float(command->draw_faded_rect.alpha_left)  / 255.0f;
-						block->faded_rect_right_alpha = float(command->draw_faded_rect.alpha_right) / 255.0f; 
+						instance->color  = pack_color(command->draw_faded_rect.color);
+						instance->params = pack_params(DRAW_TYPE_FADED_RECT, command->draw_faded_rect.alpha_left, command->draw_faded_rect.alpha_right, white_texture.texture_index);
 					}
 					break;
 					case Imm_Command_Type::Draw_Glyph:
 					{
-						block->draw_type = DRAW_TYPE_GLYPH;
-
 						auto& glyph = command->draw_glyph.glyph;
 
-						block->rect = Vector4i::make(
+						pack_rect(instance->rect,
 							command->draw_glyph.x,
 							command->draw_glyph.y,
 							command->draw_glyph.x + glyph.width,
-							command->draw_glyph.y + glyph.height
-						);
-						
-						block->color = Vector4::make(
-							command->draw_glyph.color.r,
-							command->draw_glyph.color.g,
-							command->draw_glyph.color.b,
-							command->draw_glyph.color.a
-						);
-
+							command->draw_glyph.y + glyph.height);
 
 						Glyph_Gpu_Region& glyph_gpu_region = command->draw_glyph.glyph_gpu_region;
 
 						auto atlas = glyph_gpu_region.atlas;
-						assert(atlas == current_atlas);
 
-						block->atlas_x_left   = float(glyph_gpu_region.offset.x) / float(atlas->size);
-						block->atlas_y_bottom = float(glyph_gpu_region.offset.y) / float(atlas->size);
+						instance->color  = pack_color(command->draw_glyph.color);
+						instance->params = pack_params(DRAW_TYPE_GLYPH, 0, 0, atlas->texture_index);
 
-						block->atlas_x_right  = float(glyph_gpu_region.offset.x + glyph.width)  / float(atlas->size);
-						block->atlas_y_top    = float(glyph_gpu_region.offset.y + glyph.height) / float(atlas->size);
-						
+						instance->uv[0] = pack_uv(glyph_gpu_region.offset.x,                atlas->size);
+						instance->uv[1] = pack_uv(glyph_gpu_region.offset.y,                atlas->size);
+						instance->uv[2] = pack_uv(glyph_gpu_region.offset.x + glyph.width,  atlas->size);
+						instance->uv[3] = pack_uv(glyph_gpu_region.offset.y + glyph.height, atlas->size);
+					}
+					break;
+					case Imm_Command_Type::Draw_Line:
+					{
+						auto& line = command->draw_line;
+
+						pack_rect(instance->rect, line.x0, line.y0, line.x1, line.y1);
+
+						instance->color  = pack_color(line.color);
+						instance->params = pack_params(DRAW_TYPE_LINE, 0, 0, white_texture.texture_index);
+
+						instance->uv[0] = (u16) max(0, min(int(line.thickness * 16.0f + 0.5f), 65535));
+						instance->uv[1] = line.anti_aliased ? 1 : 0;
+						instance->uv[2] = 0;
+						instance->uv[3] = 0;
+					}
+					break;
+					case Imm_Command_Type::Draw_Texture:
+					{
+						Rect& rect = command->draw_texture.rect;
+
+						if (command->draw_texture.texture_index == u32_max)
+						{
+							// Texture wasn't found, empty rect doesn't produce any fragments.
+							pack_rect(instance->rect, 0, 0, 0, 0);
+						}
+						else
+						{
+							pack_rect(instance->rect, rect.x_left, rect.y_bottom, rect.x_right, rect.y_top);
+						}
+
+						instance->color  = u32_max;
+						instance->params = pack_params(DRAW_TYPE_TEXTURE, 0, 0, command->draw_texture.texture_index == u32_max ? white_texture.texture_index : command->draw_texture.texture_index);
+
+						instance->uv[0] = 0;
+						instance->uv[1] = 0;
+						instance->uv[2] = 65535;
+						instance->uv[3] = 65535;
 					}
 					break;
 
@@ -2717,73 +5009,35 @@ void Renderer::imm_execute_commands()
 						assert(false);
 				}
 			}
-
-			vkUnmapMemory(device, memory.device_memory);
 		}
 
-	
-		imm_used_uniform_buffer_memory_allocations.add({
-			.buffer = uniform_buffer,
-			.memory = memory,
-		});
-
-		auto descriptor_set = imm_get_descriptor_set(imm_general_pipeline.descriptor_set_layout);
-	
-		// Push uniform buffer to descriptor set.
-		{
-			
 
-			VkDescriptorBufferInfo buffer_info = {
-				.buffer = uniform_buffer,
-				.offset = 0,
-				.range = VK_WHOLE_SIZE
-			};
+		if (instance_count == 0) return;
 
-			VkDescriptorImageInfo image_info = {
-				.sampler   = current_atlas ? current_atlas->image_sampler : white_texture.image_sampler,
-			    .imageView = current_atlas ? current_atlas->image_view : white_texture.image_view,
-				.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-			};
 
-			VkWriteDescriptorSet write_infos[] = {
-				{
-					.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-					.pNext = NULL,
-					.dstSet = descriptor_set,
-					.dstBinding = 0,
-					.dstArrayElement = 0,
-					.descriptorCount = 1,
-					.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-					.pBufferInfo = &buffer_info,
-				},
+		VkDescriptorSet descriptor_sets[] = {
+			imm_get_general_descriptor_set(),
+			imm_texture_table,
+		};
 
-				{
-					.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-					.pNext = NULL,
-					.dstSet = descriptor_set,
-					.dstBinding = 1,
-					.dstArrayElement = 0,
-					.descriptorCount = 1,
-					.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-					.pImageInfo = &image_info,
-				},
-			};
+		{
+			ZoneScopedN("vkCmdBindDescriptorSets");
+			vkCmdBindDescriptorSets(main_command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, imm_general_pipeline.pipeline_layout, 0, array_count(descriptor_sets), descriptor_sets, 0, NULL);
+		}
 
-			{
-				ZoneScopedN("vkUpdateDescriptorSets");
-				vkUpdateDescriptorSets(device, array_count(write_infos), write_infos, 0, NULL);
-			}
+		General_Uniform_Block uniform = {
+			.screen_size = {
+				renderer.width,
+				renderer.height
+			},
+		};
 
-			{
-				ZoneScopedN("vkCmdBindDescriptorSets");
-				vkCmdBindDescriptorSets(main_command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, imm_general_pipeline.pipeline_layout, 0, 1, &descriptor_set, 0, NULL);
-			}
-		}
+		vkCmdPushConstants(main_command_buffer, imm_general_pipeline.pipeline_layout, VK_SHADER_STAGE_ALL_GRAPHICS, 0, sizeof(uniform), &uniform);
 
 
 		{
 			ZoneScopedN("vkCmdDrawIndexed");
-		    vkCmdDraw(main_command_buffer, 6, instance_count, 0, 0);
+		    vkCmdDraw(main_command_buffer, 6, instance_count, 0, u32(instances_offset / sizeof(Imm_Instance)));
 		}	
 	};
 
@@ -2806,12 +5060,17 @@ void Renderer::imm_execute_commands()
 		{
 			case Imm_Command_Type::Recalculate_Mask_Buffer:
 			{
-				flush_at(index - 1);
-
 			#if DEBUG
 				command.is_executed = true;
 			#endif
 
+				current_clip_rect = command.recalculate_mask_buffer.clip_rect;
+
+				// Clip rect alone doesn't require any GPU work, batch in progress just continues.
+				if (!command.recalculate_mask_buffer.rebuild_stencil) break;
+
+
+				flush_at(index - 1);
 
 				begin_debug_marker("Recalculate mask buffer", rgba(150, 0, 0, 255));
 				defer { end_debug_marker(); };
@@ -2831,177 +5090,24 @@ void Renderer::imm_execute_commands()
 			    vkCmdDraw(main_command_buffer, 6, 1, 0, 0);
 
 
+				if (command.recalculate_mask_buffer.inversed_masks.count == 0) break;
+
 				vkCmdBindPipeline(main_command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, imm_inversed_mask_pipeline.pipeline);
 
-				for (auto& mask: command.recalculate_mask_buffer.mask_stack)
+				for (Rect& rect: command.recalculate_mask_buffer.inversed_masks)
 				{
-					// :MaskStackOuterRects
-					Rect left_rect = Rect::make(
-						0,
-						0,
-						mask.rect.x_left,
-						renderer.height
-					);
-
-					Rect bottom_rect = Rect::make(
-						mask.rect.x_left,
-						0,
-						mask.rect.x_right,
-						mask.rect.y_bottom
-					);
-					
-					Rect right_rect = Rect::make(
-						mask.rect.x_right,
-						0,
-						renderer.width,
-						renderer.height
-					);
-
-					Rect top_rect = Rect::make(
-						mask.rect.x_left,
-						mask.rect.y_top,
-						mask.rect.x_right,
-						renderer.height
-					);
-
-
-
-					auto draw_rect = [&](Rect rect)
-					{
-						Mask_Uniform_Block uniform = {
-							.screen_size = {
-								renderer.width,
-								renderer.height
-							},
-							
-							.rect = Vector4i::make(rect.x_left, rect.y_bottom, rect.x_right, rect.y_top),
-						};
+					Mask_Uniform_Block uniform = {
+						.screen_size = {
+							renderer.width,
+							renderer.height
+						},
 						
-						vkCmdPushConstants(main_command_buffer, imm_inversed_mask_pipeline.pipeline_layout, VK_SHADER_STAGE_ALL_GRAPHICS, 0, sizeof(uniform), &uniform);
-					    vkCmdDraw(main_command_buffer, 6, 1, 0, 0);
+						.rect = Vector4i::make(rect.x_left, rect.y_bottom, rect.x_right, rect.y_top),
 					};
-
-
-					if (mask.inversed)
-					{
-						draw_rect(mask.rect);
-					}
-					else
-					{
-						draw_rect(left_rect);
-						draw_rect(right_rect);
-						draw_rect(top_rect);
-						draw_rect(bottom_rect);
-					}
-				}
-			}
-			break;
-
-			case Imm_Command_Type::Draw_Line:
-			{
-				flush_at(index - 1);
-
-			#if DEBUG
-				command.is_executed = true;
-			#endif
-
-				begin_debug_marker("Draw line", rgba(0, 150, 80, 255));
-				defer { end_debug_marker(); };
-
-				vkCmdBindPipeline(main_command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, imm_line_pipeline.pipeline);
-
-				Line_Uniform_Block uniform = {
-					.screen_size = {
-						renderer.width,
-						renderer.height
-					},
 					
-					.line_start = Vector2i::make(command.draw_line.x0, command.draw_line.y0),
-					.line_end   = Vector2i::make(command.draw_line.x1, command.draw_line.y1),
-
-					.color = {
-						float(command.draw_line.color.r) / 255,
-						float(command.draw_line.color.g) / 255,
-						float(command.draw_line.color.b) / 255,
-						float(command.draw_line.color.a) / 255,			
-					},
-				};
-
-				vkCmdPushConstants(main_command_buffer, imm_line_pipeline.pipeline_layout, VK_SHADER_STAGE_ALL_GRAPHICS, 0, sizeof(uniform), &uniform);
-
-				vkCmdDraw(main_command_buffer, 2, 1, 0, 0);
-			}
-			break;
-
-			case Imm_Command_Type::Draw_Texture:
-			{
-				flush_at(index - 1);
-
-			#if DEBUG
-				command.is_executed = true;
-			#endif
-
-				begin_debug_marker("Draw texture", rgba(0, 150, 80, 255));
-				defer { end_debug_marker(); };
-
-				vkCmdBindPipeline(main_command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, imm_texture_pipeline.pipeline);
-
-				// Push texture to descriptor set.
-				{
-					Texture* texture = asset_storage.find_texture(command.draw_texture.texture_name);
-					if (!texture)
-					{
-						break;
-					}
-
-					make_sure_texture_is_on_gpu(texture);
-
-					auto descriptor_set = imm_get_descriptor_set(imm_texture_pipeline.descriptor_set_layout);
-	
-					VkDescriptorImageInfo image_info = {
-						.sampler   = texture->image_sampler,
-					    .imageView = texture->image_view,
-						.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-					};
-
-					VkWriteDescriptorSet write_infos[] = {
-						{
-							.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-							.pNext = NULL,
-							.dstSet = descriptor_set,
-							.dstBinding = 0,
-							.dstArrayElement = 0,
-							.descriptorCount = 1,
-							.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-							.pImageInfo = &image_info,
-						},
-					};
-
-					{
-						ZoneScopedN("vkUpdateDescriptorSets");
-						vkUpdateDescriptorSets(device, array_count(write_infos), write_infos, 0, NULL);
-					}
-
-					{
-						ZoneScopedN("vkCmdBindDescriptorSets");
-						vkCmdBindDescriptorSets(main_command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, imm_texture_pipeline.pipeline_layout, 0, 1, &descriptor_set, 0, NULL);
-					}
+					vkCmdPushConstants(main_command_buffer, imm_inversed_mask_pipeline.pipeline_layout, VK_SHADER_STAGE_ALL_GRAPHICS, 0, sizeof(uniform), &uniform);
+				    vkCmdDraw(main_command_buffer, 6, 1, 0, 0);
 				}
-
-
-				Rect& rect = command.draw_texture.rect;
-
-				Texture_Uniform_Block uniform = {
-					.screen_size = {
-						renderer.width,
-						renderer.height
-					},
-					
-					.rect = Vector4i::make(rect.x_left, rect.y_bottom, rect.x_right, rect.y_top),
-				};
-				
-				vkCmdPushConstants(main_command_buffer, imm_texture_pipeline.pipeline_layout, VK_SHADER_STAGE_ALL_GRAPHICS, 0, sizeof(uniform), &uniform);
-				vkCmdDraw(main_command_buffer, 6, 1, 0, 0);
 			}
 			break;
 
@@ -3010,40 +5116,28 @@ void Renderer::imm_execute_commands()
 				assert(
 					command.type == Imm_Command_Type::Draw_Rect ||
 					command.type == Imm_Command_Type::Draw_Glyph ||
-					command.type == Imm_Command_Type::Draw_Faded_Rect);
-
+					command.type == Imm_Command_Type::Draw_Faded_Rect ||
+					command.type == Imm_Command_Type::Draw_Texture ||
+					command.type == Imm_Command_Type::Draw_Line);
 
-				if (batch_starting_command_index == -1)
-				{
-					batch_starting_command_index = index;
-				}
 
+				command.clip_rect = current_clip_rect;
 
-				int number_of_batched_commands = index - batch_starting_command_index;
 
-				if (number_of_batched_commands >= max_batched_commands)
-				{
-					flush_at(index - 1);
-				}
-				else if (command.type == Imm_Command_Type::Draw_Glyph)
+				// Texture goes into the texture table once it's streamed in, its index is what ends up in the instance.
+				//  Until then white texture is drawn in its place.
+				if (command.type == Imm_Command_Type::Draw_Texture)
 				{
-					Glyph_Gpu_Region& glyph_gpu_region = command.draw_glyph.glyph_gpu_region;
+					command.draw_texture.texture_index = u32_max;
 
-					if (glyph_gpu_region.atlas != current_atlas)
+					Texture* texture = asset_storage.find_texture(command.draw_texture.texture_name);
+					if (texture && stream_texture_to_gpu(texture))
 					{
-						flush_at(index - 1);
+						command.draw_texture.texture_index = texture->texture_index;
 					}
 				}
 
 
-				if (command.type == Imm_Command_Type::Draw_Glyph)
-				{
-					Glyph_Gpu_Region& glyph_gpu_region = command.draw_glyph.glyph_gpu_region;
-
-					current_atlas = glyph_gpu_region.atlas;
-				}
-
-
 				if (batch_starting_command_index == -1)
 				{
 					batch_starting_command_index = index;
@@ -3130,326 +5224,226 @@ Texture_Atlas Texture_Atlas::make(int size)
     vkCreateSampler(renderer.device, &sampler_info, renderer.host_allocator, &image_sampler);
 
 
-    decltype(Texture_Atlas::free_rects) free_rects = make_array<Rect>(32, c_allocator);
-
-
-    free_rects.add(Rect::make(0, 0, size, size));
-
     return {
     	.image = image,
     	.image_view = image_view,
     	.image_sampler = image_sampler,
     	.image_memory = image_memory,
+    	.texture_index = renderer.imm_register_texture(image_view, image_sampler),
     	.size = size,
-    	.free_rects = free_rects,
+    	.shelves = make_array<Atlas_Shelf>(32, c_allocator),
     };
 }
 
-
-bool Texture_Atlas::put_in(void* image_buffer, int image_width, int image_height, int* out_uv_x_left, int* out_uv_y_bottom)
+// Caller makes sure that no frame in flight samples the atlas.
+void Texture_Atlas::destroy()
 {
 	ZoneScoped;
 
+	vkDestroySampler(renderer.device, image_sampler, renderer.host_allocator);
+	vkDestroyImageView(renderer.device, image_view, renderer.host_allocator);
+	vkDestroyImage(renderer.device, image, renderer.host_allocator);
+	vulkan_memory_allocator.free(image_memory);
 
-	int found_x_left;
-	int found_y_bottom;
+	renderer.imm_release_texture_index(texture_index);
 
-	// Find region to occupy
+	for (Atlas_Shelf& shelf: shelves)
 	{
-		ZoneScopedN("Find free atlas region");
-
-		String str = to_string(free_rects.count, frame_allocator);
-		ZoneText(str.data, str.length);
-
-		// Rects are guaranteed to go one after another to the right.
+		shelf.free_spans.free();
+	}
+	shelves.free();
 
-		constexpr bool perform_sanity_checks = false;
+	is_alive = false;
+}
 
 
-		auto validate_free_rects_indices = [&]()
-		{
-			if constexpr (perform_sanity_checks)
-			{
-				return;
-			}
-		
-			for (int i = 1; i < free_rects.count; i++)
-			{
-				assert(free_rects[i]->x_left == free_rects[i - 1]->x_right);
-			}
-		};
 
+bool Texture_Atlas::put_in(int image_width, int image_height, int* out_uv_x_left, int* out_uv_y_bottom)
+{
+	ZoneScoped;
 
-		/*
-			if free_rects.count = 100
+	if (image_width > size || image_height > size) return false;
 
-			then, this algorithm will do 100 + 99 +  98 + 97 ... iterations.
-		*/
 
+	int shelf_height = min(size, (int) align(image_height, atlas_shelf_height_step));
 
-		auto find_region = [&](int starting_index, int* out_starting_rect_index, int* out_ending_rect_index, int* out_width_sum, int* out_y_top) -> bool
+	// First fit, spans are sorted by x, so shelf fills up from the left.
+	auto put_in_shelf = [&](Atlas_Shelf* shelf) -> bool
+	{
+		for (int i = 0; i < shelf->free_spans.count; i++)
 		{
-			int leftmost_rect_with_enough_height = -1;
-			int minimum_y_top = s32_max;
-
-			for (int i = starting_index; i < free_rects.count; i++)
-			{
-				Rect rect = *free_rects[i];
-				assert(rect.y_bottom == 0);
-
-				validate_free_rects_indices();
-
-				if (rect.y_top >= image_height)
-				{
-					if (leftmost_rect_with_enough_height == -1)
-					{
-						leftmost_rect_with_enough_height = i;
-					}
-					
-
-					minimum_y_top = min(minimum_y_top, rect.y_top);
-
-				#if DEBUG
-					if constexpr (perform_sanity_checks)
-					{
-						for (int j = leftmost_rect_with_enough_height; j <= i; j++)
-						{
-							assert(free_rects[j]->y_top >= minimum_y_top);
-						}
-					}
-				#endif
-
-
-					int x_left = free_rects[leftmost_rect_with_enough_height]->x_left;
-					
-					int width = rect.x_right - x_left;
-
-					if (width >= image_width)
-					{
-						// Found enough space.
-
-						*out_y_top = minimum_y_top;
-
-						*out_starting_rect_index = leftmost_rect_with_enough_height;
-						*out_ending_rect_index = i;
-						*out_width_sum = width;
-
-						return true;
-					}
-					else
-					{
-						// Keep going
-					}
-				}
-				else
-				{
-					// Rect had not had enough height, so we begin searching height from next rectangles.
-					leftmost_rect_with_enough_height = -1;
-					minimum_y_top = s32_max;
-				}
-			}
-
-			return false;
-		};
+			Atlas_Span* span = shelf->free_spans[i];
 
+			if (span->width < image_width) continue;
 
 
-		bool does_best_exist = false;
+			*out_uv_x_left   = span->x;
+			*out_uv_y_bottom = shelf->y;
 
-		int best_y_top;
-		int best_starting_rect_index;
-		int best_ending_rect_index;
-		int best_width_sum;
+			span->x     += image_width;
+			span->width -= image_width;
 
-		for (int i = 0; i < free_rects.count; i++)
-		{
-			int starting_rect_index;
-			int ending_rect_index;
-			int width_sum;
-
-			int new_y_top;
-
-			if (find_region(i, &starting_rect_index, &ending_rect_index, &width_sum, &new_y_top))
+			if (span->width == 0)
 			{
-				i = starting_rect_index;
+				shelf->free_spans.remove_at_index(i);
+			}
 
-				bool should_write = !does_best_exist || (new_y_top > best_y_top);
-				if (should_write)
-				{
-					best_y_top = new_y_top;
+			shelf->occupied_width += image_width;
 
-					best_starting_rect_index = starting_rect_index;
-					best_ending_rect_index   = ending_rect_index;
-					best_width_sum = width_sum;
+			occupied_area += image_width * image_height;
+			regions_count += 1;
 
-					does_best_exist = true;
-				}
-			}
+			return true;
 		}
 
+		return false;
+	};
 
 
+	for (Atlas_Shelf& shelf: shelves)
+	{
+		if (shelf.height == shelf_height && put_in_shelf(&shelf)) return true;
+	}
 
-		if (does_best_exist)
-		{
-		#if DEBUG
-			if constexpr (perform_sanity_checks)
-			{
-				// Making sure, that resulting rectangle is in free region.
-
-				for (int i = best_starting_rect_index; i <= best_ending_rect_index; i++)
-				{
-					Rect rect = *free_rects[i];
-
-					assert(best_y_top <= rect.y_top);
-				}
-			}
-		#endif
+	if (shelves_top + shelf_height <= size)
+	{
+		Atlas_Shelf* shelf = shelves.add({
+			.y = shelves_top,
+			.height = shelf_height,
+			.occupied_width = 0,
+			.free_spans = make_array<Atlas_Span>(8, c_allocator),
+		});
 
-			best_y_top -= image_height;
+		shelf->free_spans.add({
+			.x = 0,
+			.width = size,
+		});
 
+		shelves_top += shelf_height;
 
-			Rect last_rect = *free_rects[best_ending_rect_index];
+		bool result = put_in_shelf(shelf);
+		assert(result);
 
+		return true;
+	}
 
-			for (int i = best_starting_rect_index; i <= best_ending_rect_index; i++)
-			{
-				free_rects[i]->y_top = best_y_top;
-			}
 
-			// Handle last rect, if it has pixels left, split it.
-			if (image_width < best_width_sum)
-			{
-				int new_x_border = last_rect.x_right - (best_width_sum - image_width);
+	// Atlas is full vertically, fall back to taller shelves, preferring the closest height.
+	Atlas_Shelf* best_shelf = NULL;
 
-				free_rects.add_at_index(best_ending_rect_index + 1, Rect::make(new_x_border, 0, last_rect.x_right, last_rect.y_top));
-				
-				free_rects[best_ending_rect_index]->x_right = new_x_border;
+	for (Atlas_Shelf& shelf: shelves)
+	{
+		if (shelf.height < shelf_height) continue;
+		if (shelf.height > shelf_height * 2 && shelf.occupied_width != 0) continue;
 
-				validate_free_rects_indices();
-			}
+		if (best_shelf && best_shelf->height <= shelf.height) continue;
 
-			found_x_left   = free_rects[best_starting_rect_index]->x_left;
-			found_y_bottom = best_y_top;
 
-		#if DEBUG
-			if constexpr (perform_sanity_checks)
+		for (Atlas_Span& span: shelf.free_spans)
+		{
+			if (span.width >= image_width)
 			{
-				// Making sure, that resulting rectangle is in now in occupied region.
-
-				for (int i = best_starting_rect_index; i <= best_ending_rect_index; i++)
-				{
-					Rect rect = *free_rects[i];
-
-					assert(best_y_top >= rect.y_top);
-				}
+				best_shelf = &shelf;
+				break;
 			}
-		#endif
-
-
-			// Merge consecutive rects with the same height.
-			{
-				int merge_start = -1;
-				int merge_start_y_top;
+		}
+	}
 
-				for (int i = 0; i < free_rects.count; i++)
-				{
-					Rect rect = free_rects.data[i];
+	if (best_shelf)
+	{
+		bool result = put_in_shelf(best_shelf);
+		assert(result);
 
-					if (merge_start == -1)
-					{
-						merge_start = i;
-						merge_start_y_top = rect.y_top;
+		return true;
+	}
 
-						continue;
-					}
-					else
-					{
-						if (rect.y_top != merge_start_y_top)
-						{
-							free_rects[merge_start]->x_right = free_rects[i - 1]->x_right;
+	return false;
+}
 
-							int remove_count = i - merge_start - 1;
+void Texture_Atlas::remove(int x_left, int y_bottom, int width, int height)
+{
+	ZoneScoped;
 
-							free_rects.remove_range(merge_start + 1, remove_count);
+	// Shelves are sorted by y.
+	int low  = 0;
+	int high = shelves.count - 1;
 
-							i -= remove_count;
+	Atlas_Shelf* shelf = NULL;
 
-							merge_start = i;
-							merge_start_y_top = rect.y_top;
-						}
-						else
-						{
-							continue;
-						}	
-					}
-				}
-			}
+	while (low <= high)
+	{
+		int middle = (low + high) / 2;
 
+		Atlas_Shelf* it = shelves[middle];
 
-			validate_free_rects_indices();
-		}
+		if      (it->y < y_bottom) low  = middle + 1;
+		else if (it->y > y_bottom) high = middle - 1;
 		else
 		{
-			return false;
+			shelf = it;
+			break;
 		}
 	}
 
+	assert(shelf);
 
-	*out_uv_x_left   = found_x_left;
-	*out_uv_y_bottom = found_y_bottom;
 
+	int index = 0;
+	while (index < shelf->free_spans.count && shelf->free_spans[index]->x < x_left)
+	{
+		index += 1;
+	}
 
-	assert(found_x_left >= 0);
-	assert(found_x_left <= size - image_width);
-	assert(found_y_bottom <= size - image_height);
-	assert(found_y_bottom >= 0);
+	shelf->free_spans.add_at_index(index, {
+		.x = x_left,
+		.width = width,
+	});
 
+	// Merge with right neighbour.
+	if (index + 1 < shelf->free_spans.count)
+	{
+		Atlas_Span* span = shelf->free_spans[index];
+		Atlas_Span* next = shelf->free_spans[index + 1];
 
+		if (span->x + span->width == next->x)
+		{
+			span->width += next->width;
+			shelf->free_spans.remove_at_index(index + 1);
+		}
+	}
 
+	// Merge with left neighbour.
+	if (index > 0)
 	{
-		ZoneScopedN("Upload texture to atlas");
+		Atlas_Span* previous = shelf->free_spans[index - 1];
+		Atlas_Span* span     = shelf->free_spans[index];
 
+		if (previous->x + previous->width == span->x)
+		{
+			previous->width += span->width;
+			shelf->free_spans.remove_at_index(index);
+		}
+	}
 
-	#if OS_DARWIN
-		VkFormat format = VK_FORMAT_R8_UNORM;
-	#else
-		VkFormat format = VK_FORMAT_R8_SRGB;
-	#endif
+	shelf->occupied_width -= width;
 
-		VkDeviceSize image_size = image_width * image_height;
-			
-		VkBuffer staging_buffer;
-		VkBufferCreateInfo create_info = {
-			.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-			.pNext = NULL,
-			.flags = 0,
-			.size = image_size,
-			.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-			.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
-			.queueFamilyIndexCount = 0,
-		};
-		vkCreateBuffer(renderer.device, &create_info, renderer.host_allocator, &staging_buffer);
-		Vulkan_Memory_Allocation staging_buffer_memory = vulkan_memory_allocator.allocate_and_bind(staging_buffer, VULKAN_MEMORY_SHOULD_BE_MAPPABLE, code_location());
+	occupied_area -= width * height;
+	regions_count -= 1;
 
-		{
-			void* data;
-		    vkMapMemory(renderer.device, staging_buffer_memory.device_memory, staging_buffer_memory.offset, image_size, 0, &data);
-			memcpy(data, image_buffer, image_size);
-		    vkUnmapMemory(renderer.device, staging_buffer_memory.device_memory);
-		}
+	assert(shelf->occupied_width >= 0);
+	assert(regions_count >= 0);
 
 
-		renderer.transition_image_layout(image, format, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-		renderer.copy_buffer_to_image(staging_buffer, image, image_width, image_height, found_x_left, found_y_bottom);
-		renderer.transition_image_layout(image, format, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+	// Give empty shelves on top back, so they can be reopened with different height.
+	while (shelves.count > 0 && shelves[shelves.count - 1]->occupied_width == 0)
+	{
+		Atlas_Shelf* last = shelves[shelves.count - 1];
 
+		shelves_top = last->y;
 
-		vkDestroyBuffer(renderer.device, staging_buffer, renderer.host_allocator);
-		vulkan_memory_allocator.free(staging_buffer_memory);
+		last->free_spans.free();
+		shelves.count -= 1;
 	}
-
-    return true;
 }
 
 
@@ -3467,9 +5461,6 @@ void Renderer::recreate_swapchain()
 		vkDestroyFramebuffer(device, main_framebuffer, host_allocator);
 		vkDestroyRenderPass(device, main_render_pass, host_allocator);
 
-		vkFreeCommandBuffers(device, command_pool, 1, &main_command_buffer);
-
-
 		vkDestroyImage(device, main_color_image, host_allocator);
 		vkDestroyImage(device, main_depth_stencil_image, host_allocator);
 
@@ -3491,7 +5482,7 @@ void Renderer::recreate_swapchain()
 
 
 
-void Renderer::transition_image_layout(VkImage image, VkFormat format, VkImageLayout old_layout, VkImageLayout new_layout)
+void Renderer::transition_image_layout(VkImage image, VkFormat format, VkImageLayout old_layout, VkImageLayout new_layout, u32 mip_levels_count)
 {
 	// ZoneScoped;
 
@@ -3506,7 +5497,7 @@ void Renderer::transition_image_layout(VkImage image, VkFormat format, VkImageLa
     barrier.image = image;
     barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
     barrier.subresourceRange.baseMipLevel = 0;
-    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.levelCount = mip_levels_count;
     barrier.subresourceRange.baseArrayLayer = 0;
     barrier.subresourceRange.layerCount = 1;
 
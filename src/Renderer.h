@@ -22,6 +22,7 @@
 #include "vulkan/vulkan.h"
 
 #include "Vulkan_Memory_Allocator.h"
+#include "Geometry_Manager.h"
 
 #if OS_WINDOWS
 #pragma comment(lib, "vulkan-1.lib")
@@ -85,27 +86,69 @@ struct Vertex
 };
 
 
+// How Mesh::vertices are laid out in the vertex buffer. CPU side always keeps Vertex.
+enum class Mesh_Vertex_Format
+{
+	Float,     // Vertex as is, 32 bytes.
+	Quantized, // Quantized_Vertex, 16 bytes. Decoded by shaders/mesh_vertex.glsl.h.
+};
+
+struct Quantized_Vertex
+{
+	u16 position[4]; // UNORM within Mesh bounds, w is padding.
+	s16 normal[2];   // SNORM, octahedral.
+	u16 uv[2];       // Half floats.
+};
+static_assert(sizeof(Quantized_Vertex) == 16);
+
+
+// Range of Mesh::indices. OBJ objects and groups become submeshes.
+struct Submesh
+{
+	u32 first_index;
+	u32 indices_count;
+};
+
 struct Mesh
 {
 	Unicode_String name;
 
 	Dynamic_Array<Vertex>  vertices;
 	Dynamic_Array<u32>     indices;
+	Dynamic_Array<Submesh> submeshes; // Empty means the whole mesh is one.
+
+	Vector3 bounds_min;
+	Vector3 bounds_max;
+
+	Mesh_Vertex_Format vertex_format = Mesh_Vertex_Format::Float;
+
+	// Ranges in geometry_manager's buffers, meshes sharing buffers are drawn without rebinding.
+	Geometry_Allocation vertex_allocation;
+	Geometry_Allocation index_allocation;
 
-	VkBuffer       vertex_buffer;
-	VkBuffer       index_buffer;
+	VkBuffer    vertex_buffer;
+	VkBuffer    index_buffer;
+	VkIndexType index_type; // 16 bit when vertices fit.
 
-	Vulkan_Memory_Allocation vertex_buffer_memory;
-	Vulkan_Memory_Allocation index_buffer_memory;
+	// vertexOffset and firstIndex of draws.
+	s32 vertex_offset;
+	u32 first_index;
+
+	bool is_on_gpu = false;
+	u64  last_used_frame = 0;
 
 	void allocate_on_gpu();
 };
 
+// Produced by import_texture(), see Texture_Import.h.
 enum class Texture_Format
 {
 	Monochrome,
-	RGB,
 	RGBA,
+
+	BC1, // Opaque RGB, 8 bytes per 4x4 block.
+	BC4, // Monochrome, 8 bytes per 4x4 block.
+	BC7, // RGBA, 16 bytes per 4x4 block.
 };
 
 struct Texture
@@ -116,23 +159,28 @@ struct Texture
 	int width;
 	int height;
 
-	u64 size;
+	u64 size; // Of the whole mip chain.
 
 	Texture_Format format;
+	int            mip_levels_count = 1;
 
 	bool is_on_gpu = false;
+	bool is_upload_pending = false; // Image is created, but transfer queue is still copying into it.
+	u64  last_used_frame = 0;
 
 	VkImage      image;
 	VkImageView  image_view;
 	VkSampler    image_sampler;
 	Vulkan_Memory_Allocation image_memory;
+
+	u32 texture_index = 0; // Index in renderer's texture table, valid when is_on_gpu.
 };
 
 struct Material
 {
 	Unicode_String name;
 
-
+	rgba color = rgba(255, 255, 255, 255);
 };
 
 struct Shader
@@ -144,6 +192,27 @@ struct Shader
 
 
 
+struct Atlas_Span
+{
+	int x;
+	int width;
+};
+
+struct Atlas_Shelf
+{
+	int y;
+	int height;
+
+	int occupied_width;
+
+	// Sorted by x, adjacent spans are always merged.
+	Dynamic_Array<Atlas_Span> free_spans;
+};
+
+// Region height is rounded up to this, so glyphs of close sizes share a shelf.
+constexpr int atlas_shelf_height_step = 4;
+
+
 // Currently 1 channel only.
 struct Texture_Atlas
 {
@@ -152,41 +221,90 @@ struct Texture_Atlas
 	VkImageView  image_view;
 	VkSampler    image_sampler;
 	Vulkan_Memory_Allocation image_memory;
+
+	u32 texture_index;
+
+	// Image stays in VK_IMAGE_LAYOUT_UNDEFINED until first upload.
+	bool has_contents = false;
 #endif
 
 	int size;
 
-	Dynamic_Array<Rect> free_rects;
+	// Sorted by y. Insert only looks at shelves, so its cost doesn't depend on how many regions atlas holds.
+	Dynamic_Array<Atlas_Shelf> shelves;
+	int shelves_top = 0;
+
+	int occupied_area = 0;
+	int regions_count = 0;
+
+	// Glyph_Cache::glyphs in the atlas, most recently used first.
+	s32 lru_first = -1;
+	s32 lru_last  = -1;
+
+	u64  last_used_frame = 0;
+	bool is_retiring = false; // Doesn't accept new regions, destroyed once it's empty and cold.
+	bool is_alive = true;
 
 	static Texture_Atlas make(int size);
+	void destroy();
 
-	bool put_in(void* image_buffer, int image_width, int image_height, int* out_uv_x_left, int* out_uv_y_bottom);
+	// Only reserves the region, pixels are uploaded with Renderer::imm_queue_atlas_upload.
+	bool put_in(int image_width, int image_height, int* out_uv_x_left, int* out_uv_y_bottom);
+	void remove(int x_left, int y_bottom, int width, int height);
+
+	inline float occupancy()
+	{
+		return float(occupied_area) / float(size * size);
+	}
 };
 
 
 
 struct Glyph_Key
 {
-	u8* image_buffer; // Image buffer should be unique.
-	int glyph_index;
+	Font::Face* face;
+	u32 glyph_index;
+	u16 pixel_size;
+	u8  subpixel_offset; // Glyphs are rasterized at whole pixels for now, so it's always 0.
 
+	u32 hash; // Computed once in make(), never 0.
 
-	static inline Glyph_Key make(const Glyph& glyph)
+
+	static inline Glyph_Key make(Font::Face* face, const Glyph& glyph, int subpixel_offset = 0)
 	{
-		return {
-			.image_buffer = glyph.image_buffer,
-			.glyph_index = glyph.freetype_glyph_index,
+		Glyph_Key key = {
+			.face = face,
+			.glyph_index = (u32) glyph.freetype_glyph_index,
+			.pixel_size = (u16) face->size,
+			.subpixel_offset = (u8) subpixel_offset,
 		};
+
+		// splitmix64 finalizer.
+		u64 x = u64(face) ^ (u64(key.glyph_index) << 32) ^ (u64(key.pixel_size) << 8) ^ u64(key.subpixel_offset);
+
+		x ^= x >> 30;
+		x *= 0xbf58476d1ce4e5b9;
+		x ^= x >> 27;
+		x *= 0x94d049bb133111eb;
+		x ^= x >> 31;
+
+		key.hash = u32(x) | 1;
+
+		return key;
 	}
 
 	bool operator!=(const Glyph_Key other) const
 	{
-		return image_buffer != other.image_buffer;
+		return !(*this == other);
 	}
 
 	bool operator==(const Glyph_Key other) const
 	{
-		return image_buffer == other.image_buffer;
+		return hash == other.hash &&
+			face == other.face &&
+			glyph_index == other.glyph_index &&
+			pixel_size == other.pixel_size &&
+			subpixel_offset == other.subpixel_offset;
 	}
 };
 
@@ -197,6 +315,68 @@ struct Glyph_Gpu_Region
 {
 	Texture_Atlas* atlas;
 	Vector2i       offset;
+	Vector2i       size;
+
+	u64 last_used_frame;
+};
+
+
+// Open addressing with linear probing, evicted glyphs are removed with backward shift deletion,
+//  so the table only holds glyphs that are on GPU.
+//  Table entries point to glyphs, which don't move, so they can be linked into their atlas's LRU list.
+struct Glyph_Cache
+{
+	struct Entry
+	{
+		Glyph_Key key; // key.hash == 0 means empty.
+		s32       glyph_index;
+	};
+
+	struct Cached_Glyph
+	{
+		Glyph_Key        key;
+		Glyph_Gpu_Region region;
+
+		// Atlas's LRU list, most recently used first. next is free list's link if glyph is unused.
+		s32 previous;
+		s32 next;
+	};
+
+	Entry* entries = NULL;
+	int capacity = 0; // Power of 2.
+	int count = 0;
+
+	Dynamic_Array<Cached_Glyph> glyphs;
+	s32 first_free_glyph = -1;
+
+	// Direct mapped by hash, text tends to repeat the same glyphs over and over.
+	//  Indices in glyphs, checked against glyph's key, so removed glyphs don't need clearing. Cleared every frame.
+	static constexpr int front_cache_size = 256;
+	s32 front_cache[front_cache_size];
+
+
+	void init(int initial_capacity);
+
+	// -1 if glyph is not cached.
+	s32  find(Glyph_Key key);
+	s32  add(Glyph_Key key, Glyph_Gpu_Region region);
+	void remove(s32 glyph_index);
+
+	// Moves glyph to the front of its atlas's LRU list.
+	void mark_used(s32 glyph_index, u64 frame);
+
+	inline Cached_Glyph* get(s32 glyph_index)
+	{
+		return glyphs[glyph_index];
+	}
+
+
+	// For internal usage.
+	void grow();
+	void clear_front_cache();
+
+	void link_to_atlas    (s32 glyph_index);
+	void unlink_from_atlas(s32 glyph_index);
 };
 
 
@@ -227,15 +407,23 @@ struct Imm_Command
 {
 	Imm_Command_Type type;
 
+	// Intersection of non-inversed masks, filled for batched draws in imm_execute_commands.
+	Rect clip_rect;
+
 #if DEBUG
 	bool is_executed = false;
 #endif
 
 	union
 	{
+		// Emitted only when clip rect or set of inversed masks changes.
+		//  Only inversed masks go to stencil buffer, rectangular clipping is done per instance.
 		struct
 		{
-			Dynamic_Array<Rect_Mask> mask_stack;
+			Rect clip_rect;
+
+			bool rebuild_stencil;
+			Dynamic_Array<Rect> inversed_masks;
 		} recalculate_mask_buffer;
 
 
@@ -249,6 +437,8 @@ struct Imm_Command
 		{
 			Rect rect;
 			Unicode_String texture_name;
+
+			u32 texture_index; // Resolved in imm_execute_commands, u32_max if texture is not found.
 		} draw_texture;
 
 		struct
@@ -268,12 +458,16 @@ struct Imm_Command
 			int y1;
 
 			rgba color;
+
+			float thickness;
+			bool  anti_aliased;
 		} draw_line;
 
 
 		struct
 		{
 			Glyph glyph;
+			Glyph_Key glyph_key;
 			int x;
 			int y;
 			rgba color;
@@ -288,14 +482,9 @@ struct Imm_Command
 #if RENDERER_VK
 constexpr int VULKAN_MAX_PUSH_CONSTANT_SIZE = 128;
 
+// Upper bound for settings.frames_in_flight.
+constexpr int max_frames_in_flight = 3;
 
-struct Line_Uniform_Block {
-	alignas(8) Vector2i screen_size;
-	alignas(8) Vector2i line_start;
-	alignas(8) Vector2i line_end;
-	alignas(16) Vector4 color;
-};
-static_assert(sizeof(Line_Uniform_Block) <= VULKAN_MAX_PUSH_CONSTANT_SIZE);
 
 struct Mask_Uniform_Block
 {
@@ -304,34 +493,53 @@ struct Mask_Uniform_Block
 };
 static_assert(sizeof(Mask_Uniform_Block) <= VULKAN_MAX_PUSH_CONSTANT_SIZE);
 
+const int DRAW_TYPE_RECT       = 0;
+const int DRAW_TYPE_GLYPH      = 1;
+const int DRAW_TYPE_FADED_RECT = 2;
+const int DRAW_TYPE_TEXTURE    = 3;
+const int DRAW_TYPE_LINE       = 4; // rect holds line's endpoints, uv[0] - thickness in 1/16 of pixel, uv[1] - anti aliasing flag.
+
+// Size of descriptor array that holds every texture and atlas, see imm_register_texture().
+const int imm_max_textures = 4096; // Keep in sync with Imm_Instance.params packing.
 
-struct Texture_Uniform_Block
+// Keep in sync with imm_uniform.glsl.h
+struct Imm_Instance
 {
-	alignas(8)  Vector2i screen_size;
-	alignas(16) Vector4i rect;
+	s16 rect[4];  // x_left, y_bottom, x_right, y_top
+	u16 uv[4];    // Atlas coords normalized to u16 range: x_left, y_bottom, x_right, y_top
+	s16 clip_rect[4];
+	u32 color;    // RGBA8, r in lowest byte.
+	u32 params;   // draw_type | faded_rect_left_alpha << 4 | faded_rect_right_alpha << 12 | texture_index << 20
 };
-static_assert(sizeof(Texture_Uniform_Block) <= VULKAN_MAX_PUSH_CONSTANT_SIZE);
+static_assert(sizeof(Imm_Instance) == 32);
+
+struct General_Uniform_Block
+{
+	alignas(8) Vector2i screen_size;
+};
+static_assert(sizeof(General_Uniform_Block) <= VULKAN_MAX_PUSH_CONSTANT_SIZE);
 
-const int DRAW_TYPE_RECT       = 0;
-const int DRAW_TYPE_GLYPH      = 1;
-const int DRAW_TYPE_FADED_RECT = 2;
 
-const int max_batched_commands = 512; // Keep in sync with C++
+// Keep in sync with mesh_uniform.glsl.h
+struct Mesh_Instance
+{
+	Vector4 rows[3]; // Object to world, row major 3x4.
+};
+static_assert(sizeof(Mesh_Instance) == 48);
+static_assert(sizeof(Mesh_Instance) == sizeof(World_Matrix)); // Instances are copies of entities' world matrices.
 
+void get_mesh_bounding_sphere(Mesh* mesh, Vector3* out_center, float* out_radius); // Object space, encloses bounds.
 
-struct Batched_Draw_Command_Block
+// view_projection is pushed once per level, the rest per draw.
+struct Mesh_Uniform_Block
 {
-	alignas(8)  Vector2i screen_size;
-	alignas(16) Vector4i rect;
-	alignas(4)  float faded_rect_left_alpha;
-	alignas(4)  float faded_rect_right_alpha;
-	alignas(4)  int draw_type;
-	alignas(4)  float atlas_x_left;
-	alignas(4)  float atlas_x_right;
-	alignas(4)  float atlas_y_bottom;
-	alignas(4)  float atlas_y_top;
-	alignas(16) Vector4 color;
+	float view_projection[16]; // Row major.
+
+	Vector4 bounds_min; // Quantized positions are relative to mesh bounds.
+	Vector4 bounds_max;
+	Vector4 color;
 };
+static_assert(sizeof(Mesh_Uniform_Block) <= VULKAN_MAX_PUSH_CONSTANT_SIZE);
 #endif
 
 
@@ -364,6 +572,8 @@ struct Renderer
 		VkImageView  image_view;
 		VkSampler    image_sampler;
 		Vulkan_Memory_Allocation image_memory;
+
+		u32 texture_index;
 	} white_texture;
 
 
@@ -380,6 +590,10 @@ struct Renderer
 	VkInstance       instance;
 	VkPhysicalDevice physical_device;
 	VkDevice         device;
+
+	VkPhysicalDeviceProperties physical_device_properties;
+
+	bool is_bc_compression_supported = false;
 	VkQueue          device_queue;
 
 	u32 queue_family_index;
@@ -389,6 +603,11 @@ struct Renderer
 
 	VkCommandPool    command_pool;
 
+	// Texture streaming queue, might be the same queue as device_queue if GPU has nothing better.
+	VkQueue       transfer_queue;
+	u32           transfer_queue_family_index;
+	VkCommandPool transfer_command_pool;
+
 
 
 
@@ -409,10 +628,7 @@ struct Renderer
 
 
 	Dynamic_Array<Swapchain_Node> swapchain_nodes;
-	Swapchain_Node* current_swapchain_node;
-	
-	VkFence rendering_done_fence;
-	VkFence image_availability_fence;
+	Swapchain_Node* current_swapchain_node; // NULL if vkAcquireNextImageKHR failed this frame.
 
 	struct
 	{
@@ -433,6 +649,7 @@ struct Renderer
 		VkImageView main_color_image_view;
 		VkImageView main_depth_stencil_image_view;
 	
+		// Command buffer of the current frame slot.
 		VkCommandBuffer main_command_buffer;
 	};
 
@@ -472,10 +689,76 @@ struct Renderer
 	void frame_end();
 
 
+	// Entities are grouped by (mesh, material), every group is one instanced draw.
+	//  Instances are written right away, draws are recorded in frame_end() before immediate mode ones.
+	//  Visible entities come from level's Level_Bvh, with settings.gpu_culling visibility is decided on GPU, see Gpu_Culling.h.
 	void draw_level(Level* level);
 
+	struct Level_Draw
+	{
+		Mesh*     mesh;
+		Material* material;
+
+		VkDescriptorSet instances_descriptor_set;
+		u32             first_instance; // Relative to the descriptor set's range.
+		u32             instances_count;
+	};
+
+	Dynamic_Array<Level_Draw> level_draws;
+
+	float   level_view_projection[16];
+	Vector4 level_frustum_planes[5]; // Normalized, inside is positive. No far plane.
+
+	// Adds unique (mesh, material) pairs of entities to draws after first_draw_index and counts their instances.
+	//  entities are ids to group, all of storage's entities in Entities_Storage::for_each_chunk() order if NULL.
+	//  Every entity gets index of its draw in out_entity_draws, u32_max if it has no mesh. Returns number of instances.
+	u32 group_level_entities(Entities_Storage* storage, Dynamic_Array<Entity_Id>* entities, Dynamic_Array<Level_Draw>* draws, int first_draw_index, Dynamic_Array<u32>* out_entity_draws);
+
+	// Through the point of the screen, y goes up as with input.mouse_y. Direction is normalized.
+	void get_camera_ray(Camera* camera, float screen_x, float screen_y, Vector3* out_origin, Vector3* out_direction);
 
+	Material default_material;
+
+	struct
+	{
+		s64    entities;
+		s64    instances;
+		s64    draw_calls;
+		double cpu_ms; // Grouping, instance writes and command recording.
+	} level_statistics;
+
+	void record_level_draws();
+
+
+	// Blocks until texture is uploaded.
 	void make_sure_texture_is_on_gpu(Texture* texture);
+	void make_sure_mesh_is_on_gpu(Mesh* mesh);
+
+	// Doesn't block, starts the upload on transfer queue if needed. Returns true if texture can be sampled this frame.
+	bool stream_texture_to_gpu(Texture* texture);
+
+
+	// Resource, that wasn't used by any frame that might still be in flight, can be destroyed or overwritten.
+	bool is_resource_cold(u64 last_used_frame);
+
+
+	// Residency.
+	//  Textures and meshes keep their CPU copies, so evicted ones are just uploaded again on next use.
+
+	// Names in asset_storage of what is on GPU.
+	Dynamic_Array<Unicode_String> resident_textures;
+	Dynamic_Array<Unicode_String> resident_meshes;
+
+	static constexpr int residency_update_interval = 30; // In frames, querying memory budget isn't free.
+	static constexpr int max_residency_moves_per_frame = 8;
+
+	void evict_texture(Texture* texture);
+	void evict_mesh(Mesh* mesh);
+
+	// Only cold resources, their memory is available right away. Returns freed bytes count.
+	u64  evict_cold_resources(u64 bytes_to_free);
+
+	void update_residency();
 
 
 
@@ -491,8 +774,21 @@ struct Renderer
 
 
 
-	Array_Map<Glyph_Key, Glyph_Gpu_Region> glyph_gpu_map;
-	Bucket_Array<Texture_Atlas> glyph_atlasses;
+	Glyph_Cache glyph_cache;
+
+	Bucket_Array<Texture_Atlas> glyph_atlasses; // Destroyed atlasses stay here with is_alive = false and get reused.
+
+	static constexpr int glyph_atlas_size = 1024;
+
+	// Atlas with lower occupancy gets retired, so its glyphs are repacked into others.
+	static constexpr int   glyph_atlas_repack_interval  = 600; // In frames.
+	static constexpr float glyph_atlas_repack_occupancy = 0.25;
+
+	u64  glyph_atlas_bytes();
+	void imm_allocate_glyph_region(int width, int height, Texture_Atlas** out_atlas, int* out_x_left, int* out_y_bottom);
+	void imm_evict_glyph(s32 glyph_index);
+	bool imm_evict_cold_glyphs(int area_to_free);
+	void imm_maintain_glyph_atlasses();
 
 
 	// Immediate mode stuff.
@@ -506,10 +802,17 @@ struct Renderer
 	Dynamic_Array<Imm_Command> imm_commands;
 	void imm_execute_commands();
 
+	// Must happen before main render pass begins, since it records atlas uploads.
+	void imm_upload_missing_glyphs();
+
 	Dynamic_Array<Rect_Mask> imm_mask_stack;
 
+	// State that last emitted Recalculate_Mask_Buffer command has set.
+	Rect                imm_clip_rect;
+	Dynamic_Array<Rect> imm_inversed_masks;
 
-	void imm_recalculate_mask_buffer();
+
+	void imm_recalculate_mask_buffer(bool force_stencil_rebuild = false);
 
 	void imm_push_mask(Rect_Mask mask)
 	{
@@ -529,7 +832,8 @@ struct Renderer
 	void imm_draw_rect(Rect rect, rgba rgba);
 	void imm_draw_rect_with_alpha_fade(Rect rect, rgba rgba, int alpha_left, int alpha_right);
 
-	void imm_draw_line(int x_start, int y_start, int x_end, int y_end, rgba color);
+	// Line goes through pixel centers, anti aliasing only makes sense for diagonal or thick lines.
+	void imm_draw_line(int x_start, int y_start, int x_end, int y_end, rgba color, float thickness = 1.0f, bool anti_aliased = false);
 
 	inline void imm_draw_rect_outline(Rect rect, rgba color, u32 edges = RECT_ALL_OUTLINE_EDGES)
 	{
@@ -549,7 +853,7 @@ struct Renderer
 
 
 
-	void imm_draw_glyph(Glyph* glyph, int x, int y, rgba color);
+	void imm_draw_glyph(Font::Face* face, Glyph* glyph, int x, int y, rgba color);
 
 	void imm_draw_text(Font::Face* face, Unicode_String str, int x, int y, rgba color = rgba(255, 255, 255, 255));
 	void imm_draw_text_culled(Font::Face* face, Unicode_String str, int x, int y, Rect cull_rect, rgba color = rgba(255, 255, 255, 255));
@@ -565,15 +869,37 @@ struct Renderer
 		VkPipelineColorBlendAttachmentState*    blending_state = NULL;
 		VkPipelineDepthStencilStateCreateInfo*  depth_stencil_state = NULL;
 		VkPipelineInputAssemblyStateCreateInfo* input_assembly_state = NULL;
+		VkPipelineRasterizationStateCreateInfo* rasterization_state = NULL;
 
 		VkDescriptorSetLayoutBinding* descriptor_set_layout_bindings = NULL;
 		int                           descriptor_set_layout_bindings_count;
 
+		// Bound as sets 1, 2, ... after pipeline's own set.
+		VkDescriptorSetLayout* additional_set_layouts = NULL;
+		int                    additional_set_layouts_count = 0;
+
 		int push_constant_size = 0;
 
+		VkPipelineVertexInputStateCreateInfo* vertex_input_state = NULL;
+		VkSpecializationInfo*                 vertex_specialization = NULL;
+
 		bool no_vertex_buffer = false;
 	};
 
+	// Vertex input of a pipeline that draws meshes, shaders get the format as specialization constant 0.
+	struct Mesh_Vertex_Input
+	{
+		VkVertexInputBindingDescription      binding;
+		VkVertexInputAttributeDescription    attributes[3];
+		VkPipelineVertexInputStateCreateInfo state;
+
+		VkBool32                 is_quantized;
+		VkSpecializationMapEntry specialization_entry;
+		VkSpecializationInfo     specialization;
+	};
+
+	void make_mesh_vertex_input(Mesh_Vertex_Format format, Mesh_Vertex_Input* out_input);
+
 	struct Imm_Pipeline
 	{
 		VkDescriptorSetLayout descriptor_set_layout;
@@ -583,6 +909,9 @@ struct Renderer
 
 	Imm_Pipeline imm_create_pipeline(Imm_Pipeline_Options options);
 
+	// Push constants are visible to compute stage only.
+	Imm_Pipeline create_compute_pipeline(VkShaderModule shader, VkDescriptorSetLayoutBinding* bindings, int bindings_count, int push_constant_size);
+
 
 	struct 
 	{
@@ -591,34 +920,144 @@ struct Renderer
 	
 		VkShaderModule mask_vertex;
 		VkShaderModule mask_fragment;
+	} imm_shaders;
 
-		VkShaderModule line_vertex;
-		VkShaderModule line_fragment;
+	struct
+	{
+		VkShaderModule mesh_vertex;
+		VkShaderModule mesh_fragment;
 
-		VkShaderModule texture_vertex;
-		VkShaderModule texture_fragment;
-	} imm_shaders;
+		VkShaderModule mesh_culled_vertex;
+		VkShaderModule gpu_cull;
+		VkShaderModule gpu_compact_draws;
+	} mesh_shaders;
 
-	struct Imm_Uniform_Buffer 
+	// Indexed by Mesh_Vertex_Format. Set 0 is Mesh_Instance array.
+	Imm_Pipeline mesh_pipelines[2];
+
+	void create_mesh_pipelines();
+
+	struct Retired_Buffer
 	{
 		VkBuffer buffer;
 		Vulkan_Memory_Allocation memory;
 	};
 
-	Dynamic_Array<Imm_Uniform_Buffer> imm_used_uniform_buffer_memory_allocations;
+	struct Retired_Image
+	{
+		VkImage     image;
+		VkImageView image_view;
+		VkSampler   image_sampler;
+		Vulkan_Memory_Allocation memory;
+	};
+
+
+
+	// CPU records the next frame while GPU still executes previous ones.
+	//  Everything that previous frame's command buffer may still reference lives in its slot
+	//  and is released only after slot's rendering_done_fence is signaled.
+	struct Frame_Slot
+	{
+		VkCommandBuffer command_buffer;
+
+		VkFence     rendering_done_fence;
+		VkSemaphore image_available_semaphore;
+		VkSemaphore rendering_done_semaphore;
+
+		Dynamic_Array<VkDescriptorPool> descriptor_pools;
+		int current_descriptor_pool = 0;
+
+		// Buffers replaced during this frame, like grown frame buffers and Gpu_Culling's device buffers.
+		Dynamic_Array<Retired_Buffer> retired_buffers;
+
+		// Imm_Instance's of this frame. Batches are addressed with firstInstance, so allocations are aligned to sizeof(Imm_Instance).
+		Vulkan_Linear_Buffer upload_buffer;
+
+		// Source of this frame's buffer to image copies, see imm_queue_atlas_upload().
+		Vulkan_Linear_Buffer staging_buffer;
+
+		// Points to upload_buffer, so it's allocated once per frame and every batch reuses it.
+		VkDescriptorSet general_descriptor_set = VK_NULL_HANDLE;
+
+		// Texture table indices released during this frame. Draws recorded this frame might still sample them.
+		Dynamic_Array<u32> released_texture_indices;
+
+		// Mesh_Instance's of this frame's level draws, see draw_level().
+		Vulkan_Linear_Buffer instance_buffer;
+
+		// Images evicted or moved by residency manager during this frame.
+		Dynamic_Array<Retired_Image> retired_images;
+
+		// Mesh ranges evicted during this frame, see Geometry_Manager::free_after_frame().
+		Dynamic_Array<Geometry_Allocation> retired_geometry;
+	};
+
+	Frame_Slot frame_slots[max_frames_in_flight];
+
+	int frames_in_flight = 2;
+	int frame_slot_index = 0;
+
+	inline Frame_Slot* current_frame_slot()
+	{
+		return &frame_slots[frame_slot_index];
+	}
+
+	void create_frame_slots();
+	void release_frame_slot_resources(Frame_Slot* slot);
+	void set_frames_in_flight(int count);
+
+
+	const u64 imm_initial_upload_buffer_size  = megabytes(1);
+	const u64 imm_initial_staging_buffer_size = megabytes(1);
+	const u64 initial_instance_buffer_size    = megabytes(8);
+
+	struct
+	{
+		s64 allocations;
+		s64 bytes;
+	} imm_upload_statistics;
+
+	void grow_frame_linear_buffer(Frame_Slot* slot, Vulkan_Linear_Buffer* buffer, u64 required_size);
+	void imm_grow_upload_buffer(Frame_Slot* slot, u64 required_size);
+	VkDescriptorSet imm_get_general_descriptor_set();
+
+
+	struct Atlas_Upload
+	{
+		Texture_Atlas*    atlas;
+		VkBuffer          staging_buffer; // Staging buffer might be regrown in the middle of the frame.
+		VkBufferImageCopy region;
+	};
+
+	// Copies into staging buffer right away, copy command is recorded by imm_record_atlas_uploads().
+	Dynamic_Array<Atlas_Upload> imm_pending_atlas_uploads;
+
+	void imm_queue_atlas_upload(Texture_Atlas* atlas, void* image_buffer, int width, int height, int x, int y);
+	void imm_record_atlas_uploads();
+
+	void begin_main_render_pass();
+
+
+	// Every texture and atlas lives in one update-after-bind descriptor array, bound as set 1 of general pipeline,
+	//  so instances just carry texture index and don't split batches.
+	VkDescriptorSetLayout imm_texture_table_layout;
+	VkDescriptorPool      imm_texture_table_pool;
+	VkDescriptorSet       imm_texture_table;
+
+	Dynamic_Array<u32> imm_free_texture_indices;
+	u32                imm_texture_table_count = 0;
+
+	void create_texture_table();
+	u32  imm_register_texture(VkImageView image_view, VkSampler sampler);
+	void imm_release_texture_index(u32 texture_index);
 
 
 
 	Imm_Pipeline imm_general_pipeline;
 	Imm_Pipeline imm_inversed_mask_pipeline;
 	Imm_Pipeline imm_clear_mask_pipeline;
-	Imm_Pipeline imm_line_pipeline;
-	Imm_Pipeline imm_texture_pipeline;
 
 
-	Dynamic_Array<VkDescriptorPool> imm_descriptor_pools;
-	int imm_current_descriptor_pool = 0;
-
 	VkDescriptorSet imm_get_descriptor_set(VkDescriptorSetLayout descriptor_set_layout);
 	
 
@@ -628,9 +1067,54 @@ struct Renderer
 	VkCommandBuffer begin_single_command_buffer();
 	void end_single_command_buffer(VkCommandBuffer command_buffer);
 
-	void transition_image_layout(VkImage image, VkFormat format, VkImageLayout old_layout, VkImageLayout new_layout);
+	void transition_image_layout(VkImage image, VkFormat format, VkImageLayout old_layout, VkImageLayout new_layout, u32 mip_levels_count = 1);
 	void copy_buffer_to_image(VkBuffer buffer, VkImage image, u32 width, u32 height, u32 dst_offset_x = 0, u32 dst_offset_y = 0);
 
+	VkFormat get_texture_vk_format(Texture_Format texture_format);
+	void     create_texture_image(Texture* texture, VkFormat format, VkBuffer* out_staging_buffer, Vulkan_Memory_Allocation* out_staging_buffer_memory);
+	void     make_texture_resident(Texture* texture, VkFormat format);
+	void     record_texture_copy(VkCommandBuffer command_buffer, VkBuffer staging_buffer, VkImage image, Texture_Format format, int width, int height, int mip_levels_count);
+
+
+	// Texture streaming.
+	//  Uploads requested during the frame are submitted to transfer queue as one batch tracked by a fence.
+	//  Once it's signaled, graphics queue acquires images before the main render pass.
+
+	struct Texture_Upload
+	{
+		Unicode_String texture_name; // Texture might be gone from asset_storage by the time upload completes.
+
+		VkImage                  image;
+		Vulkan_Memory_Allocation image_memory;
+		VkFormat                 format;
+		Texture_Format           texture_format;
+		int                      width;
+		int                      height;
+		int                      mip_levels_count;
+
+		VkBuffer                 staging_buffer;
+		Vulkan_Memory_Allocation staging_buffer_memory;
+
+		VkFence fence; // VK_NULL_HANDLE until submitted.
+	};
+
+	struct Texture_Upload_Batch
+	{
+		VkCommandBuffer command_buffer;
+		VkFence         fence;
+	};
+
+	Dynamic_Array<Texture_Upload>       texture_uploads;
+	Dynamic_Array<Texture_Upload_Batch> texture_upload_batches;
+	Dynamic_Array<VkFence>              free_texture_upload_fences;
+
+	static constexpr u64 max_texture_upload_bytes_per_frame = megabytes(32);
+	u64 texture_upload_bytes_this_frame = 0;
+
+	void submit_texture_uploads();
+	void finish_texture_uploads(); // Must happen before main render pass begins.
+
+
 	void create_one_channel_texture(u8* image_buffer, u32 width, u32 height, VkImage* out_image, VkImageView* out_image_view, VkSampler* out_sampler, Vulkan_Memory_Allocation* out_image_memory);
 
 
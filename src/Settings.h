@@ -16,10 +16,28 @@ struct Settings
 {
 	bool full_crash_dump = false;
 	bool show_fps = false;
+
+	int frames_in_flight = 2; // Clamped to [1, max_frames_in_flight].
+
+	int glyph_atlas_budget_mb = 16; // Soft limit, least recently used glyphs are evicted to stay under it.
+
+	int video_memory_budget_percent = 90; // Of budget driver reports, cold textures and meshes are evicted above it.
+
+	bool compress_textures = true; // BC1/BC4/BC7 at load time, otherwise RGBA8 and R8. Takes effect on restart.
+
+	bool quantize_meshes = true; // 16 byte vertices on GPU instead of 32. Takes effect on restart.
+
+	bool gpu_culling = true; // Level entities are culled and turned into draws by compute shaders, if device supports it.
 };
 REFLECT(Settings)
 	MEMBER(full_crash_dump);
 	MEMBER(show_fps);
+	MEMBER(frames_in_flight);
+	MEMBER(glyph_atlas_budget_mb);
+	MEMBER(video_memory_budget_percent);
+	MEMBER(compress_textures);
+	MEMBER(quantize_meshes);
+	MEMBER(gpu_culling);
 REFLECT_END();
 
 inline Settings settings;
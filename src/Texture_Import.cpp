@@ -0,0 +1,638 @@
+#include "Texture_Import.h"
+
+#include "Tracy_Header.h"
+
+#include <math.h>
+#include <float.h>
+
+
+
+int get_mip_levels_count(int width, int height)
+{
+	int levels_count = 1;
+
+	while (width > 1 || height > 1)
+	{
+		width  = max(1, width  / 2);
+		height = max(1, height / 2);
+
+		levels_count += 1;
+	}
+
+	return levels_count;
+}
+
+u64 get_mip_level_size(Texture_Format format, int width, int height)
+{
+	u64 blocks_count = u64((width + 3) / 4) * u64((height + 3) / 4);
+
+	switch (format)
+	{
+		case Texture_Format::Monochrome: return u64(width) * u64(height);
+		case Texture_Format::RGBA:       return u64(width) * u64(height) * 4;
+		case Texture_Format::BC1:        return blocks_count * 8;
+		case Texture_Format::BC4:        return blocks_count * 8;
+		case Texture_Format::BC7:        return blocks_count * 16;
+	}
+
+	assert(false);
+	return 0;
+}
+
+
+
+// sRGB textures are filtered in linear space, otherwise smaller mips get darker.
+
+static float srgb_to_linear_table[256];
+static u8    linear_to_srgb_table[4096];
+
+void init_srgb_tables()
+{
+	for (int i = 0; i < 256; i++)
+	{
+		float c = float(i) / 255.0f;
+		srgb_to_linear_table[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+	}
+
+	for (int i = 0; i < 4096; i++)
+	{
+		float c = float(i) / 4095.0f;
+		float srgb = c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
+		linear_to_srgb_table[i] = u8(clamp(0.0f, 255.0f, srgb * 255.0f + 0.5f));
+	}
+}
+
+static u8 linear_to_srgb(float c)
+{
+	return linear_to_srgb_table[int(clamp(0.0f, 1.0f, c) * 4095.0f + 0.5f)];
+}
+
+
+// Box filter. Odd last row/column is dropped, which is what hardware mip generation does too.
+static void downsample(u8* src, int src_width, int src_height, u8* dst, int dst_width, int dst_height, int channels_count, bool is_srgb)
+{
+	ZoneScoped;
+
+	for (int y = 0; y < dst_height; y++)
+	{
+		int y0 = min(y * 2,     src_height - 1);
+		int y1 = min(y * 2 + 1, src_height - 1);
+
+		for (int x = 0; x < dst_width; x++)
+		{
+			int x0 = min(x * 2,     src_width - 1);
+			int x1 = min(x * 2 + 1, src_width - 1);
+
+			u8* p00 = src + (y0 * src_width + x0) * channels_count;
+			u8* p01 = src + (y0 * src_width + x1) * channels_count;
+			u8* p10 = src + (y1 * src_width + x0) * channels_count;
+			u8* p11 = src + (y1 * src_width + x1) * channels_count;
+
+			u8* out = dst + (y * dst_width + x) * channels_count;
+
+			for (int c = 0; c < channels_count; c++)
+			{
+				// Alpha is always linear.
+				if (is_srgb && (channels_count == 1 || c < 3))
+				{
+					float sum = srgb_to_linear_table[p00[c]] + srgb_to_linear_table[p01[c]] + srgb_to_linear_table[p10[c]] + srgb_to_linear_table[p11[c]];
+					out[c] = linear_to_srgb(sum * 0.25f);
+				}
+				else
+				{
+					out[c] = u8((int(p00[c]) + int(p01[c]) + int(p10[c]) + int(p11[c]) + 2) / 4);
+				}
+			}
+		}
+	}
+}
+
+
+
+// Block encoders.
+//  Endpoints are the extremes of block's pixels projected onto their principal axis,
+//  then every pixel takes the nearest palette entry. Not as good as exhaustive search, but it's fast.
+
+static void find_principal_axis(float pixels[16][4], int channels_count, float mean[4], float axis[4])
+{
+	for (int c = 0; c < 4; c++)
+	{
+		mean[c] = 0;
+		axis[c] = 0;
+	}
+
+	for (int i = 0; i < 16; i++)
+		for (int c = 0; c < channels_count; c++)
+			mean[c] += pixels[i][c] / 16.0f;
+
+
+	float covariance[4][4] = {};
+
+	for (int i = 0; i < 16; i++)
+	{
+		for (int a = 0; a < channels_count; a++)
+		{
+			for (int b = 0; b < channels_count; b++)
+			{
+				covariance[a][b] += (pixels[i][a] - mean[a]) * (pixels[i][b] - mean[b]);
+			}
+		}
+	}
+
+
+	// Channel that varies most. Zero trace means every pixel is the mean.
+	int   widest_channel  = 0;
+	float widest_variance = 0;
+
+	for (int c = 0; c < channels_count; c++)
+	{
+		if (covariance[c][c] > widest_variance)
+		{
+			widest_channel  = c;
+			widest_variance = covariance[c][c];
+		}
+	}
+
+	// Flat block.
+	if (widest_variance == 0) return;
+
+
+	// Power iteration. Seeded with widest channel's covariance column rather than a constant vector,
+	//  which is orthogonal to the axis of anti-correlated channels, red against green on an edge for example.
+	float v[4] = {};
+	for (int c = 0; c < channels_count; c++)
+		v[c] = covariance[c][widest_channel];
+
+	for (int iteration = 0; iteration < 8; iteration++)
+	{
+		float next[4] = {};
+
+		for (int a = 0; a < channels_count; a++)
+			for (int b = 0; b < channels_count; b++)
+				next[a] += covariance[a][b] * v[b];
+
+		float largest = 0;
+		for (int c = 0; c < channels_count; c++)
+			largest = max(largest, fabsf(next[c]));
+
+		// Shouldn't happen for a seed from the covariance itself, but rounding might get there.
+		if (largest == 0)
+		{
+			axis[widest_channel] = 1;
+			return;
+		}
+
+		for (int c = 0; c < channels_count; c++)
+			v[c] = next[c] / largest;
+	}
+
+
+	float length = 0;
+	for (int c = 0; c < channels_count; c++)
+		length += v[c] * v[c];
+
+	length = sqrtf(length);
+
+	for (int c = 0; c < channels_count; c++)
+		axis[c] = v[c] / length;
+}
+
+static void find_endpoints(float pixels[16][4], int channels_count, float out_start[4], float out_end[4])
+{
+	float mean[4];
+	float axis[4];
+	find_principal_axis(pixels, channels_count, mean, axis);
+
+	float t_min = 0;
+	float t_max = 0;
+
+	for (int i = 0; i < 16; i++)
+	{
+		float t = 0;
+		for (int c = 0; c < channels_count; c++)
+			t += (pixels[i][c] - mean[c]) * axis[c];
+
+		t_min = min(t_min, t);
+		t_max = max(t_max, t);
+	}
+
+	for (int c = 0; c < 4; c++)
+	{
+		out_start[c] = clamp(0.0f, 255.0f, mean[c] + axis[c] * t_min);
+		out_end[c]   = clamp(0.0f, 255.0f, mean[c] + axis[c] * t_max);
+	}
+}
+
+static int find_nearest_palette_entry(float pixel[4], int (*palette)[4], int palette_count, int channels_count)
+{
+	int   best_index = 0;
+	float best_error = FLT_MAX;
+
+	for (int i = 0; i < palette_count; i++)
+	{
+		float error = 0;
+		for (int c = 0; c < channels_count; c++)
+		{
+			float d = pixel[c] - float(palette[i][c]);
+			error += d * d;
+		}
+
+		if (error < best_error)
+		{
+			best_error = error;
+			best_index = i;
+		}
+	}
+
+	return best_index;
+}
+
+
+static u16 pack_565(float color[4])
+{
+	u16 r = u16(int(color[0] * 31.0f / 255.0f + 0.5f));
+	u16 g = u16(int(color[1] * 63.0f / 255.0f + 0.5f));
+	u16 b = u16(int(color[2] * 31.0f / 255.0f + 0.5f));
+
+	return (r << 11) | (g << 5) | b;
+}
+
+static void unpack_565(u16 packed, int out[4])
+{
+	int r = (packed >> 11) & 31;
+	int g = (packed >> 5)  & 63;
+	int b =  packed        & 31;
+
+	out[0] = (r << 3) | (r >> 2);
+	out[1] = (g << 2) | (g >> 4);
+	out[2] = (b << 3) | (b >> 2);
+	out[3] = 255;
+}
+
+// Opaque blocks only, so always 4 color mode.
+static void encode_bc1_block(float pixels[16][4], u8* out)
+{
+	float start[4];
+	float end[4];
+	find_endpoints(pixels, 3, start, end);
+
+	u16 color_0 = pack_565(end);
+	u16 color_1 = pack_565(start);
+
+	// 4 color mode needs color_0 > color_1. Equal endpoints decode to 3 color mode, index 0 is still color_0 there.
+	if (color_0 < color_1)
+	{
+		u16 temp = color_0;
+		color_0  = color_1;
+		color_1  = temp;
+	}
+
+	int palette[4][4];
+	unpack_565(color_0, palette[0]);
+	unpack_565(color_1, palette[1]);
+
+	for (int c = 0; c < 3; c++)
+	{
+		palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+		palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+	}
+
+	u32 indices = 0;
+
+	if (color_0 != color_1)
+	{
+		for (int i = 0; i < 16; i++)
+		{
+			indices |= u32(find_nearest_palette_entry(pixels[i], palette, 4, 3)) << (i * 2);
+		}
+	}
+
+	out[0] = u8(color_0);
+	out[1] = u8(color_0 >> 8);
+	out[2] = u8(color_1);
+	out[3] = u8(color_1 >> 8);
+	out[4] = u8(indices);
+	out[5] = u8(indices >> 8);
+	out[6] = u8(indices >> 16);
+	out[7] = u8(indices >> 24);
+}
+
+static void encode_bc4_block(float pixels[16][4], u8* out)
+{
+	float lowest  = 255;
+	float highest = 0;
+
+	for (int i = 0; i < 16; i++)
+	{
+		lowest  = min(lowest,  pixels[i][0]);
+		highest = max(highest, pixels[i][0]);
+	}
+
+	int red_0 = int(highest + 0.5f);
+	int red_1 = int(lowest  + 0.5f);
+
+	u64 indices = 0;
+
+	// red_0 > red_1 selects 8 value mode, flat block decodes with index 0 either way.
+	if (red_0 > red_1)
+	{
+		int palette[8][4] = {};
+		palette[0][0] = red_0;
+		palette[1][0] = red_1;
+
+		for (int i = 2; i < 8; i++)
+		{
+			palette[i][0] = ((8 - i) * red_0 + (i - 1) * red_1) / 7;
+		}
+
+		for (int i = 0; i < 16; i++)
+		{
+			indices |= u64(find_nearest_palette_entry(pixels[i], palette, 8, 1)) << (i * 3);
+		}
+	}
+
+	out[0] = u8(red_0);
+	out[1] = u8(red_1);
+
+	for (int i = 0; i < 6; i++)
+	{
+		out[2 + i] = u8(indices >> (i * 8));
+	}
+}
+
+
+// BC7 mode 6: one subset, RGBA endpoints with 7 bits per channel plus a p-bit each, 4 bit indices.
+
+static void quantize_bc7_mode_6_endpoint(float endpoint[4], int out_quantized[4], int* out_p_bit)
+{
+	float best_error = FLT_MAX;
+
+	for (int p_bit = 0; p_bit < 2; p_bit++)
+	{
+		int   quantized[4];
+		float error = 0;
+
+		for (int c = 0; c < 4; c++)
+		{
+			quantized[c] = clamp(0, 127, int((endpoint[c] - float(p_bit)) / 2.0f + 0.5f));
+
+			float d = float(quantized[c] * 2 + p_bit) - endpoint[c];
+			error += d * d;
+		}
+
+		if (error < best_error)
+		{
+			best_error = error;
+			*out_p_bit = p_bit;
+
+			for (int c = 0; c < 4; c++)
+				out_quantized[c] = quantized[c];
+		}
+	}
+}
+
+struct Bit_Writer
+{
+	u8* data;
+	int position = 0;
+
+	void write(u32 value, int bits_count)
+	{
+		for (int i = 0; i < bits_count; i++)
+		{
+			if ((value >> i) & 1)
+			{
+				data[position / 8] |= u8(1 << (position % 8));
+			}
+			position += 1;
+		}
+	}
+};
+
+static void encode_bc7_block(float pixels[16][4], u8* out)
+{
+	const static int weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+	float start[4];
+	float end[4];
+	find_endpoints(pixels, 4, start, end);
+
+	int quantized[2][4];
+	int p_bits[2];
+	quantize_bc7_mode_6_endpoint(start, quantized[0], &p_bits[0]);
+	quantize_bc7_mode_6_endpoint(end,   quantized[1], &p_bits[1]);
+
+
+	int palette[16][4];
+
+	for (int i = 0; i < 16; i++)
+	{
+		for (int c = 0; c < 4; c++)
+		{
+			int e0 = quantized[0][c] * 2 + p_bits[0];
+			int e1 = quantized[1][c] * 2 + p_bits[1];
+
+			palette[i][c] = ((64 - weights[i]) * e0 + weights[i] * e1 + 32) >> 6;
+		}
+	}
+
+	int indices[16];
+	for (int i = 0; i < 16; i++)
+	{
+		indices[i] = find_nearest_palette_entry(pixels[i], palette, 16, 4);
+	}
+
+	// First index is stored without its top bit, so it must be below 8. Swapping endpoints mirrors indices.
+	if (indices[0] >= 8)
+	{
+		for (int c = 0; c < 4; c++)
+		{
+			int temp = quantized[0][c];
+			quantized[0][c] = quantized[1][c];
+			quantized[1][c] = temp;
+		}
+
+		int temp  = p_bits[0];
+		p_bits[0] = p_bits[1];
+		p_bits[1] = temp;
+
+		for (int i = 0; i < 16; i++)
+			indices[i] = 15 - indices[i];
+	}
+
+
+	memset(out, 0, 16);
+
+	Bit_Writer writer = { .data = out };
+
+	writer.write(1 << 6, 7); // Mode 6.
+
+	for (int c = 0; c < 4; c++)
+	{
+		writer.write(quantized[0][c], 7);
+		writer.write(quantized[1][c], 7);
+	}
+
+	writer.write(p_bits[0], 1);
+	writer.write(p_bits[1], 1);
+
+	writer.write(indices[0], 3);
+	for (int i = 1; i < 16; i++)
+	{
+		writer.write(indices[i], 4);
+	}
+
+	assert(writer.position == 128);
+}
+
+
+static void encode_mip_level(u8* pixels, int width, int height, int channels_count, Texture_Format format, bool is_srgb, u8* out)
+{
+	ZoneScoped;
+
+	if (!is_block_compressed(format))
+	{
+		memcpy(out, pixels, get_mip_level_size(format, width, height));
+		return;
+	}
+
+
+	int block_size = format == Texture_Format::BC7 ? 16 : 8;
+
+	for (int block_y = 0; block_y < height; block_y += 4)
+	{
+		for (int block_x = 0; block_x < width; block_x += 4)
+		{
+			// Partial blocks at the edges repeat the last row/column.
+			float block[16][4] = {};
+
+			for (int y = 0; y < 4; y++)
+			{
+				for (int x = 0; x < 4; x++)
+				{
+					u8* pixel = pixels + (min(block_y + y, height - 1) * width + min(block_x + x, width - 1)) * channels_count;
+
+					for (int c = 0; c < channels_count; c++)
+					{
+						block[y * 4 + x][c] = float(pixel[c]);
+					}
+
+					// There is no sRGB BC4 format, so it stores linear values.
+					if (format == Texture_Format::BC4 && is_srgb)
+					{
+						block[y * 4 + x][0] = srgb_to_linear_table[pixel[0]] * 255.0f;
+					}
+				}
+			}
+
+			switch (format)
+			{
+				case Texture_Format::BC1: encode_bc1_block(block, out); break;
+				case Texture_Format::BC4: encode_bc4_block(block, out); break;
+				case Texture_Format::BC7: encode_bc7_block(block, out); break;
+				default: assert(false);
+			}
+
+			out += block_size;
+		}
+	}
+}
+
+
+void import_texture(Texture* texture, u8* pixels, int width, int height, int channels_count, bool compress)
+{
+	ZoneScoped;
+
+	assert(channels_count == 1 || channels_count == 3 || channels_count == 4);
+
+	// Matches formats renderer picks, see Renderer::get_texture_vk_format().
+	bool is_srgb = !OS_DARWIN;
+
+
+	int level_channels_count = channels_count == 1 ? 1 : 4;
+
+	u8* level = (u8*) c_allocator.alloc(width * height * level_channels_count, code_location());
+
+	bool is_opaque = true;
+
+	if (channels_count == 3)
+	{
+		for (int i = 0; i < width * height; i++)
+		{
+			level[i * 4 + 0] = pixels[i * 3 + 0];
+			level[i * 4 + 1] = pixels[i * 3 + 1];
+			level[i * 4 + 2] = pixels[i * 3 + 2];
+			level[i * 4 + 3] = 255;
+		}
+	}
+	else
+	{
+		memcpy(level, pixels, width * height * level_channels_count);
+
+		if (channels_count == 4)
+		{
+			for (int i = 0; i < width * height; i++)
+			{
+				if (level[i * 4 + 3] != 255)
+				{
+					is_opaque = false;
+					break;
+				}
+			}
+		}
+	}
+
+
+	Texture_Format format;
+
+	if (compress)
+		format = channels_count == 1 ? Texture_Format::BC4 : (is_opaque ? Texture_Format::BC1 : Texture_Format::BC7);
+	else
+		format = channels_count == 1 ? Texture_Format::Monochrome : Texture_Format::RGBA;
+
+
+	texture->width  = width;
+	texture->height = height;
+	texture->format = format;
+
+	texture->mip_levels_count = get_mip_levels_count(width, height);
+
+	texture->size = 0;
+	for (int mip_level = 0; mip_level < texture->mip_levels_count; mip_level++)
+	{
+		texture->size += get_mip_level_size(format, get_mip_level_dimension(width, mip_level), get_mip_level_dimension(height, mip_level));
+	}
+
+	texture->image_buffer = c_allocator.alloc(texture->size, code_location());
+
+
+	u8* out = (u8*) texture->image_buffer;
+
+	int level_width  = width;
+	int level_height = height;
+
+	for (int mip_level = 0; mip_level < texture->mip_levels_count; mip_level++)
+	{
+		encode_mip_level(level, level_width, level_height, level_channels_count, format, is_srgb, out);
+		out += get_mip_level_size(format, level_width, level_height);
+
+		if (mip_level == texture->mip_levels_count - 1) break;
+
+
+		int next_width  = max(1, level_width  / 2);
+		int next_height = max(1, level_height / 2);
+
+		u8* next_level = (u8*) c_allocator.alloc(next_width * next_height * level_channels_count, code_location());
+		downsample(level, level_width, level_height, next_level, next_width, next_height, level_channels_count, is_srgb);
+
+		c_allocator.free(level, code_location());
+
+		level        = next_level;
+		level_width  = next_width;
+		level_height = next_height;
+	}
+
+	c_allocator.free(level, code_location());
+
+	assert(out == (u8*) texture->image_buffer + texture->size);
+}
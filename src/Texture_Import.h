@@ -0,0 +1,36 @@
+#pragma once
+
+#include "b_lib/Basic.h"
+
+#include "Renderer.h"
+
+
+// CPU side texture preparation, happens once at load time.
+//  Texture::image_buffer ends up with the whole mip chain in the format it's uploaded in,
+//  mip levels go one after another starting from the largest.
+
+
+int get_mip_levels_count(int width, int height);
+
+// Bytes of one mip level, block compressed levels are rounded up to 4x4 blocks.
+u64 get_mip_level_size(Texture_Format format, int width, int height);
+
+inline int get_mip_level_dimension(int dimension, int mip_level)
+{
+	return max(1, dimension >> mip_level);
+}
+
+inline bool is_block_compressed(Texture_Format format)
+{
+	return format == Texture_Format::BC1 || format == Texture_Format::BC4 || format == Texture_Format::BC7;
+}
+
+
+// Fills lookup tables import_texture() reads. Must happen once on the main thread before textures are imported,
+//  they are imported on worker_pool.
+void init_srgb_tables();
+
+// pixels is stb_image output with 1, 3 or 4 channels.
+//  Without compression RGB is expanded to RGBA, since R8G8B8 isn't supported with optimal tiling by many drivers.
+//  With compression one channel goes to BC4, opaque images to BC1 and the rest to BC7.
+void import_texture(Texture* texture, u8* pixels, int width, int height, int channels_count, bool compress);
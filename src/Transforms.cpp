@@ -0,0 +1,446 @@
+#include "Transforms.h"
+
+#include "Tracy_Header.h"
+
+#include "b_lib/Log.h"
+
+#include <immintrin.h>
+
+#if OS_WINDOWS
+#include <intrin.h>
+#elif IS_POSIX
+#include <cpuid.h>
+#endif
+
+
+// Whole build only targets AVX, so AVX2 code is compiled per function and called after runtime check.
+#if defined(__clang__) || defined(__GNUC__)
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+#else
+#define AVX2_FUNCTION
+#endif
+
+
+
+void detect_avx2_support()
+{
+#if OS_WINDOWS
+	int cpu_info[4];
+	__cpuidex(cpu_info, 7, 0);
+#elif IS_POSIX
+	u32 cpu_info[4] = {};
+	__get_cpuid_count(7, 0, &cpu_info[0], &cpu_info[1], &cpu_info[2], &cpu_info[3]);
+#endif
+
+	// OS support of YMM registers was checked together with AVX.
+	is_avx2_supported = cpu_info[1] & (1 << 5);
+}
+
+
+void compute_world_matrix(Vector3 p, Quaternion q, Vector3 s, World_Matrix* out)
+{
+	float xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+	float xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+	float wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+
+	// Columns are rotated axes scaled by scale. Zeroed quaternion comes out as identity.
+	out->rows[0] = Vector4::make((1 - 2 * (yy + zz)) * s.x, (2 * (xy - wz)) * s.y,     (2 * (xz + wy)) * s.z,     p.x);
+	out->rows[1] = Vector4::make((2 * (xy + wz)) * s.x,     (1 - 2 * (xx + zz)) * s.y, (2 * (yz - wx)) * s.z,     p.y);
+	out->rows[2] = Vector4::make((2 * (xz - wy)) * s.x,     (2 * (yz + wx)) * s.y,     (1 - 2 * (xx + yy)) * s.z, p.z);
+}
+
+void multiply_world_matrices(World_Matrix* parent, World_Matrix* local, World_Matrix* out)
+{
+	float* a = (float*) parent->rows;
+	float* b = (float*) local->rows;
+
+	float result[12];
+
+	for (int row = 0; row < 3; row++)
+	{
+		for (int column = 0; column < 4; column++)
+		{
+			result[row * 4 + column] =
+				a[row * 4 + 0] * b[0 * 4 + column] +
+				a[row * 4 + 1] * b[1 * 4 + column] +
+				a[row * 4 + 2] * b[2 * 4 + column] +
+				(column == 3 ? a[row * 4 + 3] : 0);
+		}
+	}
+
+	memcpy(out->rows, result, sizeof(result));
+}
+
+
+void compute_world_matrices_scalar(Vector3* positions, Quaternion* rotations, Vector3* scales, u8* dirty_flags, World_Matrix* out, u32 count)
+{
+	for (u32 i = 0; i < count; i++)
+	{
+		if (!dirty_flags[i]) continue;
+
+		compute_world_matrix(positions[i], rotations[i], scales[i], &out[i]);
+	}
+}
+
+AVX2_FUNCTION
+void compute_world_matrices_avx2(Vector3* positions, Quaternion* rotations, Vector3* scales, u8* dirty_flags, World_Matrix* out, u32 count)
+{
+	static_assert(sizeof(Vector3)    == 3 * sizeof(float));
+	static_assert(sizeof(Quaternion) == 4 * sizeof(float));
+
+	// Inputs are arrays of structs of floats, gathers turn 8 of them into one register per component.
+	__m256i stride_3 = _mm256_setr_epi32(0, 3, 6, 9,  12, 15, 18, 21);
+	__m256i stride_4 = _mm256_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28);
+
+	__m256 one = _mm256_set1_ps(1.0f);
+	__m256 two = _mm256_set1_ps(2.0f);
+
+	u32 i = 0;
+
+	for (; i + 8 <= count; i += 8)
+	{
+		u64 dirty;
+		memcpy(&dirty, dirty_flags + i, sizeof(dirty));
+
+		if (!dirty) continue;
+
+
+		float* p = (float*) (positions + i);
+		float* q = (float*) (rotations + i);
+		float* s = (float*) (scales    + i);
+
+		__m256 px = _mm256_i32gather_ps(p + 0, stride_3, 4);
+		__m256 py = _mm256_i32gather_ps(p + 1, stride_3, 4);
+		__m256 pz = _mm256_i32gather_ps(p + 2, stride_3, 4);
+
+		__m256 qx = _mm256_i32gather_ps(q + 0, stride_4, 4);
+		__m256 qy = _mm256_i32gather_ps(q + 1, stride_4, 4);
+		__m256 qz = _mm256_i32gather_ps(q + 2, stride_4, 4);
+		__m256 qw = _mm256_i32gather_ps(q + 3, stride_4, 4);
+
+		__m256 sx = _mm256_i32gather_ps(s + 0, stride_3, 4);
+		__m256 sy = _mm256_i32gather_ps(s + 1, stride_3, 4);
+		__m256 sz = _mm256_i32gather_ps(s + 2, stride_3, 4);
+
+
+		// Same operations in the same order as compute_world_matrix(), so results match exactly.
+		__m256 xx = _mm256_mul_ps(qx, qx), yy = _mm256_mul_ps(qy, qy), zz = _mm256_mul_ps(qz, qz);
+		__m256 xy = _mm256_mul_ps(qx, qy), xz = _mm256_mul_ps(qx, qz), yz = _mm256_mul_ps(qy, qz);
+		__m256 wx = _mm256_mul_ps(qw, qx), wy = _mm256_mul_ps(qw, qy), wz = _mm256_mul_ps(qw, qz);
+
+		__m256 m[12];
+
+		m[0]  = _mm256_mul_ps(_mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_add_ps(yy, zz))), sx);
+		m[1]  = _mm256_mul_ps(_mm256_mul_ps(two, _mm256_sub_ps(xy, wz)), sy);
+		m[2]  = _mm256_mul_ps(_mm256_mul_ps(two, _mm256_add_ps(xz, wy)), sz);
+		m[3]  = px;
+
+		m[4]  = _mm256_mul_ps(_mm256_mul_ps(two, _mm256_add_ps(xy, wz)), sx);
+		m[5]  = _mm256_mul_ps(_mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_add_ps(xx, zz))), sy);
+		m[6]  = _mm256_mul_ps(_mm256_mul_ps(two, _mm256_sub_ps(yz, wx)), sz);
+		m[7]  = py;
+
+		m[8]  = _mm256_mul_ps(_mm256_mul_ps(two, _mm256_sub_ps(xz, wy)), sx);
+		m[9]  = _mm256_mul_ps(_mm256_mul_ps(two, _mm256_add_ps(yz, wx)), sy);
+		m[10] = _mm256_mul_ps(_mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_add_ps(xx, yy))), sz);
+		m[11] = pz;
+
+
+		// Every row is a 4x8 transpose: lane k of u[j] halves is row of entity j (low half) and j + 4 (high half).
+		bool is_all_dirty = dirty == 0x0101010101010101;
+
+		for (int row = 0; row < 3; row++)
+		{
+			__m256 a = m[row * 4 + 0];
+			__m256 b = m[row * 4 + 1];
+			__m256 c = m[row * 4 + 2];
+			__m256 d = m[row * 4 + 3];
+
+			__m256 t0 = _mm256_unpacklo_ps(a, b);
+			__m256 t1 = _mm256_unpackhi_ps(a, b);
+			__m256 t2 = _mm256_unpacklo_ps(c, d);
+			__m256 t3 = _mm256_unpackhi_ps(c, d);
+
+			__m256 u[4] = {
+				_mm256_shuffle_ps(t0, t2, 0x44),
+				_mm256_shuffle_ps(t0, t2, 0xee),
+				_mm256_shuffle_ps(t1, t3, 0x44),
+				_mm256_shuffle_ps(t1, t3, 0xee),
+			};
+
+			for (int j = 0; j < 4; j++)
+			{
+				if (is_all_dirty || dirty_flags[i + j])
+					_mm_storeu_ps((float*) &out[i + j].rows[row], _mm256_castps256_ps128(u[j]));
+
+				if (is_all_dirty || dirty_flags[i + j + 4])
+					_mm_storeu_ps((float*) &out[i + j + 4].rows[row], _mm256_extractf128_ps(u[j], 1));
+			}
+		}
+	}
+
+	compute_world_matrices_scalar(positions + i, rotations + i, scales + i, dirty_flags + i, out + i, count - i);
+}
+
+void compute_world_matrices(Vector3* positions, Quaternion* rotations, Vector3* scales, u8* dirty_flags, World_Matrix* out, u32 count)
+{
+	if (is_avx2_supported)
+		compute_world_matrices_avx2  (positions, rotations, scales, dirty_flags, out, count);
+	else
+		compute_world_matrices_scalar(positions, rotations, scales, dirty_flags, out, count);
+}
+
+
+void rebuild_hierarchy_order(Entities_Storage* storage)
+{
+	ZoneScoped;
+
+	storage->hierarchy_order.clear();
+	storage->is_hierarchy_order_stale = false;
+
+	struct Child
+	{
+		Entity_Id id;
+		u32       depth;
+	};
+
+	Dynamic_Array<Child> children = make_array<Child>(64, frame_allocator);
+
+	u32 max_depth = 0;
+
+	storage->for_each_chunk([&](Entity_Chunk* chunk)
+	{
+		for (u32 i = 0; i < chunk->count; i++)
+		{
+			Entity* entity = chunk->get_entity(i);
+			if (!entity->parent) continue;
+
+			u32 depth = 0;
+			for (Entity* parent = storage->get_entity(entity->parent); parent; parent = storage->get_entity(parent->parent))
+			{
+				depth += 1;
+				assert(depth <= storage->entities_count); // Cycle.
+			}
+
+			// Parent is destroyed, entity is a root now. Its world matrix still includes the parent.
+			if (depth == 0)
+			{
+				entity->parent = 0;
+				entity->mark_transform_dirty();
+				continue;
+			}
+
+			children.add({
+				.id    = entity->id,
+				.depth = depth,
+			});
+
+			max_depth = max(max_depth, depth);
+		}
+	});
+
+	if (children.count == 0) return;
+
+
+	// Counting sort by depth, parent's depth is always smaller.
+	Dynamic_Array<u32> offsets = make_array<u32>(max_depth + 2, frame_allocator);
+	offsets.count = max_depth + 2;
+	memset(offsets.data, 0, sizeof(u32) * offsets.count);
+
+	for (Child& child: children)
+	{
+		*offsets[child.depth + 1] += 1;
+	}
+
+	for (u32 depth = 1; depth < max_depth + 2; depth++)
+	{
+		*offsets[depth] += *offsets[depth - 1];
+	}
+
+	for (int i = 0; i < children.count; i++)
+	{
+		storage->hierarchy_order.add(0);
+	}
+
+	for (Child& child: children)
+	{
+		u32* offset = offsets[child.depth];
+
+		*storage->hierarchy_order[*offset] = child.id;
+		*offset += 1;
+	}
+}
+
+void update_world_matrices(Entities_Storage* storage)
+{
+	ZoneScoped;
+
+	if (storage->is_hierarchy_order_stale)
+	{
+		rebuild_hierarchy_order(storage);
+	}
+
+	// Parent's flag is final by the time its children are visited.
+	for (Entity_Id id: storage->hierarchy_order)
+	{
+		Entity* child  = storage->get_entity(id);
+		Entity* parent = child ? storage->get_entity(child->parent) : NULL;
+
+		// Destroyed ones are waiting for flush, order is rebuilt then.
+		if (!parent) continue;
+
+		if (parent->chunk->dirty_flags[parent->index_in_chunk])
+		{
+			child->mark_transform_dirty();
+		}
+	}
+
+
+	bool is_anything_updated = false;
+
+	storage->for_each_chunk([&](Entity_Chunk* chunk)
+	{
+		if (!chunk->has_dirty_transforms) return;
+
+		compute_world_matrices(chunk->positions, chunk->rotations, chunk->scales, chunk->dirty_flags, chunk->world_matrices, chunk->count);
+
+		is_anything_updated = true;
+	});
+
+	if (!is_anything_updated) return;
+
+
+	for (Entity_Id id: storage->hierarchy_order)
+	{
+		Entity* child  = storage->get_entity(id);
+		Entity* parent = child ? storage->get_entity(child->parent) : NULL;
+
+		if (!parent || !child->chunk->dirty_flags[child->index_in_chunk]) continue;
+
+		World_Matrix* world = &child->chunk->world_matrices[child->index_in_chunk];
+		multiply_world_matrices(&parent->chunk->world_matrices[parent->index_in_chunk], world, world);
+	}
+
+	// Renderer's copy of world matrices is stale, but only in changed ranges.
+	storage->transforms_version += 1;
+	storage->changed_chunks.clear();
+
+	storage->for_each_chunk([&](Entity_Chunk* chunk)
+	{
+		if (!chunk->has_dirty_transforms) return;
+
+		chunk->changed_first = u32_max;
+		chunk->changed_end   = 0;
+
+		for (u32 i = 0; i < chunk->count; i++)
+		{
+			if (chunk->dirty_flags[i])
+			{
+				storage->moved_entities.add(chunk->get_entity(i)->id);
+
+				chunk->changed_first = min(chunk->changed_first, i);
+				chunk->changed_end   = i + 1;
+			}
+		}
+
+		storage->changed_chunks.add(chunk);
+
+		memset(chunk->dirty_flags, 0, chunk->count);
+		chunk->has_dirty_transforms = false;
+	});
+}
+
+
+void run_transform_benchmark()
+{
+	ZoneScoped;
+
+	const u32 count      = 1000000;
+	const int iterations = 20;
+
+	Vector3*      positions = (Vector3*)      c_allocator.alloc(sizeof(Vector3)      * count, code_location());
+	Quaternion*   rotations = (Quaternion*)   c_allocator.alloc(sizeof(Quaternion)   * count, code_location());
+	Vector3*      scales    = (Vector3*)      c_allocator.alloc(sizeof(Vector3)      * count, code_location());
+	u8*           dirty     = (u8*)           c_allocator.alloc(sizeof(u8)           * count, code_location());
+	World_Matrix* scalar    = (World_Matrix*) c_allocator.alloc(sizeof(World_Matrix) * count, code_location());
+	World_Matrix* simd      = (World_Matrix*) c_allocator.alloc(sizeof(World_Matrix) * count, code_location());
+
+	defer {
+		c_allocator.free(positions, code_location());
+		c_allocator.free(rotations, code_location());
+		c_allocator.free(scales,    code_location());
+		c_allocator.free(dirty,     code_location());
+		c_allocator.free(scalar,    code_location());
+		c_allocator.free(simd,      code_location());
+	};
+
+
+	u32 random = 0x9e3779b9;
+	auto next_float = [&]() -> float
+	{
+		random ^= random << 13;
+		random ^= random >> 17;
+		random ^= random << 5;
+		return float(random % 20001) / 10000.0f - 1.0f;
+	};
+
+	for (u32 i = 0; i < count; i++)
+	{
+		positions[i] = Vector3::make(next_float() * 100, next_float() * 100, next_float() * 100);
+		scales[i]    = Vector3::make(1 + next_float() * 0.5f, 1 + next_float() * 0.5f, 1 + next_float() * 0.5f);
+
+		Quaternion q;
+		q.x = next_float();
+		q.y = next_float();
+		q.z = next_float();
+		q.w = next_float();
+
+		float length = sqrtf(q.x * q.x + q.y * q.y + q.z * q.z + q.w * q.w);
+		q.x /= length;
+		q.y /= length;
+		q.z /= length;
+		q.w /= length;
+
+		rotations[i] = q;
+	}
+
+	memset(dirty, 1, count);
+
+
+	auto measure = [&](World_Matrix* out, bool use_avx2) -> double
+	{
+		// Warm up and touch every page of output.
+		memset(out, 0, sizeof(World_Matrix) * count);
+
+		Time_Measurer tm = create_time_measurer();
+
+		for (int i = 0; i < iterations; i++)
+		{
+			if (use_avx2)
+				compute_world_matrices_avx2  (positions, rotations, scales, dirty, out, count);
+			else
+				compute_world_matrices_scalar(positions, rotations, scales, dirty, out, count);
+		}
+
+		double seconds = tm.ms_elapsed_double() / 1000.0;
+
+		return double(count) * double(iterations) / seconds;
+	};
+
+	double scalar_rate = measure(scalar, false);
+	Log(U"Transform benchmark, scalar: % million matrices per second", scalar_rate / 1000000.0);
+
+	if (!is_avx2_supported)
+	{
+		Log(U"Transform benchmark: AVX2 is not supported");
+		return;
+	}
+
+	double simd_rate = measure(simd, true);
+	Log(U"Transform benchmark, AVX2: % million matrices per second, % times faster", simd_rate / 1000000.0, simd_rate / scalar_rate);
+
+	if (memcmp(scalar, simd, sizeof(World_Matrix) * count) != 0)
+	{
+		Log(U"Transform benchmark: AVX2 results differ from scalar ones");
+	}
+}
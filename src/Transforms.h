@@ -0,0 +1,37 @@
+#pragma once
+
+#include "b_lib/Basic.h"
+#include "b_lib/Math.h"
+
+#include "Level.h"
+
+
+// Entity's position, rotation and scale become its World_Matrix here, once per frame before level is drawn.
+//  Only entities flagged with Entity::mark_transform_dirty() are recomputed, chunks without dirty entities are skipped.
+//  Children are recomputed when their parent is, and composed with parent's world matrix in Entities_Storage::hierarchy_order.
+//  Recomputed entities are appended to Entities_Storage::moved_entities for Level_Bvh::update(),
+//  their chunks to Entities_Storage::changed_chunks for renderer.
+void update_world_matrices(Entities_Storage* storage);
+
+
+// Chosen at startup by detect_avx2_support(), otherwise scalar path is used.
+inline bool is_avx2_supported = false;
+
+void detect_avx2_support();
+
+// Writes out[i] for every i with dirty_flags[i] != 0, other matrices are left as they are.
+//  AVX2 path handles 8 entities at a time and has to give the same results as scalar one, which is the reference.
+void compute_world_matrices       (Vector3* positions, Quaternion* rotations, Vector3* scales, u8* dirty_flags, World_Matrix* out, u32 count);
+void compute_world_matrices_scalar(Vector3* positions, Quaternion* rotations, Vector3* scales, u8* dirty_flags, World_Matrix* out, u32 count);
+void compute_world_matrices_avx2  (Vector3* positions, Quaternion* rotations, Vector3* scales, u8* dirty_flags, World_Matrix* out, u32 count);
+
+void compute_world_matrix(Vector3 position, Quaternion rotation, Vector3 scale, World_Matrix* out);
+
+// out = parent * local, out may be local.
+void multiply_world_matrices(World_Matrix* parent, World_Matrix* local, World_Matrix* out);
+
+void rebuild_hierarchy_order(Entities_Storage* storage);
+
+
+// Logs matrices per second of both paths over a million random transforms.
+void run_transform_benchmark();
@@ -413,7 +413,7 @@ bool UI::checkbox(Rect rect, bool value, UI_ID ui_id)
 		auto face = get_font_face();
 		Glyph tick_glyph = face->request_glyph(U'\x2713');
 
-		renderer.imm_draw_glyph(&tick_glyph, rect.center_x() - tick_glyph.width / 2, rect.center_y() - tick_glyph.height / 2, parameters.checkbox_tick_color);
+		renderer.imm_draw_glyph(face, &tick_glyph, rect.center_x() - tick_glyph.width / 2, rect.center_y() - tick_glyph.height / 2, parameters.checkbox_tick_color);
 	}
 
 	return result;
@@ -1190,7 +1190,7 @@ bool UI::text_editor(Rect rect, Unicode_String text, Unicode_String* out_result,
 				{
 					Glyph glyph = glyph_iterator.current_glyph;
 					// :GlyphLocalCoords:
-					renderer.imm_draw_glyph(&glyph, x + glyph.left_offset, y - (glyph.height - glyph.top_offset), text_color);
+					renderer.imm_draw_glyph(face, &glyph, x + glyph.left_offset, y - (glyph.height - glyph.top_offset), text_color);
 				}
 			}
 		}
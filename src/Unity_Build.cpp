@@ -2,9 +2,17 @@
 #include "UI.cpp"
 #include "Renderer.cpp"
 #include "Vulkan_Memory_Allocator.cpp"
+#include "Geometry_Manager.cpp"
+#include "Gpu_Culling.cpp"
+#include "Transforms.cpp"
+#include "Level_Bvh.cpp"
 #include "Settings.cpp"
 #include "Input.cpp"
 #include "Key_Bindings.cpp"
 #include "Editor.cpp"
+#include "Asset_Cache.cpp"
 #include "Asset_Storage.cpp"
+#include "Texture_Import.cpp"
+#include "Mesh_Import.cpp"
+#include "Worker_Pool.cpp"
 
@@ -4,11 +4,455 @@
 
 #include "Renderer.h"
 #include "b_lib/Log.h"
+#include "b_lib/File.h"
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+
+static inline int find_last_set_bit(u64 x)
+{
+	assert(x);
+#if defined(_MSC_VER) && !defined(__clang__)
+	unsigned long index;
+	_BitScanReverse64(&index, x);
+	return (int) index;
+#else
+	return 63 - __builtin_clzll(x);
+#endif
+}
+
+static inline int find_first_set_bit(u32 x)
+{
+	assert(x);
+#if defined(_MSC_VER) && !defined(__clang__)
+	unsigned long index;
+	_BitScanForward(&index, x);
+	return (int) index;
+#else
+	return __builtin_ctz(x);
+#endif
+}
+
+
+// Size class, that size belongs to.
+static inline void tlsf_mapping_insert(u64 size, int* out_fl, int* out_sl)
+{
+	if (size < tlsf_small_block_size)
+	{
+		*out_fl = 0;
+		*out_sl = (int) (size >> tlsf_granularity_log2);
+	}
+	else
+	{
+		int f = find_last_set_bit(size);
+
+		*out_fl = f - (tlsf_sl_count_log2 + tlsf_granularity_log2) + 1;
+		*out_sl = (int) ((size >> (f - tlsf_sl_count_log2)) ^ tlsf_sl_count);
+	}
+}
+
+// Smallest size class, every block of which is big enough for size.
+static inline void tlsf_mapping_search(u64 size, int* out_fl, int* out_sl)
+{
+	if (size >= tlsf_small_block_size)
+	{
+		size += (u64(1) << (find_last_set_bit(size) - tlsf_sl_count_log2)) - 1;
+	}
+
+	tlsf_mapping_insert(size, out_fl, out_sl);
+}
+
+
+void Tlsf_Heap::init()
+{
+	fl_bitmap = 0;
+
+	for (int fl = 0; fl < tlsf_fl_count; fl++)
+	{
+		sl_bitmaps[fl] = 0;
+
+		for (int sl = 0; sl < tlsf_sl_count; sl++)
+		{
+			free_heads[fl][sl] = -1;
+		}
+	}
+
+	blocks = make_array<Tlsf_Block>(64, c_allocator);
+	unused_head = -1;
+
+	is_pool_draining = make_array<bool>(8, c_allocator);
+
+	total_size = 0;
+	free_size  = 0;
+}
+
+void Tlsf_Heap::deinit()
+{
+	blocks.free();
+	is_pool_draining.free();
+}
+
+s32 Tlsf_Heap::new_block()
+{
+	if (unused_head != -1)
+	{
+		s32 index = unused_head;
+		unused_head = block(index)->next_free;
+
+		return index;
+	}
+
+	blocks.add({});
+	return blocks.count - 1;
+}
+
+void Tlsf_Heap::release_block(s32 block_index)
+{
+	block(block_index)->next_free = unused_head;
+	unused_head = block_index;
+}
+
+void Tlsf_Heap::insert_free(s32 block_index)
+{
+	Tlsf_Block* b = block(block_index);
+
+	int fl, sl;
+	tlsf_mapping_insert(b->size, &fl, &sl);
+
+	s32 head = free_heads[fl][sl];
+
+	b->is_free = true;
+	b->previous_free = -1;
+	b->next_free = head;
+
+	if (head != -1)
+	{
+		block(head)->previous_free = block_index;
+	}
+
+	free_heads[fl][sl] = block_index;
+
+	fl_bitmap      |= 1u << fl;
+	sl_bitmaps[fl] |= 1u << sl;
+}
+
+void Tlsf_Heap::remove_free(s32 block_index)
+{
+	Tlsf_Block* b = block(block_index);
+	assert(b->is_free);
+
+	int fl, sl;
+	tlsf_mapping_insert(b->size, &fl, &sl);
+
+	if (b->previous_free != -1)
+	{
+		block(b->previous_free)->next_free = b->next_free;
+	}
+	else
+	{
+		assert(free_heads[fl][sl] == block_index);
+		free_heads[fl][sl] = b->next_free;
+
+		if (b->next_free == -1)
+		{
+			sl_bitmaps[fl] &= ~(1u << sl);
+
+			if (sl_bitmaps[fl] == 0)
+			{
+				fl_bitmap &= ~(1u << fl);
+			}
+		}
+	}
+
+	if (b->next_free != -1)
+	{
+		block(b->next_free)->previous_free = b->previous_free;
+	}
+
+	b->is_free = false;
+}
+
+s32 Tlsf_Heap::find_free(u64 size)
+{
+	int fl, sl;
+	tlsf_mapping_search(size, &fl, &sl);
+
+	if (fl >= tlsf_fl_count) return -1;
+
+
+	u32 sl_map = sl_bitmaps[fl] & (~0u << sl);
+
+	if (!sl_map)
+	{
+		u32 fl_map = (fl + 1 < tlsf_fl_count) ? (fl_bitmap & (~0u << (fl + 1))) : 0;
+		if (!fl_map) return -1;
+
+		fl = find_first_set_bit(fl_map);
+		sl_map = sl_bitmaps[fl];
+	}
+
+	sl = find_first_set_bit(sl_map);
+
+	return free_heads[fl][sl];
+}
+
+// Splits block in two, returns index of the right part. Neither part is put in free lists.
+s32 Tlsf_Heap::split(s32 block_index, u64 left_size)
+{
+	s32 right_index = new_block();
+
+	Tlsf_Block* left  = block(block_index);
+	Tlsf_Block* right = block(right_index);
+
+	assert(left_size < left->size);
+
+	*right = {
+		.offset = left->offset + left_size,
+		.size   = left->size - left_size,
+
+		.pool_index = left->pool_index,
+
+		.previous_physical = block_index,
+		.next_physical     = left->next_physical,
+
+		.previous_free = -1,
+		.next_free     = -1,
+
+		.is_free = false,
+	};
+
+	if (left->next_physical != -1)
+	{
+		block(left->next_physical)->previous_physical = right_index;
+	}
+
+	left->size = left_size;
+	left->next_physical = right_index;
+
+	return right_index;
+}
+
+s32 Tlsf_Heap::add_pool(s32 pool_index, u64 size)
+{
+	assert(size % tlsf_granularity == 0);
+
+	while (is_pool_draining.count <= pool_index)
+	{
+		is_pool_draining.add(false);
+	}
+	*is_pool_draining[pool_index] = false;
+
+	s32 index = new_block();
+
+	*block(index) = {
+		.offset = 0,
+		.size = size,
+
+		.pool_index = pool_index,
+
+		.previous_physical = -1,
+		.next_physical     = -1,
+
+		.previous_free = -1,
+		.next_free     = -1,
+
+		.is_free = false,
+	};
+
+	insert_free(index);
+
+	total_size += size;
+	free_size  += size;
+
+	return index;
+}
+
+s32 Tlsf_Heap::allocate(u64 size, u64 alignment)
+{
+	size      = align(max(size, (u64) 1), tlsf_granularity);
+	alignment = max(alignment, tlsf_granularity);
+
+	// Worst case padding in front, offsets are always granularity aligned.
+	u64 search_size = size + (alignment - tlsf_granularity);
+
+	s32 index = find_free(search_size);
+	if (index == -1) return -1;
+
+	remove_free(index);
+
+
+	u64 offset = block(index)->offset;
+	u64 padding = align(offset, alignment) - offset;
+
+	if (padding)
+	{
+		// Padding stays as a free block of its own.
+		s32 aligned_index = split(index, padding);
+		insert_free(index);
+
+		index = aligned_index;
+	}
+
+	if (block(index)->size - size >= tlsf_granularity)
+	{
+		s32 remainder_index = split(index, size);
+		insert_free(remainder_index);
+	}
+
+	free_size -= block(index)->size;
+
+	return index;
+}
+
+void Tlsf_Heap::free(s32 block_index)
+{
+	Tlsf_Block* b = block(block_index);
+	assert(!b->is_free);
+
+	free_size += b->size;
+
+
+	// Free blocks of draining pool aren't in free lists.
+	bool is_draining = *is_pool_draining[b->pool_index];
+
+
+	s32 next_index = b->next_physical;
+
+	if (next_index != -1 && block(next_index)->is_free)
+	{
+		if (!is_draining) remove_free(next_index);
+
+		Tlsf_Block* next = block(next_index);
+
+		b->size += next->size;
+		b->next_physical = next->next_physical;
+
+		if (next->next_physical != -1)
+		{
+			block(next->next_physical)->previous_physical = block_index;
+		}
+
+		release_block(next_index);
+	}
+
+
+	s32 previous_index = b->previous_physical;
+
+	// Left block survives, so pool's first block never changes.
+	if (previous_index != -1 && block(previous_index)->is_free)
+	{
+		if (!is_draining) remove_free(previous_index);
+
+		Tlsf_Block* previous = block(previous_index);
+
+		previous->size += b->size;
+		previous->next_physical = b->next_physical;
+
+		if (b->next_physical != -1)
+		{
+			block(b->next_physical)->previous_physical = previous_index;
+		}
+
+		release_block(block_index);
+
+		block_index = previous_index;
+	}
+
+	if (is_draining)
+	{
+		block(block_index)->is_free = true;
+	}
+	else
+	{
+		insert_free(block_index);
+	}
+}
+
+void Tlsf_Heap::set_pool_draining(s32 pool_index, s32 first_block, bool draining)
+{
+	if (*is_pool_draining[pool_index] == draining) return;
+
+	*is_pool_draining[pool_index] = draining;
+
+	for (s32 index = first_block; index != -1; index = block(index)->next_physical)
+	{
+		if (!block(index)->is_free) continue;
+
+		if (draining)
+		{
+			remove_free(index);
+			block(index)->is_free = true;
+		}
+		else
+		{
+			insert_free(index);
+		}
+	}
+}
+
+// Pool must be completely free.
+void Tlsf_Heap::remove_pool(s32 first_block)
+{
+	Tlsf_Block* b = block(first_block);
+
+	assert(b->is_free && b->offset == 0 && b->next_physical == -1);
+
+	if (!*is_pool_draining[b->pool_index])
+	{
+		remove_free(first_block);
+	}
+
+	total_size -= b->size;
+	free_size  -= b->size;
+
+	release_block(first_block);
+}
+
+
 
 void Vulkan_Memory_Allocator::init()
 {
 	pools = make_array<Vulkan_Memory_Pool>(32, c_allocator);
 
+	for (Tlsf_Heap& heap: heaps)
+	{
+		heap.init();
+	}
+
+#if DEBUG
+	trace = make_array<Trace_Event>(1024, c_allocator);
+#endif
+
+	call_sites = make_array<Vulkan_Call_Site_Statistics>(32, c_allocator);
+
+	for (int i = 0; i < VK_MAX_MEMORY_TYPES; i++)
+	{
+		dedicated_size[i]    = 0;
+		dedicated_count[i]   = 0;
+		allocations_count[i] = 0;
+
+		const char* suffixes[] = { " reserved", " used", " fragmentation" };
+
+		for (int j = 0; j < array_count(suffixes); j++)
+		{
+			char* name = plot_names[i][j];
+
+			const char* prefix = "Video memory type ";
+			int length = 0;
+
+			for (const char* c = prefix; *c; c++) name[length++] = *c;
+
+			if (i >= 10) name[length++] = '0' + i / 10;
+			name[length++] = '0' + i % 10;
+
+			for (const char* c = suffixes[j]; *c; c++) name[length++] = *c;
+
+			name[length] = 0;
+		}
+	}
+
 	update_memory_usage_information();
 }
 
@@ -32,514 +476,1100 @@ void Vulkan_Memory_Allocator::update_memory_usage_information()
 	device_memory_properties = mem_properties.memoryProperties;
 }
 
+u64 Vulkan_Memory_Allocator::device_local_memory_size()
+{
+	u64 result = 0;
+
+	for (int i = 0; i < device_memory_properties.memoryHeapCount; i++)
+	{
+		if (device_memory_properties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+		{
+			result += device_memory_properties.memoryHeaps[i].size;
+		}
+	}
 
+	return result;
+}
 
-s32 Vulkan_Memory_Allocator::find_memory_type(u32 supported_memory_types, Vulkan_Memory_Allocation_Flags allocation_flags)
+u64 Vulkan_Memory_Allocator::device_local_memory_used()
 {
-	if constexpr (DEBUG)
+	u64 result = 0;
+
+	for (int i = 0; i < device_memory_properties.memoryHeapCount; i++)
 	{
-		if (allocation_flags & VULKAN_MEMORY_ONLY_DEVICE_MEMORY)
+		if (device_memory_properties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
 		{
-			assert((allocation_flags & VULKAN_MEMORY_PREFER_HOST_MEMORY) == 0);
+			result += device_memory_budget.heapUsage[i];
 		}
 	}
 
+	return result;
+}
 
-	s32 memory_type_index = -1;
+u64 Vulkan_Memory_Allocator::device_local_memory_budget()
+{
+	u64 result = 0;
 
-	for (int i = 0; i < device_memory_properties.memoryTypeCount; i++)
+	for (int i = 0; i < device_memory_properties.memoryHeapCount; i++)
 	{
-		if ((supported_memory_types & (1 << i)) == 0) continue; 
+		if (device_memory_properties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+		{
+			result += device_memory_budget.heapBudget[i];
+		}
+	}
 
-		VkMemoryType memory_type = device_memory_properties.memoryTypes[i];
+	return result;
+}
 
-		if (allocation_flags & VULKAN_MEMORY_SHOULD_BE_MAPPABLE)
+u64 Vulkan_Memory_Allocator::device_local_free_memory_size()
+{
+	u64 budget = device_local_memory_budget();
+	u64 used   = device_local_memory_used();
+
+	return budget > used ? budget - used : 0;
+}
+
+
+// Called between frames. Owners of allocations check is_in_draining_pool() and reallocate.
+void Vulkan_Memory_Allocator::update_defragmentation()
+{
+	ZoneScoped;
+
+	if (draining_pool_index != -1)
+	{
+		Vulkan_Memory_Pool* pool = pools[draining_pool_index];
+		Tlsf_Heap* heap = &heaps[pool->memory_type_index];
+
+		if (pool->used_size == 0)
 		{
-			if (!(memory_type.propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) ||
+			Log(U"Released drained video memory pool %, size = %", draining_pool_index, size_to_string(pool->size, frame_allocator));
+
+			heap->remove_pool(pool->first_block);
+
+			vkFreeMemory(renderer.device, pool->device_memory, renderer.host_allocator);
+
+			pool->device_memory = VK_NULL_HANDLE;
+			pool->is_released = true;
+
+			draining_pool_index = -1;
+		}
+		else if (draining_started_frame + drain_pool_timeout <= frame_index)
+		{
+			// Something that can't be moved lives there.
+			heap->set_pool_draining(draining_pool_index, pool->first_block, false);
+			pool->is_drain_abandoned = true;
+
+			draining_pool_index = -1;
+		}
+
+		return;
+	}
+
+
+	// Emptiest pool, whose allocations fit into free space of other pools of the same memory type.
+	s32 best_index = -1;
+
+	for (Vulkan_Memory_Pool& pool: pools)
+	{
+		if (pool.is_released || pool.is_drain_abandoned) continue;
+		if (float(pool.used_size) > float(pool.size) * drain_pool_max_usage) continue;
+
+		Tlsf_Heap* heap = &heaps[pool.memory_type_index];
+
+		u64 free_elsewhere = heap->free_size - (pool.size - pool.used_size);
+		if (free_elsewhere == 0 || free_elsewhere < pool.used_size * 2) continue;
+
+		if (best_index == -1 || pool.used_size < pools[best_index]->used_size)
+		{
+			best_index = pools.fast_pointer_index(&pool);
+		}
+	}
+
+	if (best_index == -1) return;
+
+
+	Vulkan_Memory_Pool* pool = pools[best_index];
+
+	Log(U"Draining video memory pool %, used % of %", best_index, size_to_string(pool->used_size, frame_allocator), size_to_string(pool->size, frame_allocator));
+
+	heaps[pool->memory_type_index].set_pool_draining(best_index, pool->first_block, true);
+
+	draining_pool_index = best_index;
+	draining_started_frame = frame_index;
+}
+
+
+
+s32 Vulkan_Memory_Allocator::find_memory_type(u32 supported_memory_types, Vulkan_Memory_Allocation_Flags allocation_flags)
+{
+	if constexpr (DEBUG)
+	{
+		if (allocation_flags & VULKAN_MEMORY_ONLY_DEVICE_MEMORY)
+		{
+			assert((allocation_flags & VULKAN_MEMORY_PREFER_HOST_MEMORY) == 0);
+		}
+	}
+
+
+	s32 memory_type_index = -1;
+
+	for (int i = 0; i < device_memory_properties.memoryTypeCount; i++)
+	{
+		if ((supported_memory_types & (1 << i)) == 0) continue; 
+
+		VkMemoryType memory_type = device_memory_properties.memoryTypes[i];
+
+		if (allocation_flags & VULKAN_MEMORY_SHOULD_BE_MAPPABLE)
+		{
+			if (!(memory_type.propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) ||
 				!(memory_type.propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) continue;						
 		}
 
-		bool is_memory_on_gpu = (memory_type.propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) ? true : false; 
+		bool is_memory_on_gpu = (memory_type.propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) ? true : false; 
+
+		if (allocation_flags & VULKAN_MEMORY_ONLY_DEVICE_MEMORY)
+		{
+			if (!is_memory_on_gpu) continue;
+		}
+
+		if (allocation_flags & VULKAN_MEMORY_PREFER_HOST_MEMORY)
+		{
+			if (is_memory_on_gpu) continue;
+		}
+
+		memory_type_index = i;
+		break;
+	}
+
+
+	// If we intended to use host's RAM memory, but didn't found any, fallback to GPU memory. 
+	if ((allocation_flags & VULKAN_MEMORY_PREFER_HOST_MEMORY) && memory_type_index == -1)
+	{
+		for (int i = 0; i < device_memory_properties.memoryTypeCount; i++)
+		{
+			VkMemoryType memory_type = device_memory_properties.memoryTypes[i];
+
+			if (allocation_flags & VULKAN_MEMORY_SHOULD_BE_MAPPABLE)
+			{
+				if (!(memory_type.propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) ||
+					!(memory_type.propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) continue;						
+			}
+
+			memory_type_index = i;
+			break;
+		}
+	}
+
+	return memory_type_index;
+}
+
+
+
+
+Vulkan_Memory_Allocation Vulkan_Memory_Allocator::allocate_and_bind(VkImage image, Vulkan_Memory_Allocation_Flags allocation_flags, Code_Location code_location)
+{
+	VkImageMemoryRequirementsInfo2 i = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2,
+		.pNext = NULL,
+		.image = image,
+	};
+
+	VkMemoryDedicatedRequirementsKHR dedication_requirements = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS_KHR,
+		.pNext = NULL,
+	};
+
+	VkMemoryRequirements2 mem_requirements_2 = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2,
+		.pNext = &dedication_requirements,
+	};
+
+#if OS_DARWIN
+	vkGetImageMemoryRequirements2KHR(renderer.device, &i, &mem_requirements_2);
+#else
+	vkGetImageMemoryRequirements2(renderer.device, &i, &mem_requirements_2);
+#endif
+
+	VkMemoryRequirements mem_requirements = mem_requirements_2.memoryRequirements;
+
+	u32 memory_type_index = find_memory_type(mem_requirements.memoryTypeBits, allocation_flags);
+	if (memory_type_index == -1)
+		abort_the_mission(U"Failed to find memory type for image");
+
+
+	if (dedication_requirements.prefersDedicatedAllocation || (allocation_flags & VULKAN_MEMORY_DEDICATED))
+	{
+		Vulkan_Memory_Allocation allocation;
+		
+		if (allocate(memory_type_index, mem_requirements.size, mem_requirements.alignment, &allocation, image, VK_NULL_HANDLE, code_location))
+		{
+			vkBindImageMemory(renderer.device, image, allocation.device_memory, allocation.offset);
+			return allocation;
+		}
+	}
+
+	if (dedication_requirements.requiresDedicatedAllocation || (allocation_flags & VULKAN_MEMORY_DEDICATED))
+		abort_the_mission(U"Required dedicated video memory allocation for VkImage has failed");
+
+
+	Vulkan_Memory_Allocation allocation;
+
+	if (allocate(memory_type_index, mem_requirements.size, mem_requirements.alignment, &allocation, VK_NULL_HANDLE, VK_NULL_HANDLE, code_location))
+	{
+		vkBindImageMemory(renderer.device, image, allocation.device_memory, allocation.offset);
+		return allocation;
+	}
+
+	// Make room by dropping textures and meshes that weren't drawn lately, then try once more.
+	if (renderer.evict_cold_resources(mem_requirements.size) &&
+		allocate(memory_type_index, mem_requirements.size, mem_requirements.alignment, &allocation, VK_NULL_HANDLE, VK_NULL_HANDLE, code_location))
+	{
+		vkBindImageMemory(renderer.device, image, allocation.device_memory, allocation.offset);
+		return allocation;
+	}
+
+	abort_the_mission(U"Video memory allocation has failed");
+
+	return allocation;
+}
+
+Vulkan_Memory_Allocation Vulkan_Memory_Allocator::allocate_and_bind(VkBuffer buffer, Vulkan_Memory_Allocation_Flags allocation_flags, Code_Location code_location)
+{
+	VkBufferMemoryRequirementsInfo2 i = {
+		.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_REQUIREMENTS_INFO_2,
+		.pNext = NULL,
+		.buffer = buffer,
+	};
+
+	VkMemoryDedicatedRequirementsKHR dedication_requirements = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS_KHR,
+		.pNext = NULL,
+	};
+
+	VkMemoryRequirements2 mem_requirements_2 = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2,
+		.pNext = &dedication_requirements,
+	};
+
+#if OS_DARWIN
+	vkGetBufferMemoryRequirements2KHR(renderer.device, &i, &mem_requirements_2);
+#else
+	vkGetBufferMemoryRequirements2(renderer.device, &i, &mem_requirements_2);
+#endif
+
+	VkMemoryRequirements mem_requirements = mem_requirements_2.memoryRequirements;
+
+	u32 memory_type_index = find_memory_type(mem_requirements.memoryTypeBits, allocation_flags);
+	if (memory_type_index == -1)
+		abort_the_mission(U"Failed to find memory type for image");
+
+
+	if (dedication_requirements.prefersDedicatedAllocation || (allocation_flags & VULKAN_MEMORY_DEDICATED))
+	{
+		Vulkan_Memory_Allocation allocation;
+		
+		if (allocate(memory_type_index, mem_requirements.size, mem_requirements.alignment, &allocation, VK_NULL_HANDLE, buffer, code_location))
+		{
+			vkBindBufferMemory(renderer.device, buffer, allocation.device_memory, allocation.offset);
+			return allocation;
+		}
+	}
+
+	if (dedication_requirements.requiresDedicatedAllocation || (allocation_flags & VULKAN_MEMORY_DEDICATED))
+		abort_the_mission(U"Required dedicated video memory allocation for VkBuffer has failed");
+
+
+	Vulkan_Memory_Allocation allocation;
+
+	if (allocate(memory_type_index, mem_requirements.size, mem_requirements.alignment, &allocation, VK_NULL_HANDLE, VK_NULL_HANDLE, code_location))
+	{
+		vkBindBufferMemory(renderer.device, buffer, allocation.device_memory, allocation.offset);
+		return allocation;
+	}
+
+	// Make room by dropping textures and meshes that weren't drawn lately, then try once more.
+	if (renderer.evict_cold_resources(mem_requirements.size) &&
+		allocate(memory_type_index, mem_requirements.size, mem_requirements.alignment, &allocation, VK_NULL_HANDLE, VK_NULL_HANDLE, code_location))
+	{
+		vkBindBufferMemory(renderer.device, buffer, allocation.device_memory, allocation.offset);
+		return allocation;
+	}
+
+	abort_the_mission(U"Video memory allocation has failed");
+
+	return allocation;
+}
+
+
+
+
+bool Vulkan_Memory_Allocator::allocate(u32 memory_type_index, u64 size, u64 alignment, Vulkan_Memory_Allocation* result, VkImage dedication_image, VkBuffer dedication_buffer, Code_Location code_location)
+{
+
+	// Log(U"Allocation of size: % at: %: %", size_to_string(size, c_allocator), String(code_location.file_name, strlen(code_location.file_name)), code_location.line);
+
+	if (dedication_image)
+	{
+		assert(!dedication_buffer);
+	}
+
+	bool is_dedicated = dedication_image || dedication_buffer;
+
+
+	s32 call_site_index = -1;
+
+	for (Vulkan_Call_Site_Statistics& call_site: call_sites)
+	{
+		if (call_site.code_location.file_name == code_location.file_name && call_site.code_location.line == code_location.line)
+		{
+			call_site_index = call_sites.fast_pointer_index(&call_site);
+			break;
+		}
+	}
+
+	if (call_site_index == -1)
+	{
+		call_sites.add({
+			.code_location = code_location,
+			.bytes = 0,
+			.allocations_count = 0,
+		});
+
+		call_site_index = call_sites.count - 1;
+	}
+
+
+	if (!is_dedicated && size <= max_pooled_allocation_size)
+	{
+		Tlsf_Heap* heap = &heaps[memory_type_index];
+
+		s32 block_index = heap->allocate(size, alignment);
+
+		if (block_index == -1)
+		{
+			if (!add_pool(memory_type_index, size + alignment)) return false;
+
+			block_index = heap->allocate(size, alignment);
+			assert(block_index != -1);
+		}
+
+		Tlsf_Block* block = heap->block(block_index);
+
+		pools[block->pool_index]->used_size += block->size;
+		pools[block->pool_index]->is_drain_abandoned = false;
+
+		*result = {
+			.pool_index = block->pool_index,
+			.block_index = block_index,
+
+			.memory_type_index = memory_type_index,
+			.call_site_index = call_site_index,
+
+			.device_memory = pools[block->pool_index]->device_memory,
+			.offset = block->offset,
+			.size = size,
+		};
+
+		call_sites[call_site_index]->bytes += size;
+		call_sites[call_site_index]->allocations_count += 1;
+
+		allocations_count[memory_type_index] += 1;
+
+	#if DEBUG
+		record_trace_event({
+			.memory_type_index = memory_type_index,
+			.block_index = block_index,
+			.size = size,
+			.alignment = alignment,
+			.is_free = false,
+		});
+	#endif
+
+		return true;
+	}
+
+
+	{
+		VkMemoryDedicatedAllocateInfoKHR dedicated_info = {
+			.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO_KHR,
+			.pNext = NULL,
+			.image = dedication_image,
+			.buffer = dedication_buffer,
+		};
+
+		// :VulkanAlignment
+		VkMemoryAllocateInfo i = {
+			.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+			.pNext = is_dedicated ? &dedicated_info : NULL,
+			.allocationSize = size,
+			.memoryTypeIndex = memory_type_index,
+		};
+
+
+
+		VkDeviceMemory device_memory;
+		VkResult vk_result = vkAllocateMemory(renderer.device, &i, renderer.host_allocator, &device_memory);
+		if (vk_result != VK_SUCCESS)
+			return false;
+
+		Vulkan_Memory_Allocation allocation = {
+			.pool_index = -1,
+			.block_index = -1,
+
+			.memory_type_index = memory_type_index,
+			.call_site_index = call_site_index,
+
+			.device_memory = device_memory,
+			.offset = 0,
+			.size = size,
+		};
+
+		*result = allocation;
+
+		call_sites[call_site_index]->bytes += size;
+		call_sites[call_site_index]->allocations_count += 1;
+
+		dedicated_size [memory_type_index] += size;
+		dedicated_count[memory_type_index] += 1;
+
+		allocations_count[memory_type_index] += 1;
+
+		return true;
+	}
+}
+
+bool Vulkan_Memory_Allocator::add_pool(u32 memory_type_index, u64 required_size)
+{
+	ZoneScoped;
+
+	int tiers_count = array_count(pool_size_tiers);
+
+	int pools_of_type = 0;
+	for (Vulkan_Memory_Pool& pool: pools)
+	{
+		if (!pool.is_released && pool.memory_type_index == memory_type_index) pools_of_type += 1;
+	}
+
+	int tier = min(pools_of_type, tiers_count - 1);
+
+	while (tier < tiers_count - 1 && pool_size_tiers[tier] < required_size)
+	{
+		tier += 1;
+	}
+
+
+	// If driver refuses big pool, fall back to smaller ones that still fit.
+	for (; tier >= 0; tier--)
+	{
+		u64 pool_size = pool_size_tiers[tier];
+
+		if (pool_size < required_size) break;
+
+
+		// :VulkanAlignment
+		// As Vulkan specification states, any memory that is returned
+		//  by vkAllocateMemory meets all the alignment requirements.
+		VkMemoryAllocateInfo i = {
+			.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+			.pNext = NULL,
+			.allocationSize = pool_size,
+			.memoryTypeIndex = memory_type_index,
+		};
+
+		VkDeviceMemory device_memory;
+
+		if (vkAllocateMemory(renderer.device, &i, renderer.host_allocator, &device_memory) != VK_SUCCESS) continue;
+
+
+		s32 pool_index = -1;
+
+		for (Vulkan_Memory_Pool& pool: pools)
+		{
+			if (pool.is_released)
+			{
+				pool_index = pools.fast_pointer_index(&pool);
+				break;
+			}
+		}
+
+		if (pool_index == -1)
+		{
+			pool_index = pools.count;
+			pools.add({});
+		}
+
+		*pools[pool_index] = {
+			.device_memory = device_memory,
+			.memory_type_index = memory_type_index,
+			.size = pool_size,
+			.used_size = 0,
+			.first_block = heaps[memory_type_index].add_pool(pool_index, pool_size),
+			.is_released = false,
+			.is_drain_abandoned = false,
+		};
+
+		Log(U"New video memory pool: memory type = %, size = %", memory_type_index, size_to_string(pool_size, frame_allocator));
+
+		return true;
+	}
+
+	return false;
+}
+
+
+void Vulkan_Memory_Allocator::free(Vulkan_Memory_Allocation allocation)
+{
+	call_sites[allocation.call_site_index]->bytes -= allocation.size;
+	call_sites[allocation.call_site_index]->allocations_count -= 1;
+
+	allocations_count[allocation.memory_type_index] -= 1;
+
+	if (allocation.pool_index == -1)
+	{
+		vkFreeMemory(renderer.device, allocation.device_memory, renderer.host_allocator);
+
+		dedicated_size [allocation.memory_type_index] -= allocation.size;
+		dedicated_count[allocation.memory_type_index] -= 1;
+	}
+	else
+	{
+		Vulkan_Memory_Pool* pool = pools[allocation.pool_index];
+		Tlsf_Heap* heap = &heaps[pool->memory_type_index];
+
+		assert(heap->block(allocation.block_index)->offset == allocation.offset);
+
+		pool->used_size -= heap->block(allocation.block_index)->size;
+		pool->is_drain_abandoned = false;
+
+		heap->free(allocation.block_index);
+
+	#if DEBUG
+		record_trace_event({
+			.memory_type_index = pool->memory_type_index,
+			.block_index = allocation.block_index,
+			.is_free = true,
+		});
+	#endif
+	}
+}
+
+Vulkan_Memory_Statistics Vulkan_Memory_Allocator::get_pool_statistics(s32 pool_index)
+{
+	Vulkan_Memory_Pool* pool = pools[pool_index];
+
+	Vulkan_Memory_Statistics result = {};
+
+	if (pool->is_released) return result;
+
+	Tlsf_Heap* heap = &heaps[pool->memory_type_index];
+
+	result.reserved = pool->size;
+	result.used     = pool->used_size;
+
+	for (s32 index = pool->first_block; index != -1; index = heap->block(index)->next_physical)
+	{
+		Tlsf_Block* block = heap->block(index);
+
+		if (block->is_free)
+		{
+			result.free_blocks_count += 1;
+			result.largest_free_block = max(result.largest_free_block, block->size);
+		}
+		else
+		{
+			result.allocations_count += 1;
+		}
+	}
+
+	u64 free_size = pool->size - pool->used_size;
+
+	result.fragmentation = free_size ? 1.0f - float(double(result.largest_free_block) / double(free_size)) : 0.0f;
+
+	return result;
+}
+
+Vulkan_Memory_Statistics Vulkan_Memory_Allocator::get_memory_type_statistics(u32 memory_type_index)
+{
+	Tlsf_Heap* heap = &heaps[memory_type_index];
 
-		if (allocation_flags & VULKAN_MEMORY_ONLY_DEVICE_MEMORY)
-		{
-			if (!is_memory_on_gpu) continue;
-		}
+	Vulkan_Memory_Statistics result = {};
 
-		if (allocation_flags & VULKAN_MEMORY_PREFER_HOST_MEMORY)
-		{
-			if (is_memory_on_gpu) continue;
-		}
+	result.reserved = heap->total_size + dedicated_size[memory_type_index];
+	result.used     = heap->total_size - heap->free_size + dedicated_size[memory_type_index];
 
-		memory_type_index = i;
-		break;
-	}
+	result.allocations_count = allocations_count[memory_type_index];
 
+	u64 listed_free_size = 0;
 
-	// If we intended to use host's RAM memory, but didn't found any, fallback to GPU memory. 
-	if ((allocation_flags & VULKAN_MEMORY_PREFER_HOST_MEMORY) && memory_type_index == -1)
+	for (int fl = 0; fl < tlsf_fl_count; fl++)
 	{
-		for (int i = 0; i < device_memory_properties.memoryTypeCount; i++)
-		{
-			VkMemoryType memory_type = device_memory_properties.memoryTypes[i];
+		if (!(heap->fl_bitmap & (1u << fl))) continue;
 
-			if (allocation_flags & VULKAN_MEMORY_SHOULD_BE_MAPPABLE)
+		for (int sl = 0; sl < tlsf_sl_count; sl++)
+		{
+			for (s32 index = heap->free_heads[fl][sl]; index != -1; index = heap->block(index)->next_free)
 			{
-				if (!(memory_type.propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) ||
-					!(memory_type.propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) continue;						
-			}
+				u64 size = heap->block(index)->size;
 
-			memory_type_index = i;
-			break;
+				result.free_blocks_count += 1;
+				result.largest_free_block = max(result.largest_free_block, size);
+
+				listed_free_size += size;
+			}
 		}
 	}
 
-	return memory_type_index;
+	// Free space of draining pool isn't in free lists, it's not available to allocations anyway.
+	result.fragmentation = listed_free_size ? 1.0f - float(double(result.largest_free_block) / double(listed_free_size)) : 0.0f;
+
+	return result;
 }
 
+Vulkan_Memory_Statistics Vulkan_Memory_Allocator::get_total_statistics()
+{
+	Vulkan_Memory_Statistics result = {};
+
+	u64 free_size = 0;
+
+	for (int i = 0; i < device_memory_properties.memoryTypeCount; i++)
+	{
+		Vulkan_Memory_Statistics type = get_memory_type_statistics(i);
 
+		result.reserved += type.reserved;
+		result.used     += type.used;
 
+		result.free_blocks_count += type.free_blocks_count;
+		result.allocations_count += type.allocations_count;
 
-Vulkan_Memory_Allocation Vulkan_Memory_Allocator::allocate_and_bind(VkImage image, Vulkan_Memory_Allocation_Flags allocation_flags, Code_Location code_location)
-{
-	VkImageMemoryRequirementsInfo2 i = {
-		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2,
-		.pNext = NULL,
-		.image = image,
-	};
+		result.largest_free_block = max(result.largest_free_block, type.largest_free_block);
 
-	VkMemoryDedicatedRequirementsKHR dedication_requirements = {
-		.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS_KHR,
-		.pNext = NULL,
-	};
+		free_size += type.reserved - type.used;
+	}
 
-	VkMemoryRequirements2 mem_requirements_2 = {
-		.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2,
-		.pNext = &dedication_requirements,
-	};
+	result.fragmentation = free_size ? 1.0f - float(double(result.largest_free_block) / double(free_size)) : 0.0f;
 
-#if OS_DARWIN
-	vkGetImageMemoryRequirements2KHR(renderer.device, &i, &mem_requirements_2);
-#else
-	vkGetImageMemoryRequirements2(renderer.device, &i, &mem_requirements_2);
-#endif
+	return result;
+}
 
-	VkMemoryRequirements mem_requirements = mem_requirements_2.memoryRequirements;
+void Vulkan_Memory_Allocator::publish_statistics()
+{
+	ZoneScoped;
 
-	u32 memory_type_index = find_memory_type(mem_requirements.memoryTypeBits, allocation_flags);
-	if (memory_type_index == -1)
-		abort_the_mission(U"Failed to find memory type for image");
+	Vulkan_Memory_Statistics total = get_total_statistics();
 
+	TracyPlot("Video memory reserved",      (s64) total.reserved);
+	TracyPlot("Video memory used",          (s64) total.used);
+	TracyPlot("Video memory allocations",   (s64) total.allocations_count);
+	TracyPlot("Video memory free blocks",   (s64) total.free_blocks_count);
+	TracyPlot("Video memory device budget", (s64) device_local_memory_budget());
+	TracyPlot("Video memory device usage",  (s64) device_local_memory_used());
 
-	if (dedication_requirements.prefersDedicatedAllocation)
+	for (int i = 0; i < device_memory_properties.memoryTypeCount; i++)
 	{
-		Vulkan_Memory_Allocation allocation;
-		
-		if (allocate(memory_type_index, mem_requirements.size, mem_requirements.alignment, &allocation, image, VK_NULL_HANDLE, code_location))
-		{
-			vkBindImageMemory(renderer.device, image, allocation.device_memory, allocation.offset);
-			return allocation;
-		}
-	}
+		if (heaps[i].total_size == 0 && dedicated_count[i] == 0) continue;
 
-	if (dedication_requirements.requiresDedicatedAllocation)
-		abort_the_mission(U"Required dedicated video memory allocation for VkImage has failed");
+		Vulkan_Memory_Statistics type = get_memory_type_statistics(i);
+
+		TracyPlot(plot_names[i][0], (s64) type.reserved);
+		TracyPlot(plot_names[i][1], (s64) type.used);
+		TracyPlot(plot_names[i][2], type.fragmentation);
+	}
+}
 
+// Snapshot for comparing memory footprint between runs.
+bool Vulkan_Memory_Allocator::write_statistics_json(Unicode_String path)
+{
+	ZoneScoped;
 
-	Vulkan_Memory_Allocation allocation;
+	File file = open_file(frame_allocator, path, FILE_WRITE | FILE_CREATE_NEW);
 
-	if (allocate(memory_type_index, mem_requirements.size, mem_requirements.alignment, &allocation, VK_NULL_HANDLE, VK_NULL_HANDLE, code_location))
+	if (!file.succeeded_to_open())
 	{
-		vkBindImageMemory(renderer.device, image, allocation.device_memory, allocation.offset);
-		return allocation;
+		Log(U"Failed to open file to write video memory statistics: %", path);
+		return false;
 	}
 
-	abort_the_mission(U"Video memory allocation has failed");
+	defer { file.close(); };
 
-	return allocation;
-}
 
-Vulkan_Memory_Allocation Vulkan_Memory_Allocator::allocate_and_bind(VkBuffer buffer, Vulkan_Memory_Allocation_Flags allocation_flags, Code_Location code_location)
-{
-	VkBufferMemoryRequirementsInfo2 i = {
-		.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_REQUIREMENTS_INFO_2,
-		.pNext = NULL,
-		.buffer = buffer,
+	auto write_number = [&](u64 number)
+	{
+		String str = to_string(number, frame_allocator);
+		file.write((u8*) str.data, str.length);
 	};
 
-	VkMemoryDedicatedRequirementsKHR dedication_requirements = {
-		.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS_KHR,
-		.pNext = NULL,
+	// Fragmentation is written in per mille, so every number in the file is an integer.
+	auto write_statistics = [&](Vulkan_Memory_Statistics stats)
+	{
+		file.write("\"reserved\": ");            write_number(stats.reserved);
+		file.write(", \"used\": ");              write_number(stats.used);
+		file.write(", \"largest_free_block\": "); write_number(stats.largest_free_block);
+		file.write(", \"free_blocks_count\": ");  write_number(stats.free_blocks_count);
+		file.write(", \"fragmentation_permille\": "); write_number(u64(stats.fragmentation * 1000.0f + 0.5f));
+		file.write(", \"allocations_count\": ");  write_number(stats.allocations_count);
 	};
 
-	VkMemoryRequirements2 mem_requirements_2 = {
-		.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2,
-		.pNext = &dedication_requirements,
-	};
 
-#if OS_DARWIN
-	vkGetBufferMemoryRequirements2KHR(renderer.device, &i, &mem_requirements_2);
-#else
-	vkGetBufferMemoryRequirements2(renderer.device, &i, &mem_requirements_2);
-#endif
+	file.write("{\n");
 
-	VkMemoryRequirements mem_requirements = mem_requirements_2.memoryRequirements;
+	file.write("\t\"frame\": "); write_number(frame_index); file.write(",\n");
 
-	u32 memory_type_index = find_memory_type(mem_requirements.memoryTypeBits, allocation_flags);
-	if (memory_type_index == -1)
-		abort_the_mission(U"Failed to find memory type for image");
+	file.write("\t\"device_local_budget\": "); write_number(device_local_memory_budget()); file.write(",\n");
+	file.write("\t\"device_local_usage\": ");  write_number(device_local_memory_used());   file.write(",\n");
 
+	file.write("\t\"total\": { ");
+	write_statistics(get_total_statistics());
+	file.write(" },\n");
 
-	if (dedication_requirements.prefersDedicatedAllocation)
+
+	file.write("\t\"memory_types\": [\n");
 	{
-		Vulkan_Memory_Allocation allocation;
-		
-		if (allocate(memory_type_index, mem_requirements.size, mem_requirements.alignment, &allocation, VK_NULL_HANDLE, buffer, code_location))
+		bool is_first = true;
+
+		for (int i = 0; i < device_memory_properties.memoryTypeCount; i++)
 		{
-			vkBindBufferMemory(renderer.device, buffer, allocation.device_memory, allocation.offset);
-			return allocation;
+			if (heaps[i].total_size == 0 && dedicated_count[i] == 0) continue;
+
+			if (!is_first) file.write(",\n");
+			is_first = false;
+
+			file.write("\t\t{ \"index\": "); write_number(i);
+			file.write(", \"property_flags\": "); write_number(device_memory_properties.memoryTypes[i].propertyFlags);
+			file.write(", \"dedicated_size\": "); write_number(dedicated_size[i]);
+			file.write(", \"dedicated_count\": "); write_number(dedicated_count[i]);
+			file.write(", ");
+			write_statistics(get_memory_type_statistics(i));
+			file.write(" }");
 		}
 	}
+	file.write("\n\t],\n");
 
-	if (dedication_requirements.requiresDedicatedAllocation)
-		abort_the_mission(U"Required dedicated video memory allocation for VkBuffer has failed");
 
+	file.write("\t\"pools\": [\n");
+	{
+		bool is_first = true;
 
-	Vulkan_Memory_Allocation allocation;
+		for (Vulkan_Memory_Pool& pool: pools)
+		{
+			if (pool.is_released) continue;
 
-	if (allocate(memory_type_index, mem_requirements.size, mem_requirements.alignment, &allocation, VK_NULL_HANDLE, VK_NULL_HANDLE, code_location))
-	{
-		vkBindBufferMemory(renderer.device, buffer, allocation.device_memory, allocation.offset);
-		return allocation;
+			if (!is_first) file.write(",\n");
+			is_first = false;
+
+			s32 pool_index = pools.fast_pointer_index(&pool);
+
+			file.write("\t\t{ \"index\": "); write_number(pool_index);
+			file.write(", \"memory_type\": "); write_number(pool.memory_type_index);
+			file.write(", \"is_draining\": "); file.write(pool_index == draining_pool_index ? "true" : "false");
+			file.write(", ");
+			write_statistics(get_pool_statistics(pool_index));
+			file.write(" }");
+		}
 	}
+	file.write("\n\t],\n");
 
-	abort_the_mission(U"Video memory allocation has failed");
 
-	return allocation;
-}
+	file.write("\t\"call_sites\": [\n");
+	{
+		bool is_first = true;
 
+		for (Vulkan_Call_Site_Statistics& call_site: call_sites)
+		{
+			if (call_site.allocations_count == 0) continue;
 
+			if (!is_first) file.write(",\n");
+			is_first = false;
 
+			file.write("\t\t{ \"file\": \"");
 
-bool Vulkan_Memory_Allocator::allocate(u32 memory_type_index, u64 size, u64 alignment, Vulkan_Memory_Allocation* result, VkImage dedication_image, VkBuffer dedication_buffer, Code_Location code_location)
-{
+			// Windows paths have backslashes, they would need escaping.
+			for (const char* c = call_site.code_location.file_name; *c; c++)
+			{
+				char ch = *c == '\\' ? '/' : *c;
 
-	// Log(U"Allocation of size: % at: %: %", size_to_string(size, c_allocator), String(code_location.file_name, strlen(code_location.file_name)), code_location.line);
+				if (ch == '"') continue;
 
-	if (dedication_image)
-	{
-		assert(!dedication_buffer);
+				file.write((u8*) &ch, 1);
+			}
+
+			file.write("\", \"line\": "); write_number(call_site.code_location.line);
+			file.write(", \"bytes\": "); write_number(call_site.bytes);
+			file.write(", \"allocations_count\": "); write_number(call_site.allocations_count);
+			file.write(" }");
+		}
 	}
+	file.write("\n\t]\n");
 
-	bool is_dedicated = dedication_image || dedication_buffer;
+	file.write("}\n");
 
-	if (!is_dedicated)
-	{
-		assert(size < default_pool_size);
+	Log(U"Wrote video memory statistics to %", path);
 
-		for (Vulkan_Memory_Pool& pool: pools)
-		{
-			if (pool.memory_type_index != memory_type_index) continue;
+	return true;
+}
 
-			u64 offset = 0;
 
-			for (Vulkan_Pool_Region& region: pool.regions)
-			{
-				if (!region.allocated && region.size >= size)
-				{
-					u64 aligned_offset = align(offset, alignment);
-					u64 offsets_offset = aligned_offset - offset;
+void Vulkan_Memory_Allocator::dump_allocations()
+{
+	Log(U"Vulkan memory dump\n------\n");
+
+	for (Vulkan_Memory_Pool& pool: vulkan_memory_allocator.pools)
+	{
+		if (pool.is_released) continue;
 
-					if (region.size >= size + offsets_offset)
-					{
-						u32 region_index = pool.regions.fast_pointer_index(&region);
+		Tlsf_Heap* heap = &heaps[pool.memory_type_index];
 
-						Vulkan_Memory_Allocation allocation = {
-							.pool_index = pools.fast_pointer_index(&pool),
-							.device_memory = pool.device_memory,
-							.offset = aligned_offset,
-							.size = size,
-						};
+		Log(U"\tPool %. memory type = %, size = %", vulkan_memory_allocator.pools.fast_pointer_index(&pool), pool.memory_type_index, size_to_string(pool.size, frame_allocator));
 
-						*result = allocation;
 
-						s64 right_size = region.size - (size + offsets_offset);
-						assert(right_size >= 0);
+		for (s32 index = pool.first_block; index != -1; index = heap->block(index)->next_physical)
+		{
+			Tlsf_Block* block = heap->block(index);
 
+			Log(U"\t\tBlock %. offset = %, size = %, allocated = %", index, block->offset, size_to_string(block->size, frame_allocator), !block->is_free);
+		}
 
-						region.size = size;
-						region.allocated = true;
+		Log(U"\n");
+	}
 
+	Log(U"------");
+}
 
-						if (offsets_offset)
-						{
-							assert(offsets_offset > 0);
 
-							// We add small region at the left to compensate alignment requirement.
-							//  This introduces a little waste of memory. 
-							Vulkan_Pool_Region left_region = {
-								.size = offsets_offset,
-								.allocated = false,
-							};	
+#if DEBUG
+void Vulkan_Memory_Allocator::toggle_benchmark()
+{
+	if (!is_recording_trace)
+	{
+		trace.clear();
+		is_recording_trace = true;
 
-							pool.regions.add_at_index(region_index, left_region);
+		Log(U"Recording allocation trace, press F11 again to run the benchmark");
+		return;
+	}
 
-							region_index += 1;
-						}
+	is_recording_trace = false;
 
+	run_benchmark();
 
-						if (right_size)
-						{
-							assert(right_size > 0);
-							// Have some memory on right side.
+	// Don't keep a long trace's capacity around.
+	trace.free();
+	trace = make_array<Trace_Event>(1024, c_allocator);
+}
 
-							Vulkan_Pool_Region right_region = {
-								.size = (u64) right_size,
-								.allocated = false,
-							};
+// Replays recorded allocations, then synthetic churn resembling level streaming, on fake pools.
+//  No Vulkan calls are made, so it measures the sub-allocator alone.
+void Vulkan_Memory_Allocator::run_benchmark()
+{
+	ZoneScoped;
 
-							pool.regions.add_at_index(region_index + 1, right_region);
-						}
+	Tlsf_Heap* bench_heaps = (Tlsf_Heap*) c_allocator.alloc(sizeof(Tlsf_Heap) * VK_MAX_MEMORY_TYPES, code_location());
+	int bench_pools_count = 0;
 
-						return true;
-					}
-				}
+	for (int i = 0; i < VK_MAX_MEMORY_TYPES; i++)
+	{
+		bench_heaps[i].init();
+	}
 
-				offset += region.size; 
-			}
+	defer {
+		for (int i = 0; i < VK_MAX_MEMORY_TYPES; i++)
+		{
+			bench_heaps[i].deinit();
 		}
+		c_allocator.free(bench_heaps, code_location());
+	};
 
 
-		{
+	auto bench_allocate = [&](u32 memory_type_index, u64 size, u64 alignment) -> s32
+	{
+		Tlsf_Heap* heap = &bench_heaps[memory_type_index];
+
+		s32 index = heap->allocate(size, alignment);
+		if (index != -1) return index;
 
-			u64 new_pool_size = default_pool_size;
-			
-			// Fight against fragmentation.
-			if (size > megabytes(48))
-				new_pool_size *= 2;
+		u64 pool_size = pool_size_tiers[min(bench_pools_count, (int) array_count(pool_size_tiers) - 1)];
+		while (pool_size < size + alignment)
+		{
+			pool_size *= 2;
+		}
 
+		heap->add_pool(bench_pools_count, pool_size);
+		bench_pools_count += 1;
 
+		index = heap->allocate(size, alignment);
+		assert(index != -1);
 
-			VkMemoryAllocateInfo i = {
-				.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-				.pNext = NULL,
-				.allocationSize = new_pool_size,
-				.memoryTypeIndex = memory_type_index,
-			};
+		return index;
+	};
 
-			VkDeviceMemory new_pool_device_memory;
-			
-			VkResult allocation_result = vkAllocateMemory(renderer.device, &i, renderer.host_allocator, &new_pool_device_memory);
 
-			
-			if (allocation_result != VK_SUCCESS) return false;
+	// Recorded trace.
+	if (trace.count)
+	{
+		// Recorded block index -> replayed block index, per memory type.
+		Dynamic_Array<s32> remap[VK_MAX_MEMORY_TYPES];
+		for (auto& it: remap)
+		{
+			it = make_array<s32>(64, frame_allocator);
+		}
 
-			Vulkan_Memory_Pool new_pool = {
-				.device_memory = new_pool_device_memory,
-				.memory_type_index = memory_type_index,
+		Time_Measurer tm = create_time_measurer();
 
-				.regions = make_array<Vulkan_Pool_Region>(64, c_allocator),
-			};
+		for (Trace_Event& event: trace)
+		{
+			Dynamic_Array<s32>* map = &remap[event.memory_type_index];
 
+			while (map->count <= event.block_index)
 			{
-				// @Maybe: align the allocation size by some reasonable number.
-
-				// :VulkanAlignment
-				// As Vulkan specification states, any memory that is returned
-				//  by vkAllocateMemory meets all the alignment requirements.
-				//  And this is the first region of the allocated pool,
-				//    so this rule applies for this region.
-				Vulkan_Pool_Region allocated_region = {
-					.size = size,
-					.allocated = true,
-				};
-
-				Vulkan_Pool_Region remaining_region = {
-					.size = new_pool_size - size,
-					.allocated = false,
-				};
-				
-				new_pool.regions.add(allocated_region);
-				new_pool.regions.add(remaining_region);
+				map->add(-1);
 			}
 
+			if (event.is_free)
+			{
+				// Allocated before recording started.
+				if (*(*map)[event.block_index] == -1) continue;
 
-			pools.add(new_pool);
-
-			Vulkan_Memory_Allocation allocation = {
-				.pool_index = pools.count - 1,
-				
-				.device_memory = new_pool.device_memory,
-				.offset = 0,
-				.size = size,
-			};
+				bench_heaps[event.memory_type_index].free(*(*map)[event.block_index]);
+				*(*map)[event.block_index] = -1;
+			}
+			else
+			{
+				*(*map)[event.block_index] = bench_allocate(event.memory_type_index, event.size, event.alignment);
+			}
+		}
 
-			*result = allocation;
+		double ms = tm.ms_elapsed_double();
 
-			return true;
-		}
+		Log(U"Recorded trace: % operations, % ms, % ns per operation", trace.count, ms, ms * 1000000.0 / double(trace.count));
 	}
 
-	assert(is_dedicated);
 
+	// Synthetic churn.
 	{
-		VkMemoryDedicatedAllocateInfoKHR dedicated_info = {
-			.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO_KHR,
-			.pNext = NULL,
-			.image = dedication_image,
-			.buffer = dedication_buffer,
-		};
-
-		// :VulkanAlignment
-		VkMemoryAllocateInfo i = {
-			.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-			.pNext = &dedicated_info,
-			.allocationSize = size,
-			.memoryTypeIndex = memory_type_index,
-		};
-
+		constexpr int operations_count = 1000000;
+		constexpr int max_live_count   = 4096;
 
+		u64 random_state = 0x2545f4914f6cdd1d;
 
-		VkDeviceMemory device_memory;
-		VkResult vk_result = vkAllocateMemory(renderer.device, &i, renderer.host_allocator, &device_memory);
-		if (vk_result != VK_SUCCESS)
-			return false;
+		auto random = [&]() -> u32
+		{
+			random_state = random_state * 6364136223846793005 + 1442695040888963407;
+			return u32(random_state >> 33);
+		};
 
-		Vulkan_Memory_Allocation allocation = {
-			.pool_index = -1,
+		// Uniform buffers and glyph staging, textures, big meshes and render targets.
+		auto random_size = [&]() -> u64
+		{
+			u32 r = random() % 100;
 
-			.device_memory = device_memory,
-			.offset = 0,
-			.size = size,
+			if (r < 60) return 256               + random() % (64 * 1024);
+			if (r < 90) return 64 * 1024         + random() % megabytes(4);
+			            return megabytes(4)      + random() % megabytes(28);
 		};
 
-		*result = allocation;
+		u32 memory_type_index = 1;
 
-		return true;
-	}
-}
+		Dynamic_Array<s32> live = make_array<s32>(max_live_count, frame_allocator);
 
+		int allocations_count = 0;
+		int frees_count = 0;
 
-void Vulkan_Memory_Allocator::free(Vulkan_Memory_Allocation allocation)
-{
-	if (allocation.pool_index == -1)
-	{
-		vkFreeMemory(renderer.device, allocation.device_memory, renderer.host_allocator);
-	}
-	else
-	{
-		Vulkan_Memory_Pool* pool = pools[allocation.pool_index];
+		Time_Measurer tm = create_time_measurer();
 
-		u64 offset = 0;
-		for (Vulkan_Pool_Region& region: pool->regions)
+		for (int i = 0; i < operations_count; i++)
 		{
-			if (offset == allocation.offset)
-			{
-				assert(region.size == allocation.size && region.allocated);
-
-				int region_index = pool->regions.fast_pointer_index(&region);
-				
-
-				bool join_with_previous = false;			
-				bool join_with_next     = false;
+			bool should_allocate = live.count == 0 || (live.count < max_live_count && random() % 100 < 55);
 
+			if (should_allocate)
+			{
+				u64 alignment = u64(256) << (random() % 9);
 
-				if (region_index > 0 &&
-					!pool->regions[region_index - 1]->allocated)
-				{
-					join_with_previous = true;
-				}
+				live.add(bench_allocate(memory_type_index, random_size(), alignment));
+				allocations_count += 1;
+			}
+			else
+			{
+				int live_index = random() % live.count;
 
-				if (region_index < pool->regions.count - 1 &&
-					!pool->regions[region_index + 1]->allocated)
-				{
-					join_with_next = true;
-				}
+				bench_heaps[memory_type_index].free(*live[live_index]);
 
+				*live[live_index] = *live[live.count - 1];
+				live.count -= 1;
 
+				frees_count += 1;
+			}
+		}
 
-				if (join_with_previous && join_with_next)
-				{
-					Vulkan_Pool_Region new_region = {
-						.size = 
-							pool->regions[region_index - 1]->size + 
-							region.size +
-							pool->regions[region_index + 1]->size,
+		double ms = tm.ms_elapsed_double();
 
-						.allocated = false,
-					};
+		Tlsf_Heap* heap = &bench_heaps[memory_type_index];
 
+		Log(U"Synthetic trace: % allocations, % frees, % ms, % ns per operation", allocations_count, frees_count, ms, ms * 1000000.0 / double(operations_count));
+		Log(U"Synthetic trace: % pools, % total, % free at the end", bench_pools_count, size_to_string(heap->total_size, frame_allocator), size_to_string(heap->free_size, frame_allocator));
+	}
+}
+#endif
 
-					*pool->regions[region_index - 1] = new_region;
-					pool->regions.remove_range(region_index, 2);
-				}
-				else if (join_with_previous)
-				{
-					Vulkan_Pool_Region new_region = {
-						.size = 
-							pool->regions[region_index - 1]->size + 
-							region.size,
 
-						.allocated = false,
-					};
 
+void Vulkan_Linear_Buffer::create(u64 capacity, u64 tail_padding, VkBufferUsageFlags usage, Code_Location code_location)
+{
+	ZoneScoped;
 
-					*pool->regions[region_index - 1] = new_region;
-					pool->regions.remove_at_index(region_index);
-				}
-				else if (join_with_next)
-				{
-					Vulkan_Pool_Region new_region = {
-						.size = 
-							region.size + 
-							pool->regions[region_index + 1]->size,
+	assert(buffer == VK_NULL_HANDLE);
 
-						.allocated = false,
-					};
+	this->capacity     = capacity;
+	this->tail_padding = tail_padding;
+	this->usage        = usage;
+	this->occupied     = 0;
 
+	VkBufferCreateInfo create_info = {
+		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+		.pNext = NULL,
+		.flags = 0,
+		.size  = capacity + tail_padding,
+		.usage = usage,
+		.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+		.queueFamilyIndexCount = 0,
+	};
 
-					region = new_region;
-					pool->regions.remove_at_index(region_index + 1);
-				}
-				else
-				{
-					region.allocated = false;
-				}
+	if (vkCreateBuffer(renderer.device, &create_info, renderer.host_allocator, &buffer) != VK_SUCCESS)
+		abort_the_mission(U"Failed to vkCreateBuffer");
 
-				return;
-			}
+	memory = vulkan_memory_allocator.allocate_and_bind(buffer, (Vulkan_Memory_Allocation_Flags) (VULKAN_MEMORY_SHOULD_BE_MAPPABLE | VULKAN_MEMORY_DEDICATED), code_location);
 
-			offset += region.size;
-		}
+	void* data;
+	if (vkMapMemory(renderer.device, memory.device_memory, memory.offset, memory.size, 0, &data) != VK_SUCCESS)
+		abort_the_mission(U"Failed to vkMapMemory");
 
-		assert(false);
-	}
+	mapped_data = (u8*) data;
 }
 
-void Vulkan_Memory_Allocator::dump_allocations()
+void Vulkan_Linear_Buffer::destroy()
 {
-	Log(U"Vulkan memory dump\n------\n");
+	ZoneScoped;
 
-	for (Vulkan_Memory_Pool& pool: vulkan_memory_allocator.pools)
-	{
-		size_t pool_size = 0;
-		for (Vulkan_Pool_Region& region: pool.regions)
-		{
-			pool_size += region.size;
-		}
+	if (buffer == VK_NULL_HANDLE) return;
 
-		Log(U"\tPool %. size = %", vulkan_memory_allocator.pools.fast_pointer_index(&pool), size_to_string(pool_size, frame_allocator));
+	vkUnmapMemory(renderer.device, memory.device_memory);
 
+	vkDestroyBuffer(renderer.device, buffer, renderer.host_allocator);
+	vulkan_memory_allocator.free(memory);
 
+	buffer      = VK_NULL_HANDLE;
+	mapped_data = NULL;
+	capacity    = 0;
+	occupied    = 0;
+}
 
-		for (Vulkan_Pool_Region& region: pool.regions)
-		{
-			Log(U"\t\tRegion %. size = %, allocated = %", pool.regions.fast_pointer_index(&region), size_to_string(region.size, frame_allocator), region.allocated);
+bool Vulkan_Linear_Buffer::allocate(u64 size, u64 alignment, u64* out_offset)
+{
+	// Not using align(), alignment can be a struct size rather than power of 2.
+	u64 offset = ((occupied + alignment - 1) / alignment) * alignment;
 
-		}
+	if (offset + size > capacity) return false;
 
-		Log(U"\n");
-	}
+	occupied = offset + size;
 
-	Log(U"------");
-}
\ No newline at end of file
+	*out_offset = offset;
+	return true;
+}
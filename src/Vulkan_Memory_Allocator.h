@@ -5,23 +5,109 @@
 
 #include "vulkan/vulkan.h"
 
-struct Vulkan_Pool_Region
+// Two level segregated fit.
+//  Allocate and free are constant time, freed blocks are merged with free neighbours right away.
+//  Heap doesn't know about Vulkan, pool is just an index and a size, so it can be benchmarked without a device.
+
+constexpr int tlsf_granularity_log2 = 8; // Block offsets and sizes are multiples of 256 bytes.
+constexpr u64 tlsf_granularity      = 1 << tlsf_granularity_log2;
+
+constexpr int tlsf_sl_count_log2 = 5;
+constexpr int tlsf_sl_count      = 1 << tlsf_sl_count_log2;
+constexpr int tlsf_fl_count      = 32;
+
+// Sizes below this all live in first level 0, one second level class per granularity step.
+constexpr u64 tlsf_small_block_size = u64(tlsf_sl_count) << tlsf_granularity_log2;
+
+struct Tlsf_Block
 {
+	u64 offset;
 	u64 size;
-	bool allocated;
+
+	s32 pool_index;
+
+	// Neighbours in pool memory, -1 at pool boundaries.
+	s32 previous_physical;
+	s32 next_physical;
+
+	// Links in size class free list, or in list of unused blocks.
+	s32 previous_free;
+	s32 next_free;
+
+	bool is_free;
 };
 
+struct Tlsf_Heap
+{
+	u32 fl_bitmap;
+	u32 sl_bitmaps[tlsf_fl_count];
+	s32 free_heads[tlsf_fl_count][tlsf_sl_count];
+
+	// Blocks are referred to by index, array might be reallocated.
+	//  Unused blocks are chained through next_free.
+	Dynamic_Array<Tlsf_Block> blocks;
+	s32 unused_head;
+
+	u64 total_size;
+	u64 free_size;
+
+	// Indexed by pool index. Free blocks of draining pool are kept out of free lists, so nothing new lands there.
+	Dynamic_Array<bool> is_pool_draining;
+
+
+	void init();
+	void deinit();
+
+	// Returns index of the block that covers whole pool.
+	s32  add_pool(s32 pool_index, u64 size);
+	void remove_pool(s32 first_block);
+
+	void set_pool_draining(s32 pool_index, s32 first_block, bool draining);
+
+	// Returns -1 if there is no free block big enough.
+	s32  allocate(u64 size, u64 alignment);
+	void free(s32 block_index);
+
+	inline Tlsf_Block* block(s32 index)
+	{
+		return blocks[index];
+	}
+
+
+	// For heap's internal usage.
+	s32  new_block();
+	void release_block(s32 block_index);
+	void insert_free(s32 block_index);
+	void remove_free(s32 block_index);
+	s32  find_free(u64 size);
+	s32  split(s32 block_index, u64 left_size);
+};
+
+
+
 struct Vulkan_Memory_Pool
 {
 	VkDeviceMemory device_memory;
 	u32 memory_type_index;
 
-	Dynamic_Array<Vulkan_Pool_Region> regions;
+	u64 size;
+	u64 used_size;
+
+	s32 first_block; // Block at offset 0 keeps its index, so pool's blocks can be walked from it.
+
+	bool is_released; // VkDeviceMemory is freed, index is kept and reused by the next pool.
+
+	// Draining timed out, so pool isn't picked for draining again until something is allocated in it or freed from it.
+	bool is_drain_abandoned;
 };
 
 struct Vulkan_Memory_Allocation
 {
 	s32 pool_index; // If this is -1, allocation is dedicated and is not in pools array.
+	s32 block_index;
+
+	u32 memory_type_index;
+	s32 call_site_index; // In Vulkan_Memory_Allocator::call_sites.
 
 	VkDeviceMemory device_memory;
 	u64 offset;
@@ -29,11 +115,35 @@ struct Vulkan_Memory_Allocation
 };
 
 
+struct Vulkan_Memory_Statistics
+{
+	u64 reserved; // Bytes of VkDeviceMemory.
+	u64 used;
+
+	u64 largest_free_block;
+	u64 free_blocks_count;
+
+	// 1 - largest_free_block / free bytes. 0 means that all free space is one block.
+	float fragmentation;
+
+	u64 allocations_count;
+};
+
+struct Vulkan_Call_Site_Statistics
+{
+	Code_Location code_location;
+
+	u64 bytes;
+	u64 allocations_count;
+};
+
+
 enum Vulkan_Memory_Allocation_Flags: u32
 {
 	VULKAN_MEMORY_ONLY_DEVICE_MEMORY = 1,
 	VULKAN_MEMORY_PREFER_HOST_MEMORY = 1 << 1,
 	VULKAN_MEMORY_SHOULD_BE_MAPPABLE = 1 << 3,
+	VULKAN_MEMORY_DEDICATED          = 1 << 4, // Needed to keep memory mapped, same VkDeviceMemory can't be mapped twice.
 };
 
 
@@ -43,7 +153,56 @@ struct Vulkan_Memory_Allocator
 	//  indices should stay the same
 	Dynamic_Array<Vulkan_Memory_Pool> pools;
 
-	const u64 default_pool_size = megabytes(2);
+	// One heap per memory type, it spans every pool of that type.
+	Tlsf_Heap heaps[VK_MAX_MEMORY_TYPES];
+
+	// Every next pool of the same memory type is bigger, so big scenes don't end up with hundreds of VkDeviceMemory objects.
+	static constexpr u64 pool_size_tiers[] = { megabytes(2), megabytes(16), megabytes(64), megabytes(256) };
+
+	// Bigger allocations get VkDeviceMemory of their own.
+	static constexpr u64 max_pooled_allocation_size = megabytes(128);
+
+
+	// Defragmentation.
+	//  One mostly empty pool at a time is drained: new allocations avoid it, owners move their allocations out,
+	//  and once it's empty, its memory is returned to the driver.
+	s32 draining_pool_index = -1;
+	u64 draining_started_frame;
+
+	static constexpr float drain_pool_max_usage = 0.25; // Fraction of pool size.
+	static constexpr u64   drain_pool_timeout   = 600;  // In frames, pool with allocations nobody moves is given up on.
+
+	void update_defragmentation();
+
+	inline bool is_in_draining_pool(Vulkan_Memory_Allocation allocation)
+	{
+		return allocation.pool_index != -1 && allocation.pool_index == draining_pool_index;
+	}
+
+
+	// Statistics.
+
+	// Allocations that got VkDeviceMemory of their own, per memory type.
+	u64 dedicated_size [VK_MAX_MEMORY_TYPES];
+	u64 dedicated_count[VK_MAX_MEMORY_TYPES];
+
+	u64 allocations_count[VK_MAX_MEMORY_TYPES]; // Pooled and dedicated.
+
+	// Places that pass Code_Location into allocate_and_bind. There are few of them, so lookup is linear.
+	Dynamic_Array<Vulkan_Call_Site_Statistics> call_sites;
+
+	// Tracy keeps pointers to plot names, so they live as long as allocator.
+	char plot_names[VK_MAX_MEMORY_TYPES][3][48];
+
+	// Walks every block of the pool.
+	Vulkan_Memory_Statistics get_pool_statistics(s32 pool_index);
+
+	// Pools and dedicated allocations together. Free blocks are found from TLSF free lists, so this is cheap enough for every frame.
+	Vulkan_Memory_Statistics get_memory_type_statistics(u32 memory_type_index);
+	Vulkan_Memory_Statistics get_total_statistics();
+
+	void publish_statistics(); // As TracyPlot series.
+	bool write_statistics_json(Unicode_String path);
 
 
 	VkPhysicalDeviceMemoryProperties          device_memory_properties;
@@ -60,8 +219,11 @@ struct Vulkan_Memory_Allocator
 
 
 
+	// Across every DEVICE_LOCAL heap. Usage and budget are from VK_EXT_memory_budget,
+	//  they are as fresh as the last update_memory_usage_information() call.
 	u64 device_local_memory_size();
 	u64 device_local_memory_used();
+	u64 device_local_memory_budget();
 	u64 device_local_free_memory_size();
 
 
@@ -75,12 +237,80 @@ struct Vulkan_Memory_Allocator
 	bool allocate(u32 memory_type_index, u64 size, u64 alignment, Vulkan_Memory_Allocation* result, VkImage 
 		dedication_image = VK_NULL_HANDLE, VkBuffer dedication_buffer = VK_NULL_HANDLE, Code_Location code_location = code_location());
 
+	// For allocator's internal usage.
+	bool add_pool(u32 memory_type_index, u64 required_size);
+
 
 
 	void update_memory_usage_information();
 	void init();
 
 	void dump_allocations();
+
+
+#if DEBUG
+	// Pooled allocates and frees while is_recording_trace is set, run_benchmark() replays them.
+	struct Trace_Event
+	{
+		u32 memory_type_index;
+		s32 block_index; // Identifies allocation until it's freed.
+
+		u64 size;
+		u64 alignment;
+
+		bool is_free;
+	};
+
+	static constexpr int max_trace_events = 1 << 20; // Recording stops once it's full.
+
+	Dynamic_Array<Trace_Event> trace;
+	bool is_recording_trace = false;
+
+	// First call starts recording, second one stops it and runs run_benchmark().
+	void toggle_benchmark();
+	void run_benchmark();
+
+	inline void record_trace_event(Trace_Event event)
+	{
+		if (is_recording_trace && trace.count < max_trace_events)
+		{
+			trace.add(event);
+		}
+	}
+#endif
 };
 
-inline Vulkan_Memory_Allocator vulkan_memory_allocator;
\ No newline at end of file
+inline Vulkan_Memory_Allocator vulkan_memory_allocator;
+
+
+
+// Persistently mapped buffer with bump allocation.
+//  Everything is released at once with reset(), caller makes sure GPU is done with the memory by then.
+struct Vulkan_Linear_Buffer
+{
+	VkBuffer buffer = VK_NULL_HANDLE;
+	Vulkan_Memory_Allocation memory;
+
+	u8* mapped_data = NULL;
+
+	u64 capacity = 0;
+	u64 occupied = 0;
+
+	// Bytes after capacity that are never handed out by allocate(),
+	//  so descriptor with fixed range can be bound at any allocated offset.
+	u64 tail_padding = 0;
+
+	VkBufferUsageFlags usage;
+
+
+	void create(u64 capacity, u64 tail_padding, VkBufferUsageFlags usage, Code_Location code_location);
+	void destroy();
+
+	// Returns false if there is not enough space left. Alignment doesn't have to be a power of 2.
+	bool allocate(u64 size, u64 alignment, u64* out_offset);
+
+	inline void reset()
+	{
+		occupied = 0;
+	}
+};
\ No newline at end of file
@@ -0,0 +1,139 @@
+#include "Worker_Pool.h"
+
+#include "Main.h"
+#include "Tracy_Header.h"
+
+#include "b_lib/Log.h"
+
+#if OS_WINDOWS
+#include <intrin.h>
+#elif IS_POSIX
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+
+
+struct Worker_Run
+{
+	Worker_Job_Proc proc;
+	void*           data;
+	int             jobs_count;
+
+	volatile s32 next_job_index;
+};
+
+static s32 take_next_job_index(Worker_Run* run)
+{
+#if OS_WINDOWS
+	return _InterlockedExchangeAdd((volatile long*) &run->next_job_index, 1);
+#else
+	return __atomic_fetch_add(&run->next_job_index, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+static void work(Worker_Run* run)
+{
+	// Frame allocator belongs to main thread.
+	Arena_Allocator arena;
+	create_arena_allocator(&arena, c_allocator, 64 * 1024);
+	defer { arena.free(); };
+
+#if DEBUG
+	arena.owning_thread = threading.current_thread_id();
+#endif
+
+	while (true)
+	{
+		s32 job_index = take_next_job_index(run);
+		if (job_index >= run->jobs_count) break;
+
+		run->proc(run->data, job_index, arena);
+
+		arena.reset();
+	}
+}
+
+
+#if OS_WINDOWS
+static DWORD WINAPI worker_thread_proc(LPVOID parameter)
+#elif IS_POSIX
+static void* worker_thread_proc(void* parameter)
+#endif
+{
+	ctx.logger = main_logger;
+
+#ifdef TRACY_ENABLE
+	tracy::SetThreadName("Worker");
+#endif
+
+	work((Worker_Run*) parameter);
+
+	return 0;
+}
+
+
+void Worker_Pool::init()
+{
+	int cores_count = 1;
+
+#if OS_WINDOWS
+	SYSTEM_INFO system_info;
+	GetSystemInfo(&system_info);
+	cores_count = system_info.dwNumberOfProcessors;
+#elif IS_POSIX
+	cores_count = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+	workers_count = max(1, min(cores_count, max_workers_count));
+
+	Log(U"Worker pool: % workers", workers_count);
+}
+
+void Worker_Pool::run(Worker_Job_Proc proc, void* data, int jobs_count)
+{
+	ZoneScoped;
+
+	if (jobs_count == 0) return;
+
+
+	Worker_Run run = {
+		.proc       = proc,
+		.data       = data,
+		.jobs_count = jobs_count,
+
+		.next_job_index = 0,
+	};
+
+	int threads_count = min(workers_count, jobs_count) - 1;
+
+#if OS_WINDOWS
+	HANDLE threads[max_workers_count];
+#elif IS_POSIX
+	pthread_t threads[max_workers_count];
+#endif
+
+	for (int i = 0; i < threads_count; i++)
+	{
+	#if OS_WINDOWS
+		threads[i] = CreateThread(NULL, 0, worker_thread_proc, &run, 0, NULL);
+		if (!threads[i])
+			abort_the_mission(U"Failed to CreateThread");
+	#elif IS_POSIX
+		if (pthread_create(&threads[i], NULL, worker_thread_proc, &run) != 0)
+			abort_the_mission(U"Failed to pthread_create");
+	#endif
+	}
+
+	work(&run);
+
+	for (int i = 0; i < threads_count; i++)
+	{
+	#if OS_WINDOWS
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+	#elif IS_POSIX
+		pthread_join(threads[i], NULL);
+	#endif
+	}
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "b_lib/Basic.h"
+#include "b_lib/Arena_Allocator.h"
+
+
+// Runs a batch of independent jobs on all cores.
+//  Threads are started per run(), it's only used for long batches like asset loading, so thread start cost doesn't matter.
+
+typedef void (*Worker_Job_Proc)(void* data, int job_index, Allocator temporary_allocator);
+
+struct Worker_Pool
+{
+	static constexpr int max_workers_count = 32;
+
+	int workers_count = 1; // Including calling thread.
+
+
+	void init();
+
+	// Blocks until every job is done, calling thread runs jobs too.
+	//  temporary_allocator is an arena of the worker, it's reset after every job.
+	void run(Worker_Job_Proc proc, void* data, int jobs_count);
+};
+
+inline Worker_Pool worker_pool;
@@ -0,0 +1,93 @@
+// Keep in sync with Gpu_Culling.h
+//  Compute shaders define GPU_CULLING_COMPUTE before including, they write what vertex shader only reads.
+
+#ifdef GPU_CULLING_COMPUTE
+#define GPU_CULLING_WRITTEN
+#else
+#define GPU_CULLING_WRITTEN readonly
+#endif
+
+
+struct Gpu_Instance
+{
+	vec4 rows[3]; // Mesh_Instance, object to world, row major 3x4.
+	uint group_index;
+};
+
+struct Gpu_Draw_Group
+{
+	vec4 bounds_min;
+	vec4 bounds_max;
+	vec4 bounding_sphere; // Object space center and radius.
+	vec4 color;
+
+	uint indices_count;
+	uint first_index;
+	int  vertex_offset;
+
+	uint first_visible;
+	uint batch_index;
+	uint batch_first_command;
+};
+
+struct Draw_Indexed_Indirect_Command
+{
+	uint index_count;
+	uint instance_count;
+	uint first_index;
+	int  vertex_offset;
+	uint first_instance;
+};
+
+
+layout(std430, set = 0, binding = 0) readonly buffer Instance_Buffer
+{
+	Gpu_Instance instances[];
+} instance_buffer;
+
+layout(std430, set = 0, binding = 1) readonly buffer Group_Buffer
+{
+	Gpu_Draw_Group groups[];
+} group_buffer;
+
+// Group's visible instances are at first_visible, in no particular order.
+layout(std430, set = 0, binding = 2) GPU_CULLING_WRITTEN buffer Visible_Buffer
+{
+	uint instance_indices[];
+} visible_buffer;
+
+layout(std430, set = 0, binding = 3) GPU_CULLING_WRITTEN buffer Group_Count_Buffer
+{
+	uint counts[];
+} group_count_buffer;
+
+layout(std430, set = 0, binding = 4) GPU_CULLING_WRITTEN buffer Command_Buffer
+{
+	Draw_Indexed_Indirect_Command commands[];
+} command_buffer;
+
+// Per batch, read by vkCmdDrawIndexedIndirectCount.
+layout(std430, set = 0, binding = 5) GPU_CULLING_WRITTEN buffer Draw_Count_Buffer
+{
+	uint counts[];
+} draw_count_buffer;
+
+
+#ifdef GPU_CULLING_COMPUTE
+
+layout(push_constant) uniform Cull_Uniform_Block
+{
+	vec4 frustum_planes[5]; // Normalized, inside is positive.
+
+	uint instances_count;
+	uint groups_count;
+} u;
+
+#else
+
+layout(push_constant) uniform Culled_Mesh_Uniform_Block
+{
+	layout(row_major) mat4 view_projection;
+} u;
+
+#endif
@@ -1,13 +1,16 @@
 #version 450
 #extension GL_ARB_separate_shader_objects : enable
 #extension GL_GOOGLE_include_directive : enable
+#extension GL_EXT_nonuniform_qualifier : enable
 
 layout(location = 0) in vec2 texture_coord;
+layout(location = 1) in float line_distance;
 
 layout(location = 0) out vec4 out_color;
 
 
-layout(binding = 1) uniform sampler2D texture_sampler;
+// Renderer's texture table, indexed by Imm_Instance texture index.
+layout(set = 1, binding = 0) uniform sampler2D textures[];
 
 
 #define IMM_GLYPH_RECT_SHADER
@@ -18,6 +21,16 @@ layout(location = 2) in flat Batched_Draw_Command_Block u;
 
 void main()
 {
+	// Framebuffer's Y axis is flipped relative to rect's.
+	vec2 pixel = vec2(gl_FragCoord.x, float(general_uniform.screen_size.y) - gl_FragCoord.y);
+
+	if (pixel.x < float(u.clip_rect[0]) || pixel.x >= float(u.clip_rect[2]) ||
+		pixel.y < float(u.clip_rect[1]) || pixel.y >= float(u.clip_rect[3]))
+	{
+		discard;
+	}
+
+
 	vec4 color = u.color / 255;
 
 
@@ -31,7 +44,7 @@ void main()
 
 		case DRAW_TYPE_FADED_RECT:
 		{
-			float coeff = mix(u.faded_rect_left_alpha, u.faded_rect_right_alpha, texture_coord.x);
+			float coeff = mix(u.faded_rect_alphas[0], u.faded_rect_alphas[1], texture_coord.x);
 
 			color.xyz = color.xyz * color.a;
 			
@@ -41,9 +54,9 @@ void main()
 
 		case DRAW_TYPE_GLYPH:
 		{
-			float alpha = texture(texture_sampler, vec2(
-				mix(u.atlas_x_left,   u.atlas_x_right, texture_coord.x),
-				mix(u.atlas_y_bottom, u.atlas_y_top,   texture_coord.y)))[0];
+			float alpha = texture(textures[nonuniformEXT(u.texture_index)], vec2(
+				mix(u.atlas_rect[0], u.atlas_rect[2], texture_coord.x),
+				mix(u.atlas_rect[1], u.atlas_rect[3], texture_coord.y)))[0];
 			
 			// WTF?? why call gamma_correct 2 times??
 			alpha = gamma_correct(gamma_correct(alpha));
@@ -51,5 +64,26 @@ void main()
 			out_color = color * alpha * color.a;
 		}
 		break;
+
+		case DRAW_TYPE_LINE:
+		{
+			float coverage = 1.0;
+
+			if (u.line_params[1] != 0.0)
+			{
+				coverage = clamp(u.line_params[0] * 0.5 + 0.5 - abs(line_distance), 0.0, 1.0);
+			}
+
+			out_color = color * color.a * coverage;
+		}
+		break;
+
+		case DRAW_TYPE_TEXTURE:
+		{
+			out_color = texture(textures[nonuniformEXT(u.texture_index)], vec2(
+				mix(u.atlas_rect[0], u.atlas_rect[2], texture_coord.x),
+				mix(u.atlas_rect[1], u.atlas_rect[3], texture_coord.y)));
+		}
+		break;
 	}
 }
\ No newline at end of file
@@ -4,6 +4,7 @@
 
 
 layout(location = 0) out vec2 texture_coord;
+layout(location = 1) out float line_distance;
 
 #define IMM_GLYPH_RECT_SHADER
 #include "imm_uniform.glsl.h"
@@ -13,10 +14,37 @@ layout(location = 2) out Batched_Draw_Command_Block out_u;
 
 void main()
 {
-	Batched_Draw_Command_Block u = uniform_buffer.commands[gl_InstanceIndex];
+	// gl_InstanceIndex includes firstInstance, which points to the batch inside the frame's instance buffer.
+	Batched_Draw_Command_Block u = unpack_instance(instance_buffer.instances[gl_InstanceIndex]);
 
 	out_u = u;
 
 	texture_coord = map_vertex_index_to_texture_coord(gl_VertexIndex);
-	gl_Position   = map_vertex_index_to_vertex(gl_VertexIndex, u.screen_size, u.rect);
+	line_distance = 0.0;
+
+	if (u.draw_type == DRAW_TYPE_LINE)
+	{
+		// Line is expanded into a quad around segment between pixel centers.
+		vec2 start = vec2(u.rect.xy) + 0.5;
+		vec2 end   = vec2(u.rect.zw) + 0.5;
+
+		vec2 direction = end - start;
+		direction = length(direction) > 0.0 ? normalize(direction) : vec2(1, 0);
+
+		vec2 normal = vec2(-direction.y, direction.x);
+
+		// Extra pixel on each side for the falloff.
+		float half_width = u.line_params[0] * 0.5 + (u.line_params[1] != 0.0 ? 1.0 : 0.0);
+
+		float across = texture_coord.y * 2.0 - 1.0;
+
+		vec2 point = mix(start, end, texture_coord.x) + normal * across * half_width;
+
+		line_distance = across * half_width;
+		gl_Position   = map_point_to_vertex(point, general_uniform.screen_size);
+	}
+	else
+	{
+		gl_Position = map_vertex_index_to_vertex(gl_VertexIndex, general_uniform.screen_size, u.rect);
+	}
 }
\ No newline at end of file
@@ -1,15 +1,5 @@
 
 
-#ifdef IMM_LINE_SHADER
-
-layout(push_constant) uniform Line_Uniform_Block {
-	ivec2 screen_size;
-	ivec2 line_start;
-	ivec2 line_end;
-	vec4 color;
-} u;
-#endif
-
 #ifdef IMM_MASK_SHADER
 
 layout(push_constant) uniform Mask_Uniform_Block
@@ -19,13 +9,6 @@ layout(push_constant) uniform Mask_Uniform_Block
 } u;
 #endif
 
-#ifdef IMM_TEXTURE_SHADER
-layout(push_constant) uniform Texture_Uniform_Block
-{
-	ivec2 screen_size;
-	ivec4 rect;
-} u;
-#endif
 
 
 
@@ -34,30 +17,80 @@ layout(push_constant) uniform Texture_Uniform_Block
 const int DRAW_TYPE_RECT       = 0;
 const int DRAW_TYPE_GLYPH      = 1;
 const int DRAW_TYPE_FADED_RECT = 2;
+const int DRAW_TYPE_TEXTURE    = 3;
+const int DRAW_TYPE_LINE       = 4;
 
-const int max_batched_commands = 512; // Keep in sync with C++
+// Keep in sync with Imm_Instance in Renderer.h
+struct Imm_Instance
+{
+	uvec2 rect;   // 4 x int16: x_left, y_bottom, x_right, y_top
+	uvec2 uv;     // 4 x unorm16: x_left, y_bottom, x_right, y_top
+	uvec2 clip_rect; // 4 x int16, same layout as rect
+	uint  color;  // RGBA8
+	uint  params; // draw_type | faded_rect_left_alpha << 4 | faded_rect_right_alpha << 12 | texture_index << 20
+};
 
 
+layout(std430, binding = 0) readonly buffer Instance_Buffer
+{
+	Imm_Instance instances[];
+} instance_buffer;
 
-struct Batched_Draw_Command_Block
+layout(push_constant) uniform General_Uniform_Block
 {
 	ivec2 screen_size;
+} general_uniform;
+
+
+// Unpacked Imm_Instance, passed from vertex to fragment shader.
+//  Every member takes a separate varying location, so scalars are grouped into vectors.
+struct Batched_Draw_Command_Block
+{
 	ivec4 rect;
-	float faded_rect_left_alpha;
-	float faded_rect_right_alpha;
-	int draw_type;
-	float atlas_x_left;
-	float atlas_x_right;
-	float atlas_y_bottom;
-	float atlas_y_top;
+	ivec4 clip_rect;
+	vec4  atlas_rect;        // x_left, y_bottom, x_right, y_top
+	vec2  faded_rect_alphas; // left, right
+	vec2  line_params;       // thickness, anti aliasing flag
+	int   draw_type;
+	int   texture_index;
 	vec4  color;
 };
 
-
-layout(std140, binding = 0) uniform General_Uniform_Block
+Batched_Draw_Command_Block unpack_instance(Imm_Instance instance)
 {
-	Batched_Draw_Command_Block commands[max_batched_commands];
-} uniform_buffer;
+	Batched_Draw_Command_Block u;
+
+	u.rect = ivec4(
+		bitfieldExtract(int(instance.rect.x), 0,  16),
+		bitfieldExtract(int(instance.rect.x), 16, 16),
+		bitfieldExtract(int(instance.rect.y), 0,  16),
+		bitfieldExtract(int(instance.rect.y), 16, 16));
+
+	u.clip_rect = ivec4(
+		bitfieldExtract(int(instance.clip_rect.x), 0,  16),
+		bitfieldExtract(int(instance.clip_rect.x), 16, 16),
+		bitfieldExtract(int(instance.clip_rect.y), 0,  16),
+		bitfieldExtract(int(instance.clip_rect.y), 16, 16));
+
+	u.atlas_rect = vec4(unpackUnorm2x16(instance.uv.x), unpackUnorm2x16(instance.uv.y));
+
+	// Line's uv holds thickness in 1/16 of pixel and anti aliasing flag.
+	u.line_params = vec2(
+		float(bitfieldExtract(instance.uv.x, 0,  16)) / 16.0,
+		float(bitfieldExtract(instance.uv.x, 16, 16)));
+
+	// Fragment shader expects color in 0-255 range.
+	u.color = unpackUnorm4x8(instance.color) * 255.0;
+
+	u.draw_type     = int(bitfieldExtract(instance.params, 0,  4));
+	u.texture_index = int(bitfieldExtract(instance.params, 20, 12));
+
+	u.faded_rect_alphas = vec2(
+		float(bitfieldExtract(instance.params, 4,  8)) / 255.0,
+		float(bitfieldExtract(instance.params, 12, 8)) / 255.0);
+
+	return u;
+}
 #endif
 
 
@@ -108,6 +141,16 @@ vec4 map_vertex_index_to_vertex(int vertex_index, ivec2 screen_size, ivec4 rect)
 	return pos;
 }
 
+vec4 map_point_to_vertex(vec2 point, ivec2 screen_size)
+{
+	vec4 pos = vec4(0, 0, 0, 1);
+
+	pos.x =  (point.x / float(screen_size.x) - 0.5) * 2.0;
+	pos.y = -(point.y / float(screen_size.y) - 0.5) * 2.0;
+
+	return pos;
+}
+
 vec2 map_vertex_index_to_texture_coord(int vertex_index)
 {
 	switch (vertex_index)
@@ -0,0 +1,20 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_GOOGLE_include_directive : enable
+
+layout(location = 0) in vec3 normal;
+layout(location = 1) in vec2 uv;
+layout(location = 2) flat in vec4 color; // mesh.vert and mesh_culled.vert both feed this shader.
+
+layout(location = 0) out vec4 out_color;
+
+
+void main()
+{
+	// Levels don't have lights yet, so there's one fixed directional light.
+	vec3 light_direction = normalize(vec3(0.4, 1.0, 0.3));
+
+	float diffuse = max(dot(normalize(normal), light_direction), 0.0);
+
+	out_color = vec4(color.rgb * (0.2 + 0.8 * diffuse), 1.0);
+}
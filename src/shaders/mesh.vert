@@ -0,0 +1,36 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_GOOGLE_include_directive : enable
+
+#include "mesh_vertex.glsl.h"
+#include "mesh_uniform.glsl.h"
+
+layout(location = 0) out vec3 out_normal;
+layout(location = 1) out vec2 out_uv;
+layout(location = 2) flat out vec4 out_color;
+
+
+void main()
+{
+	// gl_InstanceIndex includes firstInstance, which points to the draw's range of instances.
+	Mesh_Instance instance = instance_buffer.instances[gl_InstanceIndex];
+
+	vec4 position = vec4(get_mesh_vertex_position(u.bounds_min.xyz, u.bounds_max.xyz), 1.0);
+	vec3 normal   = get_mesh_vertex_normal();
+
+	vec3 world_position = vec3(
+		dot(instance.rows[0], position),
+		dot(instance.rows[1], position),
+		dot(instance.rows[2], position));
+
+	// Non uniform scale bends normals a bit, fine for now.
+	out_normal = normalize(vec3(
+		dot(instance.rows[0].xyz, normal),
+		dot(instance.rows[1].xyz, normal),
+		dot(instance.rows[2].xyz, normal)));
+
+	out_uv    = in_uv;
+	out_color = u.color;
+
+	gl_Position = u.view_projection * vec4(world_position, 1.0);
+}
@@ -0,0 +1,37 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_GOOGLE_include_directive : enable
+
+#include "mesh_vertex.glsl.h"
+#include "gpu_culling.glsl.h"
+
+layout(location = 0) out vec3 out_normal;
+layout(location = 1) out vec2 out_uv;
+layout(location = 2) flat out vec4 out_color;
+
+
+// Same as mesh.vert, but instances come through visible_buffer, and per draw data from their group.
+void main()
+{
+	// firstInstance of the command is group's first_visible.
+	Gpu_Instance   instance = instance_buffer.instances[visible_buffer.instance_indices[gl_InstanceIndex]];
+	Gpu_Draw_Group group    = group_buffer.groups[instance.group_index];
+
+	vec4 position = vec4(get_mesh_vertex_position(group.bounds_min.xyz, group.bounds_max.xyz), 1.0);
+	vec3 normal   = get_mesh_vertex_normal();
+
+	vec3 world_position = vec3(
+		dot(instance.rows[0], position),
+		dot(instance.rows[1], position),
+		dot(instance.rows[2], position));
+
+	out_normal = normalize(vec3(
+		dot(instance.rows[0].xyz, normal),
+		dot(instance.rows[1].xyz, normal),
+		dot(instance.rows[2].xyz, normal)));
+
+	out_uv    = in_uv;
+	out_color = group.color;
+
+	gl_Position = u.view_projection * vec4(world_position, 1.0);
+}
@@ -0,0 +1,22 @@
+// Keep in sync with Mesh_Instance and Mesh_Uniform_Block in Renderer.h
+
+
+struct Mesh_Instance
+{
+	vec4 rows[3]; // Object to world, row major 3x4.
+};
+
+layout(std430, set = 0, binding = 0) readonly buffer Instance_Buffer
+{
+	Mesh_Instance instances[];
+} instance_buffer;
+
+
+layout(push_constant) uniform Mesh_Uniform_Block
+{
+	layout(row_major) mat4 view_projection;
+
+	vec4 bounds_min;
+	vec4 bounds_max;
+	vec4 color;
+} u;
@@ -0,0 +1,37 @@
+// Vertex inputs of mesh pipelines, see Mesh_Vertex_Format and Renderer::make_mesh_vertex_input().
+//  Both formats come through the same inputs, quantized one is decoded here.
+
+layout(constant_id = 0) const bool is_mesh_vertex_quantized = false;
+
+layout(location = 0) in vec3 in_position; // Quantized: 0..1 within mesh bounds.
+layout(location = 1) in vec3 in_normal;   // Quantized: octahedral in xy.
+layout(location = 2) in vec2 in_uv;
+
+
+vec3 decode_octahedral_normal(vec2 e)
+{
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+
+	// Unfold lower hemisphere.
+	float t = max(-n.z, 0.0);
+	n.x += n.x >= 0.0 ? -t : t;
+	n.y += n.y >= 0.0 ? -t : t;
+
+	return normalize(n);
+}
+
+vec3 get_mesh_vertex_position(vec3 bounds_min, vec3 bounds_max)
+{
+	if (is_mesh_vertex_quantized)
+		return mix(bounds_min, bounds_max, in_position);
+
+	return in_position;
+}
+
+vec3 get_mesh_vertex_normal()
+{
+	if (is_mesh_vertex_quantized)
+		return decode_octahedral_normal(in_normal.xy);
+
+	return in_normal;
+}